@@ -0,0 +1,75 @@
+/**
+ * @file Adafruit_LittleFS.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host replacement of the LittleFS wrapper of the nRF52 core
+ *        Files are kept in memory. Like on the device FILE_O_WRITE
+ *        creates the file and appends to it.
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef ADAFRUIT_LITTLEFS_H
+#define ADAFRUIT_LITTLEFS_H
+
+#include <Arduino.h>
+
+#define FILE_O_READ 0
+#define FILE_O_WRITE 1
+
+/** Max number of files in the simulated file system */
+#define NATIVE_FS_FILES 16
+/** Max size of a file in the simulated file system */
+#define NATIVE_FS_SIZE 32768
+
+/** One file in memory */
+struct s_native_file
+{
+	char name[32];
+	uint8_t data[NATIVE_FS_SIZE];
+	uint32_t size;
+	bool used;
+};
+
+class Adafruit_LittleFS
+{
+public:
+	bool begin(void) { return true; }
+	bool exists(const char *name) { return find(name) != NULL; }
+	bool remove(const char *name);
+	bool format(void);
+	s_native_file *find(const char *name);
+	s_native_file *create(const char *name);
+
+private:
+	s_native_file _files[NATIVE_FS_FILES] = {};
+};
+
+namespace Adafruit_LittleFS_Namespace
+{
+	class File
+	{
+	public:
+		File(Adafruit_LittleFS &fs) : _fs(fs) {}
+		bool open(const char *name, uint8_t mode);
+		size_t read(void *buffer, size_t size);
+		int read(void);
+		size_t write(const uint8_t *buffer, size_t size);
+		size_t write(uint8_t c) { return write(&c, 1); }
+		bool seek(uint32_t pos);
+		uint32_t position(void) { return _pos; }
+		uint32_t size(void) { return _file != NULL ? _file->size : 0; }
+		void flush(void) {}
+		void close(void) { _file = NULL; }
+		operator bool() { return _file != NULL; }
+
+	private:
+		Adafruit_LittleFS &_fs;
+		s_native_file *_file = NULL;
+		uint32_t _pos = 0;
+	};
+}
+
+#endif
@@ -0,0 +1,23 @@
+/**
+ * @file InternalFileSystem.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host replacement of the internal flash file system,
+ *        the files are kept in memory, see sim.cpp
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INTERNALFILESYSTEM_H
+#define INTERNALFILESYSTEM_H
+
+#include <Adafruit_LittleFS.h>
+
+class InternalFileSystem : public Adafruit_LittleFS
+{
+};
+extern InternalFileSystem InternalFS;
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * @file SparkFunLIS3DH.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host replacement of the SparkFun LIS3DH library,
+ *        the registers are simulated in lis3dh_sim.cpp
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef SPARKFUNLIS3DH_H
+#define SPARKFUNLIS3DH_H
+
+#include <Arduino.h>
+
+#define I2C_MODE 0
+#define SPI_MODE 1
+
+typedef enum
+{
+	IMU_SUCCESS,
+	IMU_HW_ERROR,
+	IMU_NOT_SUPPORTED,
+	IMU_GENERIC_ERROR,
+	IMU_OUT_OF_BOUNDS,
+	IMU_ALL_ONES_WARNING,
+} status_t;
+
+struct SensorSettings
+{
+	uint8_t adcEnabled;
+	uint8_t tempEnabled;
+	uint16_t accelSampleRate;
+	uint8_t accelRange;
+	uint8_t xAccelEnabled;
+	uint8_t yAccelEnabled;
+	uint8_t zAccelEnabled;
+	uint8_t fifoEnabled;
+	uint8_t fifoMode;
+	uint8_t fifoThreshold;
+};
+
+#define LIS3DH_STATUS_REG_AUX 0x07
+#define LIS3DH_WHO_AM_I 0x0F
+#define LIS3DH_TEMP_CFG_REG 0x1F
+#define LIS3DH_CTRL_REG1 0x20
+#define LIS3DH_CTRL_REG2 0x21
+#define LIS3DH_CTRL_REG3 0x22
+#define LIS3DH_CTRL_REG4 0x23
+#define LIS3DH_CTRL_REG5 0x24
+#define LIS3DH_CTRL_REG6 0x25
+#define LIS3DH_REFERENCE 0x26
+#define LIS3DH_STATUS_REG2 0x27
+#define LIS3DH_OUT_X_L 0x28
+#define LIS3DH_OUT_X_H 0x29
+#define LIS3DH_OUT_Y_L 0x2A
+#define LIS3DH_OUT_Y_H 0x2B
+#define LIS3DH_OUT_Z_L 0x2C
+#define LIS3DH_OUT_Z_H 0x2D
+#define LIS3DH_FIFO_CTRL_REG 0x2E
+#define LIS3DH_FIFO_SRC_REG 0x2F
+#define LIS3DH_INT1_CFG 0x30
+#define LIS3DH_INT1_SRC 0x31
+#define LIS3DH_INT1_THS 0x32
+#define LIS3DH_INT1_DURATION 0x33
+
+class LIS3DH
+{
+public:
+	LIS3DH(uint8_t busType = I2C_MODE, uint8_t inputArg = 0x19)
+	{
+		(void)busType;
+		(void)inputArg;
+	}
+	SensorSettings settings = {};
+	status_t begin(void);
+	status_t readRegister(uint8_t *outputPointer, uint8_t offset);
+	status_t readRegisterRegion(uint8_t *outputPointer, uint8_t offset, uint8_t length);
+	status_t writeRegister(uint8_t offset, uint8_t dataToWrite);
+};
+
+#endif
@@ -0,0 +1,94 @@
+/**
+ * @file counter.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Counter of the benchmarks in the native environment
+ *        Retired instructions of the process from the Linux perf events
+ *        are stable between runs and close to the cycles on the device.
+ *        If perf events are not available (other OS, container,
+ *        perf_event_paranoid) the monotonic clock in ns is used.
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "sim.h"
+#include <time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/** File descriptor of the instruction counter, -1 for the clock */
+static int counter_fd = -1;
+
+/**
+ * @brief Select the counter
+ *
+ * @param instructions true to count instructions
+ * @return true Instructions are counted
+ * @return false The clock in ns is used
+ */
+bool native_counter_init(bool instructions)
+{
+	if (counter_fd >= 0)
+	{
+		return true;
+	}
+	if (!instructions)
+	{
+		return false;
+	}
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	counter_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (counter_fd >= 0)
+	{
+		ioctl(counter_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter_fd, PERF_EVENT_IOC_ENABLE, 0);
+		return true;
+	}
+#endif
+	return false;
+}
+
+/**
+ * @brief Read the counter, only the difference of two reads is used
+ *
+ * @return uint32_t Instructions or ns
+ */
+uint32_t native_counter(void)
+{
+#ifdef __linux__
+	if (counter_fd >= 0)
+	{
+		uint64_t count = 0;
+		if (read(counter_fd, &count, sizeof(count)) == sizeof(count))
+		{
+			return (uint32_t)count;
+		}
+	}
+#endif
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+/**
+ * @brief Unit of the counter for the results
+ *
+ * @return const char* "instructions" or "ns"
+ */
+const char *native_counter_unit(void)
+{
+	return counter_fd >= 0 ? "instructions" : "ns";
+}
@@ -0,0 +1,22 @@
+/**
+ * @file flash_nrf5x.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host replacement of the flash cache of the nRF52 core,
+ *        only the declarations, the firmware update is not simulated
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef FLASH_NRF5X_H
+#define FLASH_NRF5X_H
+
+#include <stdint.h>
+
+void flash_nrf5x_flush(void);
+int flash_nrf5x_write(uint32_t dst, void const *src, uint32_t len);
+int flash_nrf5x_read(void *dst, uint32_t src, uint32_t len);
+
+#endif
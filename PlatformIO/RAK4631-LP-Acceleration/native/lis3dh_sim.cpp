@@ -0,0 +1,242 @@
+/**
+ * @file lis3dh_sim.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Registers of the LIS3DH for the native environment
+ *        The sensor lies still until sim_sensor_activity() starts a
+ *        movement. While moving, the movement interrupt (AOI on INT1)
+ *        fires with the next sample and again after INT1_SRC was read,
+ *        and the samples are far above the threshold. With the FIFO
+ *        enabled it fills with the data rate and the watermark fires INT1.
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "sim.h"
+#include <SparkFunLIS3DH.h>
+
+/** INT1 of the sensor is on WB_IO1 */
+#define LIS3DH_INT_PIN WB_IO1
+/** Size of the FIFO in samples */
+#define LIS3DH_FIFO_SIZE 32
+/** Sample value while moving, 1 g in the left aligned samples at 2 g range */
+#define LIS3DH_MOVING_VALUE 0x4000
+
+/** Register file */
+static uint8_t lis3dh_regs[0x40];
+/** Flag if the sensor is moved */
+static bool lis3dh_moving = false;
+/** Samples in the FIFO */
+static uint8_t lis3dh_fifo_level = 0;
+/** Time of the last sample counted into the FIFO */
+static uint64_t lis3dh_fifo_us = 0;
+/** Flag if the FIFO overflowed */
+static bool lis3dh_overrun = false;
+/** Flag if INT1 signalled the watermark, until the level falls below it */
+static bool lis3dh_wtm_signalled = false;
+
+/**
+ * @brief Output data rate of CTRL_REG1
+ *
+ * @return uint16_t Data rate in Hz, 0 = power down
+ */
+static uint16_t lis3dh_odr(void)
+{
+	static const uint16_t odr_hz[16] = {0, 1, 10, 25, 50, 100, 200, 400, 1600, 1344, 0, 0, 0, 0, 0, 0};
+	return odr_hz[lis3dh_regs[LIS3DH_CTRL_REG1] >> 4];
+}
+
+/**
+ * @brief Check if samples go into the FIFO
+ *
+ * @return true FIFO enabled and not in bypass mode
+ */
+static bool lis3dh_fifo_on(void)
+{
+	return ((lis3dh_regs[LIS3DH_CTRL_REG5] & 0x40) != 0) && ((lis3dh_regs[LIS3DH_FIFO_CTRL_REG] & 0xC0) != 0) && (lis3dh_odr() != 0);
+}
+
+/**
+ * @brief Count the samples taken since the last call into the FIFO
+ *
+ */
+static void lis3dh_fifo_fill(void)
+{
+	if (!lis3dh_fifo_on())
+	{
+		lis3dh_fifo_us = sim_time_us();
+		return;
+	}
+	uint64_t period_us = 1000000 / lis3dh_odr();
+	uint64_t samples = (sim_time_us() - lis3dh_fifo_us) / period_us;
+	lis3dh_fifo_us += samples * period_us;
+	if (lis3dh_fifo_level + samples > LIS3DH_FIFO_SIZE)
+	{
+		lis3dh_fifo_level = LIS3DH_FIFO_SIZE;
+		lis3dh_overrun = true;
+	}
+	else
+	{
+		lis3dh_fifo_level += samples;
+	}
+}
+
+/**
+ * @brief Rising edge of INT1 when the FIFO reaches the watermark
+ *
+ * @param unused
+ */
+static void lis3dh_watermark(uint32_t unused)
+{
+	(void)unused;
+	lis3dh_fifo_fill();
+	lis3dh_wtm_signalled = true;
+	sim_interrupt(LIS3DH_INT_PIN);
+}
+
+/**
+ * @brief Rising edge of INT1 when a sample is above the threshold, latched in INT1_SRC
+ *
+ * @param unused
+ */
+static void lis3dh_motion(uint32_t unused)
+{
+	(void)unused;
+	// Interrupt active, X high
+	lis3dh_regs[LIS3DH_INT1_SRC] = 0x40 | 0x02;
+	sim_interrupt(LIS3DH_INT_PIN);
+}
+
+/**
+ * @brief Schedule the next interrupt after a change of the registers,
+ *        the movement or the FIFO level
+ *
+ */
+static void lis3dh_schedule(void)
+{
+	sim_event_cancel(lis3dh_watermark);
+	sim_event_cancel(lis3dh_motion);
+	uint16_t odr = lis3dh_odr();
+	if (odr == 0)
+	{
+		return;
+	}
+	uint64_t period_us = 1000000 / odr;
+	uint8_t reg3 = lis3dh_regs[LIS3DH_CTRL_REG3];
+
+	uint8_t watermark = lis3dh_regs[LIS3DH_FIFO_CTRL_REG] & 0x1F;
+	if (((reg3 & 0x04) != 0) && lis3dh_fifo_on())
+	{
+		lis3dh_fifo_fill();
+		if (lis3dh_fifo_level < watermark)
+		{
+			lis3dh_wtm_signalled = false;
+			sim_event_at(lis3dh_fifo_us + (watermark - lis3dh_fifo_level) * period_us, lis3dh_watermark, 0);
+		}
+		else if (!lis3dh_wtm_signalled)
+		{
+			// Reached the watermark at this time, edge not yet given
+			sim_event_at(sim_time_us(), lis3dh_watermark, 0);
+		}
+	}
+	if (((reg3 & 0x40) != 0) && lis3dh_moving && ((lis3dh_regs[LIS3DH_INT1_SRC] & 0x40) == 0))
+	{
+		sim_event_at(sim_time_us() + period_us, lis3dh_motion, 0);
+	}
+}
+
+/**
+ * @brief Start or end a movement of the sensor
+ *
+ * @param active true while the sensor is moved
+ */
+void sim_sensor_activity(bool active)
+{
+	lis3dh_moving = active;
+	lis3dh_schedule();
+}
+
+status_t LIS3DH::begin(void)
+{
+	memset(lis3dh_regs, 0, sizeof(lis3dh_regs));
+	lis3dh_regs[LIS3DH_WHO_AM_I] = 0x33;
+	lis3dh_fifo_level = 0;
+	lis3dh_overrun = false;
+	lis3dh_wtm_signalled = false;
+	lis3dh_schedule();
+	return IMU_SUCCESS;
+}
+
+status_t LIS3DH::readRegister(uint8_t *outputPointer, uint8_t offset)
+{
+	offset &= 0x3F;
+	if (offset == LIS3DH_FIFO_SRC_REG)
+	{
+		lis3dh_fifo_fill();
+		uint8_t watermark = lis3dh_regs[LIS3DH_FIFO_CTRL_REG] & 0x1F;
+		lis3dh_regs[offset] = (lis3dh_fifo_level >= watermark ? 0x80 : 0x00) | (lis3dh_overrun ? 0x40 : 0x00) |
+							  (lis3dh_fifo_level == 0 ? 0x20 : 0x00) | (lis3dh_fifo_level > 31 ? 31 : lis3dh_fifo_level);
+	}
+	*outputPointer = lis3dh_regs[offset];
+	if (offset == LIS3DH_INT1_SRC)
+	{
+		// Reading clears the latched interrupt
+		lis3dh_regs[offset] = 0;
+		lis3dh_schedule();
+	}
+	return IMU_SUCCESS;
+}
+
+/**
+ * @brief Read the output registers, from the FIFO if it is enabled
+ *
+ * @param outputPointer Buffer, 6 bytes per sample
+ * @param offset Register, bit 7 is auto increment
+ * @param length Number of bytes
+ * @return status_t IMU_SUCCESS
+ */
+status_t LIS3DH::readRegisterRegion(uint8_t *outputPointer, uint8_t offset, uint8_t length)
+{
+	memset(outputPointer, 0, length);
+	if ((offset & 0x3F) != LIS3DH_OUT_X_L)
+	{
+		return IMU_SUCCESS;
+	}
+	uint8_t samples = length / 6;
+	if (lis3dh_fifo_on())
+	{
+		lis3dh_fifo_fill();
+		samples = samples < lis3dh_fifo_level ? samples : lis3dh_fifo_level;
+		lis3dh_fifo_level -= samples;
+		lis3dh_overrun = false;
+	}
+	if (lis3dh_moving)
+	{
+		// Shaking along X, high pass filtered
+		for (uint8_t idx = 0; idx < samples; idx++)
+		{
+			int16_t value = (idx & 1) ? -LIS3DH_MOVING_VALUE : LIS3DH_MOVING_VALUE;
+			outputPointer[idx * 6] = (uint8_t)value;
+			outputPointer[idx * 6 + 1] = (uint8_t)(value >> 8);
+		}
+	}
+	lis3dh_schedule();
+	return IMU_SUCCESS;
+}
+
+status_t LIS3DH::writeRegister(uint8_t offset, uint8_t dataToWrite)
+{
+	offset &= 0x3F;
+	lis3dh_fifo_fill();
+	lis3dh_regs[offset] = dataToWrite;
+	if ((offset == LIS3DH_FIFO_CTRL_REG) && ((dataToWrite & 0xC0) == 0))
+	{
+		// Bypass mode empties the FIFO
+		lis3dh_fifo_level = 0;
+		lis3dh_overrun = false;
+	}
+	lis3dh_schedule();
+	return IMU_SUCCESS;
+}
@@ -0,0 +1,402 @@
+/**
+ * @file main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Runner of the native environment
+ *        bench runs the benchmarks of AT+BENCH=? on the host and writes
+ *        the results as a JSON array.
+ *        Usage: program bench [--instructions] [--out <file>]
+ *        sim runs the application in virtual time and prints the wakeups,
+ *        uplinks and the energy estimate with the battery projection.
+ *        Usage: program sim [--days <n>] [--interval <s>] [--events <n>]
+ *        [--event-time <s>] [--loss <%>] [--seed <n>] [--at <command>]
+ *        [--report <command>] [--max-ua <uA>] [--trace <file>] [--record <file>]
+ *        --trace replays a sensor trace of AT+TRACE after the join, the run
+ *        ends with the replay. --record records the sensor readings of the
+ *        run into a trace file.
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef PIO_UNIT_TESTING
+
+#include "app.h"
+#include "sim.h"
+#include <time.h>
+#include <Adafruit_LittleFS.h>
+#include <InternalFileSystem.h>
+using namespace Adafruit_LittleFS_Namespace;
+
+/** Output of the benchmark results */
+static FILE *main_out = NULL;
+/** Number of results written */
+static uint16_t main_results = 0;
+
+/**
+ * @brief Write the JSON objects of the +BENCH: lines into the array
+ *
+ * @param line Line of the serial output
+ */
+static void main_bench_line(const char *line)
+{
+	if (strncmp(line, "+BENCH:", 7) != 0)
+	{
+		return;
+	}
+	fprintf(main_out, "%s\n  %s", main_results == 0 ? "[" : ",", &line[7]);
+	main_results++;
+}
+
+/**
+ * @brief Run the benchmarks
+ *
+ * @param argc Number of options
+ * @param argv Options
+ * @return int 0 if all benchmarks ran
+ */
+static int main_bench(int argc, char **argv)
+{
+	bool instructions = false;
+	const char *out_name = NULL;
+	for (int idx = 0; idx < argc; idx++)
+	{
+		if (strcmp(argv[idx], "--instructions") == 0)
+		{
+			instructions = true;
+		}
+		else if ((strcmp(argv[idx], "--out") == 0) && ((idx + 1) < argc))
+		{
+			out_name = argv[++idx];
+		}
+		else
+		{
+			fprintf(stderr, "bench: unknown option %s\n", argv[idx]);
+			return 1;
+		}
+	}
+	if (!native_counter_init(instructions) && instructions)
+	{
+		fprintf(stderr, "bench: no instruction counter, using ns\n");
+	}
+
+	main_out = out_name != NULL ? fopen(out_name, "w") : stdout;
+	if (main_out == NULL)
+	{
+		fprintf(stderr, "bench: can't write %s\n", out_name);
+		return 1;
+	}
+	native_serial_line = main_bench_line;
+	uint8_t result = at_bench(true, NULL);
+	native_serial_line = NULL;
+	fprintf(main_out, "%s]\n", main_results == 0 ? "[" : "\n");
+	if (main_out != stdout)
+	{
+		fclose(main_out);
+	}
+	return result == 0 ? 0 : 1;
+}
+
+/** Max number of AT commands before and after the simulation */
+#define MAIN_COMMANDS 16
+
+/**
+ * @brief Run AT commands of the application, the replies go to stdout
+ *
+ * @param commands Commands, e.g. "+ACCPOWER=1,120"
+ * @param num Number of commands
+ * @return true All commands are known
+ */
+static bool main_at(char **commands, uint8_t num)
+{
+	for (uint8_t idx = 0; idx < num; idx++)
+	{
+		if (!user_at_handler(commands[idx], strlen(commands[idx])))
+		{
+			fprintf(stderr, "sim: unknown command %s\n", commands[idx]);
+			return false;
+		}
+	}
+	return true;
+}
+
+/** Trace in the flash, same name as in trace.cpp */
+#define MAIN_TRACE_NAME "TRCE"
+
+/**
+ * @brief Load a trace of the PC into the flash of the simulation
+ *        The file is binary like the trace in flash, or has the
+ *        +TRACE:DATA,<offset>,<hex> lines of AT+TRACE=3, e.g. from a log
+ *        of the serial terminal
+ *
+ * @param name File name
+ * @return true Trace loaded
+ */
+static bool main_trace_load(const char *name)
+{
+	static uint8_t trace[NATIVE_FS_SIZE];
+	FILE *in = fopen(name, "rb");
+	if (in == NULL)
+	{
+		fprintf(stderr, "sim: can't read %s\n", name);
+		return false;
+	}
+	uint32_t size = fread(trace, 1, sizeof(trace), in);
+	if ((size < 2) || (trace[0] != 'T') || (trace[1] != 'R'))
+	{
+		rewind(in);
+		size = 0;
+		char line[256];
+		while (fgets(line, sizeof(line), in) != NULL)
+		{
+			char *hex = strstr(line, "+TRACE:DATA,");
+			if (hex == NULL)
+			{
+				continue;
+			}
+			uint32_t offset = strtoul(hex + 12, &hex, 10);
+			if (*hex++ != ',')
+			{
+				continue;
+			}
+			while (isxdigit(hex[0]) && isxdigit(hex[1]) && (offset < sizeof(trace)))
+			{
+				char byte[3] = {hex[0], hex[1], 0};
+				trace[offset++] = (uint8_t)strtoul(byte, NULL, 16);
+				hex += 2;
+			}
+			size = offset > size ? offset : size;
+		}
+	}
+	fclose(in);
+	if ((size < 2) || (trace[0] != 'T') || (trace[1] != 'R'))
+	{
+		fprintf(stderr, "sim: %s is no trace\n", name);
+		return false;
+	}
+	sim_fs_load(MAIN_TRACE_NAME, trace, size);
+	return true;
+}
+
+/**
+ * @brief Save the trace in the flash of the simulation as binary file on the PC
+ *
+ * @param name File name
+ * @return true Trace saved
+ */
+static bool main_trace_save(const char *name)
+{
+	File file(InternalFS);
+	if (!file.open(MAIN_TRACE_NAME, FILE_O_READ))
+	{
+		fprintf(stderr, "sim: nothing recorded\n");
+		return false;
+	}
+	FILE *out = fopen(name, "wb");
+	if (out == NULL)
+	{
+		fprintf(stderr, "sim: can't write %s\n", name);
+		file.close();
+		return false;
+	}
+	uint8_t block[256];
+	size_t len;
+	while ((len = file.read(block, sizeof(block))) > 0)
+	{
+		fwrite(block, 1, len, out);
+	}
+	file.close();
+	fclose(out);
+	return true;
+}
+
+/**
+ * @brief Run the application in virtual time
+ *
+ * @param argc Number of options
+ * @param argv Options
+ * @return int 0 if the average current is below the limit
+ */
+static int main_sim(int argc, char **argv)
+{
+	uint32_t days = 30;
+	uint32_t events = 0;
+	uint32_t event_time = 60;
+	uint32_t seed = 1;
+	uint32_t max_ua = 0;
+	char *commands[MAIN_COMMANDS];
+	uint8_t commands_num = 0;
+	char *reports[MAIN_COMMANDS];
+	uint8_t reports_num = 0;
+	reports[reports_num++] = (char *)"+ENERGY=?";
+	const char *replay_name = NULL;
+	const char *record_name = NULL;
+	for (int idx = 0; idx < argc; idx++)
+	{
+		const char *value = (idx + 1) < argc ? argv[idx + 1] : NULL;
+		if (value == NULL)
+		{
+			fprintf(stderr, "sim: %s needs a value\n", argv[idx]);
+			return 1;
+		}
+		if (strcmp(argv[idx], "--days") == 0)
+		{
+			days = strtoul(value, NULL, 0);
+		}
+		else if (strcmp(argv[idx], "--interval") == 0)
+		{
+			g_lorawan_settings.send_repeat_time = strtoul(value, NULL, 0) * 1000;
+		}
+		else if (strcmp(argv[idx], "--events") == 0)
+		{
+			events = strtoul(value, NULL, 0);
+		}
+		else if (strcmp(argv[idx], "--event-time") == 0)
+		{
+			event_time = strtoul(value, NULL, 0);
+		}
+		else if (strcmp(argv[idx], "--loss") == 0)
+		{
+			sim_loss = strtoul(value, NULL, 0);
+		}
+		else if (strcmp(argv[idx], "--seed") == 0)
+		{
+			seed = strtoul(value, NULL, 0);
+		}
+		else if ((strcmp(argv[idx], "--at") == 0) && (commands_num < MAIN_COMMANDS))
+		{
+			commands[commands_num++] = argv[idx + 1];
+		}
+		else if ((strcmp(argv[idx], "--report") == 0) && (reports_num < MAIN_COMMANDS))
+		{
+			reports[reports_num++] = argv[idx + 1];
+		}
+		else if (strcmp(argv[idx], "--max-ua") == 0)
+		{
+			max_ua = strtoul(value, NULL, 0);
+		}
+		else if (strcmp(argv[idx], "--trace") == 0)
+		{
+			replay_name = value;
+		}
+		else if (strcmp(argv[idx], "--record") == 0)
+		{
+			record_name = value;
+		}
+		else
+		{
+			fprintf(stderr, "sim: unknown option %s\n", argv[idx]);
+			return 1;
+		}
+		idx++;
+	}
+
+	if ((replay_name != NULL) && (record_name != NULL))
+	{
+		fprintf(stderr, "sim: --trace and --record can't be used together\n");
+		return 1;
+	}
+	if ((replay_name != NULL) && !main_trace_load(replay_name))
+	{
+		return 1;
+	}
+
+	randomSeed(seed);
+	sim_end_us = (uint64_t)days * 86400 * 1000000;
+	if (!api_setup())
+	{
+		fprintf(stderr, "sim: init_app() failed\n");
+		return 1;
+	}
+	if (!main_at(commands, commands_num))
+	{
+		return 1;
+	}
+	sim_sensor_events(events, event_time, seed);
+	if ((record_name != NULL) && !trace_start(TRACE_RECORD))
+	{
+		fprintf(stderr, "sim: can't record\n");
+		return 1;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bool replayed = false;
+	while (api_loop())
+	{
+		if ((replay_name == NULL) || !g_lpwan_has_joined)
+		{
+			continue;
+		}
+		if (replayed)
+		{
+			if (!trace_active())
+			{
+				// Replay reported its result, the run ends with it
+				break;
+			}
+		}
+		else if (trace_start(TRACE_REPLAY))
+		{
+			// Like AT+TRACE=2 on a joined node
+			replayed = true;
+		}
+		else
+		{
+			fprintf(stderr, "sim: can't replay %s\n", replay_name);
+			return 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (record_name != NULL)
+	{
+		trace_stop();
+		if (!main_trace_save(record_name))
+		{
+			return 1;
+		}
+	}
+	if ((replay_name != NULL) && (reports_num < MAIN_COMMANDS))
+	{
+		reports[reports_num++] = (char *)"+TRACE=?";
+	}
+
+	uint32_t avg_ua = energy_average_since(NULL, 0);
+	native_printf("Simulated %.2f days in %.2f s\n", sim_time_us() / 86400e6, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+	native_printf("%ld wakeups, %ld uplinks, %ld resets, %ld unhandled events, average %ld uA\n", api_wakeups, sim_uplinks, sim_resets, api_unhandled, avg_ua);
+	if (!main_at(reports, reports_num))
+	{
+		return 1;
+	}
+	if (replayed && trace_active())
+	{
+		fprintf(stderr, "sim: replay did not end within %u days\n", days);
+		return 1;
+	}
+	if ((max_ua != 0) && (avg_ua > max_ua))
+	{
+		fprintf(stderr, "sim: average %u uA is above %u uA\n", avg_ua, max_ua);
+		return 1;
+	}
+	return api_unhandled == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	if ((argc >= 2) && (strcmp(argv[1], "bench") == 0))
+	{
+		return main_bench(argc - 2, &argv[2]);
+	}
+	if ((argc >= 2) && (strcmp(argv[1], "sim") == 0))
+	{
+		return main_sim(argc - 2, &argv[2]);
+	}
+	fprintf(stderr, "Usage: %s bench [--instructions] [--out <file>]\n", argv[0]);
+	fprintf(stderr, "       %s sim [--days <n>] [--interval <s>] [--events <n>] [--event-time <s>] [--loss <%%>]\n", argv[0]);
+	fprintf(stderr, "           [--seed <n>] [--at <command>] [--report <command>] [--max-ua <uA>]\n");
+	fprintf(stderr, "           [--trace <file>] [--record <file>]\n");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,58 @@
+/**
+ * @file sim.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Virtual time and the simulated hardware of the native environment
+ *        Time only moves while the loop waits for the semaphore or in
+ *        delay(), the code itself takes no time. Timers, the LoRaWAN
+ *        stack and the sensor are events on the virtual time line.
+ *        api.cpp runs the loop task of the WisBlock-API on it.
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <Arduino.h>
+
+/** Event on the virtual time line */
+typedef void (*sim_event_t)(uint32_t arg);
+
+uint64_t sim_time_us(void);
+void sim_event_at(uint64_t time_us, sim_event_t func, uint32_t arg);
+void sim_event_cancel(sim_event_t func);
+bool sim_step(uint64_t limit_us);
+void sim_interrupt(uint32_t pin);
+void sim_fs_load(const char *name, const uint8_t *data, uint32_t size);
+
+/** End of the simulation, the semaphore wait returns pdFALSE after it */
+extern uint64_t sim_end_us;
+/** Number of system resets requested by the application */
+extern uint32_t sim_resets;
+/** Number of uplinks accepted by the LoRaWAN stack */
+extern uint32_t sim_uplinks;
+/** Confirmed uplinks without ACK in % */
+extern uint8_t sim_loss;
+
+/** Sensor events, e.g. movement, at random times */
+void sim_sensor_events(uint32_t per_day, uint32_t duration_s, uint32_t seed);
+/** Start or end of a sensor event, implemented by the sensor simulation */
+void sim_sensor_activity(bool active);
+
+/** setup() and loop() of the WisBlock-API */
+bool api_setup(void);
+bool api_loop(void);
+/** Number of wakeups of the loop task */
+extern uint32_t api_wakeups;
+/** Number of times event bits were set that no handler clears */
+extern uint32_t api_unhandled;
+
+/** Counter of the benchmarks, instructions if available, otherwise ns */
+bool native_counter_init(bool instructions);
+uint32_t native_counter(void);
+const char *native_counter_unit(void);
+
+#endif
@@ -0,0 +1,198 @@
+/**
+ * @file acc_codec.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Lossless or bounded lossy codec for 3 axis accelerometer samples
+ *        Each buffer can be decoded on its own, a lost packet does not
+ *        break the following ones.
+ *        - The first sample is stored with 16 bit per axis
+ *        - Each axis is predicted from its last value or from its last
+ *          two values, whichever had the smaller error recently
+ *        - The residual is mapped to an unsigned value (zigzag) and
+ *          written as Rice code with a parameter from the mean of the
+ *          last values of the axis
+ *        - With near > 0 the residual is quantized, the error of each
+ *          value is max near
+ *        The decoder does the same prediction on the decoded values, no
+ *        side information is needed.
+ * @version 0.1
+ * @date 2021-06-26
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "acc_codec.h"
+
+/** Longest unary part of a Rice code, larger values are escaped */
+#define ACC_CODEC_QMAX 16
+/** Bits of an escaped value, zigzag of a 17 bit residual */
+#define ACC_CODEC_ESC_BITS 17
+/** Max Rice parameter */
+#define ACC_CODEC_KMAX 16
+/** Number of values in the Rice statistics before they are halved */
+#define ACC_CODEC_NMAX 32
+/** Decay of the prediction errors, 1/8 */
+#define ACC_CODEC_ERR_SHIFT 3
+
+/**
+ * @brief Write bits into the buffer, MSB first
+ *
+ * @param codec Codec
+ * @param value Bits, right aligned
+ * @param len Number of bits, max 24
+ */
+static void acc_codec_put(s_acc_codec *codec, uint32_t value, uint8_t len)
+{
+	while (len != 0)
+	{
+		uint8_t bit_pos = codec->bits & 7;
+		uint8_t free_bits = 8 - bit_pos;
+		uint8_t chunk = len < free_bits ? len : free_bits;
+		uint8_t bits = (value >> (len - chunk)) & ((1 << chunk) - 1);
+		if (bit_pos == 0)
+		{
+			codec->buffer[codec->bits >> 3] = 0;
+		}
+		codec->buffer[codec->bits >> 3] |= bits << (free_bits - chunk);
+		codec->bits += chunk;
+		len -= chunk;
+	}
+}
+
+/**
+ * @brief Limit a value to 16 bit
+ *
+ */
+static int16_t acc_codec_clamp(int32_t value)
+{
+	return value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : value);
+}
+
+/**
+ * @brief Start a new buffer
+ *
+ * @param codec Codec
+ * @param buffer Output buffer
+ * @param size Size of the output buffer in bytes
+ * @param near Max error per value, 0 = lossless
+ */
+void acc_codec_begin(s_acc_codec *codec, uint8_t *buffer, uint16_t size, uint8_t near)
+{
+	codec->buffer = buffer;
+	codec->size_bits = size * 8;
+	codec->bits = 0;
+	codec->count = 0;
+	codec->near = near;
+	for (uint8_t axis = 0; axis < ACC_CODEC_AXES; axis++)
+	{
+		codec->err1[axis] = 0;
+		codec->err2[axis] = 0;
+		codec->sum[axis] = 4;
+		codec->num[axis] = 1;
+	}
+}
+
+/**
+ * @brief Add a sample to the buffer
+ *
+ * @param codec Codec
+ * @param sample Values of the axes
+ * @return true Sample added
+ * @return false Buffer is full, sample not added
+ */
+bool acc_codec_add(s_acc_codec *codec, const int16_t *sample)
+{
+	if (codec->count == 0)
+	{
+		if ((codec->bits + 16 * ACC_CODEC_AXES) > codec->size_bits)
+		{
+			return false;
+		}
+		for (uint8_t axis = 0; axis < ACC_CODEC_AXES; axis++)
+		{
+			acc_codec_put(codec, (uint16_t)sample[axis], 16);
+			codec->last[axis] = sample[axis];
+			codec->prev[axis] = sample[axis];
+		}
+		codec->count++;
+		return true;
+	}
+
+	// Code all axes first, the sample is added only if it fits
+	uint32_t code[ACC_CODEC_AXES];
+	uint8_t k[ACC_CODEC_AXES];
+	int16_t recon[ACC_CODEC_AXES];
+	uint16_t len = 0;
+	uint16_t step = 2 * codec->near + 1;
+	for (uint8_t axis = 0; axis < ACC_CODEC_AXES; axis++)
+	{
+		int16_t pred1 = codec->last[axis];
+		int16_t pred2 = acc_codec_clamp(2 * (int32_t)codec->last[axis] - codec->prev[axis]);
+		int16_t pred = codec->err2[axis] < codec->err1[axis] ? pred2 : pred1;
+
+		int32_t residual = (int32_t)sample[axis] - pred;
+		if (codec->near != 0)
+		{
+			residual = residual >= 0 ? (residual + codec->near) / step : -((codec->near - residual) / step);
+		}
+		recon[axis] = acc_codec_clamp(pred + residual * step);
+		code[axis] = ((uint32_t)residual << 1) ^ (uint32_t)(residual >> 31);
+
+		k[axis] = 0;
+		while ((k[axis] < ACC_CODEC_KMAX) && (((uint32_t)codec->num[axis] << k[axis]) < codec->sum[axis]))
+		{
+			k[axis]++;
+		}
+		uint32_t q = code[axis] >> k[axis];
+		len += q < ACC_CODEC_QMAX ? q + 1 + k[axis] : ACC_CODEC_QMAX + ACC_CODEC_ESC_BITS;
+	}
+	if ((codec->bits + len) > codec->size_bits)
+	{
+		return false;
+	}
+
+	for (uint8_t axis = 0; axis < ACC_CODEC_AXES; axis++)
+	{
+		uint32_t q = code[axis] >> k[axis];
+		if (q < ACC_CODEC_QMAX)
+		{
+			// Unary quotient, a 0 and the k low bits
+			acc_codec_put(codec, ((1UL << q) - 1) << 1, q + 1);
+			acc_codec_put(codec, code[axis] & ((1UL << k[axis]) - 1), k[axis]);
+		}
+		else
+		{
+			// Escape, QMAX ones and the value
+			acc_codec_put(codec, (1UL << ACC_CODEC_QMAX) - 1, ACC_CODEC_QMAX);
+			acc_codec_put(codec, code[axis], ACC_CODEC_ESC_BITS);
+		}
+
+		// Update the statistics with the decoded value, same as the decoder
+		int32_t err1 = (int32_t)recon[axis] - codec->last[axis];
+		int32_t err2 = (int32_t)recon[axis] - acc_codec_clamp(2 * (int32_t)codec->last[axis] - codec->prev[axis]);
+		codec->err1[axis] += (err1 < 0 ? -err1 : err1) - (codec->err1[axis] >> ACC_CODEC_ERR_SHIFT);
+		codec->err2[axis] += (err2 < 0 ? -err2 : err2) - (codec->err2[axis] >> ACC_CODEC_ERR_SHIFT);
+		codec->sum[axis] += code[axis];
+		codec->num[axis]++;
+		if (codec->num[axis] >= ACC_CODEC_NMAX)
+		{
+			codec->sum[axis] >>= 1;
+			codec->num[axis] >>= 1;
+		}
+		codec->prev[axis] = codec->last[axis];
+		codec->last[axis] = recon[axis];
+	}
+	codec->count++;
+	return true;
+}
+
+/**
+ * @brief Size of the coded data
+ *
+ * @param codec Codec
+ * @return uint16_t Size in bytes
+ */
+uint16_t acc_codec_len(const s_acc_codec *codec)
+{
+	return (codec->bits + 7) / 8;
+}
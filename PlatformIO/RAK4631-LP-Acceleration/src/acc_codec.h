@@ -0,0 +1,49 @@
+/**
+ * @file acc_codec.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Lossless or bounded lossy codec for 3 axis accelerometer samples
+ *        No Arduino includes, the same files can be compiled on the PC.
+ *        tools/acc_codec.py is the matching decoder.
+ * @version 0.1
+ * @date 2021-06-26
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef ACC_CODEC_H
+#define ACC_CODEC_H
+
+#include <stdint.h>
+
+/** Number of axes */
+#define ACC_CODEC_AXES 3
+
+struct s_acc_codec
+{
+	// Output buffer
+	uint8_t *buffer;
+	// Size of the output buffer in bits
+	uint16_t size_bits;
+	// Bits written
+	uint16_t bits;
+	// Samples in the buffer
+	uint16_t count;
+	// Max error per value, 0 = lossless
+	uint8_t near;
+	// Last two reconstructed values of each axis
+	int16_t last[ACC_CODEC_AXES];
+	int16_t prev[ACC_CODEC_AXES];
+	// Decaying sum of the errors of the first and second order prediction
+	uint32_t err1[ACC_CODEC_AXES];
+	uint32_t err2[ACC_CODEC_AXES];
+	// Sum and number of the coded values for the Rice parameter
+	uint32_t sum[ACC_CODEC_AXES];
+	uint8_t num[ACC_CODEC_AXES];
+};
+
+void acc_codec_begin(s_acc_codec *codec, uint8_t *buffer, uint16_t size, uint8_t near);
+bool acc_codec_add(s_acc_codec *codec, const int16_t *sample);
+uint16_t acc_codec_len(const s_acc_codec *codec);
+
+#endif
@@ -22,18 +22,89 @@ bool lora_busy = false;
 /** Packet buffer for sending */
 uint8_t collected_data[64] = {0};
 
-/** Time of last sent packet */
-time_t last_packet_time = 0;
+/** Buffer for a line received over BLE UART */
+char ble_rx_buff[64];
+
+/** Buffer for one line of the received LoRa data log */
+char lora_log_buff[16 * 3 + 1];
+
+/** Static buffers with their high-water marks, same order as the MEM_ defines */
+s_mem_pool mem_pools[] = {
+	{"PAYLOAD", sizeof(collected_data), 0},
+	{"DLRESP", DL_RESPONSE_SIZE, 0},
+	{"BLERX", sizeof(ble_rx_buff), 0},
+	{"STREAM", 8, 0},
+	{"STAMPS", 8, 0},
+	{"RXRING", RX_RING_SLOTS, 0},
+};
+const uint8_t mem_pools_num = sizeof(mem_pools) / sizeof(s_mem_pool);
+
+/** Shaper for the movement packets, default max 1 packet every 10 seconds */
+s_shaper acc_shaper;
 
 /** Timer for delayed sending of a packet */
 SoftwareTimer delayed_timer;
 
+/** Flag if a delayed sending is already scheduled */
+bool send_pending = false;
+
 /** Send Fail counter **/
 uint8_t send_fail = 0;
 
 /** Callback for delayed sending timer */
 void send_delayed(TimerHandle_t xTimerID);
 
+/**
+ * @brief Schedule sending when the shaper has a token again
+ *
+ */
+void schedule_delayed(void)
+{
+	if (send_pending)
+	{
+		return;
+	}
+	uint32_t wait_time = shaper_wait_time(&acc_shaper);
+	if (wait_time < 1000)
+	{
+		// Token available but sending failed, retry in a second
+		wait_time = 1000;
+	}
+	MYLOG("APP", "Defer sending for %ld ms", wait_time);
+	send_pending = true;
+	delayed_timer.setPeriod(wait_time);
+	delayed_timer.start();
+}
+
+/**
+ * @brief Pack the movement payload
+ *        Collected events are reported with their count and the age
+ *        of the first and last event in seconds
+ *
+ * @param buffer Payload buffer, at least 10 bytes
+ * @param shaper Shaper with the collected events
+ * @param now Current time in ms
+ * @return uint8_t Size of the payload
+ */
+uint8_t movement_pack(uint8_t *buffer, s_shaper *shaper, uint32_t now)
+{
+	uint16_t first_age = (now - shaper->first_event) / 1000;
+	uint16_t last_age = (now - shaper->last_event) / 1000;
+
+	uint8_t data_size = 0;
+	buffer[data_size++] = 0x30;
+	buffer[data_size++] = has_x_move ? 1 : 0;
+	buffer[data_size++] = has_y_move ? 1 : 0;
+	buffer[data_size++] = has_z_move ? 1 : 0;
+	buffer[data_size++] = (uint8_t)(shaper->event_count >> 8);
+	buffer[data_size++] = (uint8_t)(shaper->event_count);
+	buffer[data_size++] = (uint8_t)(first_age >> 8);
+	buffer[data_size++] = (uint8_t)(first_age);
+	buffer[data_size++] = (uint8_t)(last_age >> 8);
+	buffer[data_size++] = (uint8_t)(last_age);
+	return data_size;
+}
+
 /**
  * @brief Application specific setup functions
  * 
@@ -49,6 +120,15 @@ void setup_app(void)
 	/**************************************************************/
 	/**************************************************************/
 	g_enable_ble = true;
+
+	// Fast start, BLE is started after the first uplink
+	if (boot_check_fast_start())
+	{
+		g_enable_ble = false;
+	}
+
+	// Large MTU and data length extension for the raw data stream
+	Bluefruit.configPrphBandwidth(BANDWIDTH_MAX);
 }
 
 /**
@@ -60,13 +140,33 @@ void setup_app(void)
 bool init_app(void)
 {
 	// Add your application specific initialization here
+	boot_mark(BOOT_API_INIT);
+	app_param_load();
+	journal_load();
+	link_set_params(acc_params.link_mode, acc_params.link_margin);
 	if (!init_acc())
 	{
 		return false;
 	}
+	boot_mark(BOOT_SENSOR);
+
+	// Initialize the BLE advertising scheduler
+	ble_adv_init();
+
+	// Initialize the shaper for the movement packets
+	shaper_init(&acc_shaper, acc_params.bucket_size, acc_params.refill_time * 1000);
 
 	// Initialize timer for delayed sending
-	delayed_timer.begin(10000, send_delayed, NULL, false);
+	delayed_timer.begin(acc_params.refill_time * 1000, send_delayed, NULL, false);
+	// Initialize the timer of the sensor trace replay
+	trace_init();
+	// Start the watchdog, fed only when the loop makes progress
+	loop_init();
+	// Keep the uptime of the energy estimate from wrapping
+	energy_init();
+
+	boot_mark(BOOT_APP_READY);
+	mem_init_finished();
 	return true;
 }
 
@@ -77,6 +177,16 @@ bool init_app(void)
  */
 void app_event_handler(void)
 {
+	loop_start();
+	energy_wakeup();
+	mem_check();
+
+	// No uplinks while the radio is used for the offload
+	if (bulk_active())
+	{
+		g_task_event_type &= N_SEND_STAT;
+	}
+
 	// Timer triggered event
 	if ((g_task_event_type & STATUS) == STATUS)
 	{
@@ -92,50 +202,140 @@ void app_event_handler(void)
 		/**************************************************************/
 	}
 
+	// Replay of a sensor trace, raises ACC_TRIGGER at the recorded times
+	if ((g_task_event_type & TRACE_EVENT) == TRACE_EVENT)
+	{
+		g_task_event_type &= N_TRACE_EVENT;
+		trace_event();
+	}
+
 	// Accelerometer triggered an interrupt
 	if ((g_task_event_type & ACC_TRIGGER) == ACC_TRIGGER)
 	{
 		g_task_event_type &= N_ACC_TRIGGER;
-		MYLOG("APP", "ACC triggered wakeup");
 
-		// Get ACC status
-		get_acc_int();
+		if (bulk_capturing())
+		{
+			// FIFO watermark while recording for the offload
+			bulk_capture_handler();
+			return;
+		}
+		if (stream_active || stream_draining)
+		{
+			// FIFO watermark or retry while streaming raw data
+			stream_handler();
+			return;
+		}
+		if (acc_state == ACC_MOVING)
+		{
+			// FIFO watermark, the samples show if it still moves
+			if (!acc_moving_handler())
+			{
+				return;
+			}
+			MYLOG("APP", "ACC movement in FIFO samples");
+		}
+		else
+		{
+			MYLOG("APP", "ACC triggered wakeup");
+
+			// Get ACC status
+			get_acc_int();
+			if (acc_state == ACC_STILL)
+			{
+				acc_power_set(ACC_MOVING);
+			}
+		}
+		stamps_add(millis());
 
 		/**************************************************************/
 		/**************************************************************/
-		/// \todo either trigger an immediate packet sending
-		/// \todo which could lead to a lot packets
-		/// \todo or just wait for next alive message to send movement status
+		/// \todo the shaper decides if the packet is sent immediately
+		/// \todo or if the movement is collected and sent as soon as
+		/// \todo the packet budget allows it
 		/**************************************************************/
 		/**************************************************************/
-		if ((millis() - last_packet_time) > 10000)
+		if (shaper_event(&acc_shaper))
 		{
 			// Signal request to send a packet
 			g_task_event_type |= SEND_STAT;
 		}
 		else
 		{
-			MYLOG("APP", "Last packet was sent less than 10 seconds ago, do not send immediately");
+			MYLOG("APP", "Packet budget used up, %d events waiting", acc_shaper.event_count);
+			schedule_delayed();
 		}
 	}
 
+	// Loop is alive, the watchdog is fed when it goes to sleep
+	if ((g_task_event_type & LOOP_CHECK) == LOOP_CHECK)
+	{
+		g_task_event_type &= N_LOOP_CHECK;
+		// Statistics period of the advertising scheduler may be over
+		ble_adv_check();
+	}
+
+	// Fast advertising requested by button
+	if ((g_task_event_type & ADV_TRIGGER) == ADV_TRIGGER)
+	{
+		g_task_event_type &= N_ADV_TRIGGER;
+		MYLOG("APP", "Fast advertising requested");
+		ble_adv_force();
+	}
+
+	// Firmware update answers and swap
+	if ((g_task_event_type & FUOTA_EVENT) == FUOTA_EVENT)
+	{
+		g_task_event_type &= N_FUOTA_EVENT;
+		fuota_event();
+	}
+
+	// Offload start delay and radio events
+	if ((g_task_event_type & BULK_EVENT) == BULK_EVENT)
+	{
+		g_task_event_type &= N_BULK_EVENT;
+		bulk_event();
+	}
+
 	// Send request
 	if ((g_task_event_type & SEND_STAT) == SEND_STAT)
 	{
 		g_task_event_type &= N_SEND_STAT;
+		delayed_timer.stop();
+		send_pending = false;
 		MYLOG("APP", "Packet send triggered");
 
+		if (acc_shaper.event_count == 0)
+		{
+			MYLOG("APP", "No events to report");
+			return;
+		}
+
+		if (!shaper_take(&acc_shaper))
+		{
+			// Budget used up meanwhile, try again later
+			schedule_delayed();
+			return;
+		}
+
 		// Send a packet and report movement if any
-		uint8_t data_size = 0;
-		collected_data[data_size++] = 0x30;
-		collected_data[data_size++] = has_x_move ? 1 : 0;
-		collected_data[data_size++] = has_y_move ? 1 : 0;
-		collected_data[data_size++] = has_z_move ? 1 : 0;
-		lmh_error_status result = send_lora_packet(collected_data, data_size);
+		uint8_t data_size = movement_pack(collected_data, &acc_shaper, millis());
+		// All blocks together must fit the max payload of the data rate
+		uint8_t max_payload = link_max_payload();
+		max_payload = max_payload > sizeof(collected_data) ? sizeof(collected_data) : max_payload;
+		// Add the event timestamps and ask for the network time if needed
+		data_size = stamps_add_block(collected_data, data_size, max_payload);
+		// Add the loop latency and the confirmation of a configuration downlink
+		data_size = loop_add_diag(collected_data, data_size, max_payload > dl_response_len ? max_payload - dl_response_len : 0, acc_params.diag_interval);
+		data_size = downlink_add_response(collected_data, data_size, max_payload);
+		mem_pool_mark(MEM_PAYLOAD, data_size);
+		lmh_error_status result = link_send(collected_data, data_size);
 		switch (result)
 		{
 		case LMH_SUCCESS:
 			MYLOG("APP", "Packet enqueued");
+			boot_mark(BOOT_FIRST_TX);
+			energy_uplink(data_size);
 			break;
 		case LMH_BUSY:
 			MYLOG("APP", "LoRa transceiver is busy");
@@ -145,13 +345,21 @@ void app_event_handler(void)
 			break;
 		}
 
-		// Clear movement flags
+		if (result != LMH_SUCCESS)
+		{
+			// Keep the collected events and try again later
+			shaper_refund(&acc_shaper);
+			schedule_delayed();
+			return;
+		}
+
+		// Clear movement flags, collected events and sent confirmation
+		downlink_response_sent();
 		has_x_move = false;
 		has_y_move = false;
 		has_z_move = false;
-
-		// Remember time this packet was sent;
-		last_packet_time = millis();
+		shaper_clear(&acc_shaper);
+		stamps_clear();
 
 		MYLOG("APP", "LoRa package sent");
 
@@ -159,13 +367,14 @@ void app_event_handler(void)
 		/**************************************************************/
 		/// \todo Just as example, if BLE is enabled and you want
 		/// \todo to restart advertising on an event you can call
-		/// \todo restart_advertising(uint16_t timeout); to advertise
-		/// \todo for another <timeout> seconds
+		/// \todo ble_adv_request(uint16_t timeout); to advertise
+		/// \todo for another <timeout> seconds. The scheduler
+		/// \todo skips the window if no central connected recently
 		/**************************************************************/
 		/**************************************************************/
 		if (g_enable_ble)
 		{
-			restart_advertising(15);
+			ble_adv_request(15);
 		}
 	}
 }
@@ -176,6 +385,7 @@ void app_event_handler(void)
  */
 void ble_data_handler(void)
 {
+	loop_mark();
 	if (g_enable_ble)
 	{
 		// BLE UART data handling
@@ -188,11 +398,83 @@ void ble_data_handler(void)
 			/**************************************************************/
 			/**************************************************************/
 			g_task_event_type &= N_BLE_DATA;
-			String uart_rx_buff = g_ble_uart.readStringUntil('\n');
-
-			uart_rx_buff.toUpperCase();
+			ble_adv_connected();
+			// Read one line into the static buffer, no String on the heap
+			size_t rx_len = g_ble_uart.readBytesUntil('\n', ble_rx_buff, sizeof(ble_rx_buff) - 1);
+			ble_rx_buff[rx_len] = 0;
+			mem_pool_mark(MEM_BLE_RX, rx_len);
+			for (size_t idx = 0; idx < rx_len; idx++)
+			{
+				ble_rx_buff[idx] = toupper(ble_rx_buff[idx]);
+			}
 
-			MYLOG("BLE", "BLE Received %s", uart_rx_buff.c_str());
+			MYLOG("BLE", "BLE Received %s", ble_rx_buff);
+
+			// BOOT? show the boot timeline, ENERGY? show the energy estimate
+			// LOOP? show the loop latency
+			// BULK? show the offload, BULK capture and send to a collector
+			// TRACE? show the sensor trace, TRACE=1 record, TRACE=2 replay, TRACE=0 stop
+			// Raw data stream commands
+			// STREAM=<rate> start with 400, 1344 or 1600 Hz
+			// STREAM=<rate>,<max error> start compressed, max error 0 is lossless
+			// STREAM=0 stop, STREAM? show statistics
+			if (strncmp(ble_rx_buff, "BOOT?", 5) == 0)
+			{
+				boot_report();
+			}
+			else if (strncmp(ble_rx_buff, "ENERGY?", 7) == 0)
+			{
+				energy_report();
+			}
+			else if (strncmp(ble_rx_buff, "LOOP?", 5) == 0)
+			{
+				loop_report();
+			}
+			else if (strncmp(ble_rx_buff, "BULK?", 5) == 0)
+			{
+				bulk_report();
+			}
+			else if (strncmp(ble_rx_buff, "BULK", 4) == 0)
+			{
+				if (!bulk_send_capture())
+				{
+					g_ble_uart.println("BULK busy or streaming");
+				}
+			}
+			else if (strncmp(ble_rx_buff, "TRACE?", 6) == 0)
+			{
+				trace_report();
+			}
+			else if (strncmp(ble_rx_buff, "TRACE=", 6) == 0)
+			{
+				long mode = atol(&ble_rx_buff[6]);
+				if (mode == TRACE_OFF)
+				{
+					trace_stop();
+				}
+				else if (((mode != TRACE_RECORD) && (mode != TRACE_REPLAY)) || !trace_start(mode))
+				{
+					g_ble_uart.println("TRACE busy or no trace");
+				}
+			}
+			else if (strncmp(ble_rx_buff, "STREAM?", 7) == 0)
+			{
+				stream_report();
+			}
+			else if (strncmp(ble_rx_buff, "STREAM=", 7) == 0)
+			{
+				long rate = atol(&ble_rx_buff[7]);
+				if (rate == 0)
+				{
+					stream_stop();
+					stream_report();
+				}
+				else if (!stream_active && !bulk_active() && !trace_active())
+				{
+					char *near = strchr(ble_rx_buff, ',');
+					stream_start(rate, near == NULL ? -1 : atoi(near + 1));
+				}
+			}
 		}
 	}
 }
@@ -203,6 +485,7 @@ void ble_data_handler(void)
  */
 void lora_data_handler(void)
 {
+	loop_mark();
 	if ((g_task_event_type & LORA_JOIN_FIN) == LORA_JOIN_FIN)
 	{
 		/**************************************************************/
@@ -215,6 +498,13 @@ void lora_data_handler(void)
 		if (g_join_result)
 		{
 			MYLOG("APP", "Successfully joined network");
+			boot_mark(BOOT_JOINED);
+
+			if (acc_shaper.event_count == 0)
+			{
+				// Packets are only sent on movement, don't hold back BLE until then
+				boot_deferred_init();
+			}
 		}
 		else
 		{
@@ -225,7 +515,7 @@ void lora_data_handler(void)
 			// If BLE is enabled, restart Advertising
 			if (g_enable_ble)
 			{
-				restart_advertising(15);
+				ble_adv_request(15);
 			}
 		}
 	}
@@ -241,11 +531,21 @@ void lora_data_handler(void)
 		/**************************************************************/
 		g_task_event_type &= N_LORA_TX_FIN;
 
+		if (!boot_reached(BOOT_FIRST_TX_FIN))
+		{
+			// First uplink is out, start what was deferred
+			boot_mark(BOOT_FIRST_TX_FIN);
+			boot_deferred_init();
+			boot_report();
+		}
+
 		MYLOG("APP", "LPWAN TX cycle %s", g_rx_fin_result ? "finished ACK" : "failed NAK");
 		if (g_ble_uart_is_connected)
 		{
 			g_ble_uart.printf("LPWAN TX cycle %s", g_rx_fin_result ? "finished ACK" : "failed NAK");
 		}
+		link_tx_done(g_rx_fin_result);
+		clock_tx_done((g_task_event_type & (LORA_DATA | RX_FRAME)) != 0);
 
 		if (!g_rx_fin_result)
 		{
@@ -264,7 +564,7 @@ void lora_data_handler(void)
 	}
 
 	// LoRa data handling
-	if ((g_task_event_type & LORA_DATA) == LORA_DATA)
+	if ((g_task_event_type & (LORA_DATA | RX_FRAME)) != 0)
 	{
 		/**************************************************************/
 		/**************************************************************/
@@ -272,34 +572,54 @@ void lora_data_handler(void)
 		/// \todo parse them here
 		/**************************************************************/
 		/**************************************************************/
-		g_task_event_type &= N_LORA_DATA;
-		MYLOG("APP", "Received package over LoRa");
-		char log_buff[g_rx_data_len * 3] = {0};
-		uint8_t log_idx = 0;
-		for (int idx = 0; idx < g_rx_data_len; idx++)
-		{
-			sprintf(&log_buff[log_idx], "%02X ", g_rx_lora_data[idx]);
-			log_idx += 3;
-		}
+		// Frame is still in the receive buffer if the RX callback did not queue it
+		rx_ring_take_pending();
+		g_task_event_type &= N_RX_FRAME;
 		lora_busy = false;
-		MYLOG("APP", "%s", log_buff);
 
-		/**************************************************************/
-		/**************************************************************/
-		/// \todo Just an example, if BLE is enabled and BLE UART
-		/// \todo is connected you can send the received data
-		/// \todo for debugging
-		/**************************************************************/
-		/**************************************************************/
-		if (g_ble_uart_is_connected && g_enable_ble)
+		// Handle all queued frames in their slot
+		s_rx_frame *frame;
+		while ((frame = rx_ring_peek()) != NULL)
 		{
-			for (int idx = 0; idx < g_rx_data_len; idx++)
+			MYLOG("APP", "Received package over LoRa port %d RSSI %d SNR %d", frame->port, frame->rssi, frame->snr);
+			link_rx(frame->rssi, frame->snr);
+			// Log in lines of 16 bytes, no buffer on the stack
+			for (int line = 0; line < frame->len; line += 16)
+			{
+				uint8_t log_idx = 0;
+				for (int idx = line; (idx < frame->len) && (idx < line + 16); idx++)
+				{
+					sprintf(&lora_log_buff[log_idx], "%02X ", frame->data[idx]);
+					log_idx += 3;
+				}
+				MYLOG("APP", "%s", lora_log_buff);
+			}
+
+			// Firmware update fragments or configuration downlink
+			if (!fuota_handler(frame->port, frame->data, frame->len))
+			{
+				downlink_handler(frame->port, frame->data, frame->len);
+			}
+
+			/**************************************************************/
+			/**************************************************************/
+			/// \todo Just an example, if BLE is enabled and BLE UART
+			/// \todo is connected you can send the received data
+			/// \todo for debugging
+			/**************************************************************/
+			/**************************************************************/
+			if (g_ble_uart_is_connected && g_enable_ble)
 			{
-				g_ble_uart.printf("%02X ", g_rx_lora_data[idx]);
+				for (int idx = 0; idx < frame->len; idx++)
+				{
+					g_ble_uart.printf("%02X ", frame->data[idx]);
+				}
+				g_ble_uart.println("");
 			}
-			g_ble_uart.println("");
+			rx_ring_release();
 		}
 	}
+	loop_end();
 }
 
 /**
@@ -31,6 +31,18 @@ void lora_data_handler(void);
 #define N_ACC_TRIGGER 0b0111111111111111
 #define SEND_STAT     0b0100000000000000
 #define N_SEND_STAT   0b1011111111111111
+#define ADV_TRIGGER   0b0010000000000000
+#define N_ADV_TRIGGER 0b1101111111111111
+#define TRACE_EVENT   0b0001000000000000
+#define N_TRACE_EVENT 0b1110111111111111
+#define FUOTA_EVENT   0b0000100000000000
+#define N_FUOTA_EVENT 0b1111011111111111
+#define LOOP_CHECK    0b0000010000000000
+#define N_LOOP_CHECK  0b1111101111111111
+#define BULK_EVENT    0b0000001000000000
+#define N_BULK_EVENT  0b1111110111111111
+#define RX_FRAME      0b0000000010000000
+#define N_RX_FRAME    0b1111111101111111
 
 /** Sensor specific functions */
 #define INT1_PIN WB_IO1
@@ -39,5 +51,513 @@ void get_acc_int(void);
 extern bool has_x_move;
 extern bool has_y_move;
 extern bool has_z_move;
+bool acc_fifo_start(uint16_t rate, uint8_t threshold);
+uint8_t acc_fifo_read(uint8_t *buffer, uint8_t max_samples, bool *overrun);
+void acc_fifo_stop(void);
+// Power states of the LIS3DH
+#define ACC_FIXED 0
+#define ACC_STILL 1
+#define ACC_MOVING 2
+#define ACC_STATES 3
+struct s_acc_power
+{
+	// Time in each state in ms, without the current one
+	uint32_t time_ms[ACC_STATES];
+	// State changes
+	uint32_t switches;
+	// FIFO batches checked in the moving state
+	uint32_t batches;
+	// Register writes and writes skipped because the value did not change
+	uint32_t writes;
+	uint32_t skipped;
+};
+void acc_power_set(uint8_t state);
+bool acc_moving_handler(void);
+uint8_t at_acc_state(bool read, uint32_t *args);
+extern uint8_t acc_state;
+extern s_acc_power acc_power;
+
+/** Token bucket traffic shaper */
+struct s_shaper
+{
+	// Max number of packets that can be sent in a burst
+	uint16_t bucket_size;
+	// Time in milliseconds to earn one token
+	uint32_t refill_time;
+	// Tokens currently available
+	uint16_t tokens;
+	// Time of the last token refill
+	uint32_t last_refill;
+	// Number of events not yet reported
+	uint16_t event_count;
+	// Time of the first not reported event
+	uint32_t first_event;
+	// Time of the last not reported event
+	uint32_t last_event;
+};
+void shaper_init(s_shaper *shaper, uint16_t bucket_size, uint32_t refill_time);
+void shaper_config(s_shaper *shaper, uint16_t bucket_size, uint32_t refill_time);
+bool shaper_event(s_shaper *shaper);
+bool shaper_take(s_shaper *shaper);
+void shaper_refund(s_shaper *shaper);
+uint32_t shaper_wait_time(s_shaper *shaper);
+void shaper_clear(s_shaper *shaper);
+extern s_shaper acc_shaper;
+uint8_t movement_pack(uint8_t *buffer, s_shaper *shaper, uint32_t now);
+
+/** BLE advertising scheduler */
+void ble_adv_init(void);
+void ble_adv_request(uint16_t timeout);
+void ble_adv_force(void);
+void ble_adv_connected(void);
+void ble_adv_check(void);
+void ble_adv_report(void);
+extern uint32_t adv_time_last_hour;
+extern uint32_t adv_radio_last_hour;
+
+/** Binary BLE streaming of raw accelerometer data */
+struct s_stream_stats
+{
+	// Start time of the stream
+	uint32_t start;
+	// Duration of the last stream in ms
+	uint32_t duration;
+	// Sent notifications
+	uint32_t packets;
+	// Sent bytes including headers
+	uint32_t bytes;
+	// Samples read from the sensor
+	uint32_t samples;
+	// Number of sensor FIFO overflows
+	uint32_t overruns;
+	// Samples lost because the queue was full
+	uint32_t queue_drops;
+	// Number of times the link had no free buffer
+	uint32_t busy;
+};
+bool stream_start(uint16_t rate, int8_t near);
+void stream_stop(void);
+void stream_handler(void);
+void stream_report(void);
+extern bool stream_active;
+extern bool stream_draining;
+extern s_stream_stats stream_stats;
+
+/** Network time and event timestamps */
+#define STAMPS_TAG 0xD0
+#define CLOCK_REQUEST_TAG 0xD1
+void clock_set(uint32_t epoch);
+void clock_answer(uint32_t epoch);
+void clock_tx_done(bool rx1_data);
+bool clock_request(void);
+void stamps_add(uint32_t ms);
+void stamps_clear(void);
+uint8_t stamps_add_block(uint8_t *buffer, uint8_t len, uint8_t max_payload);
+uint8_t varint_put(uint8_t *buffer, uint32_t value);
+uint8_t at_time(bool read, uint32_t *args);
+extern bool clock_synced;
+extern int32_t clock_drift_ppm;
+
+/** Downlink configuration protocol */
+#define DL_VERSION 0x01
+// fPort of the configuration downlinks, other ports are application data
+#ifndef DL_PORT
+#define DL_PORT 10
+#endif
+#define DL_READ 0x80
+#define DL_RESPONSE_TAG 0xC0
+#define DL_RESPONSE_SIZE 24
+// LoRaWAN settings
+#define DL_SEND_REPEAT 0x01
+#define DL_ADR 0x02
+#define DL_DATA_RATE 0x03
+#define DL_TX_POWER 0x04
+#define DL_CONFIRMED 0x05
+#define DL_APP_PORT 0x06
+// Actions
+#define DL_FORCE_ADV 0x10
+// Application parameters start here
+#define DL_APP_TAGS 0x20
+// Status
+#define DL_OK 0
+#define DL_ERR_VERSION 1
+#define DL_ERR_TAG 2
+#define DL_ERR_LEN 3
+#define DL_ERR_RANGE 4
+#define DL_ERR_SIZE 5
+bool downlink_handler(uint8_t port, uint8_t *data, uint8_t len);
+// LoRaWAN regions, numbers of AT+BAND
+#define LORA_BAND_AS923_1 0
+#define LORA_BAND_AU915 1
+#define LORA_BAND_CN470 2
+#define LORA_BAND_CN779 3
+#define LORA_BAND_EU433 4
+#define LORA_BAND_EU868 5
+#define LORA_BAND_IN865 6
+#define LORA_BAND_KR920 7
+#define LORA_BAND_US915 8
+#define LORA_BAND_AS923_2 9
+#define LORA_BAND_AS923_3 10
+#define LORA_BAND_AS923_4 11
+#define LORA_BAND_RU864 12
+bool dl_valid_dr(uint8_t region, uint8_t dr);
+bool dl_valid_tx_power(uint8_t region, uint8_t power);
+uint8_t downlink_add_response(uint8_t *buffer, uint8_t len, uint8_t max_len);
+void downlink_response_sent(void);
+#define DL_MAX_WRITES 16
+uint8_t dl_write_lorawan(s_lorawan_settings *settings, uint8_t tag, uint8_t *value, uint8_t len);
+uint8_t dl_read_lorawan(uint8_t tag, uint8_t *buffer);
+void dl_apply_lorawan(s_lorawan_settings *settings);
+uint32_t dl_get_value(uint8_t *value, uint8_t len);
+uint8_t dl_put_value(uint8_t *buffer, uint32_t value, uint8_t len);
+extern uint8_t dl_response_len;
+
+/** Application parameters, stored in flash */
+#define APP_PARAMS_MARK 0x57
+void app_param_load(void);
+void app_param_begin(void);
+uint8_t app_param_write(uint8_t tag, uint8_t *value, uint8_t len);
+uint8_t app_param_read(uint8_t tag, uint8_t *buffer);
+void app_param_commit(void);
+void app_param_restore(void);
+void app_param_save(void);
+
+/** Settings journal */
+#define JOURNAL_RECORD_SIZE 12
+uint16_t crc16(const uint8_t *data, uint16_t len, uint16_t crc);
+void journal_load(void);
+void journal_write(const uint8_t *tags, uint8_t num);
+void journal_compact(void);
+struct s_acc_params
+{
+	// Marker for valid parameters in flash
+	uint8_t valid_mark = APP_PARAMS_MARK;
+	// LIS3DH output data rate in Hz, while moving
+	uint16_t odr = 10;
+	// LIS3DH range in g
+	uint8_t range = 2;
+	// LIS3DH_INT1_THS value, 1 LSb = range / 128
+	uint8_t int1_ths = 0x10;
+	// Max number of movement packets in a burst
+	uint8_t bucket_size = 1;
+	// Time to earn a packet token in seconds
+	uint16_t refill_time = 10;
+	// LIS3DH output data rate in Hz while still
+	uint8_t still_odr = 1;
+	// Seconds without movement before the still state, 0 = no power states
+	uint16_t quiet_time = 60;
+	// Link estimator 0 = off, 1 = confirmation policy, 2 = confirmation policy and data rate
+	uint8_t link_mode = 0;
+	// SNR margin in dB for a faster data rate
+	uint8_t link_margin = 10;
+	// Loop latency block in every N-th uplink, 0 = off
+	uint8_t diag_interval = 0;
+};
+extern s_acc_params acc_params;
+void acc_apply_params(void);
+// Application parameter tags
+#define DL_ACC_ODR 0x20
+#define DL_ACC_RANGE 0x21
+#define DL_ACC_THS 0x22
+#define DL_SHAPER_BUCKET 0x23
+#define DL_SHAPER_REFILL 0x24
+#define DL_ACC_TIME 0x25
+#define DL_LINK_MODE 0x26
+#define DL_LINK_MARGIN 0x27
+#define DL_DIAG_INTERVAL 0x28
+#define DL_ACC_STILL_ODR 0x29
+#define DL_ACC_QUIET 0x2A
+
+/** Application AT commands */
+#define AT_MAX_ARGS 4
+// AT error codes, see AT-Commands.md
+#define AT_ERR_GENERIC 1
+#define AT_ERR_PARAM 5
+#define AT_ERR_RANGE 8
+#define AT_HASH_SEED 2166136261UL
+// FNV-1a hash of the command names, usable at compile time
+constexpr uint32_t at_hash_step(uint32_t hash, char c)
+{
+	return (uint32_t)((hash ^ (uint8_t)c) * 16777619UL);
+}
+constexpr uint32_t at_hash(const char *str, uint32_t hash = AT_HASH_SEED)
+{
+	return *str == 0 ? hash : at_hash(str + 1, at_hash_step(hash, *str));
+}
+// Name entry of the command table, the name must be uppercase
+#define AT_NAME(name) at_hash(name), name
+struct s_at_cmd
+{
+	// Hash of the name
+	uint32_t hash;
+	// Name including the +, e.g. "+ACCTHS"
+	const char *name;
+	// Help text
+	const char *help;
+	// Number of arguments
+	uint8_t argc;
+	// Application parameter tag of each argument
+	uint8_t tags[AT_MAX_ARGS];
+	// Application parameter length of each argument
+	uint8_t lens[AT_MAX_ARGS];
+	// Optional handler for commands that are not parameters
+	uint8_t (*handler)(bool read, uint32_t *args);
+};
+// Perfect hash of the command table, the slot of a command is
+// (hash * (2 * seed + 1)) >> (32 - AT_SLOT_BITS). The first seed
+// that gives each command its own slot is searched at compile time.
+#define AT_SLOT_BITS 7
+#define AT_SLOTS (1 << AT_SLOT_BITS)
+#define AT_MAX_SEED 256
+#define AT_NO_CMD 0xFF
+struct s_at_index
+{
+	// Index into the command table for each slot, AT_NO_CMD if empty
+	uint8_t cmd[AT_SLOTS];
+};
+constexpr uint8_t at_slot(uint32_t hash, uint16_t seed)
+{
+	return (uint8_t)((uint32_t)(hash * (2UL * seed + 1)) >> (32 - AT_SLOT_BITS));
+}
+// No command after i shares the slot of command i
+constexpr bool at_slot_alone(const s_at_cmd *table, uint8_t num, uint16_t seed, uint8_t i, uint8_t j)
+{
+	return j >= num ? true : ((at_slot(table[i].hash, seed) != at_slot(table[j].hash, seed)) && at_slot_alone(table, num, seed, i, j + 1));
+}
+constexpr bool at_slots_unique(const s_at_cmd *table, uint8_t num, uint16_t seed, uint8_t i = 0)
+{
+	return i >= num ? true : (at_slot_alone(table, num, seed, i, i + 1) && at_slots_unique(table, num, seed, i + 1));
+}
+// First collision free seed, AT_MAX_SEED if there is none
+constexpr uint16_t at_find_seed(const s_at_cmd *table, uint8_t num, uint16_t seed = 0)
+{
+	return seed >= AT_MAX_SEED ? AT_MAX_SEED : (at_slots_unique(table, num, seed) ? seed : at_find_seed(table, num, seed + 1));
+}
+// Command in a slot
+constexpr uint8_t at_slot_cmd(const s_at_cmd *table, uint8_t num, uint16_t seed, uint8_t slot, uint8_t i = 0)
+{
+	return i >= num ? AT_NO_CMD : (at_slot(table[i].hash, seed) == slot ? i : at_slot_cmd(table, num, seed, slot, i + 1));
+}
+// Compile time list 0 .. N - 1 to fill the slots
+template <uint8_t... I>
+struct at_seq
+{
+};
+template <uint16_t N, uint8_t... I>
+struct at_make_seq : at_make_seq<N - 1, N - 1, I...>
+{
+};
+template <uint8_t... I>
+struct at_make_seq<0, I...>
+{
+	typedef at_seq<I...> type;
+};
+template <uint8_t... I>
+constexpr s_at_index at_make_index(const s_at_cmd *table, uint8_t num, uint16_t seed, at_seq<I...>)
+{
+	return s_at_index{{at_slot_cmd(table, num, seed, I)...}};
+}
+extern const s_at_cmd app_at_cmds[];
+extern const uint8_t app_at_cmds_num;
+extern const uint16_t app_at_seed;
+extern const s_at_index app_at_index;
+const s_at_cmd *at_find(const char **pos, const char *end);
+bool user_at_handler(char *user_cmd, uint8_t cmd_size);
+
+/** Boot timeline and fast start */
+#define BOOT_SETUP_APP 0
+#define BOOT_API_INIT 1
+#define BOOT_SENSOR 2
+#define BOOT_APP_READY 3
+#define BOOT_JOINED 4
+#define BOOT_FIRST_TX 5
+#define BOOT_FIRST_TX_FIN 6
+#define BOOT_BLE 7
+#define BOOT_STAGES 8
+void boot_mark(uint8_t stage);
+bool boot_reached(uint8_t stage);
+bool boot_check_fast_start(void);
+void boot_deferred_init(void);
+void boot_report(void);
+uint8_t at_boot(bool read, uint32_t *args);
+extern uint64_t boot_time[];
+extern bool boot_fast_start;
+
+/** Energy estimate */
+#define ENERGY_CPU 0
+#define ENERGY_TX 1
+#define ENERGY_RX 2
+#define ENERGY_BLE 3
+#define ENERGY_CATEGORIES 4
+struct s_energy
+{
+	// Number of wakeups of the loop
+	uint32_t wakeups;
+	// Number of enqueued uplinks
+	uint32_t uplinks;
+	// Active time of each category in us
+	uint64_t time_us[ENERGY_CATEGORIES];
+	// Consumed charge of each category in uA * ms
+	uint64_t charge_uams[ENERGY_CATEGORIES];
+};
+void energy_init(void);
+void energy_wakeup(void);
+void energy_uplink(uint8_t len);
+void energy_ble(uint32_t radio_us);
+uint32_t energy_time_on_air(uint8_t len, uint8_t sf);
+void energy_report(void);
+uint32_t energy_average_since(const s_energy *base, uint64_t base_ms);
+uint64_t energy_uptime_ms(void);
+uint8_t at_energy(bool read, uint32_t *args);
+extern s_energy energy;
+
+/** Memory high-water marks */
+#define MEM_MAX_TASKS 12
+#define MEM_PAYLOAD 0
+#define MEM_DL_RESPONSE 1
+#define MEM_BLE_RX 2
+#define MEM_STREAM_QUEUE 3
+#define MEM_STAMPS 4
+#define MEM_RX_RING 5
+struct s_mem_pool
+{
+	// Name of the buffer
+	const char *name;
+	// Size of the buffer
+	uint16_t size;
+	// Max used size
+	uint16_t high;
+};
+void mem_pool_mark(uint8_t pool, uint16_t used);
+void mem_init_finished(void);
+void mem_check(void);
+uint8_t at_mem(bool read, uint32_t *args);
+extern s_mem_pool mem_pools[];
+extern const uint8_t mem_pools_num;
+
+/** Ring buffer of received frames, the number of slots must be a power of 2 */
+#ifndef RX_RING
+#define RX_RING 0
+#endif
+#define RX_RING_SLOTS 4
+#define RX_FRAME_MAX 242
+struct s_rx_frame
+{
+	// LoRaWAN port
+	uint8_t port;
+	// Payload size
+	uint8_t len;
+	// RSSI of the frame
+	int16_t rssi;
+	// SNR of the frame
+	int8_t snr;
+	// Payload
+	uint8_t data[RX_FRAME_MAX];
+};
+s_rx_frame *rx_ring_reserve(void);
+void rx_ring_commit(void);
+bool rx_ring_push(const uint8_t *data, uint8_t len, uint8_t port, int16_t rssi, int8_t snr);
+void rx_ring_take_pending(void);
+s_rx_frame *rx_ring_peek(void);
+void rx_ring_release(void);
+uint8_t at_rx_ring(bool read, uint32_t *args);
+
+/** Firmware update over LoRaWAN */
+bool fuota_handler(uint8_t port, uint8_t *data, uint8_t len);
+void fuota_event(void);
+void fuota_cancel(void);
+uint8_t at_fuota(bool read, uint32_t *args);
+
+/** Link quality estimator */
+#define LINK_OFF 0
+#define LINK_CONFIRM 1
+#define LINK_DR 2
+#define LINK_CONFIRM_MAX 32
+struct s_link
+{
+	// LINK_OFF, LINK_CONFIRM or LINK_DR
+	uint8_t mode;
+	// SNR margin for a faster data rate in dB
+	uint8_t margin;
+	// Moving average of the downlink SNR in 0.1 dB
+	int16_t snr;
+	// Moving average of the downlink RSSI in dBm
+	int16_t rssi;
+	// Moving average of the ACKs of confirmed uplinks in permille
+	int16_t ack;
+	// Number of downlinks in the averages, saturates
+	uint16_t rx_samples;
+	// Data rate set by the estimator
+	uint8_t dr;
+	// Data rate of the LoRaWAN settings the estimator started from
+	uint8_t base_dr;
+	// Every N-th uplink is confirmed, 1 .. LINK_CONFIRM_MAX
+	uint8_t confirm_interval;
+	// Uplinks since the last confirmed one
+	uint8_t since_confirm;
+	// Uplinks since the last data rate change
+	uint16_t since_change;
+	// Last uplink was confirmed and waits for its result
+	bool last_confirmed;
+	// Uplinks, confirmed uplinks and ACKs
+	uint32_t uplinks;
+	uint32_t confirmed;
+	uint32_t acks;
+};
+void link_set_params(uint8_t mode, uint8_t margin);
+void link_rx(int16_t rssi, int8_t snr);
+lmh_error_status link_send(uint8_t *data, uint8_t size);
+void link_tx_done(bool ack);
+uint8_t link_data_rate(void);
+uint8_t link_max_payload(void);
+uint8_t at_link_stat(bool read, uint32_t *args);
+extern s_link link_state;
+
+/** Event loop latency and watchdog */
+#ifndef WDT_TIMEOUT
+#define WDT_TIMEOUT 0
+#endif
+#define LOOP_EVENTS 16
+#define LOOP_BUCKETS 16
+#define LOOP_DIAG_TAG 0xD3
+void loop_init(void);
+void loop_start(void);
+void loop_mark(void);
+void loop_end(void);
+void loop_clear(void);
+void loop_report(void);
+uint8_t loop_add_diag(uint8_t *buffer, uint8_t len, uint8_t max_len, uint8_t interval);
+uint8_t at_loop(bool read, uint32_t *args);
+
+/** Offload of an accelerometer capture over LoRa P2P */
+bool bulk_send_capture(void);
+bool bulk_capturing(void);
+void bulk_capture_handler(void);
+bool bulk_active(void);
+void bulk_event(void);
+void bulk_report(void);
+uint8_t at_bulk(bool read, uint32_t *args);
+
+/** Sensor trace record and replay */
+#define TRACE_OFF 0
+#define TRACE_RECORD 1
+#define TRACE_REPLAY 2
+#define TRACE_DUMP 3
+// Record tags
+#define TRACE_ACC_INT 0x01
+#define TRACE_ACC_FIFO 0x02
+void trace_init(void);
+bool trace_start(uint8_t mode);
+void trace_stop(void);
+bool trace_active(void);
+bool trace_replaying(void);
+void trace_add(uint8_t tag, const uint8_t *data, uint8_t len);
+int16_t trace_take(uint8_t tag, uint8_t *data, uint8_t max_len);
+void trace_event(void);
+void trace_report(void);
+uint8_t at_trace(bool read, uint32_t *args);
+
+/** On device benchmarks */
+uint8_t at_bench(bool read, uint32_t *args);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,261 @@
+/**
+ * @file at_user.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Application defined AT commands
+ *        The commands are defined in the app_at_cmds[] table. Each
+ *        command maps up to AT_MAX_ARGS decimal (or 0x hex) arguments
+ *        to application parameters, changes are stored in the journal.
+ *        Commands that are not parameters have their own handler.
+ *        The command names are hashed at compile time into a perfect
+ *        hash table, a received name is found with one table access.
+ *        If no collision free table is found the build fails.
+ *        Parsing works on the received buffer, no String is used.
+ * @version 0.1
+ * @date 2021-06-14
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+/**
+ * @brief Parse an unsigned decimal or 0x hex number
+ *
+ * @param str Pointer to the number, moved behind the number
+ * @param value Parsed value
+ * @return true Number is valid
+ * @return false No number or overflow
+ */
+static bool at_parse_uint(const char **str, uint32_t *value)
+{
+	const char *pos = *str;
+	uint8_t base = 10;
+	uint64_t result = 0;
+
+	if ((pos[0] == '0') && ((pos[1] == 'x') || (pos[1] == 'X')))
+	{
+		base = 16;
+		pos += 2;
+	}
+	const char *start = pos;
+	while (true)
+	{
+		char c = *pos;
+		uint8_t digit;
+		if ((c >= '0') && (c <= '9'))
+		{
+			digit = c - '0';
+		}
+		else if ((base == 16) && (c >= 'a') && (c <= 'f'))
+		{
+			digit = c - 'a' + 10;
+		}
+		else if ((base == 16) && (c >= 'A') && (c <= 'F'))
+		{
+			digit = c - 'A' + 10;
+		}
+		else
+		{
+			break;
+		}
+		result = result * base + digit;
+		if (result > 0xFFFFFFFF)
+		{
+			return false;
+		}
+		pos++;
+	}
+	if (pos == start)
+	{
+		return false;
+	}
+	*value = (uint32_t)result;
+	*str = pos;
+	return true;
+}
+
+/**
+ * @brief Print the result status of a command
+ *
+ * @param error 0 for OK, otherwise the AT error code
+ */
+static void at_status(uint8_t error)
+{
+	if (error == 0)
+	{
+		AT_PRINTF("OK");
+	}
+	else
+	{
+		AT_PRINTF("+CME ERROR:%d", error);
+	}
+}
+
+/**
+ * @brief Write the arguments as one application parameter change
+ *
+ * @param cmd The command
+ * @param args Parsed arguments
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+static uint8_t at_write(const s_at_cmd *cmd, uint32_t *args)
+{
+	app_param_begin();
+	for (uint8_t idx = 0; idx < cmd->argc; idx++)
+	{
+		uint8_t value[4];
+		uint8_t len = cmd->lens[idx];
+		if ((len < 4) && (args[idx] >= (1UL << (8 * len))))
+		{
+			return AT_ERR_RANGE;
+		}
+		dl_put_value(value, args[idx], len);
+		switch (app_param_write(cmd->tags[idx], value, len))
+		{
+		case DL_OK:
+			break;
+		case DL_ERR_RANGE:
+			return AT_ERR_RANGE;
+		default:
+			return AT_ERR_GENERIC;
+		}
+	}
+	app_param_commit();
+	journal_write(cmd->tags, cmd->argc);
+	return 0;
+}
+
+/**
+ * @brief Print the current values of a command
+ *
+ * @param cmd The command
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+static uint8_t at_read(const s_at_cmd *cmd)
+{
+	// Max 4 values with 10 digits and separator
+	char reply[48];
+	uint8_t reply_len = 0;
+	for (uint8_t idx = 0; idx < cmd->argc; idx++)
+	{
+		uint8_t value[4];
+		uint8_t len = app_param_read(cmd->tags[idx], value);
+		if (len == 0)
+		{
+			return AT_ERR_GENERIC;
+		}
+		reply_len += snprintf(&reply[reply_len], sizeof(reply) - reply_len, idx == 0 ? "%lu" : ",%lu", dl_get_value(value, len));
+	}
+	AT_PRINTF("%s:%s", cmd->name, reply);
+	return 0;
+}
+
+/**
+ * @brief Find a command of the application in the perfect hash table
+ *
+ * @param pos Start of the name, moved to the first character after the name
+ * @param end End of the command
+ * @return const s_at_cmd* Command, NULL if the name is unknown
+ */
+const s_at_cmd *at_find(const char **pos, const char *end)
+{
+	// Hash the name up to '=', '?' or end of line
+	const char *name = *pos;
+	const char *scan = name;
+	uint32_t hash = AT_HASH_SEED;
+	while ((scan < end) && (*scan != '=') && (*scan != '?') && (*scan != '\r') && (*scan != '\n') && (*scan != 0))
+	{
+		char c = *scan++;
+		if ((c >= 'a') && (c <= 'z'))
+		{
+			c -= 'a' - 'A';
+		}
+		hash = at_hash_step(hash, c);
+	}
+	uint8_t name_len = scan - name;
+	*pos = scan;
+
+	// Only one command can be in the slot, confirm hash and name
+	uint8_t idx = app_at_index.cmd[at_slot(hash, app_at_seed)];
+	if ((idx != AT_NO_CMD) && (app_at_cmds[idx].hash == hash) && (strlen(app_at_cmds[idx].name) == name_len) &&
+		(strncasecmp(app_at_cmds[idx].name, name, name_len) == 0))
+	{
+		return &app_at_cmds[idx];
+	}
+	return NULL;
+}
+
+/**
+ * @brief Handler for AT commands that are unknown to the WisBlock-API
+ *
+ * @param user_cmd Received command, with or without the leading AT
+ * @param cmd_size Length of the command
+ * @return true Command belongs to the application and was handled
+ * @return false Unknown command
+ */
+bool user_at_handler(char *user_cmd, uint8_t cmd_size)
+{
+	const char *pos = user_cmd;
+	const char *end = user_cmd + cmd_size;
+
+	if ((cmd_size >= 2) && ((pos[0] == 'A') || (pos[0] == 'a')) && ((pos[1] == 'T') || (pos[1] == 't')))
+	{
+		pos += 2;
+	}
+
+	const s_at_cmd *cmd = at_find(&pos, end);
+	if (cmd == NULL)
+	{
+		return false;
+	}
+
+	if ((pos < end) && (*pos == '?'))
+	{
+		// AT+CMD? => help
+		AT_PRINTF("%s:\"%s\"", cmd->name, cmd->help);
+		at_status(0);
+		return true;
+	}
+	if ((pos >= end) || (*pos != '='))
+	{
+		// No command without parameters
+		at_status(AT_ERR_PARAM);
+		return true;
+	}
+	pos++;
+	if ((pos < end) && (*pos == '?'))
+	{
+		// AT+CMD=? => read
+		at_status(cmd->handler != NULL ? cmd->handler(true, NULL) : at_read(cmd));
+		return true;
+	}
+
+	// AT+CMD=<arg>[,<arg>...] => write
+	uint32_t args[AT_MAX_ARGS];
+	for (uint8_t idx = 0; idx < cmd->argc; idx++)
+	{
+		if (!at_parse_uint(&pos, &args[idx]))
+		{
+			at_status(AT_ERR_PARAM);
+			return true;
+		}
+		if ((idx + 1) < cmd->argc)
+		{
+			if (*pos != ',')
+			{
+				at_status(AT_ERR_PARAM);
+				return true;
+			}
+			pos++;
+		}
+	}
+	if ((pos < end) && (*pos != 0) && (*pos != '\r') && (*pos != '\n'))
+	{
+		// Trailing characters or too many arguments
+		at_status(AT_ERR_PARAM);
+		return true;
+	}
+	at_status(cmd->handler != NULL ? cmd->handler(false, args) : at_write(cmd, args));
+	return true;
+}
@@ -0,0 +1,465 @@
+/**
+ * @file ble_stream.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Binary streaming of raw LIS3DH data over BLE UART
+ *        FIFO blocks are packed into full size notifications with
+ *        sequence numbers. If the link can't keep up, the FIFO is
+ *        not read and the sensor keeps buffering until it overflows
+ *        Optional the samples are compressed with acc_codec, lossless
+ *        or with a max error per value
+ * @version 0.1
+ * @date 2021-06-07
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+#include "acc_codec.h"
+
+/** Max ATT MTU requested from the central */
+#define STREAM_MTU 247
+/** Max notification payload (MTU - 3 bytes ATT header) */
+#define STREAM_PACKET_SIZE (STREAM_MTU - 3)
+/** Number of notification buffers waiting for the link */
+#define STREAM_QUEUE_SIZE 8
+/** Packet header: marker, sequence (2), sample count, flags */
+#define STREAM_HEADER_SIZE 5
+/** Marker of a stream packet */
+#define STREAM_MARKER 0xA5
+/** FIFO watermark in samples */
+#define STREAM_FIFO_THS 24
+/** Retry time if the link is busy in ms */
+#define STREAM_RETRY_TIME 5
+
+/** Flag for 8-bit low power samples */
+#define STREAM_FLAG_8BIT 0x01
+/** Flag that samples were lost before this packet */
+#define STREAM_FLAG_GAP 0x02
+/** Flag for compressed samples, byte 5 is shift << 4 | max error */
+#define STREAM_FLAG_CODEC 0x04
+/** Header size of compressed packets */
+#define STREAM_CODEC_HEADER_SIZE 6
+
+/** Notification buffers waiting for the link */
+uint8_t stream_queue[STREAM_QUEUE_SIZE][STREAM_PACKET_SIZE];
+/** Length of the queued notifications */
+uint8_t stream_queue_len[STREAM_QUEUE_SIZE];
+/** Index of the oldest queued notification */
+uint8_t stream_queue_head = 0;
+/** Number of queued notifications */
+uint8_t stream_queue_count = 0;
+
+/** Raw FIFO block */
+uint8_t stream_fifo[32 * 6];
+
+/** Flag if streaming is active */
+bool stream_active = false;
+/** Flag if the queue is sent after the stream was stopped */
+bool stream_draining = false;
+/** TX buffering of the BLE UART before the stream started */
+bool stream_txd_buffered = false;
+/** Flag if samples are 8-bit */
+bool stream_8bit = false;
+/** Sample size in bytes */
+uint8_t stream_sample_size = 6;
+/** Usable notification size of the current connection */
+uint8_t stream_packet_size = 20;
+/** Sequence number of the next packet */
+uint16_t stream_seq = 0;
+/** Flag that samples were lost since the last packet */
+bool stream_gap = false;
+/** Flag if samples are compressed */
+bool stream_coded = false;
+/** Max error of a compressed value */
+uint8_t stream_near = 0;
+/** Codec of the packet that is filled */
+s_acc_codec stream_codec;
+
+/** Stream statistics */
+s_stream_stats stream_stats;
+
+/** Timer to retry if the link was busy */
+SoftwareTimer stream_timer;
+
+/**
+ * @brief Access to the TX buffering flag of the BLE UART
+ *        BLEUart has no getter for it
+ *
+ */
+struct s_stream_uart : BLEUart
+{
+	static bool buffered(BLEUart &uart)
+	{
+		return uart.*(&s_stream_uart::_tx_buffered);
+	}
+};
+
+/**
+ * @brief Take the packet size from the MTU exchange
+ *        getMtu() is only valid after the exchange finished
+ *
+ * @param evt BLE event from the SoftDevice
+ */
+static void stream_ble_event(ble_evt_t *evt)
+{
+	uint16_t mtu = 0;
+	if (evt->header.evt_id == BLE_GATTC_EVT_EXCHANGE_MTU_RSP)
+	{
+		// We asked for the MTU
+		mtu = evt->evt.gattc_evt.params.exchange_mtu_rsp.server_rx_mtu;
+	}
+	else if (evt->header.evt_id == BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST)
+	{
+		// The central asked for the MTU
+		mtu = evt->evt.gatts_evt.params.exchange_mtu_request.client_rx_mtu;
+	}
+	if (mtu == 0)
+	{
+		return;
+	}
+	mtu = mtu > STREAM_MTU ? STREAM_MTU : mtu;
+	// The MTU only grows, packets that are filled already stay valid
+	if (mtu - 3 > stream_packet_size)
+	{
+		stream_packet_size = mtu - 3;
+	}
+}
+
+/**
+ * @brief Wake up the loop to retry sending
+ *
+ */
+void stream_retry(TimerHandle_t xTimerID)
+{
+	g_task_event_type |= ACC_TRIGGER;
+	xSemaphoreGive(g_task_sem);
+}
+
+/**
+ * @brief Get the buffer of the notification that is filled
+ *
+ * @return uint8_t* Pointer to the buffer, NULL if the queue is full
+ */
+static uint8_t *stream_current(void)
+{
+	uint8_t tail = (stream_queue_head + stream_queue_count) % STREAM_QUEUE_SIZE;
+	if (stream_queue_count == STREAM_QUEUE_SIZE)
+	{
+		return NULL;
+	}
+	if (stream_queue_len[tail] == 0)
+	{
+		// Start a new packet
+		stream_queue[tail][0] = STREAM_MARKER;
+		stream_queue[tail][1] = (uint8_t)(stream_seq);
+		stream_queue[tail][2] = (uint8_t)(stream_seq >> 8);
+		stream_queue[tail][3] = 0;
+		stream_queue[tail][4] = (stream_8bit ? STREAM_FLAG_8BIT : 0) | (stream_gap ? STREAM_FLAG_GAP : 0);
+		stream_queue_len[tail] = STREAM_HEADER_SIZE;
+		if (stream_coded)
+		{
+			// Low power samples are 8 bit, high resolution samples 12 bit left justified
+			stream_queue[tail][4] |= STREAM_FLAG_CODEC;
+			stream_queue[tail][5] = ((stream_8bit ? 8 : 4) << 4) | stream_near;
+			stream_queue_len[tail] = STREAM_CODEC_HEADER_SIZE;
+			acc_codec_begin(&stream_codec, &stream_queue[tail][STREAM_CODEC_HEADER_SIZE], stream_packet_size - STREAM_CODEC_HEADER_SIZE, stream_near);
+		}
+		stream_gap = false;
+		stream_seq++;
+	}
+	return stream_queue[tail];
+}
+
+/**
+ * @brief Send as many queued notifications as the link accepts
+ *
+ */
+static void stream_flush(void)
+{
+	while (stream_queue_count != 0)
+	{
+		uint8_t *packet = stream_queue[stream_queue_head];
+		uint8_t len = stream_queue_len[stream_queue_head];
+		if (g_ble_uart.write(packet, len) != len)
+		{
+			// No free notification buffer, link is busy
+			stream_stats.busy++;
+			return;
+		}
+		stream_stats.packets++;
+		stream_stats.bytes += len;
+		stream_queue_len[stream_queue_head] = 0;
+		stream_queue_head = (stream_queue_head + 1) % STREAM_QUEUE_SIZE;
+		stream_queue_count--;
+	}
+}
+
+/**
+ * @brief Add a sample to a compressed packet
+ *
+ * @param sample Raw sample from the FIFO
+ * @param packet Packet that is filled
+ * @param tail Queue index of the packet
+ * @return true Sample added
+ * @return false Packet is full
+ */
+static bool stream_code_sample(uint8_t *sample, uint8_t *packet, uint8_t tail)
+{
+	int16_t values[3];
+	for (uint8_t axis = 0; axis < 3; axis++)
+	{
+		if (stream_8bit)
+		{
+			// Only the high bytes are valid in low power mode
+			values[axis] = (int8_t)sample[axis * 2 + 1];
+		}
+		else
+		{
+			values[axis] = (int16_t)(sample[axis * 2] | (sample[axis * 2 + 1] << 8)) >> 4;
+		}
+	}
+	if ((packet[3] == 255) || !acc_codec_add(&stream_codec, values))
+	{
+		return false;
+	}
+	stream_queue_len[tail] = STREAM_CODEC_HEADER_SIZE + acc_codec_len(&stream_codec);
+	packet[3]++;
+	return true;
+}
+
+/**
+ * @brief Start streaming raw accelerometer data
+ *
+ * @param rate Output data rate, 400, 1344 or 1600 Hz
+ * @param near -1 for uncompressed samples, otherwise max error of a compressed value 0 .. 15
+ * @return true Streaming started
+ * @return false No central connected
+ */
+bool stream_start(uint16_t rate, int8_t near)
+{
+	if (!g_ble_uart_is_connected)
+	{
+		return false;
+	}
+
+	// Ask for the largest MTU, data length extension and 2M PHY
+	// Start with the current MTU, stream_ble_event() takes the result of the exchange
+	BLEConnection *conn = Bluefruit.Connection(Bluefruit.connHandle());
+	stream_packet_size = 20;
+	if (conn != NULL)
+	{
+		uint16_t mtu = conn->getMtu();
+		stream_packet_size = mtu - 3 > STREAM_PACKET_SIZE ? STREAM_PACKET_SIZE : mtu - 3;
+		Bluefruit.setEventCallback(stream_ble_event);
+		conn->requestMtuExchange(STREAM_MTU);
+		conn->requestDataLengthUpdate();
+		conn->requestPHY();
+	}
+	MYLOG("STREAM", "Start %d Hz, packet size %d, max error %d", rate, stream_packet_size, near);
+	stream_coded = near >= 0;
+	stream_near = near > 15 ? 15 : (near < 0 ? 0 : near);
+
+	if (!stream_draining)
+	{
+		stream_txd_buffered = s_stream_uart::buffered(g_ble_uart);
+	}
+	stream_draining = false;
+	g_ble_uart.bufferTXD(false);
+	memset(&stream_stats, 0, sizeof(s_stream_stats));
+	memset(stream_queue_len, 0, sizeof(stream_queue_len));
+	stream_queue_head = 0;
+	stream_queue_count = 0;
+	stream_seq = 0;
+	stream_gap = false;
+
+	stream_timer.begin(STREAM_RETRY_TIME, stream_retry, NULL, false);
+	stream_stats.start = millis();
+	stream_active = true;
+	stream_8bit = acc_fifo_start(rate, STREAM_FIFO_THS);
+	stream_sample_size = stream_8bit ? 3 : 6;
+	return true;
+}
+
+/**
+ * @brief Restore the BLE UART after the queue is sent or dropped
+ *
+ */
+static void stream_end(void)
+{
+	stream_draining = false;
+	stream_timer.stop();
+	Bluefruit.setEventCallback(NULL);
+	g_ble_uart.bufferTXD(stream_txd_buffered);
+	if (stream_queue_count != 0)
+	{
+		// Link is gone, the rest of the queue is lost
+		MYLOG("STREAM", "Dropped %d packets", stream_queue_count);
+		memset(stream_queue_len, 0, sizeof(stream_queue_len));
+		stream_queue_count = 0;
+	}
+}
+
+/**
+ * @brief Stop streaming and restore motion detection
+ *        The partly filled packet and the queue are still sent,
+ *        stream_handler() retries until the queue is empty
+ *
+ */
+void stream_stop(void)
+{
+	if (!stream_active)
+	{
+		return;
+	}
+	stream_active = false;
+	stream_timer.stop();
+	acc_fifo_stop();
+	stream_stats.duration = millis() - stream_stats.start;
+
+	uint8_t tail = (stream_queue_head + stream_queue_count) % STREAM_QUEUE_SIZE;
+	if ((stream_queue_count < STREAM_QUEUE_SIZE) && (stream_queue_len[tail] != 0))
+	{
+		if (stream_queue[tail][3] != 0)
+		{
+			// Send the last samples in a short packet
+			stream_queue_count++;
+		}
+		else
+		{
+			stream_queue_len[tail] = 0;
+		}
+	}
+	if (g_ble_uart_is_connected)
+	{
+		stream_flush();
+	}
+	if (g_ble_uart_is_connected && (stream_queue_count != 0))
+	{
+		stream_draining = true;
+		stream_timer.start();
+	}
+	else
+	{
+		stream_end();
+	}
+	MYLOG("STREAM", "Stopped, %ld packets, %ld bytes in %ld ms", stream_stats.packets, stream_stats.bytes, stream_stats.duration);
+	MYLOG("STREAM", "%ld FIFO overruns, lost %ld samples in queue, link busy %ld times", stream_stats.overruns, stream_stats.queue_drops, stream_stats.busy);
+}
+
+/**
+ * @brief Handle the FIFO watermark interrupt while streaming
+ *        Reads the FIFO only if there is space in the queue
+ *
+ */
+void stream_handler(void)
+{
+	if (stream_draining)
+	{
+		// Stream is stopped, send the rest of the queue
+		if (g_ble_uart_is_connected)
+		{
+			stream_flush();
+		}
+		if (g_ble_uart_is_connected && (stream_queue_count != 0))
+		{
+			stream_timer.start();
+			return;
+		}
+		stream_end();
+		return;
+	}
+
+	if (!g_ble_uart_is_connected)
+	{
+		stream_stop();
+		return;
+	}
+
+	stream_flush();
+
+	if (stream_queue_count == STREAM_QUEUE_SIZE)
+	{
+		// Back-pressure, leave the samples in the sensor FIFO
+		stream_timer.start();
+		return;
+	}
+
+	bool overrun = false;
+	uint8_t samples = acc_fifo_read(stream_fifo, 32, &overrun);
+	if (overrun)
+	{
+		// The sensor overwrote samples while we waited for the link
+		stream_stats.overruns++;
+		stream_gap = true;
+	}
+	stream_stats.samples += samples;
+
+	for (uint8_t idx = 0; idx < samples; idx++)
+	{
+		uint8_t *packet = stream_current();
+		if (packet == NULL)
+		{
+			// Queue full, rest of the block is lost
+			stream_stats.queue_drops += samples - idx;
+			stream_gap = true;
+			break;
+		}
+		uint8_t tail = (stream_queue_head + stream_queue_count) % STREAM_QUEUE_SIZE;
+		uint8_t *sample = &stream_fifo[idx * 6];
+		if (stream_coded)
+		{
+			if (stream_code_sample(sample, packet, tail))
+			{
+				continue;
+			}
+			// Packet is full, queue it and try the sample again in the next one
+			stream_queue_count++;
+			idx--;
+			continue;
+		}
+		if (stream_8bit)
+		{
+			// Only the high bytes are valid in low power mode
+			packet[stream_queue_len[tail]++] = sample[1];
+			packet[stream_queue_len[tail]++] = sample[3];
+			packet[stream_queue_len[tail]++] = sample[5];
+		}
+		else
+		{
+			memcpy(&packet[stream_queue_len[tail]], sample, 6);
+			stream_queue_len[tail] += 6;
+		}
+		packet[3]++;
+
+		if ((stream_queue_len[tail] + stream_sample_size) > stream_packet_size)
+		{
+			// Packet is full, queue it
+			stream_queue_count++;
+		}
+	}
+
+	mem_pool_mark(MEM_STREAM_QUEUE, stream_queue_count);
+	stream_flush();
+	if (stream_queue_count != 0)
+	{
+		stream_timer.start();
+	}
+}
+
+/**
+ * @brief Report the stream statistics over BLE UART
+ *
+ */
+void stream_report(void)
+{
+	uint32_t duration = stream_active ? millis() - stream_stats.start : stream_stats.duration;
+	uint32_t throughput = duration == 0 ? 0 : stream_stats.bytes * 1000 / duration;
+	g_ble_uart.printf("STREAM packets %ld bytes %ld samples %ld\n", stream_stats.packets, stream_stats.bytes, stream_stats.samples);
+	g_ble_uart.printf("STREAM %ld B/s, FIFO overruns %ld, queue drops %ld, busy %ld\n", throughput, stream_stats.overruns, stream_stats.queue_drops, stream_stats.busy);
+	if (stream_coded && (stream_stats.bytes != 0))
+	{
+		// Raw size of the samples against the sent bytes, in 1/100
+		g_ble_uart.printf("STREAM compressed, max error %d, ratio %ld/100\n", stream_near, stream_stats.samples * stream_sample_size * 100 / stream_stats.bytes);
+	}
+}
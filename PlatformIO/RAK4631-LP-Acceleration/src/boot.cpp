@@ -0,0 +1,176 @@
+/**
+ * @file boot.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Boot timeline from reset to the first uplink and fast start mode
+ *        With FAST_START=1 in platformio.ini, BLE is not started after a
+ *        power on or brown out reset. It is started after the first uplink
+ *        is finished, so the node gets its data out as fast as possible.
+ * @version 0.1
+ * @date 2021-06-18
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+/** Names of the boot stages for the report */
+static const char *boot_stage_name[BOOT_STAGES] = {
+	"setup_app",
+	"API init (flash, BLE, LoRa)",
+	"Sensor init",
+	"init_app finished",
+	"Joined",
+	"First uplink enqueued",
+	"First uplink finished",
+	"Deferred BLE init"};
+
+/** micros() wraps after 71.6 minutes, later stages are taken from millis() */
+#define BOOT_US_LIMIT_MS 4294000UL
+
+/** Time of each stage in us since reset */
+uint64_t boot_time[BOOT_STAGES] = {0};
+
+/** Bit mask of the reached stages */
+static uint8_t boot_done = 0;
+
+/** Flag if fast start is active */
+bool boot_fast_start = false;
+
+/**
+ * @brief Record the time of a boot stage, only the first call counts
+ *        A join or first uplink can take longer than micros() can count,
+ *        then the time has ms resolution
+ *
+ * @param stage Boot stage
+ */
+void boot_mark(uint8_t stage)
+{
+	if ((stage < BOOT_STAGES) && !boot_reached(stage))
+	{
+		uint32_t now_ms = millis();
+		boot_time[stage] = now_ms < BOOT_US_LIMIT_MS ? micros() : (uint64_t)now_ms * 1000;
+		boot_done |= 1 << stage;
+	}
+}
+
+/**
+ * @brief Check if a boot stage was reached
+ *
+ * @param stage Boot stage
+ * @return true Stage was reached
+ * @return false Stage not reached yet
+ */
+bool boot_reached(uint8_t stage)
+{
+	return (stage < BOOT_STAGES) && ((boot_done & (1 << stage)) != 0);
+}
+
+/**
+ * @brief Format a time in us, the printf of the core has no 64 bit support
+ *
+ * @param text Buffer, at least 21 characters
+ * @param time_us Time in us
+ * @return char* text
+ */
+static char *boot_us_text(char *text, uint64_t time_us)
+{
+	uint32_t high = (uint32_t)(time_us / 1000000);
+	uint32_t low = (uint32_t)(time_us % 1000000);
+	if (high == 0)
+	{
+		sprintf(text, "%ld", low);
+	}
+	else
+	{
+		sprintf(text, "%ld%06ld", high, low);
+	}
+	return text;
+}
+
+/**
+ * @brief Decide about fast start, call at the beginning of setup_app()
+ *        BLE is deferred only after a power on or brown out reset,
+ *        both leave the reset reason register empty
+ *
+ * @return true BLE has to be deferred
+ * @return false Normal start
+ */
+bool boot_check_fast_start(void)
+{
+	boot_mark(BOOT_SETUP_APP);
+#if FAST_START > 0
+	boot_fast_start = readResetReason() == 0;
+#endif
+	return boot_fast_start;
+}
+
+/**
+ * @brief Start the deferred functions after the first uplink
+ *
+ */
+void boot_deferred_init(void)
+{
+	if (!boot_fast_start)
+	{
+		return;
+	}
+	boot_fast_start = false;
+
+	MYLOG("BOOT", "Start deferred BLE");
+	g_enable_ble = true;
+	init_ble();
+	ble_adv_init();
+	boot_mark(BOOT_BLE);
+}
+
+/**
+ * @brief Print the boot timeline
+ *
+ */
+void boot_report(void)
+{
+	uint64_t last = 0;
+	char time_text[21];
+	char delta_text[21];
+	for (uint8_t idx = 0; idx < BOOT_STAGES; idx++)
+	{
+		if (!boot_reached(idx))
+		{
+			continue;
+		}
+		boot_us_text(time_text, boot_time[idx]);
+		boot_us_text(delta_text, boot_time[idx] - last);
+		MYLOG("BOOT", "%-28s %10s us  +%s us", boot_stage_name[idx], time_text, delta_text);
+		if (g_ble_uart_is_connected)
+		{
+			g_ble_uart.printf("%s %s us +%s us\n", boot_stage_name[idx], time_text, delta_text);
+		}
+		last = boot_time[idx];
+	}
+}
+
+/**
+ * @brief AT+BOOT=? prints the timeline, one line per reached stage
+ *
+ * @param read true for AT+BOOT=?
+ * @param args Not used
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_boot(bool read, uint32_t *args)
+{
+	if (!read)
+	{
+		// Read only
+		return AT_ERR_PARAM;
+	}
+	char time_text[21];
+	for (uint8_t idx = 0; idx < BOOT_STAGES; idx++)
+	{
+		if (boot_reached(idx))
+		{
+			AT_PRINTF("+BOOT:%d,%s,%s", idx, boot_us_text(time_text, boot_time[idx]), boot_stage_name[idx]);
+		}
+	}
+	return 0;
+}
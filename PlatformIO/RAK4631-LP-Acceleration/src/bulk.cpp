@@ -0,0 +1,490 @@
+/**
+ * @file bulk.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Bulk data transfer over LoRa P2P, selective repeat ARQ.
+ *        The sender announces the transfer with a START frame, then
+ *        sends bursts of data frames. The last frame of a burst polls
+ *        the receiver, it answers with a SACK: the first frame it is
+ *        missing and a bitmap of the 32 frames after it. The next burst
+ *        repeats the frames that were lost and fills the window with
+ *        new ones. If the SACK does not come, a poll without data asks
+ *        for it again.
+ *        The receiver writes each frame straight into the storage and
+ *        stays until it hears nothing more, so a lost last SACK is
+ *        answered again.
+ * @version 0.1
+ * @date 2021-06-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "bulk.h"
+
+/**
+ * @brief Payload size of a data frame, the last one can be shorter
+ *
+ * @param bulk Transfer
+ * @param seq Frame number
+ * @return uint8_t Payload size
+ */
+static uint8_t bulk_payload_size(const s_bulk *bulk, uint16_t seq)
+{
+	uint32_t left = bulk->size - (uint32_t)seq * bulk->frame_size;
+	return left < bulk->frame_size ? left : bulk->frame_size;
+}
+
+/**
+ * @brief Check if a frame in the window was acknowledged or received
+ *
+ * @param bulk Transfer
+ * @param seq Frame number, not below the base
+ * @return true Frame is done
+ */
+static bool bulk_is_set(const s_bulk *bulk, uint16_t seq)
+{
+	uint16_t bit = seq - bulk->base;
+	return (bit < BULK_WINDOW) && (((bulk->bitmap >> bit) & 1) != 0);
+}
+
+/**
+ * @brief Hand the frame to the radio
+ *
+ * @param bulk Transfer
+ * @param size Frame size
+ */
+static void bulk_send_frame(s_bulk *bulk, uint8_t size)
+{
+	if (!bulk->radio->send(bulk->frame, size))
+	{
+		bulk->state = BULK_FAILED;
+	}
+}
+
+/**
+ * @brief Announce the transfer
+ *
+ * @param bulk Transfer
+ */
+static void bulk_send_start(s_bulk *bulk)
+{
+	bulk->frame[0] = BULK_START;
+	bulk->frame[1] = bulk->session;
+	bulk->frame[2] = (uint8_t)(bulk->size);
+	bulk->frame[3] = (uint8_t)(bulk->size >> 8);
+	bulk->frame[4] = (uint8_t)(bulk->size >> 16);
+	bulk->frame[5] = (uint8_t)(bulk->size >> 24);
+	bulk->frame[6] = bulk->frame_size;
+	bulk->wait_sack = true;
+	bulk_send_frame(bulk, BULK_START_SIZE);
+}
+
+/**
+ * @brief Answer a poll with the first missing frame and the bitmap after it
+ *
+ * @param bulk Transfer
+ */
+static void bulk_send_sack(s_bulk *bulk)
+{
+	bulk->frame[0] = BULK_SACK;
+	bulk->frame[1] = bulk->session;
+	bulk->frame[2] = (uint8_t)(bulk->base);
+	bulk->frame[3] = (uint8_t)(bulk->base >> 8);
+	bulk->frame[4] = (uint8_t)(bulk->bitmap);
+	bulk->frame[5] = (uint8_t)(bulk->bitmap >> 8);
+	bulk->frame[6] = (uint8_t)(bulk->bitmap >> 16);
+	bulk->frame[7] = (uint8_t)(bulk->bitmap >> 24);
+	bulk->sacks++;
+	bulk_send_frame(bulk, BULK_SACK_SIZE);
+}
+
+/**
+ * @brief Ask for the SACK again with a poll without data
+ *
+ * @param bulk Transfer
+ */
+static void bulk_send_poll(s_bulk *bulk)
+{
+	bulk->frame[0] = BULK_POLL;
+	bulk->frame[1] = bulk->session;
+	bulk->frame[2] = (uint8_t)(bulk->base);
+	bulk->frame[3] = (uint8_t)(bulk->base >> 8);
+	bulk->wait_sack = true;
+	bulk_send_frame(bulk, BULK_HEADER_SIZE);
+}
+
+/**
+ * @brief Find the next frame of the burst, lost frames before new ones
+ *
+ * @param bulk Transfer
+ * @param seq Frame number
+ * @param peek true to only check if there is one
+ * @return true There is a frame to send
+ */
+static bool bulk_next_frame(s_bulk *bulk, uint16_t *seq, bool peek)
+{
+	uint16_t scan = bulk->scan < bulk->base ? bulk->base : bulk->scan;
+	while ((scan < bulk->next) && bulk_is_set(bulk, scan))
+	{
+		scan++;
+	}
+	if (scan < bulk->next)
+	{
+		// Sent before and not acknowledged, lost
+		*seq = scan;
+		if (!peek)
+		{
+			bulk->scan = scan + 1;
+		}
+		return true;
+	}
+	if ((bulk->next < bulk->frames) && ((uint16_t)(bulk->next - bulk->base) < BULK_WINDOW))
+	{
+		*seq = bulk->next;
+		if (!peek)
+		{
+			bulk->next++;
+			bulk->scan = bulk->next;
+		}
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Send the next data frame of the burst, the last one polls the receiver
+ *
+ * @param bulk Transfer
+ */
+static void bulk_send_data(s_bulk *bulk)
+{
+	uint16_t seq;
+	uint16_t next = bulk->next;
+	if (!bulk_next_frame(bulk, &seq, false))
+	{
+		// Window is full, wait for the SACK of the last poll
+		bulk->wait_sack = true;
+		bulk->radio->receive(BULK_SACK_TIMEOUT);
+		return;
+	}
+	if (seq < next)
+	{
+		bulk->retransmits++;
+	}
+	bulk->burst--;
+	uint16_t more;
+	bulk->wait_sack = (bulk->burst == 0) || !bulk_next_frame(bulk, &more, true);
+
+	uint8_t size = bulk_payload_size(bulk, seq);
+	bulk->frame[0] = bulk->wait_sack ? BULK_POLL : BULK_DATA;
+	bulk->frame[1] = bulk->session;
+	bulk->frame[2] = (uint8_t)(seq);
+	bulk->frame[3] = (uint8_t)(seq >> 8);
+	bulk->read((uint32_t)seq * bulk->frame_size, &bulk->frame[BULK_HEADER_SIZE], size);
+	bulk->frames_sent++;
+	bulk_send_frame(bulk, BULK_HEADER_SIZE + size);
+}
+
+/**
+ * @brief Start a burst at the first frame that is not acknowledged
+ *
+ * @param bulk Transfer
+ * @param frames Max frames in the burst
+ */
+static void bulk_start_burst(s_bulk *bulk, uint8_t frames)
+{
+	bulk->scan = bulk->base;
+	bulk->burst = frames;
+	bulk_send_data(bulk);
+}
+
+/**
+ * @brief Sender, handle a SACK
+ *
+ * @param bulk Transfer
+ * @param data Frame
+ * @param size Frame size
+ */
+static void bulk_rx_sack(s_bulk *bulk, const uint8_t *data, uint8_t size)
+{
+	if ((size != BULK_SACK_SIZE) || (data[0] != BULK_SACK) || (data[1] != bulk->session) || !bulk->wait_sack)
+	{
+		// Not for this transfer, keep waiting
+		bulk->radio->receive(BULK_SACK_TIMEOUT);
+		return;
+	}
+	uint16_t base = data[2] | (data[3] << 8);
+	if (base > bulk->next)
+	{
+		// Frames that were never sent, not from this transfer
+		bulk->radio->receive(BULK_SACK_TIMEOUT);
+		return;
+	}
+	uint32_t bitmap = data[4] | (data[5] << 8) | ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+	bulk->sacks++;
+	bulk->retries = 0;
+	bulk->wait_sack = false;
+	bulk->state = BULK_SENDING;
+
+	if (base > bulk->base)
+	{
+		uint16_t shift = base - bulk->base;
+		bulk->bitmap = shift < BULK_WINDOW ? bulk->bitmap >> shift : 0;
+		bulk->base = base;
+	}
+	if (base == bulk->base)
+	{
+		bulk->bitmap |= bitmap;
+	}
+	if (bulk->base >= bulk->frames)
+	{
+		bulk->state = BULK_DONE;
+		return;
+	}
+	bulk_start_burst(bulk, BULK_BURST);
+}
+
+/**
+ * @brief Receiver, handle a START frame
+ *        A repeated START of the same transfer means the SACK was lost
+ *
+ * @param bulk Transfer
+ * @param data Frame
+ */
+static void bulk_rx_start(s_bulk *bulk, const uint8_t *data)
+{
+	uint8_t session = data[1];
+	uint32_t size = data[2] | (data[3] << 8) | ((uint32_t)data[4] << 16) | ((uint32_t)data[5] << 24);
+	uint8_t frame_size = data[6];
+	if ((bulk->state == BULK_LISTENING) && (frame_size != 0) && (frame_size <= BULK_FRAME_MAX) && (size <= bulk->max_size) &&
+		(((size + frame_size - 1) / frame_size) <= UINT16_MAX))
+	{
+		bulk->session = session;
+		bulk->size = size;
+		bulk->frame_size = frame_size;
+		bulk->frames = (size + frame_size - 1) / frame_size;
+		bulk->base = 0;
+		bulk->bitmap = 0;
+		bulk->state = BULK_RECEIVING;
+	}
+	else if ((bulk->state != BULK_RECEIVING) || (session != bulk->session))
+	{
+		bulk->radio->receive(BULK_IDLE_TIMEOUT);
+		return;
+	}
+	bulk->retries = 0;
+	bulk_send_sack(bulk);
+}
+
+/**
+ * @brief Receiver, handle a frame
+ *
+ * @param bulk Transfer
+ * @param data Frame
+ * @param size Frame size
+ */
+static void bulk_rx_data(s_bulk *bulk, const uint8_t *data, uint8_t size)
+{
+	if ((size == BULK_START_SIZE) && (data[0] == BULK_START))
+	{
+		bulk_rx_start(bulk, data);
+		return;
+	}
+	if ((bulk->state != BULK_RECEIVING) || (size < BULK_HEADER_SIZE) || ((data[0] != BULK_DATA) && (data[0] != BULK_POLL)) || (data[1] != bulk->session))
+	{
+		bulk->radio->receive(BULK_IDLE_TIMEOUT);
+		return;
+	}
+
+	uint16_t seq = data[2] | (data[3] << 8);
+	uint16_t bit = seq - bulk->base;
+	bulk->retries = 0;
+	// A poll without data only asks for the SACK again
+	if (size > BULK_HEADER_SIZE)
+	{
+		if ((seq < bulk->frames) && (bit < BULK_WINDOW) && ((size - BULK_HEADER_SIZE) == bulk_payload_size(bulk, seq)) && !bulk_is_set(bulk, seq))
+		{
+			bulk->frames_received++;
+			bulk->write((uint32_t)seq * bulk->frame_size, &data[BULK_HEADER_SIZE], size - BULK_HEADER_SIZE);
+			bulk->bitmap |= 1UL << bit;
+			// Move the window over the frames received in order
+			while ((bulk->bitmap & 1) != 0)
+			{
+				bulk->bitmap >>= 1;
+				bulk->base++;
+			}
+		}
+		else
+		{
+			// Received before or outside the window
+			bulk->retransmits++;
+		}
+	}
+
+	if (data[0] == BULK_POLL)
+	{
+		bulk_send_sack(bulk);
+		return;
+	}
+	bulk->radio->receive(BULK_IDLE_TIMEOUT);
+}
+
+/**
+ * @brief Start sending, the START frame goes out immediately
+ *
+ * @param bulk Transfer
+ * @param radio Radio access
+ * @param session Session number
+ * @param size Size of the data
+ * @param frame_size Payload size of a data frame
+ * @param read Read data from the storage
+ * @return true Transfer started
+ * @return false Invalid frame size, too many frames or the radio is busy
+ */
+bool bulk_send_init(s_bulk *bulk, const s_bulk_radio *radio, uint8_t session, uint32_t size, uint8_t frame_size, bulk_read_t read)
+{
+	memset(bulk, 0, sizeof(s_bulk));
+	if ((frame_size == 0) || (frame_size > BULK_FRAME_MAX) || (((size + frame_size - 1) / frame_size) > UINT16_MAX))
+	{
+		return false;
+	}
+	bulk->radio = radio;
+	bulk->read = read;
+	bulk->session = session;
+	bulk->size = size;
+	bulk->frame_size = frame_size;
+	bulk->frames = (size + frame_size - 1) / frame_size;
+	bulk->state = BULK_OPENING;
+	bulk_send_start(bulk);
+	return bulk->state == BULK_OPENING;
+}
+
+/**
+ * @brief Start listening for a transfer
+ *
+ * @param bulk Transfer
+ * @param radio Radio access
+ * @param max_size Size of the storage
+ * @param write Write data into the storage
+ */
+void bulk_receive_init(s_bulk *bulk, const s_bulk_radio *radio, uint32_t max_size, bulk_write_t write)
+{
+	memset(bulk, 0, sizeof(s_bulk));
+	bulk->radio = radio;
+	bulk->write = write;
+	bulk->max_size = max_size;
+	bulk->state = BULK_LISTENING;
+	bulk->radio->receive(BULK_IDLE_TIMEOUT);
+}
+
+/**
+ * @brief Radio finished sending a frame
+ *
+ * @param bulk Transfer
+ */
+void bulk_tx_done(s_bulk *bulk)
+{
+	switch (bulk->state)
+	{
+	case BULK_OPENING:
+	case BULK_SENDING:
+		if (bulk->wait_sack)
+		{
+			bulk->radio->receive(BULK_SACK_TIMEOUT);
+		}
+		else
+		{
+			bulk_send_data(bulk);
+		}
+		break;
+	case BULK_RECEIVING:
+		bulk->radio->receive(BULK_IDLE_TIMEOUT);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * @brief Radio received a frame
+ *
+ * @param bulk Transfer
+ * @param data Frame
+ * @param size Frame size
+ */
+void bulk_rx(s_bulk *bulk, const uint8_t *data, uint8_t size)
+{
+	switch (bulk->state)
+	{
+	case BULK_OPENING:
+	case BULK_SENDING:
+		bulk_rx_sack(bulk, data, size);
+		break;
+	case BULK_LISTENING:
+	case BULK_RECEIVING:
+		bulk_rx_data(bulk, data, size);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * @brief Radio received nothing, or a broken frame, before the timeout
+ *
+ * @param bulk Transfer
+ */
+void bulk_rx_timeout(s_bulk *bulk)
+{
+	switch (bulk->state)
+	{
+	case BULK_OPENING:
+	case BULK_SENDING:
+		bulk->timeouts++;
+		if (++bulk->retries > BULK_MAX_RETRIES)
+		{
+			bulk->state = BULK_FAILED;
+			break;
+		}
+		if (bulk->state == BULK_OPENING)
+		{
+			bulk_send_start(bulk);
+		}
+		else
+		{
+			bulk_send_poll(bulk);
+		}
+		break;
+	case BULK_LISTENING:
+		bulk->radio->receive(BULK_IDLE_TIMEOUT);
+		break;
+	case BULK_RECEIVING:
+		if (bulk->base >= bulk->frames)
+		{
+			// Complete and the sender is quiet, it got the last SACK or gave up
+			bulk->state = BULK_DONE;
+			break;
+		}
+		bulk->timeouts++;
+		if (++bulk->retries > BULK_MAX_RETRIES)
+		{
+			bulk->state = BULK_FAILED;
+			break;
+		}
+		bulk->radio->receive(BULK_IDLE_TIMEOUT);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * @brief Check if the transfer is over
+ *
+ * @param bulk Transfer
+ * @return true Done or failed
+ */
+bool bulk_finished(const s_bulk *bulk)
+{
+	return (bulk->state == BULK_DONE) || (bulk->state == BULK_FAILED);
+}
@@ -0,0 +1,648 @@
+/**
+ * @file bulk_p2p.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Offload of an accelerometer capture to a nearby collector over
+ *        LoRa P2P. AT+BULK=1 or BULK over BLE stops the uplinks, records
+ *        raw samples from the FIFO into RAM and sends them with the
+ *        fastest modulation on the P2P frequency of the LoRa settings.
+ *        A second node with AT+BULK=2 is the collector, it prints the
+ *        received data as +BULK:DATA lines.
+ *        The LoRaWAN stack can't take the radio back, the node restarts
+ *        after the transfer and joins again.
+ *        Only compiled with BULK=1 in platformio.ini, the buffer takes
+ *        RAM for the whole runtime.
+ * @version 0.1
+ * @date 2021-06-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+#include "bulk.h"
+
+#if BULK > 0
+
+/** Modulation, SF7 with 500 kHz is the fastest, 500 kHz is only allowed in US915 and AU915 */
+#ifndef BULK_SF
+#define BULK_SF 7
+#endif
+// BULK_BW overrides the bandwidth of the region, 0 = 125, 1 = 250, 2 = 500 kHz
+#define BULK_CR 1 // 4/5
+#define BULK_PREAMBLE 8
+#define BULK_TX_TIMEOUT 3000
+/** Wait for the RX windows of the last uplink before the radio is taken over */
+#define BULK_START_DELAY 6000
+/** Time to send the result before the restart */
+#define BULK_RESTART_DELAY 2000
+/** Payload of a data frame */
+#define BULK_FRAME_SIZE 240
+/** Size of the capture, 2048 samples of 6 bytes */
+#define BULK_CAPTURE_SIZE 12288
+/** Sample rate of the capture */
+#define BULK_CAPTURE_RATE 400
+/** FIFO watermark in samples */
+#define BULK_CAPTURE_FIFO_THS 24
+/** Bytes in a +BULK:DATA line */
+#define BULK_DUMP_LINE 32
+/** Period of the duty cycle limit, 1 hour */
+#define BULK_DC_PERIOD 3600000
+
+/** Roles */
+#define BULK_OFF 0
+#define BULK_SENDER 1
+#define BULK_COLLECTOR 2
+
+/** Phase of the offload */
+#define BULK_WAIT 0
+#define BULK_RUN 1
+
+/** Radio events for the loop */
+#define BULK_RADIO_TX_DONE 0x01
+#define BULK_RADIO_RX_DONE 0x02
+#define BULK_RADIO_RX_TIMEOUT 0x04
+
+/** Raw samples, X, Y and Z LSB first */
+static uint8_t bulk_capture[BULK_CAPTURE_SIZE];
+/** Used bytes */
+static uint16_t bulk_capture_used = 0;
+/** Samples are recorded */
+static bool bulk_recording = false;
+/** Start delay is over, the transfer starts when the capture is complete */
+static bool bulk_delay_over = false;
+
+/** Transfer */
+s_bulk bulk_session;
+/** BULK_OFF, BULK_SENDER or BULK_COLLECTOR */
+static uint8_t bulk_role = BULK_OFF;
+/** BULK_WAIT or BULK_RUN */
+static uint8_t bulk_phase = BULK_WAIT;
+/** Start of the transfer and its duration in ms */
+static uint32_t bulk_start_ms = 0;
+static uint32_t bulk_duration = 0;
+
+/** Radio events not yet handled by the loop */
+static volatile uint8_t bulk_radio_flags = 0;
+/** Received frame */
+static uint8_t bulk_rx_frame[BULK_HEADER_SIZE + BULK_FRAME_MAX];
+static uint8_t bulk_rx_size = 0;
+/** Radio callbacks of the transfer, replace the ones of the LoRaWAN stack */
+static RadioEvents_t bulk_radio_events;
+
+/** Buffer for one +BULK:DATA line */
+static char bulk_hex[BULK_DUMP_LINE * 2 + 1];
+
+/** Airtime of the running transfer in us */
+static uint32_t bulk_airtime_us = 0;
+/** Airtime allowed by the duty cycle in one period in us */
+static uint32_t bulk_airtime_max = 0;
+/** Filename of the off time after the last transfer */
+static const char bulk_dc_name[] = "BULKDC";
+/** File for the off time */
+static File bulk_dc_file(InternalFS);
+
+/** Timer for the start delay */
+SoftwareTimer bulk_timer;
+
+/**
+ * @brief Wake up the loop with a radio event
+ *
+ * @param flag BULK_RADIO_ event
+ */
+static void bulk_radio_wake(uint8_t flag)
+{
+	bulk_radio_flags |= flag;
+	g_task_event_type |= BULK_EVENT;
+	xSemaphoreGive(g_task_sem);
+}
+
+static void bulk_on_tx_done(void)
+{
+	bulk_radio_wake(BULK_RADIO_TX_DONE);
+}
+
+static void bulk_on_tx_timeout(void)
+{
+	// Frame is lost, the ARQ repeats it
+	bulk_radio_wake(BULK_RADIO_TX_DONE);
+}
+
+static void bulk_on_rx_done(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
+{
+	if (size > sizeof(bulk_rx_frame))
+	{
+		bulk_radio_wake(BULK_RADIO_RX_TIMEOUT);
+		return;
+	}
+	memcpy(bulk_rx_frame, payload, size);
+	bulk_rx_size = size;
+	bulk_radio_wake(BULK_RADIO_RX_DONE);
+}
+
+static void bulk_on_rx_timeout(void)
+{
+	bulk_radio_wake(BULK_RADIO_RX_TIMEOUT);
+}
+
+/**
+ * @brief Bandwidth of the transfer
+ *        500 kHz is only allowed in US915 and AU915
+ *
+ * @return uint8_t 0 = 125, 1 = 250, 2 = 500 kHz
+ */
+static uint8_t bulk_bw(void)
+{
+#ifdef BULK_BW
+	return BULK_BW;
+#else
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORA_BAND_US915:
+	case LORA_BAND_AU915:
+		return 2;
+	default:
+		return 0;
+	}
+#endif
+}
+
+/**
+ * @brief Duty cycle limit of the P2P frequency in the region
+ *
+ * @return uint8_t Duty cycle in %, 100 if the region has no limit
+ */
+static uint8_t bulk_duty_cycle(void)
+{
+	uint32_t freq = g_lorawan_settings.p2p_frequency;
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORA_BAND_EU868:
+		// Sub-band 869.4 .. 869.65 MHz allows 10 %
+		return ((freq >= 869400000) && (freq <= 869650000)) ? 10 : 1;
+	case LORA_BAND_EU433:
+	case LORA_BAND_RU864:
+	case LORA_BAND_CN779:
+		return 1;
+	default:
+		return 100;
+	}
+}
+
+/**
+ * @brief Time on air of a P2P frame
+ *
+ * @param size Length of the frame
+ * @return uint32_t Time on air in us
+ */
+static uint32_t bulk_time_on_air(uint8_t size)
+{
+	// Symbol time halves with each step of the bandwidth
+	return energy_time_on_air(size, BULK_SF) >> bulk_bw();
+}
+
+/**
+ * @brief Time after the boot before the next transfer is allowed
+ *        Saved before the restart at the end of a transfer, as the
+ *        boot is later than the transfer this is on the safe side
+ *
+ * @return uint32_t Off time in ms
+ */
+static uint32_t bulk_dc_off_time(void)
+{
+	uint32_t off_time = 0;
+	if (bulk_dc_file.open(bulk_dc_name, FILE_O_READ))
+	{
+		if (bulk_dc_file.read(&off_time, sizeof(off_time)) != sizeof(off_time))
+		{
+			off_time = 0;
+		}
+		bulk_dc_file.close();
+	}
+	return off_time;
+}
+
+/**
+ * @brief Save the off time after the transfer for the duty cycle
+ *
+ */
+static void bulk_dc_save(void)
+{
+	uint8_t duty_cycle = bulk_duty_cycle();
+	InternalFS.remove(bulk_dc_name);
+	if ((duty_cycle == 100) || (bulk_airtime_us == 0))
+	{
+		return;
+	}
+	// The airtime is duty_cycle % of the off time
+	uint32_t off_time = bulk_airtime_us / 10 / duty_cycle;
+	if (bulk_dc_file.open(bulk_dc_name, FILE_O_WRITE))
+	{
+		bulk_dc_file.write((uint8_t *)&off_time, sizeof(off_time));
+		bulk_dc_file.close();
+	}
+}
+
+/**
+ * @brief Check if the duty cycle allows a transfer
+ *
+ * @param size Bytes to send, 0 for the collector
+ * @return true Transfer can start
+ */
+static bool bulk_dc_check(uint32_t size)
+{
+	uint8_t duty_cycle = bulk_duty_cycle();
+	bulk_airtime_us = 0;
+	bulk_airtime_max = duty_cycle == 100 ? 0xFFFFFFFF : (BULK_DC_PERIOD / 100 * duty_cycle) * 1000;
+	if (duty_cycle == 100)
+	{
+		return true;
+	}
+	uint32_t off_time = bulk_dc_off_time();
+	if (millis() < off_time)
+	{
+		MYLOG("BULK", "Duty cycle %d %%, next transfer in %ld s", duty_cycle, (off_time - millis()) / 1000);
+		return false;
+	}
+	// Data frames without repeats
+	uint32_t frames = (size + BULK_FRAME_SIZE - 1) / BULK_FRAME_SIZE;
+	uint32_t airtime = frames * bulk_time_on_air(BULK_HEADER_SIZE + BULK_FRAME_SIZE);
+	if (airtime > bulk_airtime_max)
+	{
+		MYLOG("BULK", "Duty cycle %d %%, %ld ms airtime is too long", duty_cycle, airtime / 1000);
+		return false;
+	}
+	return true;
+}
+
+static bool bulk_radio_send(const uint8_t *data, uint8_t size)
+{
+	uint32_t airtime = bulk_time_on_air(size);
+	if ((bulk_airtime_max - bulk_airtime_us) < airtime)
+	{
+		// Repeats used up the duty cycle, the transfer fails
+		MYLOG("BULK", "Duty cycle used up after %ld ms airtime", bulk_airtime_us / 1000);
+		return false;
+	}
+	bulk_airtime_us += airtime;
+	Radio.Send((uint8_t *)data, size);
+	return true;
+}
+
+static void bulk_radio_receive(uint32_t timeout_ms)
+{
+	Radio.Rx(timeout_ms);
+}
+
+/** Radio access of the transfer */
+static const s_bulk_radio bulk_radio = {bulk_radio_send, bulk_radio_receive};
+
+/**
+ * @brief Take the radio from the LoRaWAN stack and set up P2P
+ *
+ */
+static void bulk_radio_init(void)
+{
+	bulk_radio_events.TxDone = bulk_on_tx_done;
+	bulk_radio_events.TxTimeout = bulk_on_tx_timeout;
+	bulk_radio_events.RxDone = bulk_on_rx_done;
+	bulk_radio_events.RxTimeout = bulk_on_rx_timeout;
+	bulk_radio_events.RxError = bulk_on_rx_timeout;
+	bulk_radio_events.CadDone = NULL;
+
+	Radio.Standby();
+	Radio.Init(&bulk_radio_events);
+	Radio.SetChannel(g_lorawan_settings.p2p_frequency);
+	Radio.SetTxConfig(MODEM_LORA, g_lorawan_settings.p2p_tx_power, 0, bulk_bw(), BULK_SF, BULK_CR, BULK_PREAMBLE, false, true, 0, 0, false, BULK_TX_TIMEOUT);
+	Radio.SetRxConfig(MODEM_LORA, bulk_bw(), BULK_SF, BULK_CR, 0, BULK_PREAMBLE, 0, false, 0, true, 0, 0, false, false);
+}
+
+/**
+ * @brief Read from the capture
+ *
+ */
+static void bulk_capture_read(uint32_t offset, uint8_t *data, uint8_t size)
+{
+	memcpy(data, &bulk_capture[offset], size);
+}
+
+/**
+ * @brief Write received data into the capture buffer of the collector
+ *
+ */
+static void bulk_capture_write(uint32_t offset, const uint8_t *data, uint8_t size)
+{
+	memcpy(&bulk_capture[offset], data, size);
+}
+
+/**
+ * @brief Start delay is over
+ *
+ */
+static void bulk_timer_cb(TimerHandle_t unused)
+{
+	g_task_event_type |= BULK_EVENT;
+	xSemaphoreGive(g_task_sem);
+}
+
+/**
+ * @brief Check if the uplinks are stopped for a transfer
+ *
+ * @return true Transfer is waiting or running
+ */
+bool bulk_active(void)
+{
+	return bulk_role != BULK_OFF;
+}
+
+/**
+ * @brief Stop the uplinks and start the transfer after the start delay
+ *
+ * @param role BULK_SENDER or BULK_COLLECTOR
+ * @return true Transfer is scheduled
+ * @return false A transfer is active, the stream is running, a sensor trace is active
+ *               or the duty cycle does not allow it
+ */
+static bool bulk_begin(uint8_t role)
+{
+	if ((bulk_role != BULK_OFF) || stream_active || trace_active())
+	{
+		return false;
+	}
+	if (!bulk_dc_check(role == BULK_SENDER ? BULK_CAPTURE_SIZE : 0))
+	{
+		return false;
+	}
+	bulk_role = role;
+	bulk_phase = BULK_WAIT;
+	bulk_delay_over = false;
+	MYLOG("BULK", "%s in %d ms, uplinks stopped", role == BULK_SENDER ? "Capture and send" : "Collect", BULK_START_DELAY);
+	if (role == BULK_SENDER)
+	{
+		bulk_capture_used = 0;
+		bulk_recording = true;
+		acc_fifo_start(BULK_CAPTURE_RATE, BULK_CAPTURE_FIFO_THS);
+	}
+	bulk_timer.begin(BULK_START_DELAY, bulk_timer_cb, NULL, false);
+	bulk_timer.start();
+	return true;
+}
+
+/**
+ * @brief Print the received data as +BULK:DATA,<offset>,<hex> lines
+ *
+ */
+static void bulk_dump(void)
+{
+	for (uint32_t offset = 0; offset < bulk_session.size; offset += BULK_DUMP_LINE)
+	{
+		uint8_t len = 0;
+		for (; (len < BULK_DUMP_LINE) && ((offset + len) < bulk_session.size); len++)
+		{
+			sprintf(&bulk_hex[len * 2], "%02X", bulk_capture[offset + len]);
+		}
+		bulk_hex[len * 2] = 0;
+		AT_PRINTF("+BULK:DATA,%ld,%s", offset, bulk_hex);
+	}
+}
+
+/**
+ * @brief Print the state of the transfer
+ *
+ */
+static void bulk_status(void)
+{
+	uint32_t duration = bulk_phase == BULK_RUN ? millis() - bulk_start_ms : bulk_duration;
+	AT_PRINTF("+BULK:%d,%d,%ld,%d,%d,%ld,%ld,%ld,%ld,%ld,%ld", bulk_role, bulk_session.state, bulk_session.size, bulk_session.frames, bulk_session.base,
+			  bulk_session.frames_sent, bulk_session.frames_received, bulk_session.retransmits, bulk_session.sacks, bulk_session.timeouts, duration);
+}
+
+/**
+ * @brief Transfer is over, report it and restart to give the radio back to LoRaWAN
+ *        Does not return
+ *
+ */
+static void bulk_end(void)
+{
+	Radio.Sleep();
+	bulk_dc_save();
+	bulk_duration = millis() - bulk_start_ms;
+	bulk_phase = BULK_WAIT;
+	bulk_report();
+	bulk_status();
+	if ((bulk_role == BULK_COLLECTOR) && (bulk_session.state == BULK_DONE))
+	{
+		bulk_dump();
+	}
+	delay(BULK_RESTART_DELAY);
+	sd_nvic_SystemReset();
+}
+
+/**
+ * @brief Handle the start delay and the radio events, call on BULK_EVENT
+ *
+ */
+void bulk_event(void)
+{
+	if (bulk_role == BULK_OFF)
+	{
+		return;
+	}
+	if (bulk_phase == BULK_WAIT)
+	{
+		bulk_delay_over = true;
+		if (bulk_recording)
+		{
+			// Starts when the capture is complete
+			return;
+		}
+		bulk_radio_init();
+		bulk_radio_flags = 0;
+		bulk_start_ms = millis();
+		bulk_phase = BULK_RUN;
+		if (bulk_role == BULK_COLLECTOR)
+		{
+			bulk_receive_init(&bulk_session, &bulk_radio, sizeof(bulk_capture), bulk_capture_write);
+		}
+		else if (!bulk_send_init(&bulk_session, &bulk_radio, (uint8_t)micros(), bulk_capture_used, BULK_FRAME_SIZE, bulk_capture_read))
+		{
+			bulk_end();
+		}
+		return;
+	}
+
+	taskENTER_CRITICAL();
+	uint8_t flags = bulk_radio_flags;
+	bulk_radio_flags = 0;
+	taskEXIT_CRITICAL();
+	if ((flags & BULK_RADIO_TX_DONE) != 0)
+	{
+		bulk_tx_done(&bulk_session);
+	}
+	if ((flags & BULK_RADIO_RX_DONE) != 0)
+	{
+		bulk_rx(&bulk_session, bulk_rx_frame, bulk_rx_size);
+	}
+	if ((flags & BULK_RADIO_RX_TIMEOUT) != 0)
+	{
+		bulk_rx_timeout(&bulk_session);
+	}
+	if (bulk_finished(&bulk_session))
+	{
+		bulk_end();
+	}
+}
+
+/**
+ * @brief Cancel the transfer, restarts the node if the radio was taken over already
+ *
+ */
+static void bulk_cancel(void)
+{
+	if (bulk_role == BULK_OFF)
+	{
+		return;
+	}
+	if (bulk_phase == BULK_RUN)
+	{
+		// Only the restart gives the radio back
+		bulk_session.state = BULK_FAILED;
+		bulk_end();
+	}
+	bulk_timer.stop();
+	if (bulk_recording)
+	{
+		bulk_recording = false;
+		acc_fifo_stop();
+	}
+	bulk_role = BULK_OFF;
+	MYLOG("BULK", "Cancelled, uplinks started");
+}
+
+/**
+ * @brief Capture and send, called from the BLE UART command
+ *
+ * @return true Transfer is scheduled
+ */
+bool bulk_send_capture(void)
+{
+	return bulk_begin(BULK_SENDER);
+}
+
+/**
+ * @brief Check if the FIFO belongs to the capture
+ *
+ * @return true Samples are recorded
+ */
+bool bulk_capturing(void)
+{
+	return bulk_recording;
+}
+
+/**
+ * @brief Handle the FIFO watermark interrupt while recording
+ *        The transfer starts when the capture is full and the start delay is over
+ *
+ */
+void bulk_capture_handler(void)
+{
+	bool overrun = false;
+	uint16_t room = (BULK_CAPTURE_SIZE - bulk_capture_used) / 6;
+	uint8_t samples = acc_fifo_read(&bulk_capture[bulk_capture_used], room > 32 ? 32 : room, &overrun);
+	if (overrun)
+	{
+		MYLOG("BULK", "FIFO overrun, samples lost at %d", bulk_capture_used / 6);
+	}
+	bulk_capture_used += samples * 6;
+	if (samples < room)
+	{
+		return;
+	}
+	bulk_recording = false;
+	acc_fifo_stop();
+	MYLOG("BULK", "Capture complete, %d samples", bulk_capture_used / 6);
+	if (bulk_delay_over)
+	{
+		bulk_event();
+	}
+}
+
+/**
+ * @brief Report the transfer to the log and, if connected, to BLE UART
+ *
+ */
+void bulk_report(void)
+{
+	uint32_t duration = bulk_phase == BULK_RUN ? millis() - bulk_start_ms : bulk_duration;
+	uint32_t done = bulk_session.base * bulk_session.frame_size;
+	done = done > bulk_session.size ? bulk_session.size : done;
+	uint32_t throughput = duration == 0 ? 0 : done * 1000 / duration;
+	MYLOG("BULK", "Capture %d bytes, state %d, %ld of %ld bytes in %ld ms, %ld B/s", bulk_capture_used, bulk_session.state, done, bulk_session.size, duration, throughput);
+	MYLOG("BULK", "%ld frames sent, %ld received, %ld repeated, %ld SACKs, %ld timeouts", bulk_session.frames_sent, bulk_session.frames_received,
+		  bulk_session.retransmits, bulk_session.sacks, bulk_session.timeouts);
+	if (g_ble_uart_is_connected)
+	{
+		g_ble_uart.printf("BULK capture %d state %d %ld/%ld bytes %ld ms %ld B/s\n", bulk_capture_used, bulk_session.state, done, bulk_session.size, duration, throughput);
+		g_ble_uart.printf("BULK sent %ld received %ld repeated %ld SACKs %ld timeouts %ld\n", bulk_session.frames_sent, bulk_session.frames_received,
+						  bulk_session.retransmits, bulk_session.sacks, bulk_session.timeouts);
+	}
+}
+
+/**
+ * @brief AT+BULK=1 captures and sends, AT+BULK=2 collects, AT+BULK=0 cancels
+ *        AT+BULK=? prints role, state, size, frames, first missing frame,
+ *        frames sent, received and repeated, SACKs, timeouts and duration in ms
+ *
+ * @param read true for AT+BULK=?
+ * @param args Value for AT+BULK=<value>
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_bulk(bool read, uint32_t *args)
+{
+	if (read)
+	{
+		bulk_status();
+		return 0;
+	}
+	switch (args[0])
+	{
+	case BULK_OFF:
+		bulk_cancel();
+		return 0;
+	case BULK_SENDER:
+	case BULK_COLLECTOR:
+		return bulk_begin(args[0]) ? 0 : AT_ERR_GENERIC;
+	default:
+		return AT_ERR_PARAM;
+	}
+}
+
+#else
+
+bool bulk_active(void)
+{
+	return false;
+}
+
+bool bulk_capturing(void)
+{
+	return false;
+}
+
+bool bulk_send_capture(void)
+{
+	return false;
+}
+
+void bulk_capture_handler(void)
+{
+}
+
+void bulk_event(void)
+{
+}
+
+void bulk_report(void)
+{
+}
+
+#endif
@@ -0,0 +1,319 @@
+/**
+ * @file clock.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Network time and timestamps of the movement events
+ *        The node asks for the time with a block in the uplink, the
+ *        server answers with the time the gateway received that uplink
+ *        in a configuration downlink. The answer can come several
+ *        uplinks later, it is tied to the end of the request uplink.
+ *        A second sync measures the drift of the local clock.
+ *        Event times are sent as base time plus varint deltas.
+ * @version 0.1
+ * @date 2021-06-22
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+/** Ask for the time again after this time in ms */
+#define CLOCK_RESYNC_TIME 86400000
+/** Min time between two syncs for a drift measurement in ms */
+#define CLOCK_DRIFT_MIN_TIME 3600000
+/** Max drift of the local clock in ppm */
+#define CLOCK_DRIFT_MAX 1000
+/** Max number of timestamps in the uplink */
+#define STAMPS_MAX 8
+/** Time from the end of an uplink to the end of its TX cycle, RX2 delay */
+#define CLOCK_TX_FIN_DELAY 2000
+/** Same if a downlink was received in RX1, RX1 delay */
+#define CLOCK_TX_FIN_DELAY_RX1 1000
+
+/** State of the time request */
+#define CLOCK_REQ_NONE 0
+#define CLOCK_REQ_ADDED 1
+#define CLOCK_REQ_SENT 2
+#define CLOCK_REQ_DONE 3
+
+/** Flag if the clock was synced */
+bool clock_synced = false;
+/** Drift of the local clock in ppm, positive if millis() is slow */
+int32_t clock_drift_ppm = 0;
+/** Network time in 0.1 s at clock_base_ms */
+uint64_t clock_base_deci = 0;
+/** millis() of the base time */
+uint32_t clock_base_ms = 0;
+/** Network time in s of the last sync */
+uint32_t clock_sync_epoch = 0;
+/** millis() of the last sync */
+uint32_t clock_sync_ms = 0;
+
+/** State of the time request */
+static uint8_t clock_req_state = CLOCK_REQ_NONE;
+/** millis() at the end of the uplink with the time request */
+static uint32_t clock_req_ms = 0;
+/** Answer received before the TX cycle of the request was finished */
+static uint32_t clock_req_epoch = 0;
+
+/** Times of the latest movement events in ms */
+uint32_t stamps[STAMPS_MAX];
+/** Index of the oldest timestamp */
+uint8_t stamps_head = 0;
+/** Number of timestamps */
+uint8_t stamps_count = 0;
+
+/**
+ * @brief Convert a millis() time into network time
+ *
+ * @param ms millis() time, max 24 days from the base time
+ * @return uint64_t Network time in 0.1 s
+ */
+static uint64_t clock_deci(uint32_t ms)
+{
+	int32_t elapsed = (int32_t)(ms - clock_base_ms);
+	int64_t corrected = elapsed + (int64_t)elapsed * clock_drift_ppm / 1000000;
+	return clock_base_deci + (corrected >= 0 ? corrected / 100 : -((99 - corrected) / 100));
+}
+
+/**
+ * @brief Set the network time
+ *
+ * @param epoch Network time in seconds
+ * @param now millis() at the network time
+ */
+static void clock_sync(uint32_t epoch, uint32_t now)
+{
+	if (clock_synced)
+	{
+		uint32_t local_ms = now - clock_sync_ms;
+		if (local_ms >= CLOCK_DRIFT_MIN_TIME)
+		{
+			int64_t network_ms = (int64_t)(epoch - clock_sync_epoch) * 1000;
+			int32_t drift = (network_ms - local_ms) * 1000000 / local_ms;
+			if ((drift > -CLOCK_DRIFT_MAX) && (drift < CLOCK_DRIFT_MAX))
+			{
+				clock_drift_ppm = drift;
+			}
+		}
+	}
+	MYLOG("CLK", "Time %ld, drift %ld ppm", epoch, clock_drift_ppm);
+
+	clock_sync_epoch = epoch;
+	clock_sync_ms = now;
+	clock_base_deci = (uint64_t)epoch * 10;
+	clock_base_ms = now;
+	clock_synced = true;
+}
+
+/**
+ * @brief Set the network time now, called from AT+TIME
+ *
+ * @param epoch Network time in seconds
+ */
+void clock_set(uint32_t epoch)
+{
+	clock_sync(epoch, millis());
+}
+
+/**
+ * @brief Answer to the time request from the configuration downlink
+ *        The time is when the gateway received the request uplink. If the
+ *        TX cycle of the request is not finished yet, the answer waits
+ *        for clock_tx_done().
+ *
+ * @param epoch Network time in seconds
+ */
+void clock_answer(uint32_t epoch)
+{
+	switch (clock_req_state)
+	{
+	case CLOCK_REQ_DONE:
+		clock_req_state = CLOCK_REQ_NONE;
+		clock_sync(epoch, clock_req_ms);
+		break;
+	case CLOCK_REQ_SENT:
+		clock_req_epoch = epoch;
+		break;
+	default:
+		// No request sent, best guess is now
+		clock_set(epoch);
+		break;
+	}
+}
+
+/**
+ * @brief Record the end of the request uplink, call when the TX cycle is finished
+ *        The cycle ends after RX1 if a downlink was received there,
+ *        otherwise after RX2.
+ *
+ * @param rx1_data true if a downlink was received with this cycle
+ */
+void clock_tx_done(bool rx1_data)
+{
+	if (clock_req_state != CLOCK_REQ_SENT)
+	{
+		return;
+	}
+	rx1_data = rx1_data || (clock_req_epoch != 0);
+	clock_req_ms = millis() - (rx1_data ? CLOCK_TX_FIN_DELAY_RX1 : CLOCK_TX_FIN_DELAY);
+	clock_req_state = CLOCK_REQ_DONE;
+	if (clock_req_epoch != 0)
+	{
+		clock_answer(clock_req_epoch);
+		clock_req_epoch = 0;
+	}
+}
+
+/**
+ * @brief Check if the node has to ask for the time
+ *        Moves the base time forward, millis() differences are limited
+ *
+ * @return true Time request has to be added to the uplink
+ * @return false Clock is synced
+ */
+bool clock_request(void)
+{
+	if (!clock_synced)
+	{
+		return true;
+	}
+	uint32_t now = millis();
+	if ((now - clock_base_ms) > CLOCK_RESYNC_TIME)
+	{
+		clock_base_deci = clock_deci(now);
+		clock_base_ms = now;
+	}
+	return (now - clock_sync_ms) > CLOCK_RESYNC_TIME;
+}
+
+/**
+ * @brief Add the time of a movement event, keeps the latest STAMPS_MAX
+ *
+ * @param ms millis() of the event
+ */
+void stamps_add(uint32_t ms)
+{
+	if (stamps_count == STAMPS_MAX)
+	{
+		stamps_head = (stamps_head + 1) % STAMPS_MAX;
+		stamps_count--;
+	}
+	stamps[(stamps_head + stamps_count) % STAMPS_MAX] = ms;
+	stamps_count++;
+	mem_pool_mark(MEM_STAMPS, stamps_count);
+}
+
+/**
+ * @brief Remove all timestamps after the uplink was enqueued
+ *        A time request in the uplink waits now for the end of its TX cycle
+ *
+ */
+void stamps_clear(void)
+{
+	stamps_head = 0;
+	stamps_count = 0;
+	if (clock_req_state == CLOCK_REQ_ADDED)
+	{
+		clock_req_state = CLOCK_REQ_SENT;
+		clock_req_epoch = 0;
+	}
+}
+
+/**
+ * @brief Write an unsigned varint, 7 bit per byte, low bits first
+ *
+ * @param buffer Buffer for the varint
+ * @param value Value
+ * @return uint8_t Number of bytes written
+ */
+uint8_t varint_put(uint8_t *buffer, uint32_t value)
+{
+	uint8_t len = 0;
+	while (value >= 0x80)
+	{
+		buffer[len++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buffer[len++] = (uint8_t)value;
+	return len;
+}
+
+/**
+ * @brief Add the timestamps and the time request to an uplink
+ *        Timestamps: 0xD0 <base time s 4> <count> <varint>...
+ *        The first varint is the offset to the base time, the others the
+ *        time since the previous event, all in 0.1 s. Only as many
+ *        timestamps as fit into the max payload size are added.
+ *        Time request: 0xD1
+ *
+ * @param buffer Packet buffer
+ * @param len Current length of the packet
+ * @param max_payload Max payload size at the current data rate
+ * @return uint8_t New length of the packet
+ */
+uint8_t stamps_add_block(uint8_t *buffer, uint8_t len, uint8_t max_payload)
+{
+	bool request = clock_request();
+	// Leave space for the time request and a pending downlink confirmation
+	int16_t max_len = max_payload - (request ? 1 : 0) - dl_response_len;
+
+	if (clock_synced && (stamps_count != 0) && ((len + 7) <= max_len))
+	{
+		uint64_t last = clock_deci(stamps[stamps_head]);
+		uint32_t base = (uint32_t)(last / 10);
+		uint8_t count_idx = len + 5;
+		buffer[len++] = STAMPS_TAG;
+		len += dl_put_value(&buffer[len], base, 4);
+		buffer[len++] = 0;
+		last = (uint64_t)base * 10;
+		for (uint8_t idx = 0; idx < stamps_count; idx++)
+		{
+			uint64_t stamp = clock_deci(stamps[(stamps_head + idx) % STAMPS_MAX]);
+			uint8_t varint[5];
+			uint8_t varint_len = varint_put(varint, (uint32_t)(stamp - last));
+			if ((len + varint_len) > max_len)
+			{
+				break;
+			}
+			memcpy(&buffer[len], varint, varint_len);
+			len += varint_len;
+			buffer[count_idx]++;
+			last = stamp;
+		}
+	}
+	if (request && (len < max_payload))
+	{
+		buffer[len++] = CLOCK_REQUEST_TAG;
+		clock_req_state = CLOCK_REQ_ADDED;
+	}
+	return len;
+}
+
+/**
+ * @brief AT+TIME=<epoch> sets the network time, AT+TIME=? shows
+ *        the time, the drift and the time since the last sync
+ *
+ * @param read true for AT+TIME=?
+ * @param args Network time in seconds
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_time(bool read, uint32_t *args)
+{
+	if (!read)
+	{
+		if (args[0] == 0)
+		{
+			return AT_ERR_RANGE;
+		}
+		clock_set(args[0]);
+		return 0;
+	}
+	if (!clock_synced)
+	{
+		AT_PRINTF("+TIME:0,0,0");
+		return 0;
+	}
+	AT_PRINTF("+TIME:%ld,%ld,%ld", (uint32_t)(clock_deci(millis()) / 10), clock_drift_ppm, (millis() - clock_sync_ms) / 1000);
+	return 0;
+}
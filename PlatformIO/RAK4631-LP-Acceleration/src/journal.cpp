@@ -0,0 +1,244 @@
+/**
+ * @file journal.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Journal for settings changed over downlink or application AT commands
+ *        Instead of rewriting s_lorawan_settings and the application parameters
+ *        on every change, the changed fields are appended as small records:
+ *        <tag> <length> <value> <CRC16>
+ *        The tags are the tags of the downlink configuration protocol.
+ *        The first record (tag 0) holds the CRC16 of the s_lorawan_settings
+ *        the journal is based on. If the WisBlock-API saved the settings
+ *        meanwhile (AT command or BLE), the LoRaWAN records are outdated.
+ *        Before LoRaWAN records are appended, the CRC of the stored
+ *        settings is checked and a new journal is started if it changed.
+ *        At boot the journal is scanned once. Scanning stops at the first
+ *        record with a wrong CRC (power loss during the write). The journal
+ *        is compacted into the base storage when it is full or damaged.
+ * @version 0.1
+ * @date 2021-06-16
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+#include <Adafruit_LittleFS.h>
+#include <InternalFileSystem.h>
+using namespace Adafruit_LittleFS_Namespace;
+
+/** Filename of the journal */
+static const char journal_name[] = "JRNL";
+
+/** Max size of the journal before it is compacted */
+#define JOURNAL_MAX_SIZE 1024
+
+/** Tag of the base record */
+#define JOURNAL_BASE 0x00
+
+/** File of the settings saved by the WisBlock-API */
+#define JOURNAL_API_SETTINGS "RAK"
+
+/** File for the journal */
+static File journal_file(InternalFS);
+
+/** CRC16 of the s_lorawan_settings in flash */
+static uint16_t journal_base_crc = 0;
+
+/**
+ * @brief CRC16-CCITT
+ *
+ * @param data Data
+ * @param len Length of data
+ * @param crc Start value, used to continue a CRC
+ * @return uint16_t CRC16
+ */
+uint16_t crc16(const uint8_t *data, uint16_t len, uint16_t crc)
+{
+	for (uint16_t idx = 0; idx < len; idx++)
+	{
+		crc ^= (uint16_t)data[idx] << 8;
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/**
+ * @brief CRC16 of the s_lorawan_settings stored by the WisBlock-API
+ *
+ * @return uint16_t CRC16 of the file, the base CRC if it can't be read
+ */
+static uint16_t journal_stored_crc(void)
+{
+	s_lorawan_settings stored;
+	if (!journal_file.open(JOURNAL_API_SETTINGS, FILE_O_READ))
+	{
+		return journal_base_crc;
+	}
+	uint32_t read = journal_file.read((uint8_t *)&stored, sizeof(s_lorawan_settings));
+	journal_file.close();
+	if (read != sizeof(s_lorawan_settings))
+	{
+		return journal_base_crc;
+	}
+	return crc16((uint8_t *)&stored, sizeof(s_lorawan_settings), 0xFFFF);
+}
+
+/**
+ * @brief Append a record to the open journal file
+ *
+ * @param tag Tag of the field
+ * @param value Value of the field
+ * @param len Length of the value
+ */
+static void journal_append(uint8_t tag, uint8_t *value, uint8_t len)
+{
+	uint8_t record[JOURNAL_RECORD_SIZE];
+	record[0] = tag;
+	record[1] = len;
+	memcpy(&record[2], value, len);
+	uint16_t crc = crc16(record, len + 2, 0xFFFF);
+	record[len + 2] = (uint8_t)(crc >> 8);
+	record[len + 3] = (uint8_t)crc;
+	journal_file.write(record, len + 4);
+}
+
+/**
+ * @brief Write the journaled values into the base storage and start a new journal
+ *
+ */
+void journal_compact(void)
+{
+	MYLOG("JRNL", "Compact journal");
+	// Base first, if power is lost before the journal is removed
+	// the records only repeat the values of the base
+	save_settings();
+	app_param_save();
+	journal_base_crc = crc16((uint8_t *)&g_lorawan_settings, sizeof(s_lorawan_settings), 0xFFFF);
+	InternalFS.remove(journal_name);
+}
+
+/**
+ * @brief Read the journal and apply the records
+ *        Call after app_param_load() and before the sensor is initialized
+ *
+ */
+void journal_load(void)
+{
+	journal_base_crc = crc16((uint8_t *)&g_lorawan_settings, sizeof(s_lorawan_settings), 0xFFFF);
+
+	InternalFS.begin();
+	if (!journal_file.open(journal_name, FILE_O_READ))
+	{
+		return;
+	}
+
+	s_lorawan_settings new_settings;
+	memcpy(&new_settings, &g_lorawan_settings, sizeof(s_lorawan_settings));
+	app_param_begin();
+
+	bool lorawan_valid = false;
+	bool damaged = false;
+	uint16_t records = 0;
+	uint8_t record[JOURNAL_RECORD_SIZE];
+	while (journal_file.read(record, 2) == 2)
+	{
+		uint8_t len = record[1];
+		if (((len + 4) > JOURNAL_RECORD_SIZE) || (journal_file.read(&record[2], len + 2) != (len + 2)))
+		{
+			damaged = true;
+			break;
+		}
+		uint16_t crc = crc16(record, len + 2, 0xFFFF);
+		if ((record[len + 2] != (uint8_t)(crc >> 8)) || (record[len + 3] != (uint8_t)crc))
+		{
+			damaged = true;
+			break;
+		}
+		records++;
+
+		if (record[0] == JOURNAL_BASE)
+		{
+			// LoRaWAN records are only valid for the same base
+			lorawan_valid = dl_get_value(&record[2], len) == journal_base_crc;
+		}
+		else if (record[0] < DL_APP_TAGS)
+		{
+			if (lorawan_valid)
+			{
+				dl_write_lorawan(&new_settings, record[0], &record[2], len);
+			}
+		}
+		else
+		{
+			app_param_write(record[0], &record[2], len);
+		}
+	}
+	uint32_t size = journal_file.size();
+	journal_file.close();
+	MYLOG("JRNL", "%d records, %ld bytes", records, size);
+
+	dl_apply_lorawan(&new_settings);
+	app_param_restore();
+
+	if (damaged || (size > JOURNAL_MAX_SIZE) || ((records != 0) && !lorawan_valid))
+	{
+		journal_compact();
+	}
+}
+
+/**
+ * @brief Write the current values of changed fields into the journal
+ *        All records are committed to flash when the file is closed
+ *
+ * @param tags Tags of the changed fields
+ * @param num Number of tags
+ */
+void journal_write(const uint8_t *tags, uint8_t num)
+{
+	// Check the base once, before the first LoRaWAN record
+	for (uint8_t idx = 0; idx < num; idx++)
+	{
+		if (tags[idx] < DL_APP_TAGS)
+		{
+			if (journal_stored_crc() != journal_base_crc)
+			{
+				// The WisBlock-API saved the settings since the journal was started,
+				// LoRaWAN records of the old base would be dropped at the next boot
+				journal_compact();
+			}
+			break;
+		}
+	}
+
+	if (!journal_file.open(journal_name, FILE_O_WRITE))
+	{
+		MYLOG("JRNL", "Can't open journal");
+		return;
+	}
+
+	uint8_t value[8];
+	if (journal_file.size() == 0)
+	{
+		// New journal, start with the base record
+		journal_append(JOURNAL_BASE, value, dl_put_value(value, journal_base_crc, 2));
+	}
+	for (uint8_t idx = 0; idx < num; idx++)
+	{
+		uint8_t len = tags[idx] < DL_APP_TAGS ? dl_read_lorawan(tags[idx], value) : app_param_read(tags[idx], value);
+		if (len != 0)
+		{
+			journal_append(tags[idx], value, len);
+		}
+	}
+	uint32_t size = journal_file.size();
+	journal_file.close();
+
+	if (size > JOURNAL_MAX_SIZE)
+	{
+		journal_compact();
+	}
+}
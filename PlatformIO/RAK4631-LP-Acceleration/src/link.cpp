@@ -0,0 +1,329 @@
+/**
+ * @file link.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Link quality estimator
+ *        Tracks RSSI and SNR of the downlinks and the ACKs of confirmed
+ *        uplinks as moving averages. Only every N-th uplink is sent
+ *        confirmed, N doubles with each ACK and drops back to 1 on a NAK.
+ *        In mode 2 the data rate is raised while the ACKs come in and
+ *        the SNR has enough margin for the next faster data rate, and
+ *        lowered after NAKs or when the SNR drops below the limit.
+ *        With ADR enabled the network server sets the data rate.
+ *        The data rate limits depend on the region, in a region
+ *        without a table only the confirmation policy is used.
+ * @version 0.1
+ * @date 2021-06-27
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+/** Moving average weight of a new value, 1/4 */
+#define LINK_EWMA_SHIFT 2
+/** ACK average in permille below which the data rate is lowered after a NAK */
+#define LINK_ACK_LOW 500
+/** ACK average in permille required to raise the data rate */
+#define LINK_ACK_HIGH 900
+/** ACK average after a data rate change */
+#define LINK_ACK_RESET 750
+/** Uplinks at a data rate before it is raised again */
+#define LINK_HOLD 4
+
+/** SNR in 0.1 dB required to receive SF12 .. SF7 at 125 kHz */
+static const int16_t link_snr_sf[6] = {-200, -175, -150, -125, -100, -75};
+
+/** State of the estimator */
+s_link link_state;
+
+/** Uplink data for lmh_send() */
+static lmh_app_data_t link_app_data;
+
+/**
+ * @brief Get the SNR limits of the 125 kHz data rates of the region
+ *
+ * @param dr_max Fastest 125 kHz data rate of the region
+ * @return const int16_t* SNR in 0.1 dB required for DR0 .. dr_max, NULL if the region has no table
+ */
+static const int16_t *link_snr_req(uint8_t *dr_max)
+{
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORA_BAND_US915:
+		// DR0 = SF10 .. DR3 = SF7, DR4 is 500 kHz
+		*dr_max = 3;
+		return &link_snr_sf[2];
+	case LORA_BAND_AS923_1:
+	case LORA_BAND_AS923_2:
+	case LORA_BAND_AS923_3:
+	case LORA_BAND_AS923_4:
+	case LORA_BAND_AU915:
+	case LORA_BAND_CN470:
+	case LORA_BAND_CN779:
+	case LORA_BAND_EU433:
+	case LORA_BAND_EU868:
+	case LORA_BAND_IN865:
+	case LORA_BAND_KR920:
+	case LORA_BAND_RU864:
+		// DR0 = SF12 .. DR5 = SF7
+		*dr_max = 5;
+		return link_snr_sf;
+	default:
+		*dr_max = 0;
+		return NULL;
+	}
+}
+
+/**
+ * @brief Check if the estimator may change the data rate
+ *
+ */
+static bool link_controls_dr(void)
+{
+	uint8_t dr_max;
+	return (link_state.mode == LINK_DR) && !g_lorawan_settings.adr_enabled && (link_snr_req(&dr_max) != NULL);
+}
+
+/**
+ * @brief Switch to another data rate
+ *
+ * @param dr New data rate
+ */
+static void link_set_dr(uint8_t dr)
+{
+	MYLOG("LINK", "DR%d -> DR%d, SNR %d, ACK %d", link_state.dr, dr, link_state.snr, link_state.ack);
+	link_state.dr = dr;
+	link_state.since_change = 0;
+	link_state.ack = LINK_ACK_RESET;
+	lmh_datarate_set(dr, false);
+}
+
+/**
+ * @brief Start over from the data rate of the LoRaWAN settings
+ *
+ */
+static void link_reset(void)
+{
+	link_state.base_dr = g_lorawan_settings.data_rate;
+	link_state.dr = g_lorawan_settings.data_rate;
+	link_state.since_change = 0;
+	link_state.confirm_interval = 1;
+	link_state.since_confirm = 0;
+	link_state.last_confirmed = false;
+	link_state.ack = LINK_ACK_RESET;
+}
+
+/**
+ * @brief Set the mode and the SNR margin from the application parameters
+ *
+ * @param mode LINK_OFF, LINK_CONFIRM or LINK_DR
+ * @param margin SNR margin for a faster data rate in dB
+ */
+void link_set_params(uint8_t mode, uint8_t margin)
+{
+	uint8_t old_mode = link_state.mode;
+	link_state.mode = mode;
+	link_state.margin = margin;
+	if (mode == old_mode)
+	{
+		return;
+	}
+	if ((old_mode == LINK_DR) && !g_lorawan_settings.adr_enabled)
+	{
+		// Back to the data rate of the settings
+		lmh_datarate_set(g_lorawan_settings.data_rate, g_lorawan_settings.adr_enabled);
+	}
+	link_reset();
+}
+
+/**
+ * @brief Add RSSI and SNR of a received downlink
+ *
+ * @param rssi RSSI in dBm
+ * @param snr SNR in dB
+ */
+void link_rx(int16_t rssi, int8_t snr)
+{
+	if (link_state.rx_samples == 0)
+	{
+		link_state.rssi = rssi;
+		link_state.snr = snr * 10;
+	}
+	else
+	{
+		link_state.rssi += (rssi - link_state.rssi) / (1 << LINK_EWMA_SHIFT);
+		link_state.snr += (snr * 10 - link_state.snr) / (1 << LINK_EWMA_SHIFT);
+	}
+	if (link_state.rx_samples < UINT16_MAX)
+	{
+		link_state.rx_samples++;
+	}
+
+	// Below the limit of the current data rate, do not wait for the NAKs
+	uint8_t dr_max;
+	const int16_t *snr_req = link_snr_req(&dr_max);
+	if (link_controls_dr() && (link_state.dr > 0) && (link_state.dr <= dr_max) && (link_state.snr < snr_req[link_state.dr]))
+	{
+		link_set_dr(link_state.dr - 1);
+		link_state.confirm_interval = 1;
+	}
+}
+
+/**
+ * @brief Send an uplink, confirmed only as often as the policy requires
+ *        Without link mode the uplink is sent with the LoRaWAN settings
+ *
+ * @param data Payload
+ * @param size Payload size
+ * @return lmh_error_status Result of the enqueue
+ */
+lmh_error_status link_send(uint8_t *data, uint8_t size)
+{
+	if (link_state.mode == LINK_OFF)
+	{
+		return send_lora_packet(data, size);
+	}
+	if (lmh_join_status_get() != LMH_SET)
+	{
+		return LMH_BUSY;
+	}
+	if (link_state.base_dr != g_lorawan_settings.data_rate)
+	{
+		// Data rate changed over AT command or downlink
+		link_reset();
+	}
+
+	bool confirm = (link_state.since_confirm + 1) >= link_state.confirm_interval;
+	link_app_data.buffer = data;
+	link_app_data.buffsize = size;
+	link_app_data.port = g_lorawan_settings.app_port;
+	lmh_error_status result = lmh_send(&link_app_data, confirm ? LMH_CONFIRMED_MSG : LMH_UNCONFIRMED_MSG);
+	if (result != LMH_SUCCESS)
+	{
+		return result;
+	}
+
+	link_state.uplinks++;
+	link_state.last_confirmed = confirm;
+	if (link_state.since_change < UINT16_MAX)
+	{
+		link_state.since_change++;
+	}
+	if (confirm)
+	{
+		link_state.confirmed++;
+		link_state.since_confirm = 0;
+	}
+	else
+	{
+		link_state.since_confirm++;
+	}
+	return result;
+}
+
+/**
+ * @brief Result of the last uplink, only confirmed uplinks are counted
+ *
+ * @param ack true if the uplink was acknowledged
+ */
+void link_tx_done(bool ack)
+{
+	if ((link_state.mode == LINK_OFF) || !link_state.last_confirmed)
+	{
+		return;
+	}
+	link_state.last_confirmed = false;
+	link_state.ack += ((ack ? 1000 : 0) - link_state.ack) / (1 << LINK_EWMA_SHIFT);
+
+	if (!ack)
+	{
+		// Check the link with the next uplink again
+		link_state.confirm_interval = 1;
+		if (link_controls_dr() && (link_state.ack < LINK_ACK_LOW) && (link_state.dr > 0))
+		{
+			link_set_dr(link_state.dr - 1);
+		}
+		return;
+	}
+
+	link_state.acks++;
+	if (link_state.confirm_interval < LINK_CONFIRM_MAX)
+	{
+		link_state.confirm_interval *= 2;
+	}
+
+	// Next data rate needs its SNR plus the margin, without downlinks the ACKs decide
+	uint8_t dr_max;
+	const int16_t *snr_req = link_snr_req(&dr_max);
+	if (link_controls_dr() && (link_state.dr < dr_max) && (link_state.ack >= LINK_ACK_HIGH) && (link_state.since_change >= LINK_HOLD))
+	{
+		if ((link_state.rx_samples == 0) || (link_state.snr >= snr_req[link_state.dr + 1] + link_state.margin * 10))
+		{
+			link_set_dr(link_state.dr + 1);
+			// Verify the new data rate with the next uplink
+			link_state.confirm_interval = 1;
+		}
+	}
+}
+
+/**
+ * @brief Data rate of the next uplink
+ *
+ * @return uint8_t Data rate from the MAC, includes the changes of ADR and the estimator
+ */
+uint8_t link_data_rate(void)
+{
+	MibRequestConfirm_t mib_req;
+	mib_req.Type = MIB_CHANNELS_DATARATE;
+	if (LoRaMacMibGetRequestConfirm(&mib_req) == LORAMAC_STATUS_OK)
+	{
+		return mib_req.Param.ChannelsDatarate;
+	}
+	return link_state.mode == LINK_OFF ? g_lorawan_settings.data_rate : link_state.dr;
+}
+
+/**
+ * @brief Max application payload of the next uplink
+ *        Values without repeater, AS923 with uplink dwell time,
+ *        regions with 242 bytes at the fast data rates use 222
+ *
+ * @return uint8_t Max payload size in bytes
+ */
+uint8_t link_max_payload(void)
+{
+	static const uint8_t payload_us915[5] = {11, 53, 125, 242, 242};
+	static const uint8_t payload_as923[8] = {11, 11, 11, 53, 125, 242, 242, 242};
+	static const uint8_t payload_125k[8] = {51, 51, 51, 115, 222, 222, 222, 222};
+	uint8_t dr = link_data_rate();
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORA_BAND_US915:
+		return payload_us915[dr > 4 ? 4 : dr];
+	case LORA_BAND_AS923_1:
+	case LORA_BAND_AS923_2:
+	case LORA_BAND_AS923_3:
+	case LORA_BAND_AS923_4:
+		return payload_as923[dr > 7 ? 7 : dr];
+	default:
+		return payload_125k[dr > 7 ? 7 : dr];
+	}
+}
+
+/**
+ * @brief AT+LINKSTAT=? prints the link estimate
+ *
+ * @param read true for AT+LINKSTAT=?
+ * @param args Not used
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_link_stat(bool read, uint32_t *args)
+{
+	if (!read)
+	{
+		return AT_ERR_PARAM;
+	}
+	AT_PRINTF("+LINKSTAT:%d,%d,%d,%d,%d,%d,%ld,%ld,%ld", link_state.mode, link_data_rate(), link_state.snr, link_state.rssi,
+			  link_state.ack, link_state.confirm_interval, link_state.uplinks, link_state.confirmed, link_state.acks);
+	return 0;
+}
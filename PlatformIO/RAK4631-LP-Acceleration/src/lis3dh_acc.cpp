@@ -2,6 +2,14 @@
  * @file lis3dh_acc.cpp
  * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
  * @brief Function to handle the LIS3DH Acceleration sensor
+ *        Power states: while still the sensor runs in 8 bit low power
+ *        mode at a low data rate and wakes up the MCU on movement.
+ *        While moving it runs in high resolution mode, the samples are
+ *        collected in the FIFO and checked in batches. After the quiet
+ *        time without movement it goes back to the still state.
+ *        Registers are written only if their value changes.
+ *        Interrupt source and FIFO batches can be recorded and replayed,
+ *        see trace.cpp.
  * @version 0.1
  * @date 2021-05-30
  * 
@@ -26,6 +34,181 @@ bool has_y_move = false;
 /** Flag if a z-axis movement was detected */
 bool has_z_move = false;
 
+/** Power state of the sensor */
+uint8_t acc_state = ACC_FIXED;
+/** Statistics of the power states */
+s_acc_power acc_power;
+
+/** Last written value of the registers 0x20 .. 0x3F */
+static uint8_t acc_reg_cache[32];
+/** Registers with a valid cached value, bit 0 = 0x20 */
+static uint32_t acc_reg_valid = 0;
+/** Time of the last movement in the moving state */
+static uint32_t acc_last_motion = 0;
+/** Time of the last state change */
+static uint32_t acc_state_start = 0;
+/** Samples of one FIFO batch */
+static uint8_t acc_batch[32 * 6];
+
+/** Samples per I2C read, limited by the Wire buffer */
+#define ACC_BURST_SAMPLES 10
+
+/**
+ * @brief Write a register only if its value changed
+ *
+ * @param reg Register 0x20 .. 0x3F
+ * @param value New value
+ */
+static void acc_write_reg(uint8_t reg, uint8_t value)
+{
+	uint32_t bit = 1UL << (reg - 0x20);
+	if (((acc_reg_valid & bit) != 0) && (acc_reg_cache[reg - 0x20] == value))
+	{
+		acc_power.skipped++;
+		return;
+	}
+	acc_sensor.writeRegister(reg, value);
+	acc_reg_cache[reg - 0x20] = value;
+	acc_reg_valid |= bit;
+	acc_power.writes++;
+}
+
+/**
+ * @brief ODR bits of CTRL_REG1
+ *
+ * @param odr Data rate in Hz
+ * @return uint8_t ODR3 .. ODR0 in bit 7 .. 4
+ */
+static uint8_t acc_odr_bits(uint16_t odr)
+{
+	switch (odr)
+	{
+	case 1:
+		return 0x10;
+	case 10:
+		return 0x20;
+	case 25:
+		return 0x30;
+	case 50:
+		return 0x40;
+	case 100:
+		return 0x50;
+	case 200:
+		return 0x60;
+	default:
+		return 0x70;
+	}
+}
+
+/**
+ * @brief Full scale bits of CTRL_REG4
+ *
+ * @return uint8_t FS1 and FS0 in bit 5 .. 4
+ */
+static uint8_t acc_range_bits(void)
+{
+	switch (acc_params.range)
+	{
+	case 4:
+		return 0x10;
+	case 8:
+		return 0x20;
+	case 16:
+		return 0x30;
+	default:
+		return 0x00;
+	}
+}
+
+/**
+ * @brief Program the registers of a power state, only changed registers are written
+ *        ACC_FIXED  normal mode at the configured data rate, movement interrupt
+ *        ACC_STILL  8 bit low power mode at the still data rate, movement interrupt
+ *        ACC_MOVING 12 bit high resolution mode at the configured data rate,
+ *                   high pass filtered samples in the FIFO, INT1 on the watermark
+ *
+ * @param state New power state
+ */
+void acc_power_set(uint8_t state)
+{
+	uint32_t now = millis();
+	if (state != acc_state)
+	{
+		acc_power.time_ms[acc_state] += now - acc_state_start;
+		acc_state_start = now;
+		acc_power.switches++;
+		MYLOG("ACC", "Power state %d -> %d", acc_state, state);
+	}
+	acc_state = state;
+
+	uint8_t reg1 = acc_odr_bits(acc_params.odr) | 0x07; // X, Y and Z enabled
+	uint8_t reg2 = 0x01;								// High pass filter for the movement interrupt
+	uint8_t reg3 = 0x40 | 0x20;							// AOI1 and AOI2 events on INT1
+	uint8_t reg4 = acc_range_bits();
+	uint8_t reg5 = 0x08; // Latch interrupt, FIFO disabled
+	uint8_t fifo = 0x00; // Bypass
+	uint8_t duration = 0x01;
+	switch (state)
+	{
+	case ACC_STILL:
+		reg1 = acc_odr_bits(acc_params.still_odr) | 0x08 | 0x07; // Low power mode
+		// One sample above the threshold is enough, 1 LSb is one sample
+		duration = 0x00;
+		break;
+	case ACC_MOVING:
+		reg2 = 0x08 | 0x01; // Filtered samples into the FIFO
+		reg3 = 0x04;		// FIFO watermark on INT1
+		reg4 |= 0x08;		// High resolution
+		reg5 = 0x40;		// FIFO enabled
+		// About one batch per second
+		fifo = 0x80 | (acc_params.odr < 24 ? acc_params.odr : 24);
+		acc_last_motion = now;
+		break;
+	}
+
+	// No interrupt while the registers change, LPen and HR must not be set together
+	acc_write_reg(LIS3DH_CTRL_REG3, 0x00);
+	if ((reg1 & 0x08) != 0)
+	{
+		acc_write_reg(LIS3DH_CTRL_REG4, reg4);
+		acc_write_reg(LIS3DH_CTRL_REG1, reg1);
+	}
+	else
+	{
+		acc_write_reg(LIS3DH_CTRL_REG1, reg1);
+		acc_write_reg(LIS3DH_CTRL_REG4, reg4);
+	}
+	acc_write_reg(LIS3DH_CTRL_REG2, reg2);
+	acc_write_reg(LIS3DH_INT1_CFG, 0x20 | 0x08 | 0x02); // Z, Y and X high
+	acc_write_reg(LIS3DH_INT1_THS, acc_params.int1_ths);
+	acc_write_reg(LIS3DH_INT1_DURATION, duration);
+	acc_write_reg(LIS3DH_CTRL_REG6, 0x00); // No interrupt on pin 2
+	if ((fifo & 0x80) != 0)
+	{
+		// Bypass mode clears the FIFO
+		acc_write_reg(LIS3DH_FIFO_CTRL_REG, 0x00);
+	}
+	acc_write_reg(LIS3DH_CTRL_REG5, reg5);
+	acc_write_reg(LIS3DH_FIFO_CTRL_REG, fifo);
+
+	// Reading the reference register resets the high pass filter
+	uint8_t dummy;
+	acc_sensor.readRegister(&dummy, LIS3DH_REFERENCE);
+	// Clear a latched interrupt
+	acc_sensor.readRegister(&dummy, LIS3DH_INT1_SRC);
+	acc_write_reg(LIS3DH_CTRL_REG3, reg3);
+}
+
+/**
+ * @brief Power state for the configured quiet time
+ *
+ * @return uint8_t ACC_FIXED if the state machine is off, otherwise ACC_MOVING
+ */
+static uint8_t acc_active_state(void)
+{
+	return acc_params.quiet_time == 0 ? ACC_FIXED : ACC_MOVING;
+}
+
 /**
  * @brief Initialize LIS3DH 3-axis 
  * acceleration sensor
@@ -38,8 +221,8 @@ bool init_acc(void)
 	// Setup interrupt pin
 	pinMode(INT1_PIN, INPUT);
 
-	acc_sensor.settings.accelSampleRate = 10; //Hz.  Can be: 0,1,10,25,50,100,200,400,1600,5000 Hz
-	acc_sensor.settings.accelRange = 2;		  //Max G force readable.  Can be: 2, 4, 8, 16
+	acc_sensor.settings.accelSampleRate = acc_params.odr; //Hz.  Can be: 0,1,10,25,50,100,200,400,1600,5000 Hz
+	acc_sensor.settings.accelRange = acc_params.range;	  //Max G force readable.  Can be: 2, 4, 8, 16
 
 	acc_sensor.settings.adcEnabled = 0;
 	acc_sensor.settings.tempEnabled = 0;
@@ -52,40 +235,136 @@ bool init_acc(void)
 		return false;
 	}
 
-	uint8_t dataToWrite = 0;
-	dataToWrite |= 0x20;									//Z high
-	dataToWrite |= 0x08;									//Y high
-	dataToWrite |= 0x02;									//X high
-	acc_sensor.writeRegister(LIS3DH_INT1_CFG, dataToWrite); // Enable interrupts on high tresholds for x, y and z
+	// Write all registers once, start in the moving state
+	acc_reg_valid = 0;
+	acc_state_start = millis();
+	acc_power_set(acc_active_state());
 
-	dataToWrite = 0;
-	dataToWrite |= 0x10;									// 1/8 range
-	acc_sensor.writeRegister(LIS3DH_INT1_THS, dataToWrite); // 1/8th range
+	get_acc_int();
 
-	dataToWrite = 0;
-	dataToWrite |= 0x01; // 1 * 1/50 s = 20ms
-	acc_sensor.writeRegister(LIS3DH_INT1_DURATION, dataToWrite);
+	// Set the interrupt callback function
+	attachInterrupt(INT1_PIN, acc_int_handler, RISING);
 
-	acc_sensor.readRegister(&dataToWrite, LIS3DH_CTRL_REG5);
-	dataToWrite &= 0xF3;									 //Clear bits of interest
-	dataToWrite |= 0x08;									 //Latch interrupt (Cleared by reading int1_src)
-	acc_sensor.writeRegister(LIS3DH_CTRL_REG5, dataToWrite); // Set interrupt to latching
+	return true;
+}
 
-	dataToWrite = 0;
-	dataToWrite |= 0x40; //AOI1 event (Generator 1 interrupt on pin 1)
-	dataToWrite |= 0x20; //AOI2 event ()
-	acc_sensor.writeRegister(LIS3DH_CTRL_REG3, dataToWrite);
+/**
+ * @brief Apply changed data rate, range, threshold and quiet time
+ *        without a new initialization of the sensor
+ *
+ */
+void acc_apply_params(void)
+{
+	acc_sensor.settings.accelSampleRate = acc_params.odr;
+	acc_sensor.settings.accelRange = acc_params.range;
+	if (stream_active)
+	{
+		// Settings are applied when the stream stops
+		return;
+	}
+	acc_power_set(acc_state == ACC_STILL && acc_params.quiet_time != 0 ? ACC_STILL : acc_active_state());
+}
 
-	acc_sensor.writeRegister(LIS3DH_CTRL_REG6, 0x00); // No interrupt on pin 2
+/**
+ * @brief Read samples from the FIFO, several samples with each I2C read
+ *        With the FIFO enabled the address rolls back from OUT_Z_H to OUT_X_L
+ *
+ * @param buffer Buffer for the raw samples, 6 bytes per sample
+ * @param samples Number of samples
+ */
+static void acc_fifo_burst(uint8_t *buffer, uint8_t samples)
+{
+	for (uint8_t idx = 0; idx < samples; idx += ACC_BURST_SAMPLES)
+	{
+		uint8_t chunk = (samples - idx) < ACC_BURST_SAMPLES ? samples - idx : ACC_BURST_SAMPLES;
+		// Bit 7 of the sub address enables auto increment
+		acc_sensor.readRegisterRegion(&buffer[idx * 6], LIS3DH_OUT_X_L | 0x80, chunk * 6);
+	}
+}
 
-	acc_sensor.writeRegister(LIS3DH_CTRL_REG2, 0x01); // Enable high pass filter
+/**
+ * @brief Handle the FIFO watermark in the moving state
+ *        Checks the high pass filtered samples against the movement
+ *        threshold and falls back to the still state after the quiet time
+ *
+ * @return true Movement found in the samples
+ * @return false No movement
+ */
+bool acc_moving_handler(void)
+{
+	uint8_t samples;
+	int16_t traced = trace_take(TRACE_ACC_FIFO, acc_batch, sizeof(acc_batch));
+	if (traced < 0)
+	{
+		bool overrun;
+		samples = acc_fifo_read(acc_batch, 32, &overrun);
+		trace_add(TRACE_ACC_FIFO, acc_batch, samples * 6);
+	}
+	else
+	{
+		samples = traced / 6;
+	}
+	acc_power.batches++;
 
-	get_acc_int();
+	// 1 LSb of the threshold is 1/128 of the range, 256 in the left aligned samples
+	int32_t limit = (int32_t)acc_params.int1_ths << 8;
+	bool moved = false;
+	for (uint8_t idx = 0; idx < samples; idx++)
+	{
+		for (uint8_t axis = 0; axis < 3; axis++)
+		{
+			int16_t value = (int16_t)(acc_batch[idx * 6 + axis * 2] | (acc_batch[idx * 6 + axis * 2 + 1] << 8));
+			if ((value > limit) || (value < -limit))
+			{
+				moved = true;
+				if (axis == 0)
+				{
+					has_x_move = true;
+				}
+				else if (axis == 1)
+				{
+					has_y_move = true;
+				}
+				else
+				{
+					has_z_move = true;
+				}
+			}
+		}
+	}
 
-	// Set the interrupt callback function
-	attachInterrupt(INT1_PIN, acc_int_handler, RISING);
+	uint32_t now = millis();
+	if (moved)
+	{
+		acc_last_motion = now;
+	}
+	else if ((now - acc_last_motion) >= (uint32_t)acc_params.quiet_time * 1000)
+	{
+		MYLOG("ACC", "No movement for %d s", acc_params.quiet_time);
+		acc_power_set(ACC_STILL);
+	}
+	return moved;
+}
 
-	return true;
+/**
+ * @brief AT+ACCSTATE=? prints the power state and its statistics
+ *
+ * @param read true for AT+ACCSTATE=?
+ * @param args Not used
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_acc_state(bool read, uint32_t *args)
+{
+	if (!read)
+	{
+		return AT_ERR_PARAM;
+	}
+	uint32_t time_ms[ACC_STATES];
+	memcpy(time_ms, acc_power.time_ms, sizeof(time_ms));
+	time_ms[acc_state] += millis() - acc_state_start;
+	AT_PRINTF("+ACCSTATE:%d,%ld,%ld,%ld,%ld,%ld,%ld,%ld", acc_state, time_ms[ACC_FIXED] / 1000, time_ms[ACC_STILL] / 1000, time_ms[ACC_MOVING] / 1000,
+			  acc_power.switches, acc_power.batches, acc_power.writes, acc_power.skipped);
+	return 0;
 }
 
 /**
@@ -95,6 +374,11 @@ bool init_acc(void)
  */
 void acc_int_handler(void)
 {
+	if (trace_replaying())
+	{
+		// The interrupts come from the trace
+		return;
+	}
 	// Set the event flag
 	g_task_event_type |= ACC_TRIGGER;
 	// Wake up the task to handle it
@@ -108,7 +392,17 @@ void acc_int_handler(void)
 void get_acc_int(void)
 {
 	uint8_t dataRead;
-	acc_sensor.readRegister(&dataRead, LIS3DH_INT1_SRC);
+	int16_t traced = trace_take(TRACE_ACC_INT, &dataRead, 1);
+	if (traced < 0)
+	{
+		acc_sensor.readRegister(&dataRead, LIS3DH_INT1_SRC);
+		trace_add(TRACE_ACC_INT, &dataRead, 1);
+	}
+	else if (traced == 0)
+	{
+		// Replay took another path than the recording
+		dataRead = 0;
+	}
 
 	if (dataRead & 0x40)
 		MYLOG("ACC", "Interrupt Active 0x%X", dataRead);
@@ -143,3 +437,81 @@ void get_acc_int(void)
 		has_x_move = false;
 	}
 }
+
+/**
+ * @brief Switch the LIS3DH into FIFO stream mode for raw data capture
+ *        Motion interrupts are disabled, INT1 signals the FIFO watermark
+ *
+ * @param rate Output data rate, 400, 1344 or 1600 Hz
+ * @param threshold FIFO watermark level in samples (1 .. 31)
+ * @return true If 8-bit low power data is delivered (1600 Hz)
+ * @return false If 10-bit normal mode data is delivered
+ */
+bool acc_fifo_start(uint16_t rate, uint8_t threshold)
+{
+	uint8_t odr_reg = 0x07; // X, Y and Z enabled
+	bool low_power = false;
+	switch (rate)
+	{
+	case 1600:
+		odr_reg |= 0x80 | 0x08; // 1.6kHz, low power mode
+		low_power = true;
+		break;
+	case 1344:
+		odr_reg |= 0x90; // 1.344kHz
+		break;
+	default:
+		odr_reg |= 0x70; // 400Hz
+		break;
+	}
+
+	acc_write_reg(LIS3DH_CTRL_REG3, 0x00);						// No interrupts while switching
+	acc_write_reg(LIS3DH_FIFO_CTRL_REG, 0x00);					// Bypass mode clears the FIFO
+	acc_write_reg(LIS3DH_CTRL_REG4, acc_range_bits());			// Normal resolution
+	acc_write_reg(LIS3DH_CTRL_REG2, 0x01);						// Unfiltered samples
+	acc_write_reg(LIS3DH_CTRL_REG5, 0x40);						// FIFO enabled, no latch
+	acc_write_reg(LIS3DH_FIFO_CTRL_REG, 0x80 | (threshold & 0x1F)); // Stream mode with watermark
+	acc_write_reg(LIS3DH_CTRL_REG1, odr_reg);
+	acc_write_reg(LIS3DH_CTRL_REG3, 0x04);						// FIFO watermark on INT1
+	return low_power;
+}
+
+/**
+ * @brief Read all samples available in the LIS3DH FIFO
+ *
+ * @param buffer Buffer for the raw samples, 6 bytes per sample (X, Y, Z LSB first)
+ * @param max_samples Max number of samples that fit into the buffer
+ * @param overrun Set to true if the FIFO overflowed and samples were lost
+ * @return uint8_t Number of samples read
+ */
+uint8_t acc_fifo_read(uint8_t *buffer, uint8_t max_samples, bool *overrun)
+{
+	uint8_t fifo_src;
+	acc_sensor.readRegister(&fifo_src, LIS3DH_FIFO_SRC_REG);
+	*overrun = (fifo_src & 0x40) == 0x40;
+
+	uint8_t samples = fifo_src & 0x1F;
+	if (*overrun)
+	{
+		// FIFO is full, FSS shows 31
+		samples = 32;
+	}
+	if (samples > max_samples)
+	{
+		samples = max_samples;
+	}
+	acc_fifo_burst(buffer, samples);
+	return samples;
+}
+
+/**
+ * @brief Leave FIFO stream mode and restore motion detection
+ *        The sensor was just handled, start in the moving state
+ *
+ */
+void acc_fifo_stop(void)
+{
+	acc_write_reg(LIS3DH_FIFO_CTRL_REG, 0x00);
+	acc_power_set(acc_active_state());
+	get_acc_int();
+}
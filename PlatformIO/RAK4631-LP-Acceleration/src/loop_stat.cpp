@@ -0,0 +1,367 @@
+/**
+ * @file loop_stat.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Latency of the event loop and hang watchdog
+ *        The loop is woken up by the semaphore and calls the handlers
+ *        until all event bits are cleared. For each event bit the time
+ *        from the wake up to the end of the handler that cleared it is
+ *        counted in a log scale histogram, the complete wake up as well.
+ *        Bucket 0 is below 32 us, each bucket doubles the time, the last
+ *        one is 524 ms and more.
+ *        The nRF52 watchdog is fed only when the loop finished all events
+ *        and goes back to sleep. A timer wakes the loop regularly, so a
+ *        loop that hangs in a handler or never finishes resets the node.
+ *        The watchdog is off by default, WDT_TIMEOUT=<seconds> in
+ *        platformio.ini enables it.
+ * @version 0.1
+ * @date 2021-06-28
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+/** Upper limit of bucket 0 in us */
+#define LOOP_BUCKET_MIN_US 32
+/** Histogram row of the complete wake up */
+#define LOOP_ROW_WAKE LOOP_EVENTS
+/** Number of histogram rows, event bits and the wake up */
+#define LOOP_ROWS (LOOP_EVENTS + 1)
+
+/** Histograms, a row is halved when one of its buckets is full */
+static uint16_t loop_hist[LOOP_ROWS][LOOP_BUCKETS];
+/** Longest time of each row in us */
+static uint32_t loop_max[LOOP_ROWS];
+
+/** Start of the current wake up, micros() */
+static uint32_t loop_wake_us = 0;
+/** Loop is sleeping, the next handler call starts a wake up */
+static bool loop_idle = true;
+/** Event bits at the start of the current handler */
+static uint16_t loop_events = 0;
+/** Uplinks since the last diagnostics block */
+static uint8_t loop_diag_count = 0;
+/** Last reset was done by the watchdog */
+static bool loop_wdt_reset = false;
+
+/** Timer that wakes the loop to show it is alive */
+SoftwareTimer loop_timer;
+
+/**
+ * @brief Bucket of a time
+ *
+ * @param time_us Time in us
+ * @return uint8_t Bucket
+ */
+static uint8_t loop_bucket(uint32_t time_us)
+{
+	uint8_t bucket = 0;
+	while ((bucket < (LOOP_BUCKETS - 1)) && (time_us >= ((uint32_t)LOOP_BUCKET_MIN_US << bucket)))
+	{
+		bucket++;
+	}
+	return bucket;
+}
+
+/**
+ * @brief Add a time to a histogram row
+ *
+ * @param row Event bit or LOOP_ROW_WAKE
+ * @param time_us Time in us
+ */
+static void loop_add(uint8_t row, uint32_t time_us)
+{
+	uint8_t bucket = loop_bucket(time_us);
+	if (loop_hist[row][bucket] == UINT16_MAX)
+	{
+		// Keep the shape of the distribution
+		for (uint8_t idx = 0; idx < LOOP_BUCKETS; idx++)
+		{
+			loop_hist[row][idx] >>= 1;
+		}
+	}
+	loop_hist[row][bucket]++;
+	if (time_us > loop_max[row])
+	{
+		loop_max[row] = time_us;
+	}
+}
+
+/**
+ * @brief Number of samples of a row
+ *
+ * @param row Event bit or LOOP_ROW_WAKE
+ * @return uint32_t Number of samples
+ */
+static uint32_t loop_count(uint8_t row)
+{
+	uint32_t count = 0;
+	for (uint8_t idx = 0; idx < LOOP_BUCKETS; idx++)
+	{
+		count += loop_hist[row][idx];
+	}
+	return count;
+}
+
+/**
+ * @brief Bucket below which a part of the samples of a row are
+ *
+ * @param row Event bit or LOOP_ROW_WAKE
+ * @param permille Part of the samples, e.g. 500 for the median
+ * @return uint8_t Bucket
+ */
+static uint8_t loop_percentile(uint8_t row, uint16_t permille)
+{
+	uint32_t limit = (loop_count(row) * permille + 999) / 1000;
+	uint32_t sum = 0;
+	for (uint8_t idx = 0; idx < LOOP_BUCKETS; idx++)
+	{
+		sum += loop_hist[row][idx];
+		if ((sum >= limit) && (sum != 0))
+		{
+			return idx;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Upper limit of a bucket
+ *
+ * @param bucket Bucket
+ * @return uint32_t Time in us, the last bucket has no upper limit, it returns its lower limit
+ */
+static uint32_t loop_bucket_us(uint8_t bucket)
+{
+	return bucket < (LOOP_BUCKETS - 1) ? (uint32_t)LOOP_BUCKET_MIN_US << bucket : (uint32_t)LOOP_BUCKET_MIN_US << (bucket - 1);
+}
+
+/**
+ * @brief Feed the watchdog
+ *
+ */
+static void loop_wdt_feed(void)
+{
+#if WDT_TIMEOUT > 0
+	NRF_WDT->RR[0] = WDT_RR_RR_Reload;
+#endif
+}
+
+/**
+ * @brief Timer callback, wakes the loop to check it is alive
+ *
+ * @param unused
+ */
+static void loop_timer_cb(TimerHandle_t unused)
+{
+	g_task_event_type |= LOOP_CHECK;
+	xSemaphoreGive(g_task_sem);
+}
+
+/**
+ * @brief Start the watchdog and the timer
+ *        After a soft reset the watchdog is still running with the
+ *        old settings, it is only fed then.
+ *
+ */
+void loop_init(void)
+{
+	loop_wdt_reset = (readResetReason() & POWER_RESETREAS_DOG_Msk) != 0;
+	if (loop_wdt_reset)
+	{
+		MYLOG("LOOP", "Last reset by watchdog, loop was stuck");
+	}
+#if WDT_TIMEOUT > 0
+	if (NRF_WDT->RUNSTATUS == 0)
+	{
+		// Keep running in sleep, pause while the debugger halts the CPU
+		NRF_WDT->CONFIG = (WDT_CONFIG_SLEEP_Run << WDT_CONFIG_SLEEP_Pos) | (WDT_CONFIG_HALT_Pause << WDT_CONFIG_HALT_Pos);
+		NRF_WDT->CRV = WDT_TIMEOUT * 32768 - 1;
+		NRF_WDT->RREN = WDT_RREN_RR0_Msk;
+		NRF_WDT->TASKS_START = 1;
+	}
+	loop_wdt_feed();
+	loop_timer.begin(WDT_TIMEOUT * 1000 / 4, loop_timer_cb);
+	loop_timer.start();
+#endif
+}
+
+/**
+ * @brief Call at the start of app_event_handler()
+ *        Starts a new wake up if the loop was sleeping
+ *
+ */
+void loop_start(void)
+{
+	if (loop_idle)
+	{
+		loop_idle = false;
+		loop_wake_us = micros();
+	}
+	loop_events = g_task_event_type;
+}
+
+/**
+ * @brief Call at the start of the following handlers
+ *        Counts the events cleared by the previous handler
+ *
+ */
+void loop_mark(void)
+{
+	uint16_t done = loop_events & ~g_task_event_type;
+	if (done != 0)
+	{
+		uint32_t time_us = micros() - loop_wake_us;
+		for (uint8_t bit = 0; bit < LOOP_EVENTS; bit++)
+		{
+			if ((done & (1 << bit)) != 0)
+			{
+				loop_add(bit, time_us);
+			}
+		}
+	}
+	loop_events = g_task_event_type;
+}
+
+/**
+ * @brief Call at the end of lora_data_handler(), the last handler
+ *        If no event is left the loop goes to sleep, the wake up is
+ *        counted and the watchdog is fed. AT commands and BLE settings
+ *        are handled by the WisBlock-API without calling the handlers,
+ *        their bits do not keep the wake up open.
+ *
+ */
+void loop_end(void)
+{
+	loop_mark();
+	if ((g_task_event_type & ~(AT_CMD | BLE_CONFIG)) != NO_EVENT)
+	{
+		// Loop calls the handlers again
+		return;
+	}
+	loop_add(LOOP_ROW_WAKE, micros() - loop_wake_us);
+	loop_idle = true;
+	loop_wdt_feed();
+}
+
+/**
+ * @brief Clear the histograms
+ *
+ */
+void loop_clear(void)
+{
+	memset(loop_hist, 0, sizeof(loop_hist));
+	memset(loop_max, 0, sizeof(loop_max));
+}
+
+/**
+ * @brief Print the histograms of the event bits with samples and of the wake ups
+ *        to the log and, if connected, to BLE UART
+ *
+ */
+void loop_report(void)
+{
+	for (uint8_t row = 0; row < LOOP_ROWS; row++)
+	{
+		uint32_t count = loop_count(row);
+		if (count == 0)
+		{
+			continue;
+		}
+		uint32_t p50 = loop_bucket_us(loop_percentile(row, 500));
+		uint32_t p99 = loop_bucket_us(loop_percentile(row, 990));
+		MYLOG("LOOP", "0x%04X count %ld, p50 < %ld us, p99 < %ld us, max %ld us", row == LOOP_ROW_WAKE ? 0xFFFF : 1 << row, count, p50, p99, loop_max[row]);
+		if (g_ble_uart_is_connected)
+		{
+			if (row == LOOP_ROW_WAKE)
+			{
+				g_ble_uart.printf("Wake %ld p50 %ld p99 %ld max %ld us\n", count, p50, p99, loop_max[row]);
+			}
+			else
+			{
+				g_ble_uart.printf("0x%04X %ld p50 %ld p99 %ld max %ld us\n", 1 << row, count, p50, p99, loop_max[row]);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Add the diagnostics block to an uplink every N-th uplink
+ *        0xD3 <flags> then <row> <p50 bucket << 4 | p99 bucket> <max bucket>
+ *        for each row with samples, row 0 .. 15 is the event bit,
+ *        16 the complete wake up. Flag bit 0 is set after a watchdog reset.
+ *
+ * @param buffer Packet buffer
+ * @param len Length of the packet
+ * @param max_len Space for the packet with the block
+ * @param interval Every N-th uplink, 0 = off
+ * @return uint8_t New length of the packet
+ */
+uint8_t loop_add_diag(uint8_t *buffer, uint8_t len, uint8_t max_len, uint8_t interval)
+{
+	if (interval == 0)
+	{
+		return len;
+	}
+	loop_diag_count++;
+	if ((loop_diag_count < interval) || ((len + 2) > max_len))
+	{
+		return len;
+	}
+	loop_diag_count = 0;
+	buffer[len++] = LOOP_DIAG_TAG;
+	buffer[len++] = loop_wdt_reset ? 0x01 : 0x00;
+	for (uint8_t row = 0; (row < LOOP_ROWS) && ((len + 3) <= max_len); row++)
+	{
+		if (loop_count(row) == 0)
+		{
+			continue;
+		}
+		buffer[len++] = row;
+		buffer[len++] = (loop_percentile(row, 500) << 4) | loop_percentile(row, 990);
+		buffer[len++] = loop_bucket(loop_max[row]);
+	}
+	return len;
+}
+
+/**
+ * @brief AT+LOOP=? prints the latency of each event bit and of the wake ups,
+ *        AT+LOOP=0 clears the histograms
+ *
+ * @param read true for AT+LOOP=?
+ * @param args Value for AT+LOOP=<value>
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_loop(bool read, uint32_t *args)
+{
+	if (!read)
+	{
+		if (args[0] != 0)
+		{
+			return AT_ERR_PARAM;
+		}
+		loop_clear();
+		return 0;
+	}
+	for (uint8_t row = 0; row < LOOP_ROWS; row++)
+	{
+		uint32_t count = loop_count(row);
+		if (count == 0)
+		{
+			continue;
+		}
+		uint32_t p50 = loop_bucket_us(loop_percentile(row, 500));
+		uint32_t p99 = loop_bucket_us(loop_percentile(row, 990));
+		if (row == LOOP_ROW_WAKE)
+		{
+			AT_PRINTF("+LOOP:WAKE,%ld,%ld,%ld,%ld", count, p50, p99, loop_max[row]);
+		}
+		else
+		{
+			AT_PRINTF("+LOOP:0x%04X,%ld,%ld,%ld,%ld", 1 << row, count, p50, p99, loop_max[row]);
+		}
+	}
+	AT_PRINTF("+LOOP:WDT,%d,%d", WDT_TIMEOUT, loop_wdt_reset ? 1 : 0);
+	return 0;
+}
@@ -0,0 +1,322 @@
+/**
+ * @file params.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Application parameters, base storage in flash and
+ *        access from the downlink configuration protocol
+ * @version 0.1
+ * @date 2021-06-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+#include <Adafruit_LittleFS.h>
+#include <InternalFileSystem.h>
+using namespace Adafruit_LittleFS_Namespace;
+
+/** Filename of the application parameters */
+static const char app_params_name[] = "APP";
+
+/** Active application parameters */
+s_acc_params acc_params;
+
+/** Shadow copy for the downlink configuration */
+s_acc_params new_acc_params;
+
+/** Network time received with the configuration, 0 if none */
+static uint32_t new_clock_time = 0;
+
+/** Application AT commands, map to application parameters or have their own handler */
+constexpr s_at_cmd app_at_cmds[] = {
+	{AT_NAME("+ACCTHS"), "Get or set the movement threshold 1 .. 127, 1 LSb = range / 128", 1, {DL_ACC_THS}, {1}},
+	{AT_NAME("+ACCODR"), "Get or set the data rate while moving 1, 10, 25, 50, 100, 200 or 400 Hz", 1, {DL_ACC_ODR}, {2}},
+	{AT_NAME("+ACCRANGE"), "Get or set the range 2, 4, 8 or 16 g", 1, {DL_ACC_RANGE}, {1}},
+	{AT_NAME("+SHAPER"), "Get or set the packet burst size and the time to earn a packet in seconds", 2, {DL_SHAPER_BUCKET, DL_SHAPER_REFILL}, {1, 2}},
+	{AT_NAME("+ACCPOWER"), "Get or set the data rate while still 1, 10, 25 or 50 Hz and the seconds without movement before still, 0 = off", 2, {DL_ACC_STILL_ODR, DL_ACC_QUIET}, {1, 2}},
+	{AT_NAME("+ACCSTATE"), "Show power state, seconds fixed, still and moving, state changes, FIFO batches, register writes and skipped writes", 0, {}, {}, at_acc_state},
+	{AT_NAME("+TIME"), "Get or set the network time in seconds, read gives time, drift in ppm and sync age in s", 1, {}, {}, at_time},
+	{AT_NAME("+LINK"), "Get or set the link estimator 0 = off 1 = confirmation 2 = confirmation and data rate, and the SNR margin in dB", 2, {DL_LINK_MODE, DL_LINK_MARGIN}, {1, 1}},
+	{AT_NAME("+LINKSTAT"), "Show link mode, data rate, SNR in 0.1 dB, RSSI, ACK permille, confirm interval, uplinks, confirmed and ACKs", 0, {}, {}, at_link_stat},
+	{AT_NAME("+DIAG"), "Get or set the loop latency block in every N-th uplink, 0 = off", 1, {DL_DIAG_INTERVAL}, {1}},
+	{AT_NAME("+LOOP"), "Show the loop latency of each event bit and of the wake ups, 0 to clear", 1, {}, {}, at_loop},
+	{AT_NAME("+BOOT"), "Show the boot timeline in us since reset", 0, {}, {}, at_boot},
+	{AT_NAME("+ENERGY"), "Show uptime, wakeups, uplinks, TX, RX and BLE ms, average uA and battery days", 0, {}, {}, at_energy},
+	{AT_NAME("+MEM"), "Show heap, task stack and buffer high-water marks", 0, {}, {}, at_mem},
+	{AT_NAME("+RXRING"), "Show received, dropped and queued downlinks", 0, {}, {}, at_rx_ring},
+#if BULK > 0
+	{AT_NAME("+BULK"), "Offload over LoRa P2P 1 = capture and send 2 = collect 0 = cancel, read gives role, state, size, frames, base, sent, received, repeated, SACKs, timeouts and ms", 1, {}, {}, at_bulk},
+#endif
+	{AT_NAME("+TRACE"), "Sensor trace 1 = record 2 = replay 3 = print 0 = stop, read gives mode, bytes, records, mismatches, replay s, wakeups, uplinks and uA", 1, {}, {}, at_trace},
+#if FUOTA > 0
+	{AT_NAME("+FUOTA"), "Show firmware update state, fragments, received, parity used and lost, 0 to cancel", 1, {}, {}, at_fuota},
+#endif
+#if BENCH > 0
+	{AT_NAME("+BENCH"), "Run the benchmarks, result in CPU cycles", 0, {}, {}, at_bench},
+#endif
+};
+const uint8_t app_at_cmds_num = sizeof(app_at_cmds) / sizeof(s_at_cmd);
+constexpr uint16_t app_at_seed = at_find_seed(app_at_cmds, sizeof(app_at_cmds) / sizeof(s_at_cmd));
+static_assert(app_at_seed < AT_MAX_SEED, "No collision free AT command slots, rename the command or increase AT_SLOT_BITS");
+constexpr s_at_index app_at_index = at_make_index(app_at_cmds, sizeof(app_at_cmds) / sizeof(s_at_cmd), app_at_seed, at_make_seq<AT_SLOTS>::type());
+
+/** File to store the parameters */
+static File params_file(InternalFS);
+
+/**
+ * @brief Load the parameters from flash, keep the defaults if none are saved
+ *        Changes since the last save are in the journal
+ *
+ */
+void app_param_load(void)
+{
+	s_acc_params flash_params;
+	uint8_t crc[2];
+
+	InternalFS.begin();
+	if (params_file.open(app_params_name, FILE_O_READ))
+	{
+		if ((params_file.read((uint8_t *)&flash_params, sizeof(s_acc_params)) == sizeof(s_acc_params)) && (params_file.read(crc, 2) == 2))
+		{
+			uint16_t check = crc16((uint8_t *)&flash_params, sizeof(s_acc_params), 0xFFFF);
+			if ((flash_params.valid_mark == APP_PARAMS_MARK) && (crc[0] == (uint8_t)(check >> 8)) && (crc[1] == (uint8_t)check))
+			{
+				memcpy(&acc_params, &flash_params, sizeof(s_acc_params));
+				MYLOG("PARAM", "Parameters loaded from flash");
+			}
+		}
+		params_file.close();
+	}
+}
+
+/**
+ * @brief Save the parameters to flash, called when the journal is compacted
+ *
+ */
+void app_param_save(void)
+{
+	uint16_t check = crc16((uint8_t *)&acc_params, sizeof(s_acc_params), 0xFFFF);
+	uint8_t crc[2] = {(uint8_t)(check >> 8), (uint8_t)check};
+
+	InternalFS.remove(app_params_name);
+	if (params_file.open(app_params_name, FILE_O_WRITE))
+	{
+		params_file.write((uint8_t *)&acc_params, sizeof(s_acc_params));
+		params_file.write(crc, 2);
+		params_file.flush();
+		params_file.close();
+	}
+}
+
+/**
+ * @brief Start a downlink configuration, changes go into a shadow copy
+ *
+ */
+void app_param_begin(void)
+{
+	memcpy(&new_acc_params, &acc_params, sizeof(s_acc_params));
+	new_clock_time = 0;
+}
+
+/**
+ * @brief Write a parameter into the shadow copy
+ *
+ * @param tag Tag of the parameter
+ * @param value Pointer to the value
+ * @param len Length of the value
+ * @return uint8_t DL_OK or error status
+ */
+uint8_t app_param_write(uint8_t tag, uint8_t *value, uint8_t len)
+{
+	uint32_t new_value = dl_get_value(value, len);
+	switch (tag)
+	{
+	case DL_ACC_ODR:
+		if (len != 2)
+		{
+			return DL_ERR_LEN;
+		}
+		switch (new_value)
+		{
+		case 1:
+		case 10:
+		case 25:
+		case 50:
+		case 100:
+		case 200:
+		case 400:
+			new_acc_params.odr = new_value;
+			return DL_OK;
+		default:
+			return DL_ERR_RANGE;
+		}
+	case DL_ACC_RANGE:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		if ((new_value != 2) && (new_value != 4) && (new_value != 8) && (new_value != 16))
+		{
+			return DL_ERR_RANGE;
+		}
+		new_acc_params.range = new_value;
+		return DL_OK;
+	case DL_ACC_THS:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		if ((new_value == 0) || (new_value > 0x7F))
+		{
+			return DL_ERR_RANGE;
+		}
+		new_acc_params.int1_ths = new_value;
+		return DL_OK;
+	case DL_SHAPER_BUCKET:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		if (new_value == 0)
+		{
+			return DL_ERR_RANGE;
+		}
+		new_acc_params.bucket_size = new_value;
+		return DL_OK;
+	case DL_SHAPER_REFILL:
+		if (len != 2)
+		{
+			return DL_ERR_LEN;
+		}
+		if (new_value == 0)
+		{
+			return DL_ERR_RANGE;
+		}
+		new_acc_params.refill_time = new_value;
+		return DL_OK;
+	case DL_LINK_MODE:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		if (new_value > LINK_DR)
+		{
+			return DL_ERR_RANGE;
+		}
+		new_acc_params.link_mode = new_value;
+		return DL_OK;
+	case DL_LINK_MARGIN:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		if (new_value > 30)
+		{
+			return DL_ERR_RANGE;
+		}
+		new_acc_params.link_margin = new_value;
+		return DL_OK;
+	case DL_DIAG_INTERVAL:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		new_acc_params.diag_interval = new_value;
+		return DL_OK;
+	case DL_ACC_STILL_ODR:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		if ((new_value != 1) && (new_value != 10) && (new_value != 25) && (new_value != 50))
+		{
+			return DL_ERR_RANGE;
+		}
+		new_acc_params.still_odr = new_value;
+		return DL_OK;
+	case DL_ACC_QUIET:
+		if (len != 2)
+		{
+			return DL_ERR_LEN;
+		}
+		new_acc_params.quiet_time = new_value;
+		return DL_OK;
+	case DL_ACC_TIME:
+		// Action only, not stored and not readable
+		if (len != 4)
+		{
+			return DL_ERR_LEN;
+		}
+		new_clock_time = new_value;
+		return DL_OK;
+	default:
+		return DL_ERR_TAG;
+	}
+}
+
+/**
+ * @brief Read a parameter
+ *
+ * @param tag Tag of the parameter
+ * @param buffer Buffer for the value
+ * @return uint8_t Length of the value, 0 if the tag is unknown
+ */
+uint8_t app_param_read(uint8_t tag, uint8_t *buffer)
+{
+	switch (tag)
+	{
+	case DL_ACC_ODR:
+		return dl_put_value(buffer, acc_params.odr, 2);
+	case DL_ACC_RANGE:
+		return dl_put_value(buffer, acc_params.range, 1);
+	case DL_ACC_THS:
+		return dl_put_value(buffer, acc_params.int1_ths, 1);
+	case DL_SHAPER_BUCKET:
+		return dl_put_value(buffer, acc_params.bucket_size, 1);
+	case DL_SHAPER_REFILL:
+		return dl_put_value(buffer, acc_params.refill_time, 2);
+	case DL_ACC_STILL_ODR:
+		return dl_put_value(buffer, acc_params.still_odr, 1);
+	case DL_ACC_QUIET:
+		return dl_put_value(buffer, acc_params.quiet_time, 2);
+	case DL_LINK_MODE:
+		return dl_put_value(buffer, acc_params.link_mode, 1);
+	case DL_LINK_MARGIN:
+		return dl_put_value(buffer, acc_params.link_margin, 1);
+	case DL_DIAG_INTERVAL:
+		return dl_put_value(buffer, acc_params.diag_interval, 1);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Apply the shadow copy to the sensor, the shaper and the link estimator
+ *
+ */
+void app_param_commit(void)
+{
+	if (new_clock_time != 0)
+	{
+		clock_answer(new_clock_time);
+	}
+	if (memcmp(&new_acc_params, &acc_params, sizeof(s_acc_params)) == 0)
+	{
+		return;
+	}
+	memcpy(&acc_params, &new_acc_params, sizeof(s_acc_params));
+	acc_apply_params();
+	shaper_config(&acc_shaper, acc_params.bucket_size, acc_params.refill_time * 1000);
+	link_set_params(acc_params.link_mode, acc_params.link_margin);
+}
+
+/**
+ * @brief Take over the shadow copy without applying it,
+ *        used at boot before the sensor is initialized
+ *
+ */
+void app_param_restore(void)
+{
+	memcpy(&acc_params, &new_acc_params, sizeof(s_acc_params));
+}
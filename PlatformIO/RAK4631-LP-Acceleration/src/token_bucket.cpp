@@ -0,0 +1,168 @@
+/**
+ * @file token_bucket.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Token bucket traffic shaper for event triggered uplinks
+ *        Events are never dropped, bursts are collected and
+ *        reported with the next packet that the bucket allows
+ * @version 0.1
+ * @date 2021-06-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+/**
+ * @brief Add the tokens that were earned since the last refill
+ *
+ * @param shaper Pointer to the shaper
+ */
+static void shaper_refill(s_shaper *shaper)
+{
+	uint32_t now = millis();
+
+	if (shaper->tokens >= shaper->bucket_size)
+	{
+		// Bucket is full, nothing to earn
+		shaper->last_refill = now;
+		return;
+	}
+
+	uint32_t earned = (now - shaper->last_refill) / shaper->refill_time;
+	if (earned == 0)
+	{
+		return;
+	}
+
+	if (earned >= (uint32_t)(shaper->bucket_size - shaper->tokens))
+	{
+		shaper->tokens = shaper->bucket_size;
+		shaper->last_refill = now;
+	}
+	else
+	{
+		shaper->tokens += earned;
+		// Keep the remainder for the next token
+		shaper->last_refill += earned * shaper->refill_time;
+	}
+}
+
+/**
+ * @brief Initialize a shaper, the bucket starts full
+ *
+ * @param shaper Pointer to the shaper
+ * @param bucket_size Max number of packets that can be sent in a burst
+ * @param refill_time Time in milliseconds to earn one token
+ */
+void shaper_init(s_shaper *shaper, uint16_t bucket_size, uint32_t refill_time)
+{
+	shaper->tokens = 0;
+	shaper->event_count = 0;
+	shaper->first_event = 0;
+	shaper->last_event = 0;
+	shaper_config(shaper, bucket_size, refill_time);
+	shaper->tokens = shaper->bucket_size;
+	shaper->last_refill = millis();
+}
+
+/**
+ * @brief Change the shaper settings at runtime
+ *        Already collected events are kept
+ *
+ * @param shaper Pointer to the shaper
+ * @param bucket_size Max number of packets that can be sent in a burst
+ * @param refill_time Time in milliseconds to earn one token
+ */
+void shaper_config(s_shaper *shaper, uint16_t bucket_size, uint32_t refill_time)
+{
+	shaper->bucket_size = bucket_size == 0 ? 1 : bucket_size;
+	shaper->refill_time = refill_time == 0 ? 1 : refill_time;
+	if (shaper->tokens > shaper->bucket_size)
+	{
+		shaper->tokens = shaper->bucket_size;
+	}
+}
+
+/**
+ * @brief Register an event in the shaper
+ *
+ * @param shaper Pointer to the shaper
+ * @return true A token is available, packet can be sent now
+ * @return false No token available, sending has to be deferred
+ */
+bool shaper_event(s_shaper *shaper)
+{
+	uint32_t now = millis();
+
+	if (shaper->event_count == 0)
+	{
+		shaper->first_event = now;
+	}
+	shaper->last_event = now;
+	if (shaper->event_count < 0xFFFF)
+	{
+		shaper->event_count++;
+	}
+
+	shaper_refill(shaper);
+	return shaper->tokens != 0;
+}
+
+/**
+ * @brief Take a token before sending a packet
+ *
+ * @param shaper Pointer to the shaper
+ * @return true Token taken, packet can be sent
+ * @return false No token available
+ */
+bool shaper_take(s_shaper *shaper)
+{
+	shaper_refill(shaper);
+	if (shaper->tokens == 0)
+	{
+		return false;
+	}
+	shaper->tokens--;
+	return true;
+}
+
+/**
+ * @brief Return a token if the packet could not be sent
+ *
+ * @param shaper Pointer to the shaper
+ */
+void shaper_refund(s_shaper *shaper)
+{
+	if (shaper->tokens < shaper->bucket_size)
+	{
+		shaper->tokens++;
+	}
+}
+
+/**
+ * @brief Get the time until the next token is available
+ *
+ * @param shaper Pointer to the shaper
+ * @return uint32_t Time in milliseconds, 0 if a token is available
+ */
+uint32_t shaper_wait_time(s_shaper *shaper)
+{
+	shaper_refill(shaper);
+	if (shaper->tokens != 0)
+	{
+		return 0;
+	}
+	uint32_t elapsed = millis() - shaper->last_refill;
+	return elapsed >= shaper->refill_time ? 1 : shaper->refill_time - elapsed;
+}
+
+/**
+ * @brief Clear the collected events after they were reported
+ *
+ * @param shaper Pointer to the shaper
+ */
+void shaper_clear(s_shaper *shaper)
+{
+	shaper->event_count = 0;
+}
@@ -0,0 +1,492 @@
+/**
+ * @file trace.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Record and replay of the sensor readings
+ *        AT+TRACE=1 records the INT1_SRC reads of get_acc_int() and the
+ *        FIFO batches of the moving state with their time into a binary
+ *        trace in flash:
+ *        'T' 'R' <version> <app> <power state>
+ *        then <tag> <ms since the previous record varint> <len> <data>...
+ *        AT+TRACE=2 plays the trace back. A timer raises ACC_TRIGGER at the
+ *        recorded times and the readings come from the trace instead of
+ *        the sensor, the application code is the same. At the end the
+ *        wakeups, uplinks, average current and loop latency of the replay
+ *        are reported, two firmware versions can be compared with the
+ *        same field data. AT+TRACE=3 prints the trace as +TRACE:DATA lines.
+ *        In the native environment program sim --trace replays a trace
+ *        from a file of the PC in virtual time, see native/main.cpp.
+ * @version 0.1
+ * @date 2021-07-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+#include <Adafruit_LittleFS.h>
+#include <InternalFileSystem.h>
+using namespace Adafruit_LittleFS_Namespace;
+
+/** Filename of the trace */
+static const char trace_name[] = "TRCE";
+
+/** Max size of the trace in flash */
+#ifndef TRACE_MAX_SIZE
+#define TRACE_MAX_SIZE 16384
+#endif
+/** Records are collected in RAM and written to flash in blocks */
+#define TRACE_BUFFER_SIZE 256
+/** Header of the trace */
+#define TRACE_HEADER_SIZE 5
+#define TRACE_VERSION 1
+#define TRACE_APP 0x01
+/** Time after the last record before the replay is reported, covers the shaper */
+#ifndef TRACE_END_DELAY
+#define TRACE_END_DELAY 30000
+#endif
+/** Bytes in a +TRACE:DATA line */
+#define TRACE_DUMP_LINE 32
+
+/** TRACE_OFF, TRACE_RECORD or TRACE_REPLAY */
+static uint8_t trace_mode = TRACE_OFF;
+/** File for the replay */
+static File trace_file(InternalFS);
+/** Records not yet written to flash */
+static uint8_t trace_buffer[TRACE_BUFFER_SIZE];
+static uint16_t trace_used = 0;
+/** Size of the trace including the buffer */
+static uint32_t trace_size = 0;
+/** Time of the last record */
+static uint32_t trace_last_ms = 0;
+/** Records recorded or replayed */
+static uint32_t trace_records = 0;
+/** Replayed readings the application did not ask for or asked with another tag */
+static uint32_t trace_mismatches = 0;
+
+/** Timer for the recorded times of the replay */
+SoftwareTimer trace_timer;
+/** Record that is due, waits for the application to read it */
+static uint8_t trace_data[TRACE_BUFFER_SIZE];
+static uint8_t trace_due_tag = 0;
+static uint8_t trace_due_len = 0;
+static bool trace_due = false;
+/** Header of the record after it */
+static uint8_t trace_next_tag = 0;
+static uint32_t trace_next_delta = 0;
+static uint8_t trace_next_len = 0;
+static bool trace_has_next = false;
+
+/** Counters at the start of the replay */
+static s_energy trace_energy;
+static uint64_t trace_start_ms = 0;
+/** Result of the last replay */
+static uint32_t trace_duration = 0;
+static uint32_t trace_wakeups = 0;
+static uint32_t trace_uplinks = 0;
+static uint32_t trace_avg_ua = 0;
+
+/** Buffer for one +TRACE:DATA line */
+static char trace_hex[TRACE_DUMP_LINE * 2 + 1];
+
+/**
+ * @brief Replay timer callback, handled by the loop
+ *
+ * @param unused
+ */
+static void trace_timer_cb(TimerHandle_t unused)
+{
+	g_task_event_type |= TRACE_EVENT;
+	xSemaphoreGive(g_task_sem);
+}
+
+/**
+ * @brief Initialize the replay timer
+ *
+ */
+void trace_init(void)
+{
+	trace_timer.begin(1000, trace_timer_cb, NULL, false);
+}
+
+/**
+ * @brief Check if a trace is recorded or replayed
+ *
+ * @return true Recording or replaying
+ */
+bool trace_active(void)
+{
+	return trace_mode != TRACE_OFF;
+}
+
+/**
+ * @brief Check if the readings come from the trace, the sensor interrupt is ignored then
+ *
+ * @return true Replaying
+ */
+bool trace_replaying(void)
+{
+	return trace_mode == TRACE_REPLAY;
+}
+
+/**
+ * @brief Write the buffered records to flash
+ *
+ */
+static void trace_flush(void)
+{
+	if (trace_used == 0)
+	{
+		return;
+	}
+	if (trace_file.open(trace_name, FILE_O_WRITE))
+	{
+		trace_file.write(trace_buffer, trace_used);
+		trace_file.close();
+	}
+	else
+	{
+		MYLOG("TRACE", "Can't open trace");
+	}
+	trace_used = 0;
+}
+
+/**
+ * @brief Add bytes to the buffer, the buffer is written to flash when it is full
+ *
+ * @param data Bytes to add
+ * @param len Number of bytes
+ */
+static void trace_append(const uint8_t *data, uint16_t len)
+{
+	if ((trace_used + len) > TRACE_BUFFER_SIZE)
+	{
+		trace_flush();
+	}
+	memcpy(&trace_buffer[trace_used], data, len);
+	trace_used += len;
+	trace_size += len;
+}
+
+/**
+ * @brief Record a reading of the sensor
+ *
+ * @param tag TRACE_ACC_INT or TRACE_ACC_FIFO
+ * @param data Value read from the sensor
+ * @param len Size of the value
+ */
+void trace_add(uint8_t tag, const uint8_t *data, uint8_t len)
+{
+	if (trace_mode != TRACE_RECORD)
+	{
+		return;
+	}
+	uint32_t now = millis();
+	uint8_t head[7];
+	uint8_t head_len = 0;
+	head[head_len++] = tag;
+	head_len += varint_put(&head[head_len], now - trace_last_ms);
+	head[head_len++] = len;
+	if ((trace_size + head_len + len) > TRACE_MAX_SIZE)
+	{
+		MYLOG("TRACE", "Trace full");
+		trace_stop();
+		return;
+	}
+	trace_append(head, head_len);
+	trace_append(data, len);
+	trace_last_ms = now;
+	trace_records++;
+}
+
+/**
+ * @brief Read the header of the next record from the trace
+ *
+ * @return true Header read into trace_next_tag, trace_next_delta and trace_next_len
+ * @return false End of the trace
+ */
+static bool trace_read_next(void)
+{
+	if (trace_file.read(&trace_next_tag, 1) != 1)
+	{
+		return false;
+	}
+	trace_next_delta = 0;
+	uint8_t value;
+	for (uint8_t shift = 0; shift < 35; shift += 7)
+	{
+		if (trace_file.read(&value, 1) != 1)
+		{
+			return false;
+		}
+		trace_next_delta |= (uint32_t)(value & 0x7F) << shift;
+		if ((value & 0x80) == 0)
+		{
+			break;
+		}
+	}
+	return trace_file.read(&trace_next_len, 1) == 1;
+}
+
+/**
+ * @brief Start to record, an old trace is deleted
+ *
+ * @return true Recording
+ */
+static bool trace_record_start(void)
+{
+	InternalFS.begin();
+	InternalFS.remove(trace_name);
+	trace_used = 0;
+	trace_size = 0;
+	trace_records = 0;
+	trace_mismatches = 0;
+	uint8_t header[TRACE_HEADER_SIZE] = {'T', 'R', TRACE_VERSION, TRACE_APP, acc_state};
+	trace_append(header, TRACE_HEADER_SIZE);
+	trace_last_ms = millis();
+	trace_mode = TRACE_RECORD;
+	MYLOG("TRACE", "Recording, power state %d", acc_state);
+	return true;
+}
+
+/**
+ * @brief Start to replay the trace from flash
+ *        The sensor starts in the recorded power state
+ *
+ * @return true Replaying
+ * @return false No trace or the trace is from another application
+ */
+static bool trace_replay_start(void)
+{
+	InternalFS.begin();
+	if (!trace_file.open(trace_name, FILE_O_READ))
+	{
+		MYLOG("TRACE", "No trace");
+		return false;
+	}
+	uint8_t header[TRACE_HEADER_SIZE];
+	if ((trace_file.read(header, TRACE_HEADER_SIZE) != TRACE_HEADER_SIZE) || (header[0] != 'T') || (header[1] != 'R') ||
+		(header[2] != TRACE_VERSION) || (header[3] != TRACE_APP) || (header[4] >= ACC_STATES) || !trace_read_next())
+	{
+		MYLOG("TRACE", "Trace invalid or empty");
+		trace_file.close();
+		return false;
+	}
+	trace_size = trace_file.size();
+	trace_records = 0;
+	trace_mismatches = 0;
+	trace_due = false;
+	trace_has_next = true;
+	acc_power_set(header[4]);
+
+	memcpy(&trace_energy, &energy, sizeof(s_energy));
+	trace_start_ms = energy_uptime_ms();
+	loop_clear();
+	trace_mode = TRACE_REPLAY;
+	MYLOG("TRACE", "Replay %ld bytes, power state %d", trace_size, header[4]);
+	trace_timer.setPeriod(trace_next_delta == 0 ? 1 : trace_next_delta);
+	trace_timer.start();
+	return true;
+}
+
+/**
+ * @brief Replay is over, keep and report the result
+ *        The sensor is set up again to clear its latched interrupt
+ *
+ */
+static void trace_replay_end(void)
+{
+	trace_timer.stop();
+	trace_file.close();
+	trace_mode = TRACE_OFF;
+	trace_duration = (uint32_t)(energy_uptime_ms() - trace_start_ms);
+	trace_wakeups = energy.wakeups - trace_energy.wakeups;
+	trace_uplinks = energy.uplinks - trace_energy.uplinks;
+	trace_avg_ua = energy_average_since(&trace_energy, trace_start_ms);
+	acc_power_set(acc_state);
+	trace_report();
+	loop_report();
+}
+
+/**
+ * @brief Start to record or to replay
+ *        Not while the raw data stream or the offload use the FIFO
+ *
+ * @param mode TRACE_RECORD or TRACE_REPLAY
+ * @return true Started
+ * @return false Busy or no trace to replay
+ */
+bool trace_start(uint8_t mode)
+{
+	if ((trace_mode != TRACE_OFF) || stream_active || bulk_active())
+	{
+		return false;
+	}
+	if (mode == TRACE_RECORD)
+	{
+		return trace_record_start();
+	}
+	return trace_replay_start();
+}
+
+/**
+ * @brief Stop to record or to replay
+ *
+ */
+void trace_stop(void)
+{
+	if (trace_mode == TRACE_RECORD)
+	{
+		trace_flush();
+		trace_mode = TRACE_OFF;
+		MYLOG("TRACE", "Recorded %ld records, %ld bytes", trace_records, trace_size);
+	}
+	else if (trace_mode == TRACE_REPLAY)
+	{
+		trace_replay_end();
+	}
+}
+
+/**
+ * @brief Make the next record due and raise ACC_TRIGGER like the sensor
+ *        interrupt, call on TRACE_EVENT before ACC_TRIGGER is handled
+ *
+ */
+void trace_event(void)
+{
+	if (trace_mode != TRACE_REPLAY)
+	{
+		return;
+	}
+	if (trace_due)
+	{
+		// The application did not read the last record
+		trace_mismatches++;
+		trace_due = false;
+	}
+	if (!trace_has_next || (trace_file.read(trace_data, trace_next_len) != trace_next_len))
+	{
+		trace_replay_end();
+		return;
+	}
+	trace_due_tag = trace_next_tag;
+	trace_due_len = trace_next_len;
+	trace_due = true;
+	trace_records++;
+
+	trace_has_next = trace_read_next();
+	trace_timer.setPeriod(!trace_has_next ? TRACE_END_DELAY : (trace_next_delta == 0 ? 1 : trace_next_delta));
+	trace_timer.start();
+
+	g_task_event_type |= ACC_TRIGGER;
+}
+
+/**
+ * @brief Get a reading from the trace instead of the sensor
+ *
+ * @param tag TRACE_ACC_INT or TRACE_ACC_FIFO
+ * @param data Buffer for the value
+ * @param max_len Size of the buffer
+ * @return int16_t Size of the value, 0 if the due record has another tag, -1 if not replaying
+ */
+int16_t trace_take(uint8_t tag, uint8_t *data, uint8_t max_len)
+{
+	if (trace_mode != TRACE_REPLAY)
+	{
+		return -1;
+	}
+	if (!trace_due || (trace_due_tag != tag))
+	{
+		// The application takes another path than the recorded firmware
+		trace_mismatches++;
+		trace_due = false;
+		return 0;
+	}
+	trace_due = false;
+	uint8_t len = trace_due_len > max_len ? max_len : trace_due_len;
+	memcpy(data, trace_data, len);
+	return len;
+}
+
+/**
+ * @brief Print the trace as +TRACE:DATA,<offset>,<hex> lines, also over BLE UART if connected
+ *
+ */
+static void trace_dump(void)
+{
+	InternalFS.begin();
+	if (!trace_file.open(trace_name, FILE_O_READ))
+	{
+		return;
+	}
+	uint8_t line[TRACE_DUMP_LINE];
+	uint32_t offset = 0;
+	int len;
+	while ((len = trace_file.read(line, TRACE_DUMP_LINE)) > 0)
+	{
+		for (int idx = 0; idx < len; idx++)
+		{
+			sprintf(&trace_hex[idx * 2], "%02X", line[idx]);
+		}
+		trace_hex[len * 2] = 0;
+		AT_PRINTF("+TRACE:DATA,%ld,%s", offset, trace_hex);
+		if (g_ble_uart_is_connected)
+		{
+			g_ble_uart.printf("+TRACE:DATA,%ld,%s\n", offset, trace_hex);
+		}
+		offset += len;
+	}
+	trace_file.close();
+}
+
+/**
+ * @brief Report the trace and the last replay to the log and, if connected, to BLE UART
+ *
+ */
+void trace_report(void)
+{
+	MYLOG("TRACE", "Mode %d, %ld bytes, %ld records, %ld mismatches", trace_mode, trace_size, trace_records, trace_mismatches);
+	MYLOG("TRACE", "Replay %ld s, %ld wakeups, %ld uplinks, average %ld uA", trace_duration / 1000, trace_wakeups, trace_uplinks, trace_avg_ua);
+	if (g_ble_uart_is_connected)
+	{
+		g_ble_uart.printf("TRACE mode %d %ld bytes %ld records %ld mismatches\n", trace_mode, trace_size, trace_records, trace_mismatches);
+		g_ble_uart.printf("Replay %ld s %ld wakeups %ld uplinks %ld uA\n", trace_duration / 1000, trace_wakeups, trace_uplinks, trace_avg_ua);
+	}
+}
+
+/**
+ * @brief AT+TRACE=1 records, AT+TRACE=2 replays, AT+TRACE=3 prints the trace, AT+TRACE=0 stops
+ *        AT+TRACE=? prints mode, bytes, records, mismatches and of the last
+ *        replay the duration in s, wakeups, uplinks and average current in uA
+ *
+ * @param read true for AT+TRACE=?
+ * @param args Value for AT+TRACE=<value>
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_trace(bool read, uint32_t *args)
+{
+	if (read)
+	{
+		AT_PRINTF("+TRACE:%d,%ld,%ld,%ld,%ld,%ld,%ld,%ld", trace_mode, trace_size, trace_records, trace_mismatches,
+				  trace_duration / 1000, trace_wakeups, trace_uplinks, trace_avg_ua);
+		return 0;
+	}
+	switch (args[0])
+	{
+	case TRACE_OFF:
+		trace_stop();
+		return 0;
+	case TRACE_RECORD:
+	case TRACE_REPLAY:
+		return trace_start(args[0]) ? 0 : AT_ERR_GENERIC;
+	case TRACE_DUMP:
+		if (trace_mode != TRACE_OFF)
+		{
+			return AT_ERR_GENERIC;
+		}
+		trace_dump();
+		return 0;
+	default:
+		return AT_ERR_PARAM;
+	}
+}
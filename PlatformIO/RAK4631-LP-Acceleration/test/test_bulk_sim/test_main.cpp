@@ -0,0 +1,123 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Loss recovery of the bulk transfer over the simulated LoRa P2P link
+ *        Run with pio test -e native
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <unity.h>
+#include "bulk_sim.h"
+
+/** Size of the capture buffer of the offload */
+#define TEST_SIZE 12288
+/** Frame size of the offload */
+#define TEST_FRAME 240
+/** Runs with different loss patterns per loss rate */
+#define TEST_SEEDS 8
+
+static uint8_t test_data[TEST_SIZE];
+static uint8_t test_out[TEST_SIZE];
+static s_bulk test_tx;
+static s_bulk test_rx;
+static s_bulk_sim_result test_result;
+
+void setUp(void)
+{
+	uint32_t lcg = 4711;
+	for (uint32_t idx = 0; idx < TEST_SIZE; idx++)
+	{
+		lcg = lcg * 1103515245 + 12345;
+		test_data[idx] = (uint8_t)(lcg >> 16);
+	}
+	memset(test_out, 0, sizeof(test_out));
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * @brief Run the transfer with a loss rate and several seeds
+ *        The data must arrive unchanged and the lost frames must be repeated
+ *
+ * @param loss Lost frames in %
+ */
+static void test_loss(uint8_t loss)
+{
+	for (uint32_t seed = 1; seed <= TEST_SEEDS; seed++)
+	{
+		memset(test_out, 0, sizeof(test_out));
+		bool done = bulk_sim_run(test_data, TEST_SIZE, test_out, TEST_FRAME, loss, seed, &test_tx, &test_rx, &test_result);
+		TEST_ASSERT_TRUE_MESSAGE(done, "transfer did not finish");
+		TEST_ASSERT_TRUE_MESSAGE(test_result.ok, "data not complete");
+		TEST_ASSERT_EQUAL_MEMORY(test_data, test_out, TEST_SIZE);
+		TEST_ASSERT_EQUAL(BULK_DONE, test_tx.state);
+		if (loss == 0)
+		{
+			TEST_ASSERT_EQUAL(0, test_result.lost);
+			TEST_ASSERT_EQUAL(0, test_tx.retransmits);
+		}
+		else
+		{
+			TEST_ASSERT_GREATER_THAN(0, test_result.lost);
+		}
+	}
+}
+
+static void test_loss_0(void)
+{
+	test_loss(0);
+}
+
+static void test_loss_10(void)
+{
+	test_loss(10);
+}
+
+static void test_loss_20(void)
+{
+	test_loss(20);
+}
+
+static void test_loss_30(void)
+{
+	test_loss(30);
+}
+
+static void test_loss_40(void)
+{
+	test_loss(40);
+}
+
+/**
+ * @brief More loss takes more time
+ *
+ */
+static void test_loss_time(void)
+{
+	uint32_t last_ms = 0;
+	for (uint8_t loss = 0; loss <= 40; loss += 20)
+	{
+		bulk_sim_run(test_data, TEST_SIZE, test_out, TEST_FRAME, loss, 1, &test_tx, &test_rx, &test_result);
+		TEST_ASSERT_TRUE(test_result.ok);
+		TEST_ASSERT_GREATER_THAN(last_ms, test_result.time_ms);
+		last_ms = test_result.time_ms;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_loss_0);
+	RUN_TEST(test_loss_10);
+	RUN_TEST(test_loss_20);
+	RUN_TEST(test_loss_30);
+	RUN_TEST(test_loss_40);
+	RUN_TEST(test_loss_time);
+	return UNITY_END();
+}
@@ -0,0 +1,200 @@
+"""
+Decoder for the compressed accelerometer stream of RAK4631-LP-Acceleration
+
+Same algorithm as src/acc_codec.cpp. The encoder is included to check the
+compression of a recorded trace.
+
+Usage:
+    python acc_codec.py <trace.csv> [max error]
+
+The trace is a CSV file written by stream_reader.py. It is encoded in
+packets of the max BLE notification size, decoded again and the
+compression ratio and the max error are printed.
+"""
+
+import sys
+
+AXES = 3
+QMAX = 16
+ESC_BITS = 17
+KMAX = 16
+NMAX = 32
+ERR_SHIFT = 3
+
+
+def clamp(value):
+    return max(-32768, min(32767, value))
+
+
+class _State:
+    def __init__(self, near):
+        self.near = near
+        self.step = 2 * near + 1
+        self.last = [0] * AXES
+        self.prev = [0] * AXES
+        self.err1 = [0] * AXES
+        self.err2 = [0] * AXES
+        self.sum = [4] * AXES
+        self.num = [1] * AXES
+
+    def predict(self, axis):
+        pred1 = self.last[axis]
+        pred2 = clamp(2 * self.last[axis] - self.prev[axis])
+        return pred2 if self.err2[axis] < self.err1[axis] else pred1
+
+    def rice_k(self, axis):
+        k = 0
+        while k < KMAX and (self.num[axis] << k) < self.sum[axis]:
+            k += 1
+        return k
+
+    def update(self, axis, recon, code):
+        err1 = abs(recon - self.last[axis])
+        err2 = abs(recon - clamp(2 * self.last[axis] - self.prev[axis]))
+        self.err1[axis] += err1 - (self.err1[axis] >> ERR_SHIFT)
+        self.err2[axis] += err2 - (self.err2[axis] >> ERR_SHIFT)
+        self.sum[axis] += code
+        self.num[axis] += 1
+        if self.num[axis] >= NMAX:
+            self.sum[axis] >>= 1
+            self.num[axis] >>= 1
+        self.prev[axis] = self.last[axis]
+        self.last[axis] = recon
+
+
+class _BitReader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def bit(self):
+        value = (self.data[self.pos >> 3] >> (7 - (self.pos & 7))) & 1
+        self.pos += 1
+        return value
+
+    def bits(self, count):
+        value = 0
+        for _ in range(count):
+            value = (value << 1) | self.bit()
+        return value
+
+
+class _BitWriter:
+    def __init__(self):
+        self.bits = []
+
+    def put(self, value, count):
+        for idx in range(count - 1, -1, -1):
+            self.bits.append((value >> idx) & 1)
+
+    def data(self):
+        padded = self.bits + [0] * (-len(self.bits) % 8)
+        return bytes(int("".join(map(str, padded[idx:idx + 8])), 2) for idx in range(0, len(padded), 8))
+
+
+def decode(data, count, near):
+    """Decode count samples from a coded buffer"""
+    state = _State(near)
+    reader = _BitReader(data)
+    samples = []
+    for idx in range(count):
+        sample = []
+        for axis in range(AXES):
+            if idx == 0:
+                value = reader.bits(16)
+                value = value - 0x10000 if value & 0x8000 else value
+                state.last[axis] = value
+                state.prev[axis] = value
+                sample.append(value)
+                continue
+            q = 0
+            while q < QMAX and reader.bit():
+                q += 1
+            k = state.rice_k(axis)
+            if q < QMAX:
+                code = (q << k) | reader.bits(k)
+            else:
+                code = reader.bits(ESC_BITS)
+            residual = (code >> 1) ^ -(code & 1)
+            recon = clamp(state.predict(axis) + residual * state.step)
+            state.update(axis, recon, code)
+            sample.append(recon)
+        samples.append(tuple(sample))
+    return samples
+
+
+def encode(samples, size, near):
+    """Encode samples into a buffer of size bytes, returns the data and the number of samples"""
+    state = _State(near)
+    writer = _BitWriter()
+    count = 0
+    for sample in samples:
+        if count == 0:
+            if 16 * AXES > size * 8:
+                break
+            for axis in range(AXES):
+                writer.put(sample[axis] & 0xFFFF, 16)
+                state.last[axis] = sample[axis]
+                state.prev[axis] = sample[axis]
+            count += 1
+            continue
+        codes = []
+        length = 0
+        for axis in range(AXES):
+            pred = state.predict(axis)
+            residual = sample[axis] - pred
+            if near:
+                residual = (residual + near) // state.step if residual >= 0 else -((near - residual) // state.step)
+            recon = clamp(pred + residual * state.step)
+            code = residual << 1 if residual >= 0 else ((-residual) << 1) - 1
+            k = state.rice_k(axis)
+            q = code >> k
+            length += q + 1 + k if q < QMAX else QMAX + ESC_BITS
+            codes.append((recon, code, k, q))
+        if len(writer.bits) + length > size * 8:
+            break
+        for axis, (recon, code, k, q) in enumerate(codes):
+            if q < QMAX:
+                writer.put(((1 << q) - 1) << 1, q + 1)
+                writer.put(code & ((1 << k) - 1), k)
+            else:
+                writer.put((1 << QMAX) - 1, QMAX)
+                writer.put(code, ESC_BITS)
+            state.update(axis, recon, code)
+        count += 1
+    return writer.data(), count
+
+
+def main(trace, near):
+    samples = []
+    with open(trace) as csv:
+        next(csv)
+        for line in csv:
+            samples.append(tuple(int(value) for value in line.split(",")[1:4]))
+
+    # Values are left justified, the node codes them without the unused low bits
+    shift = 0
+    while shift < 8 and all(value % (1 << (shift + 1)) == 0 for sample in samples for value in sample):
+        shift += 1
+    values = [tuple(value >> shift for value in sample) for sample in samples]
+    raw_size = len(samples) * (3 if shift == 8 else 6)
+
+    # Max notification 244 bytes, 5 bytes header and 1 byte codec setup
+    coded_size = 0
+    max_error = 0
+    pos = 0
+    while pos < len(values):
+        data, count = encode(values[pos:], 244 - 6, near)
+        decoded = decode(data, count, near)
+        for original, result in zip(values[pos:pos + count], decoded):
+            max_error = max(max_error, max(abs(a - b) for a, b in zip(original, result)))
+        coded_size += len(data) + 6
+        pos += count
+    print("%d samples, raw %d bytes, coded %d bytes with headers, ratio %.2f, max error %d" % (len(samples), raw_size, coded_size, raw_size / coded_size, max_error))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) not in (2, 3):
+        print(__doc__)
+        sys.exit(1)
+    main(sys.argv[1], int(sys.argv[2]) if len(sys.argv) == 3 else 0)
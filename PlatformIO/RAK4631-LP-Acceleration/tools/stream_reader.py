@@ -0,0 +1,97 @@
+"""
+Host side reader for the raw accelerometer stream of RAK4631-LP-Acceleration
+
+Connects to the BLE UART service, starts the stream, rebuilds the sample
+sequence from the notifications and writes it as CSV.
+
+Usage:
+    pip install bleak
+    python stream_reader.py <BLE address> <rate 400|1344|1600> <seconds> <output.csv> [max error]
+
+With a max error the node compresses the samples, 0 is lossless.
+"""
+
+import asyncio
+import struct
+import sys
+
+from bleak import BleakClient
+
+import acc_codec
+
+UART_RX = "6e400002-b5a3-f393-e0a9-e50e24dcca9e"  # Write to the node
+UART_TX = "6e400003-b5a3-f393-e0a9-e50e24dcca9e"  # Notifications from the node
+
+STREAM_MARKER = 0xA5
+FLAG_8BIT = 0x01
+FLAG_GAP = 0x02
+FLAG_CODEC = 0x04
+
+
+class StreamDecoder:
+    def __init__(self):
+        self.samples = []
+        self.next_seq = None
+        self.lost_packets = 0
+        self.gaps = 0
+        self.packets = 0
+        self.bytes = 0
+
+    def feed(self, data):
+        if len(data) < 5 or data[0] != STREAM_MARKER:
+            # Text output of the node, e.g. the statistics
+            print(data.decode(errors="replace"), end="")
+            return
+        seq, count, flags = struct.unpack_from("<HBB", data, 1)
+        if self.next_seq is not None and seq != self.next_seq:
+            self.lost_packets += (seq - self.next_seq) & 0xFFFF
+        self.next_seq = (seq + 1) & 0xFFFF
+        if flags & FLAG_GAP:
+            self.gaps += 1
+        self.packets += 1
+        self.bytes += len(data)
+
+        payload = data[5:]
+        if flags & FLAG_CODEC:
+            # Values without the unused low bits, scale back to 16 bit left justified
+            shift = payload[0] >> 4
+            for sample in acc_codec.decode(payload[1:], count, payload[0] & 0x0F):
+                self.samples.append((seq,) + tuple(value << shift for value in sample))
+        elif flags & FLAG_8BIT:
+            for idx in range(count):
+                x, y, z = struct.unpack_from("<bbb", payload, idx * 3)
+                # Scale to the 16 bit left justified format of the normal mode
+                self.samples.append((seq, x * 256, y * 256, z * 256))
+        else:
+            for idx in range(count):
+                self.samples.append((seq,) + struct.unpack_from("<hhh", payload, idx * 6))
+
+
+async def main(address, rate, duration, out_file, near):
+    decoder = StreamDecoder()
+    async with BleakClient(address) as client:
+        print("MTU", client.mtu_size)
+        await client.start_notify(UART_TX, lambda _, data: decoder.feed(bytes(data)))
+        if near is None:
+            await client.write_gatt_char(UART_RX, b"STREAM=%d\n" % rate)
+        else:
+            await client.write_gatt_char(UART_RX, b"STREAM=%d,%d\n" % (rate, near))
+        await asyncio.sleep(duration)
+        await client.write_gatt_char(UART_RX, b"STREAM=0\n")
+        await asyncio.sleep(1)
+        await client.stop_notify(UART_TX)
+
+    with open(out_file, "w") as csv:
+        csv.write("seq,x,y,z\n")
+        for sample in decoder.samples:
+            csv.write("%d,%d,%d,%d\n" % sample)
+
+    print("%d samples, %d packets, %d bytes, %.0f B/s" % (len(decoder.samples), decoder.packets, decoder.bytes, decoder.bytes / duration))
+    print("%d packets lost on the link, %d gaps reported by the node" % (decoder.lost_packets, decoder.gaps))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) not in (5, 6):
+        print(__doc__)
+        sys.exit(1)
+    asyncio.run(main(sys.argv[1], int(sys.argv[2]), float(sys.argv[3]), sys.argv[4], int(sys.argv[5]) if len(sys.argv) == 6 else None))
@@ -0,0 +1,55 @@
+/**
+ * @file Adafruit_BME680.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host replacement of the Adafruit BME680 library,
+ *        the readings are simulated in bme680_sim.cpp
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef ADAFRUIT_BME680_H
+#define ADAFRUIT_BME680_H
+
+#include <Arduino.h>
+
+#define BME680_OS_NONE 0
+#define BME680_OS_1X 1
+#define BME680_OS_2X 2
+#define BME680_OS_4X 3
+#define BME680_OS_8X 4
+#define BME680_OS_16X 5
+
+#define BME680_FILTER_SIZE_0 0
+#define BME680_FILTER_SIZE_1 1
+#define BME680_FILTER_SIZE_3 2
+#define BME680_FILTER_SIZE_7 3
+#define BME680_FILTER_SIZE_15 4
+#define BME680_FILTER_SIZE_31 5
+#define BME680_FILTER_SIZE_63 6
+#define BME680_FILTER_SIZE_127 7
+
+class Adafruit_BME680
+{
+public:
+	bool begin(uint8_t addr = 0x77, bool initSettings = true);
+	bool performReading(void);
+	bool setTemperatureOversampling(uint8_t os);
+	bool setPressureOversampling(uint8_t os);
+	bool setHumidityOversampling(uint8_t os);
+	bool setIIRFilterSize(uint8_t fs);
+	bool setGasHeater(uint16_t heaterTemp, uint16_t heaterTime);
+
+	float temperature = 0;
+	uint32_t pressure = 0;
+	float humidity = 0;
+	uint32_t gas_resistance = 0;
+
+private:
+	uint16_t _heater_temp = 0;
+	uint16_t _heater_time = 0;
+};
+
+#endif
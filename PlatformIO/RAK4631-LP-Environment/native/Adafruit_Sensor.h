@@ -0,0 +1,18 @@
+/**
+ * @file Adafruit_Sensor.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host replacement of the Adafruit unified sensor library,
+ *        nothing of it is used by the application
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef ADAFRUIT_SENSOR_H
+#define ADAFRUIT_SENSOR_H
+
+#include <Arduino.h>
+
+#endif
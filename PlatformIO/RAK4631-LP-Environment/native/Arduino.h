@@ -0,0 +1,225 @@
+/**
+ * @file Arduino.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host replacement of the Arduino core of the RAK4631 for the
+ *        native environment. Time is virtual, see sim.cpp. The FreeRTOS
+ *        semaphores and the software timers of the nRF52 core are part
+ *        of the Arduino.h of the core, so they are declared here too.
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+/** WisBlock IO pins of the RAK4631 */
+#define WB_IO1 17
+#define WB_IO2 34
+#define WB_IO3 21
+#define WB_IO4 4
+#define WB_IO5 9
+#define WB_IO6 10
+#define LED_GREEN 35
+#define LED_BLUE 36
+
+/** Number of pins with an interrupt in the simulation */
+#define NATIVE_PINS 48
+
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+long random(long max);
+long random(long min, long max);
+void randomSeed(uint32_t seed);
+void pinMode(uint32_t pin, uint32_t mode);
+void digitalWrite(uint32_t pin, uint32_t value);
+int digitalRead(uint32_t pin);
+void attachInterrupt(uint32_t pin, void (*callback)(void), uint32_t mode);
+void detachInterrupt(uint32_t pin);
+
+/** Reset reason of the nRF52 */
+#define POWER_RESETREAS_DOG_Msk (0x1UL << 1)
+uint32_t readResetReason(void);
+
+/**
+ * @brief vsnprintf() with the 32 bit long of the device
+ *        The code prints uint32_t with %ld, on the host the l is dropped
+ *
+ */
+int native_vsnprintf(char *buffer, size_t size, const char *format, va_list args);
+int native_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+/** Memory barriers of the Cortex M4 */
+#define __DMB() __sync_synchronize()
+#define __DSB() __sync_synchronize()
+
+/**
+ * @brief Output of the Arduino Print class, formatted output ends in write()
+ *
+ */
+class Print
+{
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buffer, size_t size)
+	{
+		for (size_t idx = 0; idx < size; idx++)
+		{
+			write(buffer[idx]);
+		}
+		return size;
+	}
+	size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+	int printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+	{
+		char line[256];
+		va_list args;
+		va_start(args, format);
+		int len = native_vsnprintf(line, sizeof(line), format, args);
+		va_end(args);
+		if (len > (int)sizeof(line) - 1)
+		{
+			len = sizeof(line) - 1;
+		}
+		write((const uint8_t *)line, len);
+		return len;
+	}
+	size_t print(const char *str) { return write(str); }
+	size_t print(long value) { return printf("%ld", value); }
+	size_t println(void) { return write((const uint8_t *)"\r\n", 2); }
+	size_t println(const char *str) { return print(str) + println(); }
+	size_t println(long value) { return print(value) + println(); }
+};
+
+/**
+ * @brief Input of the Arduino Stream class
+ *
+ */
+class Stream : public Print
+{
+public:
+	virtual int available(void) { return 0; }
+	virtual int read(void) { return -1; }
+	size_t readBytesUntil(char terminator, char *buffer, size_t length)
+	{
+		size_t idx = 0;
+		while (idx < length)
+		{
+			int c = read();
+			if ((c < 0) || (c == terminator))
+			{
+				break;
+			}
+			buffer[idx++] = (char)c;
+		}
+		return idx;
+	}
+	size_t readBytes(uint8_t *buffer, size_t length) { return readBytesUntil(-1, (char *)buffer, length); }
+};
+
+/**
+ * @brief USB serial, the lines go to native_serial_line
+ *
+ */
+class Uart : public Stream
+{
+public:
+	void begin(uint32_t baud) { (void)baud; }
+	operator bool() { return true; }
+	size_t write(uint8_t c);
+	using Print::write;
+
+private:
+	char _line[256];
+	size_t _len = 0;
+};
+extern Uart Serial;
+
+/** Handler for complete lines of the serial output, prints to stdout if NULL */
+extern void (*native_serial_line)(const char *line);
+
+/** FreeRTOS of the nRF52 core, one task, ticks are 1/1024 s */
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define portMAX_DELAY 0xFFFFFFFFUL
+#define configTICK_RATE_HZ 1024
+#define configUSE_TRACE_FACILITY 0
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+
+struct s_native_sem;
+typedef s_native_sem *SemaphoreHandle_t;
+struct s_native_timer;
+typedef s_native_timer *TimerHandle_t;
+typedef void *TaskHandle_t;
+typedef uint32_t StackType_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t xTimer);
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+void *pvTimerGetTimerID(TimerHandle_t timer);
+const char *pcTaskGetName(TaskHandle_t task);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+#define portYIELD_FROM_ISR(x) (void)(x)
+#define taskENTER_CRITICAL()
+#define taskEXIT_CRITICAL()
+
+/**
+ * @brief Software timer of the nRF52 core
+ *        setPeriod() starts the timer like xTimerChangePeriod()
+ *
+ */
+class SoftwareTimer
+{
+public:
+	SoftwareTimer() : _handle(NULL) {}
+	void begin(uint32_t ms, TimerCallbackFunction_t callback, void *timerID = NULL, bool repeating = true);
+	TimerHandle_t getHandle(void) { return _handle; }
+	void setID(void *id);
+	void *getID(void);
+	bool start(void);
+	bool stop(void);
+	bool reset(void) { return start(); }
+	bool setPeriod(uint32_t ms);
+	bool startFromISR(void) { return start(); }
+	bool stopFromISR(void) { return stop(); }
+
+private:
+	TimerHandle_t _handle;
+};
+
+#endif
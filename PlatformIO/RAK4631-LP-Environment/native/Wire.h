@@ -0,0 +1,26 @@
+/**
+ * @file Wire.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host replacement of the I2C bus, the sensors are simulated
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <Arduino.h>
+
+class TwoWire
+{
+public:
+	void begin(void) {}
+	void end(void) {}
+	void setClock(uint32_t clock) { (void)clock; }
+};
+extern TwoWire Wire;
+
+#endif
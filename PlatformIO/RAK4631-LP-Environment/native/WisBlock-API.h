@@ -0,0 +1,321 @@
+/**
+ * @file WisBlock-API.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host replacement of the parts of the WisBlock-API, the LoRaWAN
+ *        stack and the Bluefruit library that the application uses.
+ *        The LoRaWAN and BLE side is simulated in sim.cpp.
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef WISBLOCK_API_H
+#define WISBLOCK_API_H
+
+#include <Arduino.h>
+
+#if MY_DEBUG > 0
+#define MYLOG(tag, ...)                  \
+	do                                   \
+	{                                    \
+		if (tag)                         \
+			printf("[%s] ", tag);        \
+		native_printf(__VA_ARGS__);      \
+		printf("\n");                    \
+	} while (0)
+#else
+#define MYLOG(...)
+#endif
+
+/** AT command replies, the API adds the line end */
+#define AT_PRINTF(...)                       \
+	do                                       \
+	{                                        \
+		Serial.printf(__VA_ARGS__);          \
+		Serial.printf("\r\n");               \
+		if (g_ble_uart_is_connected)         \
+		{                                    \
+			g_ble_uart.printf(__VA_ARGS__);  \
+			g_ble_uart.printf("\n");         \
+		}                                    \
+	} while (0)
+
+/** Events of the API */
+#define NO_EVENT 0
+#define STATUS 0b0000000000000001
+#define N_STATUS 0b1111111111111110
+#define BLE_CONFIG 0b0000000000000010
+#define N_BLE_CONFIG 0b1111111111111101
+#define BLE_DATA 0b0000000000000100
+#define N_BLE_DATA 0b1111111111111011
+#define LORA_DATA 0b0000000000001000
+#define N_LORA_DATA 0b1111111111110111
+#define LORA_TX_FIN 0b0000000000010000
+#define N_LORA_TX_FIN 0b1111111111101111
+#define AT_CMD 0b0000000000100000
+#define N_AT_CMD 0b1111111111011111
+#define LORA_JOIN_FIN 0b0000000001000000
+#define N_LORA_JOIN_FIN 0b1111111110111111
+
+/** LoRaWAN regions of the SX126x-Arduino library */
+#define LORA_BAND_AS923_1 0
+#define LORA_BAND_AU915 1
+#define LORA_BAND_CN470 2
+#define LORA_BAND_CN779 3
+#define LORA_BAND_EU433 4
+#define LORA_BAND_EU868 5
+#define LORA_BAND_IN865 6
+#define LORA_BAND_KR920 7
+#define LORA_BAND_US915 8
+#define LORA_BAND_AS923_2 9
+#define LORA_BAND_AS923_3 10
+#define LORA_BAND_AS923_4 11
+#define LORA_BAND_RU864 12
+
+typedef enum
+{
+	LMH_SUCCESS = 0,
+	LMH_BUSY = -1,
+	LMH_ERROR = -2,
+} lmh_error_status;
+
+typedef enum
+{
+	LMH_UNCONFIRMED_MSG = 0,
+	LMH_CONFIRMED_MSG = 1,
+} lmh_confirm;
+
+typedef enum
+{
+	LMH_RESET = 0,
+	LMH_SET = 1,
+} lmh_join_status;
+
+typedef struct
+{
+	uint8_t *buffer;
+	uint8_t buffsize;
+	uint8_t port;
+	int16_t rssi;
+	int8_t snr;
+} lmh_app_data_t;
+
+lmh_error_status lmh_send(lmh_app_data_t *app_data, lmh_confirm is_tx_confirmed);
+lmh_join_status lmh_join_status_get(void);
+lmh_error_status lmh_datarate_set(uint8_t data_rate, bool enable_adr);
+lmh_error_status lmh_tx_power_set(uint8_t tx_power);
+void lmh_join(void);
+
+lmh_error_status send_lora_packet(uint8_t *data, uint8_t size);
+
+/** MAC information base of the LoRaMac */
+typedef enum
+{
+	LORAMAC_STATUS_OK = 0,
+	LORAMAC_STATUS_BUSY,
+	LORAMAC_STATUS_SERVICE_UNKNOWN,
+} LoRaMacStatus_t;
+
+typedef enum
+{
+	MIB_CHANNELS_DATARATE = 19,
+} Mib_t;
+
+typedef union
+{
+	int8_t ChannelsDatarate;
+} MibParam_t;
+
+typedef struct
+{
+	Mib_t Type;
+	MibParam_t Param;
+} MibRequestConfirm_t;
+
+LoRaMacStatus_t LoRaMacMibGetRequestConfirm(MibRequestConfirm_t *mibGet);
+
+/** Settings of the API, same layout as the flash file of the API */
+struct s_lorawan_settings
+{
+	uint8_t valid_mark_1 = 0xAA;
+	uint8_t valid_mark_2 = 0x57;
+	uint8_t node_device_eui[8] = {0x00, 0x0D, 0x75, 0xE6, 0x56, 0x4D, 0xC1, 0xF3};
+	uint8_t node_app_eui[8] = {0x70, 0xB3, 0xD5, 0x7E, 0xD0, 0x02, 0x01, 0xE1};
+	uint8_t node_app_key[16] = {0};
+	uint32_t node_dev_addr = 0x26021FB4;
+	uint8_t node_nws_key[16] = {0};
+	uint8_t node_apps_key[16] = {0};
+	bool otaa_enabled = true;
+	bool adr_enabled = false;
+	bool public_network = true;
+	bool duty_cycle_enabled = false;
+	uint32_t send_repeat_time = 0;
+	uint8_t join_trials = 5;
+	uint8_t tx_power = 0;
+	uint8_t data_rate = 3;
+	uint8_t lora_class = 0;
+	uint8_t subband_channels = 1;
+	bool auto_join = true;
+	uint8_t app_port = 2;
+	lmh_confirm confirmed_msg_enabled = LMH_UNCONFIRMED_MSG;
+	bool resetRequest = true;
+	uint8_t lora_region = LORA_BAND_EU868;
+	bool lorawan_enable = true;
+	uint32_t p2p_frequency = 868000000;
+	uint8_t p2p_tx_power = 22;
+	uint8_t p2p_bandwidth = 0;
+	uint8_t p2p_sf = 7;
+	uint8_t p2p_cr = 1;
+	uint8_t p2p_preamble_len = 8;
+	uint16_t p2p_symbol_timeout = 0;
+};
+
+/** BLE events of the SoftDevice used by the application */
+#define BLE_GATTC_EVT_EXCHANGE_MTU_RSP 0x3A
+#define BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST 0x55
+#define BANDWIDTH_MAX 3
+
+typedef struct
+{
+	struct
+	{
+		uint16_t evt_id;
+		uint16_t evt_len;
+	} header;
+	union
+	{
+		struct
+		{
+			uint16_t conn_handle;
+			union
+			{
+				struct
+				{
+					uint16_t server_rx_mtu;
+				} exchange_mtu_rsp;
+			} params;
+		} gattc_evt;
+		struct
+		{
+			uint16_t conn_handle;
+			union
+			{
+				struct
+				{
+					uint16_t client_rx_mtu;
+				} exchange_mtu_request;
+			} params;
+		} gatts_evt;
+	} evt;
+} ble_evt_t;
+
+class BLEConnection
+{
+public:
+	uint16_t getMtu(void) { return 23; }
+	bool requestMtuExchange(uint16_t mtu)
+	{
+		(void)mtu;
+		return true;
+	}
+	bool requestDataLengthUpdate(void) { return true; }
+	bool requestPHY(void) { return true; }
+};
+
+class BLEAdvertising
+{
+public:
+	bool isRunning(void);
+	bool stop(void);
+	void setInterval(uint16_t fast, uint16_t slow)
+	{
+		(void)fast;
+		(void)slow;
+	}
+};
+
+class BLEPeriph
+{
+public:
+	void setConnectCallback(void (*callback)(uint16_t conn_handle)) { _connect_cb = callback; }
+	void (*_connect_cb)(uint16_t conn_handle) = NULL;
+};
+
+class AdafruitBluefruit
+{
+public:
+	BLEAdvertising Advertising;
+	BLEPeriph Periph;
+	void configPrphBandwidth(uint8_t bw) { (void)bw; }
+	bool setTxPower(int8_t power)
+	{
+		(void)power;
+		return true;
+	}
+	void setEventCallback(void (*callback)(ble_evt_t *evt)) { (void)callback; }
+	uint8_t connected(void) { return 0; }
+	uint16_t connHandle(void) { return 0xFFFF; }
+	BLEConnection *Connection(uint16_t conn_handle)
+	{
+		(void)conn_handle;
+		return NULL;
+	}
+};
+extern AdafruitBluefruit Bluefruit;
+
+/**
+ * @brief BLE UART, output is dropped, there is no central in the simulation
+ *
+ */
+class BLEUart : public Stream
+{
+public:
+	size_t write(uint8_t c)
+	{
+		(void)c;
+		return 1;
+	}
+	size_t write(const uint8_t *buffer, size_t size)
+	{
+		(void)buffer;
+		return size;
+	}
+	using Print::write;
+	bool bufferTXD(bool enable)
+	{
+		_tx_buffered = enable;
+		return true;
+	}
+
+protected:
+	bool _tx_buffered = false;
+};
+
+/** Globals of the API */
+extern volatile uint16_t g_task_event_type;
+extern SemaphoreHandle_t g_task_sem;
+extern SoftwareTimer g_task_wakeup_timer;
+extern s_lorawan_settings g_lorawan_settings;
+extern BLEUart g_ble_uart;
+extern bool g_ble_uart_is_connected;
+extern bool g_enable_ble;
+extern char g_ble_dev_name[];
+extern uint8_t g_rx_lora_data[];
+extern uint8_t g_rx_data_len;
+extern int16_t g_last_rssi;
+extern int8_t g_last_snr;
+extern uint8_t g_last_fport;
+extern bool g_rx_fin_result;
+extern bool g_join_result;
+extern bool g_lpwan_has_joined;
+
+/** Functions of the API */
+void init_ble(void);
+void restart_advertising(uint16_t timeout);
+bool save_settings(void);
+void sd_nvic_SystemReset(void);
+uint32_t sd_softdevice_disable(void);
+
+#endif
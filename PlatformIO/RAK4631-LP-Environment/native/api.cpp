@@ -0,0 +1,99 @@
+/**
+ * @file api.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief setup() and the loop task of the WisBlock-API for the native environment
+ *        Same order as the API: setup_app(), BLE, LoRaWAN join and the
+ *        wakeup timer, init_app(). The loop waits for g_task_sem and calls
+ *        the handlers of the application until all event bits are cleared.
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+#include "sim.h"
+
+uint32_t api_wakeups = 0;
+uint32_t api_unhandled = 0;
+
+/**
+ * @brief Timer callback of the send interval, raises the STATUS event
+ *
+ * @param unused
+ */
+static void api_periodic_wakeup(TimerHandle_t unused)
+{
+	(void)unused;
+	g_task_event_type |= STATUS;
+	xSemaphoreGive(g_task_sem);
+}
+
+/**
+ * @brief Initialize the application like setup() of the API
+ *
+ * @return true Application is ready
+ * @return false init_app() failed
+ */
+bool api_setup(void)
+{
+	g_task_sem = xSemaphoreCreateBinary();
+	g_task_event_type = NO_EVENT;
+
+	setup_app();
+	if (g_enable_ble)
+	{
+		init_ble();
+	}
+	if (g_lorawan_settings.lorawan_enable)
+	{
+		if (g_lorawan_settings.send_repeat_time != 0)
+		{
+			g_task_wakeup_timer.begin(g_lorawan_settings.send_repeat_time, api_periodic_wakeup);
+			g_task_wakeup_timer.start();
+		}
+		if (g_lorawan_settings.auto_join)
+		{
+			lmh_join();
+		}
+	}
+	return init_app();
+}
+
+/**
+ * @brief One pass of the loop task, sleeps until the semaphore is given
+ *        AT commands and BLE configuration are handled by the API itself,
+ *        their event bits are cleared here. Bits that no handler clears
+ *        would keep the loop busy on the device, they are counted and
+ *        cleared.
+ *
+ * @return true Events were handled
+ * @return false End of the simulation
+ */
+bool api_loop(void)
+{
+	if (xSemaphoreTake(g_task_sem, portMAX_DELAY) != pdTRUE)
+	{
+		return false;
+	}
+	api_wakeups++;
+	while (g_task_event_type != NO_EVENT)
+	{
+		uint16_t before = g_task_event_type;
+		app_event_handler();
+		if (g_enable_ble)
+		{
+			ble_data_handler();
+		}
+		lora_data_handler();
+		g_task_event_type &= N_AT_CMD & N_BLE_CONFIG;
+		if ((g_task_event_type != NO_EVENT) && (g_task_event_type == before))
+		{
+			fprintf(stderr, "api: event 0x%04X not handled\n", g_task_event_type);
+			api_unhandled++;
+			g_task_event_type = NO_EVENT;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,82 @@
+/**
+ * @file bme680_sim.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief BME680 readings for the native environment
+ *        Constant room climate, the gas resistance falls with the
+ *        heater temperature. During an event of sim_sensor_activity()
+ *        the air is bad, e.g. cooking, the gas resistance is a quarter.
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "sim.h"
+#include <Adafruit_BME680.h>
+
+/** Flag if the air is bad */
+static bool bme680_bad_air = false;
+
+/**
+ * @brief Start or end a time of bad air
+ *
+ * @param active true while the air is bad
+ */
+void sim_sensor_activity(bool active)
+{
+	bme680_bad_air = active;
+}
+
+bool Adafruit_BME680::begin(uint8_t addr, bool initSettings)
+{
+	(void)addr;
+	(void)initSettings;
+	return true;
+}
+
+bool Adafruit_BME680::performReading(void)
+{
+	temperature = 21.5f;
+	humidity = 45.0f;
+	pressure = 101325;
+	// About 100 kOhm at 320 degrees, no reading with the heater off
+	gas_resistance = (_heater_temp == 0) || (_heater_time == 0) ? 0 : 32000000UL / _heater_temp;
+	if (bme680_bad_air)
+	{
+		gas_resistance /= 4;
+	}
+	delay(_heater_time);
+	return true;
+}
+
+bool Adafruit_BME680::setTemperatureOversampling(uint8_t os)
+{
+	(void)os;
+	return true;
+}
+
+bool Adafruit_BME680::setPressureOversampling(uint8_t os)
+{
+	(void)os;
+	return true;
+}
+
+bool Adafruit_BME680::setHumidityOversampling(uint8_t os)
+{
+	(void)os;
+	return true;
+}
+
+bool Adafruit_BME680::setIIRFilterSize(uint8_t fs)
+{
+	(void)fs;
+	return true;
+}
+
+bool Adafruit_BME680::setGasHeater(uint16_t heaterTemp, uint16_t heaterTime)
+{
+	_heater_temp = heaterTemp;
+	_heater_time = heaterTime;
+	return true;
+}
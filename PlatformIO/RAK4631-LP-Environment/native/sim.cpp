@@ -0,0 +1,865 @@
+/**
+ * @file sim.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Virtual time, FreeRTOS, the file system, BLE and the LoRaWAN
+ *        stack of the native environment
+ *        The semaphore wait jumps to the next event instead of sleeping,
+ *        millis() is calculated from the tick count like on the device,
+ *        so it wraps after 48.5 days of virtual time.
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "sim.h"
+#include <WisBlock-API.h>
+#include <Wire.h>
+#include <InternalFileSystem.h>
+#include <flash/flash_nrf5x.h>
+
+using namespace Adafruit_LittleFS_Namespace;
+
+/** Current virtual time in us */
+static uint64_t sim_us = 0;
+
+uint64_t sim_end_us = UINT64_MAX;
+uint32_t sim_resets = 0;
+uint32_t sim_uplinks = 0;
+uint8_t sim_loss = 0;
+
+/** Max number of pending events */
+#define SIM_EVENTS 32
+
+/** Pending events, unsorted */
+static struct
+{
+	uint64_t time_us;
+	sim_event_t func;
+	uint32_t arg;
+} sim_events[SIM_EVENTS];
+static uint8_t sim_events_num = 0;
+
+/** Software timer, kept in a list of all timers */
+struct s_native_timer
+{
+	uint64_t expiry_us;
+	uint32_t period_ms;
+	TimerCallbackFunction_t callback;
+	void *id;
+	bool repeating;
+	bool active;
+	s_native_timer *next;
+};
+static s_native_timer *sim_timers = NULL;
+
+/** Binary semaphore */
+struct s_native_sem
+{
+	bool given;
+};
+
+/** Interrupt handlers of the pins */
+static void (*sim_isr[NATIVE_PINS])(void);
+
+/** Seed of random() */
+static uint32_t sim_seed = 1;
+
+/** Seed of the scenario, separate from random() of the application */
+static uint32_t sim_scenario_seed = 1;
+
+/** Globals of the core and the API */
+Uart Serial;
+void (*native_serial_line)(const char *line) = NULL;
+TwoWire Wire;
+InternalFileSystem InternalFS;
+AdafruitBluefruit Bluefruit;
+BLEUart g_ble_uart;
+volatile uint16_t g_task_event_type = NO_EVENT;
+SemaphoreHandle_t g_task_sem = NULL;
+SoftwareTimer g_task_wakeup_timer;
+s_lorawan_settings g_lorawan_settings;
+bool g_ble_uart_is_connected = false;
+bool g_enable_ble = false;
+uint8_t g_rx_lora_data[256];
+uint8_t g_rx_data_len = 0;
+int16_t g_last_rssi = 0;
+int8_t g_last_snr = 0;
+uint8_t g_last_fport = 0;
+bool g_rx_fin_result = false;
+bool g_join_result = false;
+bool g_lpwan_has_joined = false;
+
+/**
+ * @brief Get the virtual time
+ *
+ * @return uint64_t Time since start in us
+ */
+uint64_t sim_time_us(void)
+{
+	return sim_us;
+}
+
+/**
+ * @brief Add an event to the time line
+ *
+ * @param time_us Time of the event, in the past means now
+ * @param func Function to call
+ * @param arg Argument of the function
+ */
+void sim_event_at(uint64_t time_us, sim_event_t func, uint32_t arg)
+{
+	if (sim_events_num >= SIM_EVENTS)
+	{
+		fprintf(stderr, "sim: too many events\n");
+		exit(1);
+	}
+	sim_events[sim_events_num].time_us = time_us < sim_us ? sim_us : time_us;
+	sim_events[sim_events_num].func = func;
+	sim_events[sim_events_num].arg = arg;
+	sim_events_num++;
+}
+
+/**
+ * @brief Remove all pending events of a function
+ *
+ * @param func Function of the events
+ */
+void sim_event_cancel(sim_event_t func)
+{
+	uint8_t kept = 0;
+	for (uint8_t idx = 0; idx < sim_events_num; idx++)
+	{
+		if (sim_events[idx].func != func)
+		{
+			sim_events[kept++] = sim_events[idx];
+		}
+	}
+	sim_events_num = kept;
+}
+
+/**
+ * @brief Run the next timer or event if it is due before a limit
+ *        Timers before events at the same time, events in the order
+ *        they were added
+ *
+ * @param limit_us Latest time of the next step
+ * @return true A timer or event was run, time moved to it
+ * @return false Nothing due up to the limit, time did not move
+ */
+bool sim_step(uint64_t limit_us)
+{
+	s_native_timer *timer = NULL;
+	for (s_native_timer *check = sim_timers; check != NULL; check = check->next)
+	{
+		if (check->active && ((timer == NULL) || (check->expiry_us < timer->expiry_us)))
+		{
+			timer = check;
+		}
+	}
+	int16_t event = -1;
+	for (uint8_t idx = 0; idx < sim_events_num; idx++)
+	{
+		if ((event < 0) || (sim_events[idx].time_us < sim_events[event].time_us))
+		{
+			event = idx;
+		}
+	}
+
+	if ((timer != NULL) && (timer->expiry_us <= limit_us) && ((event < 0) || (timer->expiry_us <= sim_events[event].time_us)))
+	{
+		// Late after a delay() in the loop, time does not go back
+		sim_us = timer->expiry_us > sim_us ? timer->expiry_us : sim_us;
+		if (timer->repeating)
+		{
+			timer->expiry_us += (uint64_t)timer->period_ms * 1000;
+		}
+		else
+		{
+			timer->active = false;
+		}
+		timer->callback(timer);
+		return true;
+	}
+	if ((event >= 0) && (sim_events[event].time_us <= limit_us))
+	{
+		sim_event_t func = sim_events[event].func;
+		uint32_t arg = sim_events[event].arg;
+		sim_us = sim_events[event].time_us > sim_us ? sim_events[event].time_us : sim_us;
+		sim_events[event] = sim_events[--sim_events_num];
+		func(arg);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Call the interrupt handler of a pin
+ *
+ * @param pin Pin number
+ */
+void sim_interrupt(uint32_t pin)
+{
+	if ((pin < NATIVE_PINS) && (sim_isr[pin] != NULL))
+	{
+		sim_isr[pin]();
+	}
+}
+
+/**
+ * @brief Put a file into the file system, replaces an existing file
+ *
+ * @param name File name
+ * @param data Content
+ * @param size Size of the content
+ */
+void sim_fs_load(const char *name, const uint8_t *data, uint32_t size)
+{
+	InternalFS.remove(name);
+	s_native_file *file = InternalFS.create(name);
+	if ((file == NULL) || (size > NATIVE_FS_SIZE))
+	{
+		fprintf(stderr, "sim: can't load %s\n", name);
+		exit(1);
+	}
+	memcpy(file->data, data, size);
+	file->size = size;
+}
+
+/**
+ * @brief Next number of the scenario
+ *
+ * @param max Upper limit, not included
+ * @return uint32_t 0 .. max - 1
+ */
+static uint32_t sim_scenario_random(uint32_t max)
+{
+	sim_scenario_seed = sim_scenario_seed * 1103515245 + 12345;
+	return max > 0 ? (sim_scenario_seed >> 8) % max : 0;
+}
+
+/** Mean time between the starts of two sensor events and their duration in s */
+static uint32_t sim_event_gap_s = 0;
+static uint32_t sim_event_time_s = 0;
+
+/**
+ * @brief Start or end of a sensor event, schedules the next change
+ *
+ * @param active 1 for the start of the event
+ */
+static void sim_sensor_change(uint32_t active)
+{
+	sim_sensor_activity(active != 0);
+	if (active != 0)
+	{
+		sim_event_at(sim_us + (uint64_t)sim_event_time_s * 1000000, sim_sensor_change, 0);
+	}
+	else
+	{
+		// Pauses between 0 and twice the mean, the events keep the mean rate
+		uint32_t pause_s = sim_scenario_random(2 * (sim_event_gap_s - sim_event_time_s) + 1);
+		sim_event_at(sim_us + (uint64_t)pause_s * 1000000, sim_sensor_change, 1);
+	}
+}
+
+/**
+ * @brief Start sensor events at random times
+ *
+ * @param per_day Mean number of events per day, 0 = none
+ * @param duration_s Duration of one event, limited to the mean time between them
+ * @param seed Seed of the event times
+ */
+void sim_sensor_events(uint32_t per_day, uint32_t duration_s, uint32_t seed)
+{
+	sim_event_cancel(sim_sensor_change);
+	sim_scenario_seed = seed;
+	if (per_day == 0)
+	{
+		return;
+	}
+	sim_event_gap_s = 86400 / per_day;
+	sim_event_time_s = duration_s < sim_event_gap_s ? duration_s : sim_event_gap_s;
+	sim_sensor_change(0);
+}
+
+/** Arduino core */
+
+uint32_t millis(void)
+{
+	return (uint32_t)(((uint64_t)xTaskGetTickCount() * 1000) / configTICK_RATE_HZ);
+}
+
+uint32_t micros(void)
+{
+	return (uint32_t)sim_us;
+}
+
+/**
+ * @brief Busy wait, the timers run after the wait like on the device
+ *        where the loop task blocks the lower priority work
+ *
+ * @param ms Time to wait
+ */
+void delay(uint32_t ms)
+{
+	sim_us += (uint64_t)ms * 1000;
+}
+
+void delayMicroseconds(uint32_t us)
+{
+	sim_us += us;
+}
+
+long random(long max)
+{
+	sim_seed = sim_seed * 1103515245 + 12345;
+	return max > 0 ? (long)((sim_seed >> 8) % (uint32_t)max) : 0;
+}
+
+long random(long min, long max)
+{
+	return min + random(max - min);
+}
+
+void randomSeed(uint32_t seed)
+{
+	sim_seed = seed;
+}
+
+void pinMode(uint32_t pin, uint32_t mode)
+{
+	(void)pin;
+	(void)mode;
+}
+
+void digitalWrite(uint32_t pin, uint32_t value)
+{
+	(void)pin;
+	(void)value;
+}
+
+int digitalRead(uint32_t pin)
+{
+	(void)pin;
+	return LOW;
+}
+
+void attachInterrupt(uint32_t pin, void (*callback)(void), uint32_t mode)
+{
+	(void)mode;
+	if (pin < NATIVE_PINS)
+	{
+		sim_isr[pin] = callback;
+	}
+}
+
+void detachInterrupt(uint32_t pin)
+{
+	if (pin < NATIVE_PINS)
+	{
+		sim_isr[pin] = NULL;
+	}
+}
+
+/**
+ * @brief vsnprintf() for the formats of the device
+ *        long is 32 bit on the device, the code prints uint32_t with %ld.
+ *        The l is dropped, the argument is read as int, %lld stays.
+ *
+ * @param buffer Output buffer
+ * @param size Size of the buffer
+ * @param format Format of the device
+ * @param args Arguments
+ * @return int Length of the output without the limit
+ */
+int native_vsnprintf(char *buffer, size_t size, const char *format, va_list args)
+{
+	char host[256];
+	uint16_t len = 0;
+	bool spec = false;
+	for (const char *pos = format; (*pos != 0) && (len < sizeof(host) - 1); pos++)
+	{
+		if (!spec)
+		{
+			spec = *pos == '%';
+		}
+		else if ((pos[0] == 'l') && (pos[1] != 'l') && (pos[-1] != 'l'))
+		{
+			continue;
+		}
+		else if (strchr("0123456789.-+ #hlLzjt", *pos) == NULL)
+		{
+			spec = false;
+		}
+		host[len++] = *pos;
+	}
+	host[len] = 0;
+	return vsnprintf(buffer, size, host, args);
+}
+
+int native_printf(const char *format, ...)
+{
+	char line[256];
+	va_list args;
+	va_start(args, format);
+	int len = native_vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	fputs(line, stdout);
+	return len;
+}
+
+uint32_t readResetReason(void)
+{
+	return 0;
+}
+
+/**
+ * @brief Collect the serial output in lines
+ *
+ * @param c Character
+ * @return size_t 1
+ */
+size_t Uart::write(uint8_t c)
+{
+	if (c == '\r')
+	{
+		return 1;
+	}
+	if ((c != '\n') && (_len < sizeof(_line) - 1))
+	{
+		_line[_len++] = c;
+		return 1;
+	}
+	if (c == '\n')
+	{
+		_line[_len] = 0;
+		_len = 0;
+		if (native_serial_line != NULL)
+		{
+			native_serial_line(_line);
+		}
+		else
+		{
+			puts(_line);
+		}
+	}
+	return 1;
+}
+
+/** FreeRTOS */
+
+TickType_t xTaskGetTickCount(void)
+{
+	return (TickType_t)((sim_us * configTICK_RATE_HZ) / 1000000);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	s_native_sem *sem = new s_native_sem;
+	sem->given = false;
+	return sem;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	if (sem->given)
+	{
+		return pdFALSE;
+	}
+	sem->given = true;
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken)
+{
+	if (woken != NULL)
+	{
+		*woken = pdTRUE;
+	}
+	return xSemaphoreGive(sem);
+}
+
+/**
+ * @brief Take the semaphore, time moves to the events until it is given
+ *
+ * @param sem Semaphore
+ * @param ticks Max wait time
+ * @return BaseType_t pdFALSE after the wait time or at the end of the simulation
+ */
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+	uint64_t limit_us = ticks == portMAX_DELAY ? sim_end_us : sim_us + ((uint64_t)ticks * 1000000) / configTICK_RATE_HZ;
+	if (limit_us > sim_end_us)
+	{
+		limit_us = sim_end_us;
+	}
+	while (!sem->given)
+	{
+		if (!sim_step(limit_us))
+		{
+			if ((limit_us != UINT64_MAX) && (limit_us > sim_us))
+			{
+				sim_us = limit_us;
+			}
+			return pdFALSE;
+		}
+	}
+	sem->given = false;
+	return pdTRUE;
+}
+
+void *pvTimerGetTimerID(TimerHandle_t timer)
+{
+	return timer->id;
+}
+
+const char *pcTaskGetName(TaskHandle_t task)
+{
+	(void)task;
+	return "loop";
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+	(void)task;
+	return 0;
+}
+
+void SoftwareTimer::begin(uint32_t ms, TimerCallbackFunction_t callback, void *timerID, bool repeating)
+{
+	if (_handle == NULL)
+	{
+		_handle = new s_native_timer;
+		_handle->next = sim_timers;
+		sim_timers = _handle;
+	}
+	_handle->period_ms = ms;
+	_handle->callback = callback;
+	_handle->id = timerID;
+	_handle->repeating = repeating;
+	_handle->active = false;
+}
+
+void SoftwareTimer::setID(void *id)
+{
+	_handle->id = id;
+}
+
+void *SoftwareTimer::getID(void)
+{
+	return _handle->id;
+}
+
+bool SoftwareTimer::start(void)
+{
+	if (_handle == NULL)
+	{
+		return false;
+	}
+	_handle->expiry_us = sim_us + (uint64_t)_handle->period_ms * 1000;
+	_handle->active = true;
+	return true;
+}
+
+bool SoftwareTimer::stop(void)
+{
+	if (_handle == NULL)
+	{
+		return false;
+	}
+	_handle->active = false;
+	return true;
+}
+
+bool SoftwareTimer::setPeriod(uint32_t ms)
+{
+	if (_handle == NULL)
+	{
+		return false;
+	}
+	_handle->period_ms = ms;
+	return start();
+}
+
+/** File system */
+
+s_native_file *Adafruit_LittleFS::find(const char *name)
+{
+	for (uint8_t idx = 0; idx < NATIVE_FS_FILES; idx++)
+	{
+		if (_files[idx].used && (strcmp(_files[idx].name, name) == 0))
+		{
+			return &_files[idx];
+		}
+	}
+	return NULL;
+}
+
+s_native_file *Adafruit_LittleFS::create(const char *name)
+{
+	for (uint8_t idx = 0; idx < NATIVE_FS_FILES; idx++)
+	{
+		if (!_files[idx].used)
+		{
+			strncpy(_files[idx].name, name, sizeof(_files[idx].name) - 1);
+			_files[idx].size = 0;
+			_files[idx].used = true;
+			return &_files[idx];
+		}
+	}
+	return NULL;
+}
+
+bool Adafruit_LittleFS::remove(const char *name)
+{
+	s_native_file *file = find(name);
+	if (file == NULL)
+	{
+		return false;
+	}
+	file->used = false;
+	return true;
+}
+
+bool Adafruit_LittleFS::format(void)
+{
+	for (uint8_t idx = 0; idx < NATIVE_FS_FILES; idx++)
+	{
+		_files[idx].used = false;
+	}
+	return true;
+}
+
+bool File::open(const char *name, uint8_t mode)
+{
+	_file = _fs.find(name);
+	if ((_file == NULL) && (mode == FILE_O_WRITE))
+	{
+		_file = _fs.create(name);
+	}
+	if (_file == NULL)
+	{
+		return false;
+	}
+	// Writes append like in the LittleFS wrapper
+	_pos = mode == FILE_O_WRITE ? _file->size : 0;
+	return true;
+}
+
+size_t File::read(void *buffer, size_t size)
+{
+	if (_file == NULL)
+	{
+		return 0;
+	}
+	if (size > _file->size - _pos)
+	{
+		size = _file->size - _pos;
+	}
+	memcpy(buffer, &_file->data[_pos], size);
+	_pos += size;
+	return size;
+}
+
+int File::read(void)
+{
+	uint8_t c;
+	return read(&c, 1) == 1 ? c : -1;
+}
+
+size_t File::write(const uint8_t *buffer, size_t size)
+{
+	if (_file == NULL)
+	{
+		return 0;
+	}
+	if (size > NATIVE_FS_SIZE - _pos)
+	{
+		size = NATIVE_FS_SIZE - _pos;
+	}
+	memcpy(&_file->data[_pos], buffer, size);
+	_pos += size;
+	if (_pos > _file->size)
+	{
+		_file->size = _pos;
+	}
+	return size;
+}
+
+bool File::seek(uint32_t pos)
+{
+	if ((_file == NULL) || (pos > _file->size))
+	{
+		return false;
+	}
+	_pos = pos;
+	return true;
+}
+
+/** Flash, the firmware update is not simulated */
+
+void flash_nrf5x_flush(void)
+{
+}
+
+int flash_nrf5x_write(uint32_t dst, void const *src, uint32_t len)
+{
+	(void)dst;
+	(void)src;
+	return len;
+}
+
+int flash_nrf5x_read(void *dst, uint32_t src, uint32_t len)
+{
+	(void)src;
+	memset(dst, 0xFF, len);
+	return len;
+}
+
+/** BLE, advertising windows without a central */
+
+/** End of the advertising window */
+static uint64_t sim_adv_end_us = 0;
+
+bool BLEAdvertising::isRunning(void)
+{
+	return sim_us < sim_adv_end_us;
+}
+
+bool BLEAdvertising::stop(void)
+{
+	sim_adv_end_us = sim_us;
+	return true;
+}
+
+/**
+ * @brief Start advertising
+ *
+ * @param timeout Time in s, 0 = until stopped
+ */
+void restart_advertising(uint16_t timeout)
+{
+	sim_adv_end_us = timeout == 0 ? UINT64_MAX : sim_us + (uint64_t)timeout * 1000000;
+}
+
+void init_ble(void)
+{
+}
+
+/** Settings of the API */
+
+/**
+ * @brief Save the settings into the same file as the API
+ *
+ * @return true Always
+ */
+bool save_settings(void)
+{
+	sim_fs_load("RAK", (uint8_t *)&g_lorawan_settings, sizeof(s_lorawan_settings));
+	return true;
+}
+
+void sd_nvic_SystemReset(void)
+{
+	sim_resets++;
+}
+
+uint32_t sd_softdevice_disable(void)
+{
+	return 0;
+}
+
+/** LoRaWAN, every uplink is delivered, the TX cycle ends after the RX windows.
+ *  Confirmed uplinks get no ACK with the probability sim_loss */
+
+/** Time of the TX cycle after the uplink, both RX windows */
+#define SIM_TX_CYCLE_US 2100000ULL
+/** Time of the join */
+#define SIM_JOIN_US 6000000ULL
+
+/** Flag if a TX cycle is running */
+static bool sim_tx_busy = false;
+/** Data rate of the MAC */
+static uint8_t sim_data_rate = 0;
+
+static void sim_tx_finished(uint32_t confirmed)
+{
+	sim_tx_busy = false;
+	g_rx_fin_result = (confirmed == LMH_UNCONFIRMED_MSG) || (sim_scenario_random(100) >= sim_loss);
+	g_task_event_type |= LORA_TX_FIN;
+	xSemaphoreGive(g_task_sem);
+}
+
+static void sim_joined(uint32_t unused)
+{
+	(void)unused;
+	g_join_result = true;
+	g_lpwan_has_joined = true;
+	g_task_event_type |= LORA_JOIN_FIN;
+	xSemaphoreGive(g_task_sem);
+}
+
+lmh_error_status lmh_send(lmh_app_data_t *app_data, lmh_confirm is_tx_confirmed)
+{
+	(void)app_data;
+	if (!g_lpwan_has_joined)
+	{
+		return LMH_ERROR;
+	}
+	if (sim_tx_busy)
+	{
+		return LMH_BUSY;
+	}
+	sim_tx_busy = true;
+	sim_uplinks++;
+	sim_event_at(sim_us + SIM_TX_CYCLE_US, sim_tx_finished, is_tx_confirmed);
+	return LMH_SUCCESS;
+}
+
+lmh_join_status lmh_join_status_get(void)
+{
+	return g_lpwan_has_joined ? LMH_SET : LMH_RESET;
+}
+
+/**
+ * @brief Send with the settings of the API
+ *
+ * @param data Payload
+ * @param size Size of the payload
+ * @return lmh_error_status Result of lmh_send()
+ */
+lmh_error_status send_lora_packet(uint8_t *data, uint8_t size)
+{
+	lmh_app_data_t app_data = {data, size, g_lorawan_settings.app_port, 0, 0};
+	sim_data_rate = g_lorawan_settings.data_rate;
+	return lmh_send(&app_data, g_lorawan_settings.confirmed_msg_enabled);
+}
+
+lmh_error_status lmh_datarate_set(uint8_t data_rate, bool enable_adr)
+{
+	(void)enable_adr;
+	sim_data_rate = data_rate;
+	return LMH_SUCCESS;
+}
+
+LoRaMacStatus_t LoRaMacMibGetRequestConfirm(MibRequestConfirm_t *mibGet)
+{
+	if (mibGet->Type != MIB_CHANNELS_DATARATE)
+	{
+		return LORAMAC_STATUS_SERVICE_UNKNOWN;
+	}
+	mibGet->Param.ChannelsDatarate = sim_data_rate;
+	return LORAMAC_STATUS_OK;
+}
+
+lmh_error_status lmh_tx_power_set(uint8_t tx_power)
+{
+	(void)tx_power;
+	return LMH_SUCCESS;
+}
+
+void lmh_join(void)
+{
+	sim_event_at(sim_us + SIM_JOIN_US, sim_joined, 0);
+}
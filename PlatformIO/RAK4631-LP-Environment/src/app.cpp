@@ -22,6 +22,21 @@ uint32_t packet_counter = 0;
 /** Packet buffer for sending */
 uint8_t collected_data[64] = {0};
 
+/** Buffer for a line received over BLE UART */
+char ble_rx_buff[64];
+
+/** Buffer for one line of the received LoRa data log */
+char lora_log_buff[16 * 3 + 1];
+
+/** Static buffers with their high-water marks, same order as the MEM_ defines */
+s_mem_pool mem_pools[] = {
+	{"PAYLOAD", sizeof(collected_data), 0},
+	{"DLRESP", DL_RESPONSE_SIZE, 0},
+	{"BLERX", sizeof(ble_rx_buff), 0},
+	{"RXRING", RX_RING_SLOTS, 0},
+};
+const uint8_t mem_pools_num = sizeof(mem_pools) / sizeof(s_mem_pool);
+
 /** Send Fail counter **/
 uint8_t send_fail = 0;
 
@@ -40,6 +55,12 @@ void setup_app(void)
 	/**************************************************************/
 	/**************************************************************/
 	g_enable_ble = true;
+
+	// Fast start, BLE is started after the first uplink
+	if (boot_check_fast_start())
+	{
+		g_enable_ble = false;
+	}
 }
 
 /**
@@ -51,11 +72,26 @@ void setup_app(void)
 bool init_app(void)
 {
 	// Add your application specific initialization here
+	boot_mark(BOOT_API_INIT);
+	app_param_load();
+	journal_load();
+	link_set_params(bme_params.link_mode, bme_params.link_margin);
 	if (!init_bme680())
 	{
 		return false;
 	}
+	boot_mark(BOOT_SENSOR);
+
+	// Initialize the BLE advertising scheduler
+	ble_adv_init();
 
+	// Start the watchdog, fed only when the loop makes progress
+	loop_init();
+	// Keep the uptime of the energy estimate from wrapping
+	energy_init();
+
+	boot_mark(BOOT_APP_READY);
+	mem_init_finished();
 	return true;
 }
 
@@ -66,6 +102,16 @@ bool init_app(void)
  */
 void app_event_handler(void)
 {
+	loop_start();
+	energy_wakeup();
+	mem_check();
+
+	// No uplinks while the radio is used for the offload
+	if (bulk_active())
+	{
+		g_task_event_type &= N_STATUS;
+	}
+
 	// Timer triggered event
 	if ((g_task_event_type & STATUS) == STATUS)
 	{
@@ -76,13 +122,14 @@ void app_event_handler(void)
 		/**************************************************************/
 		/// \todo Just as example, if BLE is enabled and you want
 		/// \todo to restart advertising on an event you can call
-		/// \todo restart_advertising(uint16_t timeout); to advertise
-		/// \todo for another <timeout> seconds
+		/// \todo ble_adv_request(uint16_t timeout); to advertise
+		/// \todo for another <timeout> seconds. The scheduler
+		/// \todo skips the window if no central connected recently
 		/**************************************************************/
 		/**************************************************************/
 		if (g_enable_ble)
 		{
-			restart_advertising(15);
+			ble_adv_request(15);
 		}
 
 		/**************************************************************/
@@ -94,12 +141,24 @@ void app_event_handler(void)
 		/**************************************************************/
 
 		uint8_t data_size = bme680_get();
-		lmh_error_status result = send_lora_packet(collected_data, data_size);
+		// Keep the reading for the offload to a collector
+		bulk_log_add(collected_data, data_size);
+		// Add the loop latency and the confirmation of a configuration downlink
+		// All blocks together must fit the max payload of the data rate
+		uint8_t max_payload = link_max_payload();
+		max_payload = max_payload > sizeof(collected_data) ? sizeof(collected_data) : max_payload;
+		data_size = loop_add_diag(collected_data, data_size, max_payload > dl_response_len ? max_payload - dl_response_len : 0, bme_params.diag_interval);
+		data_size = downlink_add_response(collected_data, data_size, max_payload);
+		mem_pool_mark(MEM_PAYLOAD, data_size);
+		lmh_error_status result = link_send(collected_data, data_size);
 		switch (result)
 		{
 		case LMH_SUCCESS:
 			MYLOG("APP", "Packet enqueued");
+			boot_mark(BOOT_FIRST_TX);
+			energy_uplink(data_size);
 		packet_counter++;
+			downlink_response_sent();
 			break;
 		case LMH_BUSY:
 			MYLOG("APP", "LoRa transceiver is busy");
@@ -111,6 +170,55 @@ void app_event_handler(void)
 
 		MYLOG("APP", "LoRa package sent");
 	}
+
+	// Reading between the uplinks for the air quality alert
+	if ((g_task_event_type & IAQ_SAMPLE) == IAQ_SAMPLE)
+	{
+		g_task_event_type &= N_IAQ_SAMPLE;
+		if (bme680_sample())
+		{
+			MYLOG("APP", "IAQ threshold crossed, send now");
+			g_task_event_type |= STATUS;
+			xSemaphoreGive(g_task_sem);
+		}
+	}
+
+	// Loop is alive, the watchdog is fed when it goes to sleep
+	if ((g_task_event_type & LOOP_CHECK) == LOOP_CHECK)
+	{
+		g_task_event_type &= N_LOOP_CHECK;
+		// Statistics period of the advertising scheduler may be over
+		ble_adv_check();
+	}
+
+	// Fast advertising requested by button
+	if ((g_task_event_type & ADV_TRIGGER) == ADV_TRIGGER)
+	{
+		g_task_event_type &= N_ADV_TRIGGER;
+		MYLOG("APP", "Fast advertising requested");
+		ble_adv_force();
+	}
+
+	// Firmware update answers and swap
+	if ((g_task_event_type & FUOTA_EVENT) == FUOTA_EVENT)
+	{
+		g_task_event_type &= N_FUOTA_EVENT;
+		fuota_event();
+	}
+
+	// Offload start delay and radio events
+	if ((g_task_event_type & BULK_EVENT) == BULK_EVENT)
+	{
+		g_task_event_type &= N_BULK_EVENT;
+		bulk_event();
+	}
+
+	// Sensor trace replay is used up
+	if ((g_task_event_type & TRACE_EVENT) == TRACE_EVENT)
+	{
+		g_task_event_type &= N_TRACE_EVENT;
+		trace_event();
+	}
 }
 
 /**
@@ -119,6 +227,7 @@ void app_event_handler(void)
  */
 void ble_data_handler(void)
 {
+	loop_mark();
 	if (g_enable_ble)
 	{
 		// BLE UART data handling
@@ -131,11 +240,66 @@ void ble_data_handler(void)
 			/**************************************************************/
 			/**************************************************************/
 			g_task_event_type &= N_BLE_DATA;
-			String uart_rx_buff = g_ble_uart.readStringUntil('\n');
+			ble_adv_connected();
+			// Read one line into the static buffer, no String on the heap
+			size_t rx_len = g_ble_uart.readBytesUntil('\n', ble_rx_buff, sizeof(ble_rx_buff) - 1);
+			ble_rx_buff[rx_len] = 0;
+			mem_pool_mark(MEM_BLE_RX, rx_len);
+			for (size_t idx = 0; idx < rx_len; idx++)
+			{
+				ble_rx_buff[idx] = toupper(ble_rx_buff[idx]);
+			}
 
-			uart_rx_buff.toUpperCase();
+			MYLOG("BLE", "BLE Received %s", ble_rx_buff);
 
-			MYLOG("BLE", "BLE Received %s", uart_rx_buff.c_str());
+			// BOOT? show the boot timeline, ENERGY? show the energy estimate
+			// LOOP? show the loop latency
+			// BULK? show the offload, BULK send the log to a collector
+			// TRACE? show the sensor trace, TRACE=1 record, TRACE=2 replay, TRACE=0 stop
+			// GAS measure gas with the next reading
+			if (strncmp(ble_rx_buff, "BOOT?", 5) == 0)
+			{
+				boot_report();
+			}
+			else if (strncmp(ble_rx_buff, "ENERGY?", 7) == 0)
+			{
+				energy_report();
+			}
+			else if (strncmp(ble_rx_buff, "LOOP?", 5) == 0)
+			{
+				loop_report();
+			}
+			else if (strncmp(ble_rx_buff, "BULK?", 5) == 0)
+			{
+				bulk_report();
+			}
+			else if (strncmp(ble_rx_buff, "BULK", 4) == 0)
+			{
+				if (!bulk_send_log())
+				{
+					g_ble_uart.println("BULK busy or log empty");
+				}
+			}
+			else if (strncmp(ble_rx_buff, "TRACE?", 6) == 0)
+			{
+				trace_report();
+			}
+			else if (strncmp(ble_rx_buff, "TRACE=", 6) == 0)
+			{
+				long mode = atol(&ble_rx_buff[6]);
+				if (mode == TRACE_OFF)
+				{
+					trace_stop();
+				}
+				else if (((mode != TRACE_RECORD) && (mode != TRACE_REPLAY)) || !trace_start(mode))
+				{
+					g_ble_uart.println("TRACE busy or no trace");
+				}
+			}
+			else if (strncmp(ble_rx_buff, "GAS", 3) == 0)
+			{
+				bme680_gas_request();
+			}
 		}
 	}
 }
@@ -146,6 +310,7 @@ void ble_data_handler(void)
  */
 void lora_data_handler(void)
 {
+	loop_mark();
 	if ((g_task_event_type & LORA_JOIN_FIN) == LORA_JOIN_FIN)
 	{
 		/**************************************************************/
@@ -158,6 +323,14 @@ void lora_data_handler(void)
 		if (g_join_result)
 		{
 			MYLOG("APP", "Successfully joined network");
+			boot_mark(BOOT_JOINED);
+
+			if (boot_fast_start)
+			{
+				// Send the first packet without waiting for the timer
+				g_task_event_type |= STATUS;
+				xSemaphoreGive(g_task_sem);
+			}
 		}
 		else
 		{
@@ -168,7 +341,7 @@ void lora_data_handler(void)
 			// If BLE is enabled, restart Advertising
 			if (g_enable_ble)
 			{
-				restart_advertising(15);
+				ble_adv_request(15);
 			}
 		}
 	}
@@ -184,11 +357,20 @@ void lora_data_handler(void)
 		/**************************************************************/
 		g_task_event_type &= N_LORA_TX_FIN;
 
+		if (!boot_reached(BOOT_FIRST_TX_FIN))
+		{
+			// First uplink is out, start what was deferred
+			boot_mark(BOOT_FIRST_TX_FIN);
+			boot_deferred_init();
+			boot_report();
+		}
+
 		MYLOG("APP", "LPWAN TX cycle %s", g_rx_fin_result ? "finished ACK" : "failed NAK");
 		if (g_ble_uart_is_connected)
 		{
 			g_ble_uart.printf("LPWAN TX cycle %s", g_rx_fin_result ? "finished ACK" : "failed NAK");
 		}
+		link_tx_done(g_rx_fin_result);
 
 		if (!g_rx_fin_result)
 		{
@@ -205,7 +387,7 @@ void lora_data_handler(void)
 	}
 
 	// LoRa data handling
-	if ((g_task_event_type & LORA_DATA) == LORA_DATA)
+	if ((g_task_event_type & (LORA_DATA | RX_FRAME)) != 0)
 	{
 		/**************************************************************/
 		/**************************************************************/
@@ -213,31 +395,50 @@ void lora_data_handler(void)
 		/// \todo parse them here
 		/**************************************************************/
 		/**************************************************************/
-		g_task_event_type &= N_LORA_DATA;
-		MYLOG("APP", "Received package over LoRa");
-		char log_buff[g_rx_data_len * 3] = {0};
-		uint8_t log_idx = 0;
-		for (int idx = 0; idx < g_rx_data_len; idx++)
+		// Frame is still in the receive buffer if the RX callback did not queue it
+		rx_ring_take_pending();
+		g_task_event_type &= N_RX_FRAME;
+		// Handle all queued frames in their slot
+		s_rx_frame *frame;
+		while ((frame = rx_ring_peek()) != NULL)
 		{
-			sprintf(&log_buff[log_idx], "%02X ", g_rx_lora_data[idx]);
-			log_idx += 3;
-		}
-		MYLOG("APP", "%s", log_buff);
+			MYLOG("APP", "Received package over LoRa port %d RSSI %d SNR %d", frame->port, frame->rssi, frame->snr);
+			link_rx(frame->rssi, frame->snr);
+			// Log in lines of 16 bytes, no buffer on the stack
+			for (int line = 0; line < frame->len; line += 16)
+			{
+				uint8_t log_idx = 0;
+				for (int idx = line; (idx < frame->len) && (idx < line + 16); idx++)
+				{
+					sprintf(&lora_log_buff[log_idx], "%02X ", frame->data[idx]);
+					log_idx += 3;
+				}
+				MYLOG("APP", "%s", lora_log_buff);
+			}
 
-		/**************************************************************/
-		/**************************************************************/
-		/// \todo Just an example, if BLE is enabled and BLE UART
-		/// \todo is connected you can send the received data
-		/// \todo for debugging
-		/**************************************************************/
-		/**************************************************************/
-		if (g_ble_uart_is_connected && g_enable_ble)
-		{
-			for (int idx = 0; idx < g_rx_data_len; idx++)
+			// Firmware update fragments or configuration downlink
+			if (!fuota_handler(frame->port, frame->data, frame->len))
+			{
+				downlink_handler(frame->port, frame->data, frame->len);
+			}
+
+			/**************************************************************/
+			/**************************************************************/
+			/// \todo Just an example, if BLE is enabled and BLE UART
+			/// \todo is connected you can send the received data
+			/// \todo for debugging
+			/**************************************************************/
+			/**************************************************************/
+			if (g_ble_uart_is_connected && g_enable_ble)
 			{
-				g_ble_uart.printf("%02X ", g_rx_lora_data[idx]);
+				for (int idx = 0; idx < frame->len; idx++)
+				{
+					g_ble_uart.printf("%02X ", frame->data[idx]);
+				}
+				g_ble_uart.println("");
 			}
-			g_ble_uart.println("");
+			rx_ring_release();
 		}
 	}
+	loop_end();
 }
@@ -0,0 +1,299 @@
+/**
+ * @file bench.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief On device benchmark of the payload encoder, the downlink parser,
+ *        the semaphore used to wake up the loop and the firmware update
+ *        decoder on a lossy channel and the bulk transfer on a simulated
+ *        LoRa P2P link.
+ *        Only compiled with BENCH=1 in platformio.ini, build it with
+ *        MY_DEBUG=0, otherwise the log output is measured.
+ *        AT+BENCH=? prints one JSON object per benchmark. In the native
+ *        environment the same benchmarks run on the PC, see native/main.cpp.
+ * @version 0.1
+ * @date 2021-06-19
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+#include "frag_decoder.h"
+#include "bulk_sim.h"
+
+#if BENCH > 0
+
+/** Number of runs of each benchmark */
+#define BENCH_ITERATIONS 1000
+
+#if NATIVE > 0
+#include "sim.h"
+/** Counter of the host, instructions or ns, see native/counter.cpp */
+#define BENCH_COUNT() native_counter()
+#define BENCH_UNIT native_counter_unit()
+#else
+/** DWT cycle counter, CPU cycles at 64 MHz */
+#define BENCH_COUNT() DWT->CYCCNT
+#define BENCH_UNIT "cycles"
+#endif
+
+/** Buffer for the encoder */
+static uint8_t bench_buffer[64];
+
+/** Semaphore for the wake up benchmark */
+static SemaphoreHandle_t bench_sem = NULL;
+
+/** Read only downlink, changes no settings */
+static uint8_t bench_downlink[] = {DL_VERSION, 0x00, DL_READ | DL_SEND_REPEAT, 0x00, DL_READ | DL_DATA_RATE, 0x00};
+
+/**
+ * @brief Empty function to measure the call overhead
+ *
+ */
+static void bench_empty(void)
+{
+}
+
+/** Sensor values for the encoder, volatile to keep them out of the compile time */
+static volatile float bench_temp = -12.34f;
+static volatile float bench_hum = 56.78f;
+static volatile uint32_t bench_pres = 101325;
+
+/**
+ * @brief Pack a sensor reading into the payload
+ *
+ */
+static void bench_encoder(void)
+{
+	bme680_pack(bench_buffer, bench_temp, bench_hum, bench_pres, 123456, 0);
+}
+
+/**
+ * @brief The conversion before the single precision path, for comparison
+ *        Double math is done in software, negative temperatures are lost
+ *
+ */
+static void bench_encoder_double(void)
+{
+	double temp = bench_temp;
+	double pres = bench_pres / 100.0;
+	double hum = bench_hum;
+	uint16_t t = temp * 100;
+	uint16_t h = hum * 100;
+	uint32_t pre = pres * 100;
+	bench_buffer[1] = (uint8_t)(t >> 8);
+	bench_buffer[2] = (uint8_t)t;
+	bench_buffer[3] = (uint8_t)(h >> 8);
+	bench_buffer[4] = (uint8_t)h;
+	bench_buffer[5] = (uint8_t)(pre >> 24);
+	bench_buffer[6] = (uint8_t)(pre >> 16);
+	bench_buffer[7] = (uint8_t)(pre >> 8);
+	bench_buffer[8] = (uint8_t)pre;
+}
+
+/**
+ * @brief Parse a read only configuration downlink
+ *
+ */
+static void bench_downlink_handler(void)
+{
+	downlink_handler(DL_PORT, bench_downlink, sizeof(bench_downlink));
+}
+
+/** Command for the lookup, the name is hashed until the '=' */
+static const char bench_at_cmd[] = "+ENERGY=?";
+
+/**
+ * @brief Find a command in the perfect hash table of the AT commands
+ *
+ */
+static void bench_at_find(void)
+{
+	const char *pos = bench_at_cmd;
+	at_find(&pos, bench_at_cmd + sizeof(bench_at_cmd) - 1);
+}
+
+/**
+ * @brief Set an event and wake up the loop, like the timer callbacks do
+ *
+ */
+static void bench_wakeup(void)
+{
+	g_task_event_type |= ADV_TRIGGER;
+	xSemaphoreGive(bench_sem);
+	xSemaphoreTake(bench_sem, 0);
+	g_task_event_type &= N_ADV_TRIGGER;
+}
+
+/** Lossy channel for the firmware update decoder, 10 % of the fragments are lost */
+#define BENCH_FRAG_NB 64
+#define BENCH_FRAG_SIZE 48
+#define BENCH_FRAG_LOSS 10
+#define BENCH_FRAG_SENT (BENCH_FRAG_NB * 2)
+static uint8_t bench_image[BENCH_FRAG_NB * BENCH_FRAG_SIZE];
+static uint8_t bench_store[BENCH_FRAG_NB * BENCH_FRAG_SIZE];
+static uint8_t bench_rx[BENCH_FRAG_SENT][BENCH_FRAG_SIZE];
+static uint16_t bench_rx_n[BENCH_FRAG_SENT];
+static uint16_t bench_rx_num = 0;
+static s_frag_decoder bench_dec;
+
+static void bench_frag_write(uint16_t idx, const uint8_t *data, uint8_t size)
+{
+	memcpy(&bench_store[idx * size], data, size);
+}
+
+static void bench_frag_read(uint16_t idx, uint8_t *data, uint8_t size)
+{
+	memcpy(data, &bench_store[idx * size], size);
+}
+
+/**
+ * @brief Encode an image and drop fragments like a lossy channel
+ *        Same random sequence on each run
+ *
+ */
+static void bench_frag_channel(void)
+{
+	uint32_t lcg = 12345;
+	uint8_t row[BENCH_FRAG_NB / 8];
+	for (uint16_t idx = 0; idx < sizeof(bench_image); idx++)
+	{
+		lcg = lcg * 1103515245 + 12345;
+		bench_image[idx] = (uint8_t)(lcg >> 16);
+	}
+	bench_rx_num = 0;
+	for (uint16_t n = 1; n <= BENCH_FRAG_SENT; n++)
+	{
+		lcg = lcg * 1103515245 + 12345;
+		if (((lcg >> 16) % 100) < BENCH_FRAG_LOSS)
+		{
+			continue;
+		}
+		uint8_t *frag = bench_rx[bench_rx_num];
+		bench_rx_n[bench_rx_num++] = n;
+		if (n <= BENCH_FRAG_NB)
+		{
+			memcpy(frag, &bench_image[(n - 1) * BENCH_FRAG_SIZE], BENCH_FRAG_SIZE);
+			continue;
+		}
+		// Parity fragment
+		frag_parity_row(n - BENCH_FRAG_NB, BENCH_FRAG_NB, row);
+		memset(frag, 0, BENCH_FRAG_SIZE);
+		for (uint16_t idx = 0; idx < BENCH_FRAG_NB; idx++)
+		{
+			if ((row[idx >> 3] >> (idx & 7)) & 1)
+			{
+				for (uint8_t byte = 0; byte < BENCH_FRAG_SIZE; byte++)
+				{
+					frag[byte] ^= bench_image[idx * BENCH_FRAG_SIZE + byte];
+				}
+			}
+		}
+	}
+}
+
+/**
+ * @brief Decode the image from the received fragments
+ *
+ */
+static void bench_frag_decoder(void)
+{
+	frag_decoder_init(&bench_dec, BENCH_FRAG_NB, BENCH_FRAG_SIZE, bench_frag_write, bench_frag_read);
+	for (uint16_t idx = 0; idx < bench_rx_num; idx++)
+	{
+		if (frag_decoder_process(&bench_dec, bench_rx_n[idx], bench_rx[idx]) != FRAG_ONGOING)
+		{
+			break;
+		}
+	}
+}
+
+/** Offload of the image over a simulated LoRa P2P link, 20 % of the frames are lost */
+#define BENCH_BULK_LOSS 20
+#define BENCH_BULK_FRAME 240
+static s_bulk bench_bulk_tx;
+static s_bulk bench_bulk_rx;
+static s_bulk_sim_result bench_bulk_result;
+
+/**
+ * @brief Send the image over the simulated link into the storage
+ *
+ */
+static void bench_bulk(void)
+{
+	bulk_sim_run(bench_image, sizeof(bench_image), bench_store, BENCH_BULK_FRAME, BENCH_BULK_LOSS, 12345, &bench_bulk_tx, &bench_bulk_rx, &bench_bulk_result);
+}
+
+/**
+ * @brief Run a benchmark and print the result
+ *        On the device the DWT cycle counter counts CPU cycles at 64 MHz,
+ *        in the native environment the host counts instructions or ns.
+ *        The minimum is the stable value to compare between releases,
+ *        the average includes interrupts of the BLE and LoRa stacks.
+ *
+ * @param name Name of the benchmark
+ * @param func Function to measure
+ */
+static void bench_run(const char *name, void (*func)(void))
+{
+	uint32_t min = 0xFFFFFFFF;
+	uint32_t max = 0;
+	uint64_t sum = 0;
+	for (uint16_t idx = 0; idx < BENCH_ITERATIONS; idx++)
+	{
+		uint32_t start = BENCH_COUNT();
+		func();
+		uint32_t cycles = BENCH_COUNT() - start;
+		min = cycles < min ? cycles : min;
+		max = cycles > max ? cycles : max;
+		sum += cycles;
+	}
+	AT_PRINTF("+BENCH:{\"name\":\"%s\",\"unit\":\"%s\",\"iterations\":%d,\"min\":%ld,\"avg\":%ld,\"max\":%ld}", name, BENCH_UNIT, BENCH_ITERATIONS, min,
+			  (uint32_t)(sum / BENCH_ITERATIONS), max);
+}
+
+/**
+ * @brief AT+BENCH=? runs all benchmarks
+ *        A pending downlink confirmation is dropped by the downlink benchmark,
+ *        a firmware update session by the decoder benchmark
+ *
+ * @param read true for AT+BENCH=?
+ * @param args Not used
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_bench(bool read, uint32_t *args)
+{
+	if (!read)
+	{
+		return AT_ERR_PARAM;
+	}
+	if (bench_sem == NULL)
+	{
+		bench_sem = xSemaphoreCreateBinary();
+	}
+
+#if NATIVE == 0
+	// Enable the cycle counter
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+
+	bench_run("empty", bench_empty);
+	bench_run("bme680_pack", bench_encoder);
+	bench_run("bme680_pack_double", bench_encoder_double);
+	bench_run("downlink_handler", bench_downlink_handler);
+	bench_run("at_find", bench_at_find);
+	bench_run("wakeup", bench_wakeup);
+	fuota_cancel();
+	bench_frag_channel();
+	bench_run("frag_decoder", bench_frag_decoder);
+	AT_PRINTF("+BENCH:{\"name\":\"frag_channel\",\"loss\":%d,\"fragments\":%d,\"received\":%d,\"parity\":%d,\"ok\":%d}", BENCH_FRAG_LOSS, BENCH_FRAG_NB, bench_rx_num, bench_dec.parity,
+			  (bench_dec.known == BENCH_FRAG_NB) && (memcmp(bench_image, bench_store, sizeof(bench_image)) == 0));
+	bench_run("bulk_sim", bench_bulk);
+	AT_PRINTF("+BENCH:{\"name\":\"bulk_channel\",\"loss\":%d,\"bytes\":%d,\"frames\":%ld,\"repeated\":%ld,\"timeouts\":%ld,\"ms\":%ld,\"bytes_s\":%ld,\"ok\":%d}", BENCH_BULK_LOSS,
+			  BENCH_FRAG_NB * BENCH_FRAG_SIZE, bench_bulk_result.frames, bench_bulk_tx.retransmits, bench_bulk_tx.timeouts, bench_bulk_result.time_ms, bench_bulk_result.throughput, bench_bulk_result.ok);
+	downlink_response_sent();
+	return 0;
+}
+
+#endif
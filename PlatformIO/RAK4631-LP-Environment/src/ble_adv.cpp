@@ -0,0 +1,335 @@
+/**
+ * @file ble_adv.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Adaptive BLE advertising scheduler
+ *        Backs off exponentially if no central connects,
+ *        reduces interval and TX power while backed off and
+ *        keeps statistics of the advertising time per hour
+ *        A timer rolls the statistics, a connect callback marks
+ *        a connection even if the central never sends data
+ * @version 0.1
+ * @date 2021-06-04
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+/** Advertising interval in units of 0.625 ms at backoff level 0 (100 ms) */
+#define ADV_INTERVAL_MIN 160
+/** Advertising interval in units of 0.625 ms for forced windows (20 ms) */
+#define ADV_INTERVAL_FAST 32
+/** Max shift of the advertising interval (100 ms << 3 = 800 ms) */
+#define ADV_INTERVAL_MAX_SHIFT 3
+/** First gap between two advertising windows after a window without connection */
+#define ADV_GAP_MIN 60000
+/** Max gap between two advertising windows */
+#define ADV_GAP_MAX 3600000
+/** Length of a forced advertising window in seconds */
+#define ADV_FORCE_TIME 60
+/** Estimated radio on time of one advertising event on 3 channels in us */
+#define ADV_EVENT_US 1200
+/** Statistics period, 1 hour */
+#define ADV_STAT_PERIOD 3600000
+
+/** Number of windows that finished without connection */
+uint8_t adv_level = 0;
+/** Min time between two advertising windows */
+uint32_t adv_gap = 0;
+/** Start time of the current or last advertising window */
+uint32_t adv_start = 0;
+/** Length of the current or last advertising window in ms */
+uint32_t adv_window = 0;
+/** Interval of the current or last advertising window in 0.625 ms units */
+uint16_t adv_interval = ADV_INTERVAL_MIN;
+/** Flag if the current or last window was already accounted */
+bool adv_accounted = true;
+/** Flag if a central connected since the last window was started */
+bool adv_had_connection = false;
+
+/** Start of the statistics period */
+uint32_t adv_stat_start = 0;
+/** Advertising time in the current statistics period in ms */
+uint32_t adv_time_period = 0;
+/** Advertising time in the last complete hour in ms */
+uint32_t adv_time_last_hour = 0;
+/** Estimated radio on time in the last complete hour in us */
+uint32_t adv_radio_last_hour = 0;
+/** Estimated radio on time in the current statistics period in us */
+uint32_t adv_radio_period = 0;
+/** Flag if the statistics period is over */
+volatile bool adv_stat_due = false;
+/** Flag if the statistics timer was started */
+bool adv_stat_running = false;
+
+/** Timer for the statistics period */
+SoftwareTimer adv_stat_timer;
+
+/**
+ * @brief Timer callback, the statistics period is over
+ *        Wakes the loop, ble_adv_check() rolls the statistics
+ *
+ * @param unused
+ */
+static void adv_stat_cb(TimerHandle_t unused)
+{
+	adv_stat_due = true;
+	g_task_event_type |= LOOP_CHECK;
+	xSemaphoreGive(g_task_sem);
+}
+
+/**
+ * @brief Connect callback of the peripheral
+ *        Replaces the callback of the API, which only sets the connection flag
+ *
+ * @param conn_handle Handle of the new connection
+ */
+static void adv_connect_cb(uint16_t conn_handle)
+{
+	(void)conn_handle;
+	g_ble_uart_is_connected = true;
+	ble_adv_connected();
+}
+
+#ifdef ADV_TRIGGER_PIN
+/**
+ * @brief Interrupt handler of the advertising trigger pin
+ *
+ */
+void adv_trigger_handler(void)
+{
+	BaseType_t woken = pdFALSE;
+	g_task_event_type |= ADV_TRIGGER;
+	xSemaphoreGiveFromISR(g_task_sem, &woken);
+	portYIELD_FROM_ISR(woken);
+}
+#endif
+
+/**
+ * @brief Add the finished advertising window to the statistics
+ *        and adjust the backoff
+ *
+ */
+static void ble_adv_account(void)
+{
+	if (adv_accounted)
+	{
+		return;
+	}
+
+	if (Bluefruit.connected() != 0)
+	{
+		adv_had_connection = true;
+	}
+
+	uint32_t elapsed = millis() - adv_start;
+	if (Bluefruit.Advertising.isRunning() && (elapsed < adv_window))
+	{
+		// Window still open
+		return;
+	}
+	if (elapsed > adv_window)
+	{
+		elapsed = adv_window;
+	}
+
+	adv_accounted = true;
+	adv_time_period += elapsed;
+	// Interval is in 0.625 ms units
+	uint32_t radio_us = (elapsed * 8 / (adv_interval * 5)) * ADV_EVENT_US;
+	adv_radio_period += radio_us;
+	energy_ble(radio_us);
+
+	if (adv_had_connection)
+	{
+		adv_level = 0;
+		adv_gap = 0;
+	}
+	else
+	{
+		if (adv_level < 0xFF)
+		{
+			adv_level++;
+		}
+		adv_gap = adv_gap == 0 ? ADV_GAP_MIN : adv_gap * 2;
+		if (adv_gap > ADV_GAP_MAX)
+		{
+			adv_gap = ADV_GAP_MAX;
+		}
+	}
+}
+
+/**
+ * @brief Roll over the statistics every hour
+ *
+ */
+static void ble_adv_stats(void)
+{
+	if (!adv_stat_due)
+	{
+		return;
+	}
+	adv_stat_due = false;
+	adv_time_last_hour = adv_time_period;
+	adv_radio_last_hour = adv_radio_period;
+	adv_time_period = 0;
+	adv_radio_period = 0;
+	adv_stat_start = millis();
+	ble_adv_report();
+}
+
+/**
+ * @brief Start an advertising window
+ *
+ * @param timeout Window length in seconds
+ * @param interval Advertising interval in 0.625 ms units
+ * @param tx_power TX power in dBm
+ */
+static void ble_adv_start(uint16_t timeout, uint16_t interval, int8_t tx_power)
+{
+	if (Bluefruit.Advertising.isRunning())
+	{
+		Bluefruit.Advertising.stop();
+	}
+	Bluefruit.setTxPower(tx_power);
+	Bluefruit.Advertising.setInterval(interval, interval);
+	restart_advertising(timeout);
+
+	adv_start = millis();
+	adv_window = timeout * 1000;
+	adv_interval = interval;
+	adv_accounted = false;
+	adv_had_connection = false;
+}
+
+/**
+ * @brief Initialize the scheduler
+ *        The advertising started by the BLE init is counted as first window,
+ *        call it again if BLE was started late
+ *
+ */
+void ble_adv_init(void)
+{
+	adv_stat_start = millis();
+	adv_start = millis();
+	adv_window = 60000;
+	adv_interval = ADV_INTERVAL_MIN;
+	adv_accounted = !g_enable_ble;
+
+	if (g_enable_ble)
+	{
+		Bluefruit.Periph.setConnectCallback(adv_connect_cb);
+	}
+	if (!adv_stat_running)
+	{
+		adv_stat_timer.begin(ADV_STAT_PERIOD, adv_stat_cb, NULL, true);
+		adv_stat_timer.start();
+		adv_stat_running = true;
+	}
+	adv_stat_due = false;
+
+#ifdef ADV_TRIGGER_PIN
+	pinMode(ADV_TRIGGER_PIN, INPUT_PULLUP);
+	attachInterrupt(ADV_TRIGGER_PIN, adv_trigger_handler, FALLING);
+#endif
+}
+
+/**
+ * @brief Request an advertising window
+ *        Replaces restart_advertising(). The window is only started
+ *        if the backoff time since the last window has passed
+ *
+ * @param timeout Window length in seconds
+ */
+void ble_adv_request(uint16_t timeout)
+{
+	if (!g_enable_ble)
+	{
+		return;
+	}
+
+	ble_adv_account();
+	ble_adv_stats();
+
+	if (!adv_accounted)
+	{
+		// Window is still open
+		return;
+	}
+
+	if ((millis() - adv_start) < (adv_window + adv_gap))
+	{
+		MYLOG("ADV", "Backoff, next window earliest in %ld s", (adv_window + adv_gap - (millis() - adv_start)) / 1000);
+		return;
+	}
+
+	uint8_t shift = adv_level > ADV_INTERVAL_MAX_SHIFT ? ADV_INTERVAL_MAX_SHIFT : adv_level;
+	int8_t tx_power = adv_level == 0 ? 0 : (adv_level == 1 ? -4 : -8);
+	MYLOG("ADV", "Advertise %d s, level %d, interval %d, TX %d dBm", timeout, adv_level, ADV_INTERVAL_MIN << shift, tx_power);
+	ble_adv_start(timeout, ADV_INTERVAL_MIN << shift, tx_power);
+}
+
+/**
+ * @brief Account a finished window and roll the statistics
+ *        Call when the loop wakes up without an advertising request
+ *
+ */
+void ble_adv_check(void)
+{
+	if (!g_enable_ble)
+	{
+		adv_stat_due = false;
+		return;
+	}
+	ble_adv_account();
+	ble_adv_stats();
+}
+
+/**
+ * @brief Force a fast advertising window, e.g. after a button push
+ *        or a downlink command. Resets the backoff
+ *
+ */
+void ble_adv_force(void)
+{
+	if (!g_enable_ble)
+	{
+		return;
+	}
+	// Window is replaced, account what was used so far
+	if (!adv_accounted && ((millis() - adv_start) < adv_window))
+	{
+		adv_window = millis() - adv_start;
+	}
+	ble_adv_account();
+	adv_level = 0;
+	adv_gap = 0;
+	MYLOG("ADV", "Forced advertising %d s", ADV_FORCE_TIME);
+	ble_adv_start(ADV_FORCE_TIME, ADV_INTERVAL_FAST, 4);
+}
+
+/**
+ * @brief Report that a central is connected
+ *        Call on BLE events that need a connection
+ *
+ */
+void ble_adv_connected(void)
+{
+	adv_had_connection = true;
+	adv_level = 0;
+	adv_gap = 0;
+}
+
+/**
+ * @brief Report the advertising time of the last hour
+ *
+ */
+void ble_adv_report(void)
+{
+	MYLOG("ADV", "Last hour advertising %ld s, est. radio on %ld ms", adv_time_last_hour / 1000, adv_radio_last_hour / 1000);
+	if (g_ble_uart_is_connected)
+	{
+		g_ble_uart.printf("Last hour advertising %ld s, est. radio on %ld ms\n", adv_time_last_hour / 1000, adv_radio_last_hour / 1000);
+	}
+}
@@ -2,6 +2,7 @@
  * @file bme680_sensor.cpp
  * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
  * @brief BME680 sensor functions
+ *        Readings can be recorded and replayed, see trace.cpp
  * @version 0.1
  * @date 2021-05-29
  * 
@@ -29,42 +30,301 @@ bool init_bme680(void)
 	}
 
 	// Set up oversampling and filter initialization
-	bme.setTemperatureOversampling(BME680_OS_8X);
-	bme.setHumidityOversampling(BME680_OS_2X);
-	bme.setPressureOversampling(BME680_OS_4X);
 	bme.setIIRFilterSize(BME680_FILTER_SIZE_3);
-	bme.setGasHeater(320, 150); // 320*C for 150 ms
+	bme680_apply_params();
 
 	return true;
 }
 
+static int32_t bme680_scale(float value, int32_t min, int32_t max);
+
+/** Number of readings since the last gas measurement */
+uint8_t bme_gas_count = 0;
+/** Gas measurement requested for the next reading */
+bool bme_gas_request = false;
+/** Current step of the heater profile */
+uint8_t bme_profile_step = 0;
+/** Heater temperature set in the sensor, 0 if the heater is off */
+uint16_t bme_heater_set = 0;
+/** Gas resistance of the last reading, 0 if gas was not measured */
+uint32_t bme_last_gas = 0;
+/** Heater profile step of the last reading */
+uint8_t bme_last_step = 0;
+
+/**
+ * @brief Set oversampling and gas heater from the application parameters
+ *        Default is T 8x, H 2x, P 4x and 320*C for 150 ms
+ *        The heater is switched on only for readings with gas measurement
+ *
+ */
+void bme680_apply_params(void)
+{
+	bme.setTemperatureOversampling(bme_params.temp_os);
+	bme.setHumidityOversampling(bme_params.hum_os);
+	bme.setPressureOversampling(bme_params.pres_os);
+	bme.setGasHeater(0, 0);
+	bme_heater_set = 0;
+	bme_profile_step = 0;
+	// Start with a gas measurement
+	bme_gas_count = bme_params.gas_interval;
+	iaq_timer_apply();
+}
+
+/**
+ * @brief Request a gas measurement with the next reading
+ *
+ */
+void bme680_gas_request(void)
+{
+	bme_gas_request = true;
+}
+
+/**
+ * @brief Get the heater temperature of a profile step
+ *        Step 0 is the heater temperature, steps 1 .. 3 the profile
+ *
+ * @param step Profile step
+ * @return uint16_t Heater temperature, 0 if the step is not used
+ */
+static uint16_t bme680_profile_temp(uint8_t step)
+{
+	return step == 0 ? bme_params.heater_temp : bme_params.heater_profile[step - 1];
+}
+
+/**
+ * @brief Decide if this reading measures gas and set up the heater
+ *        Readings for the air quality index between the uplinks always
+ *        measure gas at the base heater temperature and leave the
+ *        schedule and the profile of the uplinks untouched
+ *
+ * @param iaq_sample true for a reading between the uplinks
+ * @return true Gas is measured with this reading
+ * @return false Only T/H/P
+ */
+static bool bme680_gas_schedule(bool iaq_sample)
+{
+	bool gas = iaq_sample || bme_gas_request;
+	if (!iaq_sample && (bme_params.gas_interval != 0))
+	{
+		bme_gas_count++;
+		if (bme_gas_count >= bme_params.gas_interval)
+		{
+			gas = true;
+		}
+	}
+	if (bme_params.heater_temp == 0)
+	{
+		// Heater disabled
+		gas = false;
+	}
+
+	uint16_t heater_temp = 0;
+	if (gas)
+	{
+		if (!iaq_sample)
+		{
+			bme_gas_request = false;
+			bme_gas_count = 0;
+		}
+		heater_temp = bme680_profile_temp(iaq_sample ? 0 : bme_profile_step);
+	}
+	if (heater_temp != bme_heater_set)
+	{
+		bme.setGasHeater(heater_temp, heater_temp == 0 ? 0 : bme_params.heater_time);
+		bme_heater_set = heater_temp;
+	}
+	return gas;
+}
+
+/**
+ * @brief Read the sensor, or take the reading from the sensor trace while it is replayed
+ *        Recorded are temperature, humidity, pressure and gas resistance
+ *
+ */
+static void bme680_perform(void)
+{
+	uint8_t reading[16];
+	int16_t traced = trace_take(TRACE_BME, reading, sizeof(reading));
+	if (traced < 0)
+	{
+		bme.performReading();
+		memcpy(&reading[0], &bme.temperature, 4);
+		memcpy(&reading[4], &bme.humidity, 4);
+		memcpy(&reading[8], &bme.pressure, 4);
+		memcpy(&reading[12], &bme.gas_resistance, 4);
+		trace_add(TRACE_BME, reading, sizeof(reading));
+	}
+	else if (traced == sizeof(reading))
+	{
+		memcpy(&bme.temperature, &reading[0], 4);
+		memcpy(&bme.humidity, &reading[4], 4);
+		memcpy(&bme.pressure, &reading[8], 4);
+		memcpy(&bme.gas_resistance, &reading[12], 4);
+	}
+}
+
+/**
+ * @brief Read the sensor and update the air quality index
+ *
+ * @param iaq_sample true for a reading between the uplinks, measures at the base heater temperature
+ * @return true The air quality index crossed the alert threshold
+ * @return false No crossing
+ */
+static bool bme680_read(bool iaq_sample)
+{
+	bool gas = bme680_gas_schedule(iaq_sample);
+	uint8_t step = iaq_sample ? 0 : bme_profile_step;
+
+	bme680_perform();
+	uint32_t gas_resistance = gas ? bme.gas_resistance : 0;
+	if (!iaq_sample)
+	{
+		// Values of the uplink payload
+		bme_last_step = step;
+		bme_last_gas = gas_resistance;
+	}
+
+	bool crossed = false;
+	if (gas)
+	{
+		// Only the base heater temperature is comparable with the baseline
+		if (step == 0)
+		{
+			crossed = iaq_update(gas_resistance, bme680_scale(bme.humidity, 0, 10000));
+		}
+		if (!iaq_sample)
+		{
+			// Next used step of the profile for the next gas measurement
+			do
+			{
+				bme_profile_step = (bme_profile_step + 1) % BME_PROFILE_STEPS;
+			} while (bme680_profile_temp(bme_profile_step) == 0);
+		}
+		MYLOG("BME", "Gas step %d %d*C %ld Ohm", step, bme680_profile_temp(step), gas_resistance);
+	}
+	return crossed;
+}
+
+/**
+ * @brief Reading between the uplinks to check the air quality threshold
+ *
+ * @return true The air quality index crossed the alert threshold
+ * @return false No crossing
+ */
+bool bme680_sample(void)
+{
+	return bme680_read(true);
+}
+
 uint8_t bme680_get()
 {
-	bme.performReading(); 
-	
-	double temp = bme.temperature;
-	double pres = bme.pressure / 100.0;
-	double hum = bme.humidity;
-	uint32_t gas = bme.gas_resistance;
-	
+	bme680_read(false);
+
+	// Pressure is in Pa, same as hPa * 100 in the payload
+	if (bme_params.iaq_format != 0)
+	{
+		return bme680_pack_iaq(collected_data, bme.temperature, bme.humidity, bme.pressure, iaq.index, iaq.accuracy);
+	}
+	return bme680_pack(collected_data, bme.temperature, bme.humidity, bme.pressure, bme_last_gas, bme_last_step);
+}
+
+/**
+ * @brief Scale a value by 100, round and limit it
+ *        Single precision only, the FPU of the nRF52840 has no double
+ *
+ * @param value Value to scale
+ * @param min Lower limit of the result
+ * @param max Upper limit of the result
+ * @return int32_t Scaled value
+ */
+static int32_t bme680_scale(float value, int32_t min, int32_t max)
+{
+	float scaled = value * 100.0f;
+	if (scaled <= (float)min)
+	{
+		return min;
+	}
+	if (scaled >= (float)max)
+	{
+		return max;
+	}
+	return (int32_t)(scaled >= 0.0f ? scaled + 0.5f : scaled - 0.5f);
+}
+
+/**
+ * @brief Pack the payload type, temperature, humidity and pressure
+ *        Temperature is signed, humidity is limited to 0 .. 100 %RH
+ *
+ * @param buffer Payload buffer
+ * @param type Payload type
+ * @param temp Temperature in degree Celsius
+ * @param hum Humidity in %RH
+ * @param pres Pressure in Pa
+ * @return uint8_t Size of the packed values
+ */
+static uint8_t bme680_pack_thp(uint8_t *buffer, uint8_t type, float temp, float hum, uint32_t pres)
+{
 	uint8_t i = 0;
-	uint16_t t = temp * 100;
-	uint16_t h = hum * 100;
-	uint32_t pre = pres * 100;
-
-	collected_data[i++] = 0x01;
-	collected_data[i++] = (uint8_t)(t >> 8);
-	collected_data[i++] = (uint8_t)t;
-	collected_data[i++] = (uint8_t)(h >> 8);
-	collected_data[i++] = (uint8_t)h;
-	collected_data[i++] = (uint8_t)((pre & 0xFF000000) >> 24);
-	collected_data[i++] = (uint8_t)((pre & 0x00FF0000) >> 16);
-	collected_data[i++] = (uint8_t)((pre & 0x0000FF00) >> 8);
-	collected_data[i++] = (uint8_t)(pre & 0x000000FF);
-	collected_data[i++] = (uint8_t)((gas & 0xFF000000) >> 24);
-	collected_data[i++] = (uint8_t)((gas & 0x00FF0000) >> 16);
-	collected_data[i++] = (uint8_t)((gas & 0x0000FF00) >> 8);
-	collected_data[i++] = (uint8_t)(gas & 0x000000FF);
+	int16_t t = bme680_scale(temp, INT16_MIN, INT16_MAX);
+	uint16_t h = bme680_scale(hum, 0, 10000);
+
+	buffer[i++] = type;
+	buffer[i++] = (uint8_t)(t >> 8);
+	buffer[i++] = (uint8_t)t;
+	buffer[i++] = (uint8_t)(h >> 8);
+	buffer[i++] = (uint8_t)h;
+	buffer[i++] = (uint8_t)((pres & 0xFF000000) >> 24);
+	buffer[i++] = (uint8_t)((pres & 0x00FF0000) >> 16);
+	buffer[i++] = (uint8_t)((pres & 0x0000FF00) >> 8);
+	buffer[i++] = (uint8_t)(pres & 0x000000FF);
+	return i;
+}
+
+/**
+ * @brief Pack the sensor values with the raw gas resistance into the payload
+ *        Gas resistance is 0 for readings without gas measurement
+ *
+ * @param buffer Payload buffer, at least 13 bytes
+ * @param temp Temperature in degree Celsius
+ * @param hum Humidity in %RH
+ * @param pres Pressure in Pa
+ * @param gas Gas resistance in Ohm, 0 if gas was not measured
+ * @param step Heater profile step of the gas measurement
+ * @return uint8_t Size of the payload
+ */
+uint8_t bme680_pack(uint8_t *buffer, float temp, float hum, uint32_t pres, uint32_t gas, uint8_t step)
+{
+	uint8_t i = bme680_pack_thp(buffer, 0x01, temp, hum, pres);
+	// Gas resistance in 24 bit, the upper byte is the profile step
+	if (gas > 0x00FFFFFF)
+	{
+		gas = 0x00FFFFFF;
+	}
+	buffer[i++] = gas == 0 ? 0 : step;
+	buffer[i++] = (uint8_t)((gas & 0x00FF0000) >> 16);
+	buffer[i++] = (uint8_t)((gas & 0x0000FF00) >> 8);
+	buffer[i++] = (uint8_t)(gas & 0x000000FF);
 
 	return i;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Pack the sensor values with the air quality index into the payload
+ *
+ * @param buffer Payload buffer, at least 11 bytes
+ * @param temp Temperature in degree Celsius
+ * @param hum Humidity in %RH
+ * @param pres Pressure in Pa
+ * @param index Air quality index 0 .. 500
+ * @param accuracy Accuracy of the index 0 .. 3
+ * @return uint8_t Size of the payload
+ */
+uint8_t bme680_pack_iaq(uint8_t *buffer, float temp, float hum, uint32_t pres, uint16_t index, uint8_t accuracy)
+{
+	uint8_t i = bme680_pack_thp(buffer, 0x02, temp, hum, pres);
+	// One byte, 2 index points per step
+	buffer[i++] = (uint8_t)(index / 2);
+	buffer[i++] = accuracy;
+
+	return i;
+}
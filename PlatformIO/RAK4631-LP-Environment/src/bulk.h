@@ -0,0 +1,121 @@
+/**
+ * @file bulk.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Bulk data transfer over LoRa P2P with a sliding window and
+ *        selective acknowledgements. No Arduino includes, the radio is
+ *        accessed through s_bulk_radio, the same files can be compiled
+ *        with the simulated radio of bulk_sim.h on the PC.
+ * @version 0.1
+ * @date 2021-06-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef BULK_H
+#define BULK_H
+
+#include <stdint.h>
+#include <string.h>
+
+/** Frame types */
+#define BULK_START 0xB0
+#define BULK_DATA 0xB1
+#define BULK_SACK 0xB2
+#define BULK_POLL 0xB3
+/** Header of a data frame: type, session, sequence (2) */
+#define BULK_HEADER_SIZE 4
+/** Size of a START frame: type, session, size (4), frame size */
+#define BULK_START_SIZE 7
+/** Size of a SACK frame: type, session, base (2), bitmap (4) */
+#define BULK_SACK_SIZE 8
+/** Max payload of a data frame */
+#define BULK_FRAME_MAX 240
+/** Frames in flight, one bit each in the SACK bitmap */
+#define BULK_WINDOW 32
+/** Frames sent before the receiver is polled for a SACK */
+#define BULK_BURST 16
+/** Timeouts in a row before the transfer fails */
+#define BULK_MAX_RETRIES 16
+/** Time to wait for a SACK after a poll in ms */
+#ifndef BULK_SACK_TIMEOUT
+#define BULK_SACK_TIMEOUT 250
+#endif
+/** Time the receiver waits for the next frame in ms */
+#ifndef BULK_IDLE_TIMEOUT
+#define BULK_IDLE_TIMEOUT 2000
+#endif
+
+/** State of a transfer */
+#define BULK_IDLE 0
+#define BULK_OPENING 1
+#define BULK_SENDING 2
+#define BULK_LISTENING 3
+#define BULK_RECEIVING 4
+#define BULK_DONE 5
+#define BULK_FAILED 6
+
+/** Radio access, replaced by a simulated radio for tests */
+struct s_bulk_radio
+{
+	// Start sending a frame, bulk_tx_done() is called when it is out
+	bool (*send)(const uint8_t *data, uint8_t size);
+	// Start receiving, bulk_rx() is called with a frame, bulk_rx_timeout() without
+	void (*receive)(uint32_t timeout_ms);
+};
+
+/** Read data to send from the storage */
+typedef void (*bulk_read_t)(uint32_t offset, uint8_t *data, uint8_t size);
+/** Write received data into the storage */
+typedef void (*bulk_write_t)(uint32_t offset, const uint8_t *data, uint8_t size);
+
+struct s_bulk
+{
+	// BULK_IDLE .. BULK_FAILED
+	uint8_t state;
+	// Session number, frames of other sessions are ignored
+	uint8_t session;
+	// Size of the data in bytes
+	uint32_t size;
+	// Max size accepted by the receiver
+	uint32_t max_size;
+	// Payload size of a data frame
+	uint8_t frame_size;
+	// Number of data frames
+	uint16_t frames;
+	// First frame not acknowledged (sender) or not received (receiver)
+	uint16_t base;
+	// Bit n is set if frame base + n was acknowledged or received
+	uint32_t bitmap;
+	// Sender, next frame never sent before
+	uint16_t next;
+	// Sender, next frame to check for a retransmission in this burst
+	uint16_t scan;
+	// Sender, frames left in this burst
+	uint8_t burst;
+	// Sender, last frame polled the receiver, wait for its SACK
+	bool wait_sack;
+	// Timeouts in a row
+	uint8_t retries;
+	// Data frames sent and new ones received, repeated ones, SACKs, timeouts
+	uint32_t frames_sent;
+	uint32_t frames_received;
+	uint32_t retransmits;
+	uint32_t sacks;
+	uint32_t timeouts;
+	// Radio and storage
+	const s_bulk_radio *radio;
+	bulk_read_t read;
+	bulk_write_t write;
+	// Frame that is sent, kept until the radio is done with it
+	uint8_t frame[BULK_HEADER_SIZE + BULK_FRAME_MAX];
+};
+
+bool bulk_send_init(s_bulk *bulk, const s_bulk_radio *radio, uint8_t session, uint32_t size, uint8_t frame_size, bulk_read_t read);
+void bulk_receive_init(s_bulk *bulk, const s_bulk_radio *radio, uint32_t max_size, bulk_write_t write);
+void bulk_tx_done(s_bulk *bulk);
+void bulk_rx(s_bulk *bulk, const uint8_t *data, uint8_t size);
+void bulk_rx_timeout(s_bulk *bulk);
+bool bulk_finished(const s_bulk *bulk);
+
+#endif
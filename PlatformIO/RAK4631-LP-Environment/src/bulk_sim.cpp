@@ -0,0 +1,211 @@
+/**
+ * @file bulk_sim.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Simulated LoRa P2P link for the bulk transfer. Node 0 sends,
+ *        node 1 receives. A frame on the air reaches the other node if
+ *        it is listening and the frame is not lost, the loss is drawn
+ *        from a fixed pseudo random sequence so each run with the same
+ *        seed gives the same result. Time only exists in the simulation,
+ *        a transfer of many seconds is calculated in a few ms.
+ * @version 0.1
+ * @date 2021-06-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "bulk_sim.h"
+
+struct s_bulk_sim_node
+{
+	// Transfer of the node
+	s_bulk *bulk;
+	// Frame waiting to go on the air
+	uint8_t frame[BULK_HEADER_SIZE + BULK_FRAME_MAX];
+	// Size of the waiting frame, 0 = none
+	uint8_t size;
+	// Receiver is on
+	bool listening;
+	// End of the receive window in us
+	uint64_t deadline_us;
+};
+
+/** Sender and receiver */
+static s_bulk_sim_node bulk_sim_nodes[2];
+/** Simulated time in us */
+static uint64_t bulk_sim_time_us;
+/** Data that is sent and the storage of the receiver */
+static const uint8_t *bulk_sim_src;
+static uint8_t *bulk_sim_dst;
+/** Frame on the air */
+static uint8_t bulk_sim_air[BULK_HEADER_SIZE + BULK_FRAME_MAX];
+
+static bool bulk_sim_send(uint8_t node, const uint8_t *data, uint8_t size)
+{
+	memcpy(bulk_sim_nodes[node].frame, data, size);
+	bulk_sim_nodes[node].size = size;
+	bulk_sim_nodes[node].listening = false;
+	return true;
+}
+
+static void bulk_sim_receive(uint8_t node, uint32_t timeout_ms)
+{
+	bulk_sim_nodes[node].listening = true;
+	bulk_sim_nodes[node].deadline_us = bulk_sim_time_us + (uint64_t)timeout_ms * 1000;
+}
+
+static bool bulk_sim_send_0(const uint8_t *data, uint8_t size)
+{
+	return bulk_sim_send(0, data, size);
+}
+
+static bool bulk_sim_send_1(const uint8_t *data, uint8_t size)
+{
+	return bulk_sim_send(1, data, size);
+}
+
+static void bulk_sim_receive_0(uint32_t timeout_ms)
+{
+	bulk_sim_receive(0, timeout_ms);
+}
+
+static void bulk_sim_receive_1(uint32_t timeout_ms)
+{
+	bulk_sim_receive(1, timeout_ms);
+}
+
+/** Radio of each node */
+static const s_bulk_radio bulk_sim_radio[2] = {
+	{bulk_sim_send_0, bulk_sim_receive_0},
+	{bulk_sim_send_1, bulk_sim_receive_1},
+};
+
+static void bulk_sim_read(uint32_t offset, uint8_t *data, uint8_t size)
+{
+	memcpy(data, &bulk_sim_src[offset], size);
+}
+
+static void bulk_sim_write(uint32_t offset, const uint8_t *data, uint8_t size)
+{
+	memcpy(&bulk_sim_dst[offset], data, size);
+}
+
+/**
+ * @brief Time on air of a LoRa packet, CR 4/5, explicit header, 8 symbols preamble
+ *        See Semtech AN1200.13
+ *
+ * @param len Length of the packet
+ * @param sf Spreading factor
+ * @param bw_khz Bandwidth in kHz
+ * @return uint32_t Time on air in us
+ */
+uint32_t bulk_sim_airtime(uint8_t len, uint8_t sf, uint16_t bw_khz)
+{
+	uint32_t t_sym = ((uint32_t)1 << sf) * 1000 / bw_khz;
+	// Low data rate optimization above 16 ms symbol time
+	uint8_t de = t_sym >= 16000 ? 1 : 0;
+	int32_t num = 8 * len - 4 * sf + 28 + 16;
+	int32_t den = 4 * (sf - 2 * de);
+	uint32_t payload_sym = 8;
+	if (num > 0)
+	{
+		payload_sym += ((num + den - 1) / den) * 5;
+	}
+	return (payload_sym * t_sym) + (t_sym * 49 / 4);
+}
+
+/**
+ * @brief Run a transfer over the simulated link
+ *
+ * @param data Data to send
+ * @param size Size of the data
+ * @param out Storage of the receiver, at least size bytes
+ * @param frame_size Payload size of a data frame
+ * @param loss Frames lost on the air in percent
+ * @param seed Start of the pseudo random sequence
+ * @param sender Transfer of the sender, holds its statistics after the run
+ * @param receiver Transfer of the receiver
+ * @param result Time, frames and throughput
+ * @return true Data arrived complete and unchanged
+ */
+bool bulk_sim_run(const uint8_t *data, uint32_t size, uint8_t *out, uint8_t frame_size, uint8_t loss, uint32_t seed,
+				  s_bulk *sender, s_bulk *receiver, s_bulk_sim_result *result)
+{
+	memset(bulk_sim_nodes, 0, sizeof(bulk_sim_nodes));
+	memset(result, 0, sizeof(s_bulk_sim_result));
+	bulk_sim_nodes[0].bulk = sender;
+	bulk_sim_nodes[1].bulk = receiver;
+	bulk_sim_time_us = 0;
+	bulk_sim_src = data;
+	bulk_sim_dst = out;
+	uint32_t lcg = seed;
+	uint64_t done_us = 0;
+
+	bulk_receive_init(receiver, &bulk_sim_radio[1], size, bulk_sim_write);
+	if (!bulk_send_init(sender, &bulk_sim_radio[0], 1, size, frame_size, bulk_sim_read))
+	{
+		return false;
+	}
+
+	while ((!bulk_finished(sender) || !bulk_finished(receiver)) && (result->frames < BULK_SIM_MAX_FRAMES))
+	{
+		if (bulk_finished(sender) && (done_us == 0))
+		{
+			done_us = bulk_sim_time_us;
+		}
+		s_bulk_sim_node *tx = bulk_sim_nodes[0].size != 0 ? &bulk_sim_nodes[0] : (bulk_sim_nodes[1].size != 0 ? &bulk_sim_nodes[1] : NULL);
+		uint64_t start_us = bulk_sim_time_us + BULK_SIM_TURN_US;
+
+		// A receive window that ends before the next frame times out first
+		s_bulk_sim_node *timeout = NULL;
+		for (uint8_t node = 0; node < 2; node++)
+		{
+			if (bulk_sim_nodes[node].listening && ((tx == NULL) || (bulk_sim_nodes[node].deadline_us < start_us)) &&
+				((timeout == NULL) || (bulk_sim_nodes[node].deadline_us < timeout->deadline_us)))
+			{
+				timeout = &bulk_sim_nodes[node];
+			}
+		}
+		if (timeout != NULL)
+		{
+			if (timeout->deadline_us > bulk_sim_time_us)
+			{
+				bulk_sim_time_us = timeout->deadline_us;
+			}
+			timeout->listening = false;
+			bulk_rx_timeout(timeout->bulk);
+			continue;
+		}
+		if (tx == NULL)
+		{
+			// Nobody sends or listens
+			break;
+		}
+
+		s_bulk_sim_node *rx = tx == &bulk_sim_nodes[0] ? &bulk_sim_nodes[1] : &bulk_sim_nodes[0];
+		uint8_t air_size = tx->size;
+		memcpy(bulk_sim_air, tx->frame, air_size);
+		tx->size = 0;
+		bulk_sim_time_us = start_us + bulk_sim_airtime(air_size, BULK_SIM_SF, BULK_SIM_BW);
+		result->frames++;
+		lcg = lcg * 1103515245 + 12345;
+		bool lost = ((lcg >> 16) % 100) < loss;
+		if (lost)
+		{
+			result->lost++;
+		}
+		bool heard = !lost && rx->listening;
+
+		bulk_tx_done(tx->bulk);
+		if (heard)
+		{
+			rx->listening = false;
+			bulk_rx(rx->bulk, bulk_sim_air, air_size);
+		}
+	}
+
+	result->time_ms = (done_us != 0 ? done_us : bulk_sim_time_us) / 1000;
+	result->throughput = result->time_ms == 0 ? 0 : (uint64_t)size * 1000 / result->time_ms;
+	result->ok = (sender->state == BULK_DONE) && (receiver->state == BULK_DONE) && (memcmp(data, out, size) == 0);
+	return result->ok;
+}
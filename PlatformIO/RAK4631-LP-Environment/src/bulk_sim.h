@@ -0,0 +1,49 @@
+/**
+ * @file bulk_sim.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Simulated LoRa P2P link between two bulk transfer nodes with
+ *        time on air and frame loss. No Arduino includes, runs on the
+ *        device in the benchmark and on the PC together with bulk.cpp.
+ * @version 0.1
+ * @date 2021-06-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef BULK_SIM_H
+#define BULK_SIM_H
+
+#include "bulk.h"
+
+/** Simulated modulation */
+#ifndef BULK_SIM_SF
+#define BULK_SIM_SF 7
+#endif
+#ifndef BULK_SIM_BW
+#define BULK_SIM_BW 500
+#endif
+/** Time between two frames for the loop and the radio to turn around in us */
+#define BULK_SIM_TURN_US 5000
+/** Max frames on the air before the simulation gives up */
+#define BULK_SIM_MAX_FRAMES 100000
+
+struct s_bulk_sim_result
+{
+	// Simulated time until the sender is done in ms
+	uint32_t time_ms;
+	// Frames on the air in both directions
+	uint32_t frames;
+	// Frames lost on the air
+	uint32_t lost;
+	// Data bytes per second
+	uint32_t throughput;
+	// Data arrived complete and unchanged
+	bool ok;
+};
+
+uint32_t bulk_sim_airtime(uint8_t len, uint8_t sf, uint16_t bw_khz);
+bool bulk_sim_run(const uint8_t *data, uint32_t size, uint8_t *out, uint8_t frame_size, uint8_t loss, uint32_t seed,
+				  s_bulk *sender, s_bulk *receiver, s_bulk_sim_result *result);
+
+#endif
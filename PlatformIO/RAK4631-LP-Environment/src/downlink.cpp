@@ -0,0 +1,403 @@
+/**
+ * @file downlink.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Binary downlink configuration protocol
+ *        Frame on fPort DL_PORT: <version> <sequence> [<tag> <length> <value>]...
+ *        Tags with bit 7 set are read requests without value.
+ *        All writes of a frame are validated first, then applied
+ *        together and stored with one journal write.
+ *        The result is sent with the next uplink.
+ * @version 0.1
+ * @date 2021-06-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+/** Buffer for the confirmation that is added to the next uplink */
+uint8_t dl_response[DL_RESPONSE_SIZE];
+/** Length of the pending confirmation, 0 if nothing is pending */
+uint8_t dl_response_len = 0;
+
+/**
+ * @brief Get a big endian value from the downlink
+ *
+ * @param value Pointer to the value
+ * @param len Length of the value, 1 to 4 bytes
+ * @return uint32_t The value
+ */
+uint32_t dl_get_value(uint8_t *value, uint8_t len)
+{
+	uint32_t result = 0;
+	for (uint8_t idx = 0; idx < len; idx++)
+	{
+		result = (result << 8) | value[idx];
+	}
+	return result;
+}
+
+/**
+ * @brief Put a big endian value into a buffer
+ *
+ * @param buffer Buffer for the value
+ * @param value The value
+ * @param len Length of the value, 1 to 4 bytes
+ * @return uint8_t Number of bytes written
+ */
+uint8_t dl_put_value(uint8_t *buffer, uint32_t value, uint8_t len)
+{
+	for (uint8_t idx = 0; idx < len; idx++)
+	{
+		buffer[idx] = (uint8_t)(value >> (8 * (len - 1 - idx)));
+	}
+	return len;
+}
+
+/**
+ * @brief Check a data rate against the uplink data rates of a region
+ *        See Appendix I of AT-Commands.md
+ *
+ * @param region Region number of AT+BAND
+ * @param dr Data rate
+ * @return true Data rate can be used for uplinks in the region
+ */
+bool dl_valid_dr(uint8_t region, uint8_t dr)
+{
+	switch (region)
+	{
+	case LORA_BAND_AU915:
+		return dr <= 6;
+	case LORA_BAND_CN470:
+	case LORA_BAND_KR920:
+		return dr <= 5;
+	case LORA_BAND_IN865:
+		// DR6 is RFU
+		return (dr <= 5) || (dr == 7);
+	case LORA_BAND_US915:
+		return dr <= 4;
+	default:
+		// AS923, CN779, EU433, EU868 and RU864
+		return dr <= 7;
+	}
+}
+
+/**
+ * @brief Check a TX power index against the TX power table of a region
+ *        See the LoRaWAN Regional Parameters
+ *
+ * @param region Region number of AT+BAND
+ * @param power TX power index, 0 is the max power
+ * @return true TX power can be used in the region
+ */
+bool dl_valid_tx_power(uint8_t region, uint8_t power)
+{
+	switch (region)
+	{
+	case LORA_BAND_AU915:
+	case LORA_BAND_US915:
+		return power <= 14;
+	case LORA_BAND_IN865:
+		return power <= 10;
+	case LORA_BAND_CN779:
+	case LORA_BAND_EU433:
+		return power <= 5;
+	default:
+		// AS923, CN470, EU868, KR920 and RU864
+		return power <= 7;
+	}
+}
+
+/**
+ * @brief Write a LoRaWAN setting into the shadow copy
+ *
+ * @param settings Shadow copy of the settings
+ * @param tag Tag of the setting
+ * @param value Pointer to the value
+ * @param len Length of the value
+ * @return uint8_t DL_OK or error status
+ */
+uint8_t dl_write_lorawan(s_lorawan_settings *settings, uint8_t tag, uint8_t *value, uint8_t len)
+{
+	uint32_t new_value;
+	switch (tag)
+	{
+	case DL_SEND_REPEAT:
+		if (len != 4)
+		{
+			return DL_ERR_LEN;
+		}
+		// Seconds in the downlink, milliseconds in the settings
+		new_value = dl_get_value(value, len);
+		if (new_value > 86400)
+		{
+			return DL_ERR_RANGE;
+		}
+		settings->send_repeat_time = new_value * 1000;
+		return DL_OK;
+	case DL_ADR:
+	case DL_DATA_RATE:
+	case DL_TX_POWER:
+	case DL_CONFIRMED:
+	case DL_APP_PORT:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		break;
+	default:
+		return DL_ERR_TAG;
+	}
+
+	new_value = value[0];
+	switch (tag)
+	{
+	case DL_ADR:
+		settings->adr_enabled = new_value != 0;
+		break;
+	case DL_DATA_RATE:
+		if (!dl_valid_dr(settings->lora_region, new_value))
+		{
+			return DL_ERR_RANGE;
+		}
+		settings->data_rate = new_value;
+		break;
+	case DL_TX_POWER:
+		if (!dl_valid_tx_power(settings->lora_region, new_value))
+		{
+			return DL_ERR_RANGE;
+		}
+		settings->tx_power = new_value;
+		break;
+	case DL_CONFIRMED:
+		settings->confirmed_msg_enabled = new_value != 0 ? LMH_CONFIRMED_MSG : LMH_UNCONFIRMED_MSG;
+		break;
+	case DL_APP_PORT:
+		if ((new_value == 0) || (new_value > 223))
+		{
+			return DL_ERR_RANGE;
+		}
+		settings->app_port = new_value;
+		break;
+	}
+	return DL_OK;
+}
+
+/**
+ * @brief Read a LoRaWAN setting
+ *
+ * @param tag Tag of the setting
+ * @param buffer Buffer for the value
+ * @return uint8_t Length of the value, 0 if the tag is unknown
+ */
+uint8_t dl_read_lorawan(uint8_t tag, uint8_t *buffer)
+{
+	switch (tag)
+	{
+	case DL_SEND_REPEAT:
+		return dl_put_value(buffer, g_lorawan_settings.send_repeat_time / 1000, 4);
+	case DL_ADR:
+		buffer[0] = g_lorawan_settings.adr_enabled ? 1 : 0;
+		return 1;
+	case DL_DATA_RATE:
+		buffer[0] = g_lorawan_settings.data_rate;
+		return 1;
+	case DL_TX_POWER:
+		buffer[0] = g_lorawan_settings.tx_power;
+		return 1;
+	case DL_CONFIRMED:
+		buffer[0] = g_lorawan_settings.confirmed_msg_enabled == LMH_CONFIRMED_MSG ? 1 : 0;
+		return 1;
+	case DL_APP_PORT:
+		buffer[0] = g_lorawan_settings.app_port;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Apply changed LoRaWAN settings without reboot
+ *
+ * @param settings The new settings
+ */
+void dl_apply_lorawan(s_lorawan_settings *settings)
+{
+	bool timer_changed = settings->send_repeat_time != g_lorawan_settings.send_repeat_time;
+	bool dr_changed = (settings->data_rate != g_lorawan_settings.data_rate) || (settings->adr_enabled != g_lorawan_settings.adr_enabled);
+	bool power_changed = settings->tx_power != g_lorawan_settings.tx_power;
+
+	memcpy(&g_lorawan_settings, settings, sizeof(s_lorawan_settings));
+
+	// Before the join the timer is not running yet, it is started with the new time
+	if (timer_changed && g_lpwan_has_joined)
+	{
+		g_task_wakeup_timer.stop();
+		if (g_lorawan_settings.send_repeat_time != 0)
+		{
+			g_task_wakeup_timer.setPeriod(g_lorawan_settings.send_repeat_time);
+			g_task_wakeup_timer.start();
+		}
+	}
+	if (dr_changed)
+	{
+		lmh_datarate_set(g_lorawan_settings.data_rate, g_lorawan_settings.adr_enabled);
+	}
+	if (power_changed)
+	{
+		lmh_tx_power_set(g_lorawan_settings.tx_power);
+	}
+}
+
+/**
+ * @brief Parse and apply a configuration downlink
+ *        Only frames on DL_PORT are configuration, other ports are application data
+ *
+ * @param port fPort of the downlink
+ * @param data Received data
+ * @param len Length of received data
+ * @return true If the data was a configuration frame
+ * @return false If the data is not for the configuration protocol
+ */
+bool downlink_handler(uint8_t port, uint8_t *data, uint8_t len)
+{
+	if ((port != DL_PORT) || (len < 2) || (data[0] != DL_VERSION))
+	{
+		return false;
+	}
+
+	uint8_t status = DL_OK;
+	bool lorawan_changed = false;
+	bool app_changed = false;
+	bool force_adv = false;
+	uint8_t changed_tags[DL_MAX_WRITES];
+	uint8_t changed_num = 0;
+	s_lorawan_settings new_settings;
+	memcpy(&new_settings, &g_lorawan_settings, sizeof(s_lorawan_settings));
+	app_param_begin();
+
+	dl_response_len = 0;
+	dl_response[dl_response_len++] = DL_RESPONSE_TAG;
+	dl_response[dl_response_len++] = data[1];
+	dl_response[dl_response_len++] = DL_OK;
+
+	uint8_t idx = 2;
+	while ((idx < len) && (status == DL_OK))
+	{
+		uint8_t tag = data[idx++];
+		if (idx >= len)
+		{
+			status = DL_ERR_LEN;
+			break;
+		}
+		uint8_t value_len = data[idx++];
+		if ((idx + value_len) > len)
+		{
+			status = DL_ERR_LEN;
+			break;
+		}
+		uint8_t *value = &data[idx];
+		idx += value_len;
+
+		if ((tag & DL_READ) == DL_READ)
+		{
+			// Read request, answer with <tag> <length> <value>
+			uint8_t read_buff[8];
+			tag &= ~DL_READ;
+			uint8_t read_len = tag < DL_APP_TAGS ? dl_read_lorawan(tag, read_buff) : app_param_read(tag, read_buff);
+			if (read_len == 0)
+			{
+				status = DL_ERR_TAG;
+			}
+			else if ((dl_response_len + read_len + 2) > DL_RESPONSE_SIZE)
+			{
+				status = DL_ERR_SIZE;
+			}
+			else
+			{
+				dl_response[dl_response_len++] = tag;
+				dl_response[dl_response_len++] = read_len;
+				memcpy(&dl_response[dl_response_len], read_buff, read_len);
+				dl_response_len += read_len;
+			}
+		}
+		else if (tag == DL_FORCE_ADV)
+		{
+			force_adv = true;
+		}
+		else if (changed_num == DL_MAX_WRITES)
+		{
+			status = DL_ERR_SIZE;
+		}
+		else if (tag < DL_APP_TAGS)
+		{
+			status = dl_write_lorawan(&new_settings, tag, value, value_len);
+			changed_tags[changed_num++] = tag;
+			lorawan_changed = true;
+		}
+		else
+		{
+			status = app_param_write(tag, value, value_len);
+			changed_tags[changed_num++] = tag;
+			app_changed = true;
+		}
+	}
+
+	dl_response[2] = status;
+	if (status != DL_OK)
+	{
+		// Reject the complete frame, report only the status
+		MYLOG("DL", "Frame %d rejected, status %d", data[1], status);
+		dl_response_len = 3;
+		return true;
+	}
+
+	// All commands valid, apply and store them
+	if (lorawan_changed)
+	{
+		dl_apply_lorawan(&new_settings);
+	}
+	if (app_changed)
+	{
+		app_param_commit();
+	}
+	if (changed_num != 0)
+	{
+		journal_write(changed_tags, changed_num);
+	}
+	if (force_adv)
+	{
+		ble_adv_force();
+	}
+	mem_pool_mark(MEM_DL_RESPONSE, dl_response_len);
+	MYLOG("DL", "Frame %d applied", data[1]);
+	return true;
+}
+
+/**
+ * @brief Add a pending confirmation to an uplink packet
+ *
+ * @param buffer Packet buffer
+ * @param len Current length of the packet
+ * @param max_len Size of the packet buffer
+ * @return uint8_t New length of the packet
+ */
+uint8_t downlink_add_response(uint8_t *buffer, uint8_t len, uint8_t max_len)
+{
+	if ((dl_response_len == 0) || ((len + dl_response_len) > max_len))
+	{
+		return len;
+	}
+	memcpy(&buffer[len], dl_response, dl_response_len);
+	return len + dl_response_len;
+}
+
+/**
+ * @brief Clear the pending confirmation after it was enqueued
+ *
+ */
+void downlink_response_sent(void)
+{
+	dl_response_len = 0;
+}
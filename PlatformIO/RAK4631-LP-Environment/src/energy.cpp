@@ -0,0 +1,274 @@
+/**
+ * @file energy.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Energy estimate from the activity of the node
+ *        Counts wakeups and uplinks, estimates the LoRa time on air
+ *        and the BLE radio time and calculates the consumed charge
+ *        with typical currents of the RAK4631. The average current
+ *        gives a projection of the battery life.
+ * @version 0.1
+ * @date 2021-06-20
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+/** Sleep current of the RAK4631 with the sensor in uA */
+#define ENERGY_SLEEP_UA 40
+/** Current of the MCU while awake in uA */
+#define ENERGY_CPU_UA 3500
+/** Current of the SX1262 while sending in uA */
+#define ENERGY_TX_UA 125000
+/** Current of the SX1262 while receiving in uA */
+#define ENERGY_RX_UA 6000
+/** Current of the BLE radio while advertising in uA */
+#define ENERGY_BLE_UA 6000
+/** Estimated awake time for one wakeup of the loop in us */
+#define ENERGY_WAKEUP_US 3000
+/** Symbols the radio listens in each RX window */
+#define ENERGY_RX_SYMBOLS 8
+/** LoRaWAN overhead of an uplink (MHDR, FHDR, FPort, MIC) */
+#define ENERGY_LORAWAN_OVERHEAD 13
+/** Battery capacity for the projection in mAh */
+#ifndef ENERGY_BATTERY_MAH
+#define ENERGY_BATTERY_MAH 3200
+#endif
+/** Max time between two uptime updates, the tick count wraps after 48.5 days */
+#define ENERGY_WAKE_PERIOD (7 * 24 * 3600000UL)
+
+/** Activity counters and consumed charge */
+s_energy energy;
+
+/** Uptime in ticks, the tick count and millis() wrap after 48.5 days */
+static uint64_t energy_uptime = 0;
+
+/** Tick count at the last uptime update */
+static TickType_t energy_last_tick = 0;
+
+/** Timer to update the uptime before the tick count wraps */
+SoftwareTimer energy_timer;
+
+/**
+ * @brief Add an active time to a category
+ *
+ * @param category ENERGY_CPU, ENERGY_TX, ENERGY_RX or ENERGY_BLE
+ * @param time_us Active time in us
+ */
+static void energy_add(uint8_t category, uint32_t time_us)
+{
+	static const uint32_t current_ua[ENERGY_CATEGORIES] = {ENERGY_CPU_UA, ENERGY_TX_UA, ENERGY_RX_UA, ENERGY_BLE_UA};
+	energy.time_us[category] += time_us;
+	energy.charge_uams[category] += (uint64_t)current_ua[category] * time_us / 1000;
+}
+
+/**
+ * @brief Get the spreading factor and bandwidth of an uplink data rate
+ *        FSK data rates are counted as SF7 with 250 kHz
+ *
+ * @param data_rate LoRaWAN data rate
+ * @param bw_shift Bandwidth as shift of 125 kHz, 0 = 125, 1 = 250, 2 = 500 kHz
+ * @return uint8_t Spreading factor
+ */
+static uint8_t energy_sf(uint8_t data_rate, uint8_t *bw_shift)
+{
+	*bw_shift = 0;
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORA_BAND_US915:
+		// DR0 = SF10 .. DR3 = SF7, DR4 = SF8 with 500 kHz
+		if (data_rate >= 4)
+		{
+			*bw_shift = 2;
+			return 8;
+		}
+		return 10 - data_rate;
+	case LORA_BAND_AU915:
+		// DR0 = SF12 .. DR5 = SF7, DR6 = SF8 with 500 kHz
+		if (data_rate >= 6)
+		{
+			*bw_shift = 2;
+			return 8;
+		}
+		return 12 - data_rate;
+	default:
+		// DR0 = SF12 .. DR5 = SF7, DR6 = SF7 with 250 kHz, DR7 = FSK
+		if (data_rate >= 6)
+		{
+			*bw_shift = 1;
+			return 7;
+		}
+		return 12 - data_rate;
+	}
+}
+
+/**
+ * @brief Time on air of a LoRa packet, 125 kHz, CR 4/5, explicit header
+ *        See Semtech AN1200.13
+ *
+ * @param len Length of the LoRaWAN frame
+ * @param sf Spreading factor
+ * @return uint32_t Time on air in us
+ */
+uint32_t energy_time_on_air(uint8_t len, uint8_t sf)
+{
+	// Symbol time at 125 kHz in us
+	uint32_t t_sym = (1UL << sf) * 8;
+	// Low data rate optimization for SF11 and SF12
+	uint8_t de = sf >= 11 ? 1 : 0;
+	int32_t num = 8 * len - 4 * sf + 28 + 16;
+	int32_t den = 4 * (sf - 2 * de);
+	uint32_t payload_sym = 8;
+	if (num > 0)
+	{
+		payload_sym += ((num + den - 1) / den) * 5;
+	}
+	// 8 preamble symbols + 4.25 sync symbols
+	return (payload_sym * t_sym) + (t_sym * 49 / 4);
+}
+
+/**
+ * @brief Get the uptime, adds the tick count difference since the last call
+ *        Called on every wakeup and at least every 7 days by energy_timer,
+ *        so the difference never wraps
+ *
+ * @return uint64_t Uptime in ms
+ */
+uint64_t energy_uptime_ms(void)
+{
+	TickType_t now = xTaskGetTickCount();
+	energy_uptime += (TickType_t)(now - energy_last_tick);
+	energy_last_tick = now;
+	return energy_uptime * 1000 / configTICK_RATE_HZ;
+}
+
+/**
+ * @brief Wake up the loop, energy_wakeup() updates the uptime
+ *
+ * @param unused
+ */
+static void energy_timer_cb(TimerHandle_t unused)
+{
+	g_task_event_type |= LOOP_CHECK;
+	xSemaphoreGive(g_task_sem);
+}
+
+/**
+ * @brief Start the timer that keeps the uptime from wrapping
+ *        if the loop sleeps for weeks
+ *
+ */
+void energy_init(void)
+{
+	energy_uptime_ms();
+	energy_timer.begin(ENERGY_WAKE_PERIOD, energy_timer_cb, NULL, true);
+	energy_timer.start();
+}
+
+/**
+ * @brief Count a wakeup of the loop
+ *
+ */
+void energy_wakeup(void)
+{
+	energy_uptime_ms();
+	energy.wakeups++;
+	energy_add(ENERGY_CPU, ENERGY_WAKEUP_US);
+}
+
+/**
+ * @brief Count an enqueued uplink
+ *
+ * @param len Length of the payload
+ */
+void energy_uplink(uint8_t len)
+{
+	uint8_t bw_shift;
+	uint8_t sf = energy_sf(link_data_rate(), &bw_shift);
+	energy.uplinks++;
+	energy_add(ENERGY_TX, energy_time_on_air(len + ENERGY_LORAWAN_OVERHEAD, sf) >> bw_shift);
+	// RX1 and RX2 window
+	energy_add(ENERGY_RX, (2 * ENERGY_RX_SYMBOLS * (1UL << sf) * 8) >> bw_shift);
+}
+
+/**
+ * @brief Add the radio time of an advertising window
+ *
+ * @param radio_us Estimated radio on time in us
+ */
+void energy_ble(uint32_t radio_us)
+{
+	energy_add(ENERGY_BLE, radio_us);
+}
+
+/**
+ * @brief Get the average current since a snapshot of the counters
+ *
+ * @param base Counters at the start, NULL for power up
+ * @param base_ms Uptime of the snapshot in ms
+ * @return uint32_t Average current in uA
+ */
+uint32_t energy_average_since(const s_energy *base, uint64_t base_ms)
+{
+	uint64_t uptime_ms = energy_uptime_ms() - base_ms;
+	if (uptime_ms == 0)
+	{
+		return ENERGY_SLEEP_UA;
+	}
+	uint64_t charge = (uint64_t)ENERGY_SLEEP_UA * uptime_ms;
+	for (uint8_t idx = 0; idx < ENERGY_CATEGORIES; idx++)
+	{
+		charge += energy.charge_uams[idx] - (base == NULL ? 0 : base->charge_uams[idx]);
+	}
+	return (uint32_t)(charge / uptime_ms);
+}
+
+/**
+ * @brief Get the average current since power up
+ *
+ * @return uint32_t Average current in uA
+ */
+static uint32_t energy_average(void)
+{
+	return energy_average_since(NULL, 0);
+}
+
+/**
+ * @brief Print the energy estimate
+ *
+ */
+void energy_report(void)
+{
+	uint32_t avg_ua = energy_average();
+	uint32_t days = (uint32_t)ENERGY_BATTERY_MAH * 1000 / avg_ua / 24;
+	MYLOG("NRG", "Uptime %ld s, %ld wakeups, %ld uplinks", (uint32_t)(energy_uptime_ms() / 1000), energy.wakeups, energy.uplinks);
+	MYLOG("NRG", "TX %ld ms, RX %ld ms, BLE %ld ms", (uint32_t)(energy.time_us[ENERGY_TX] / 1000), (uint32_t)(energy.time_us[ENERGY_RX] / 1000), (uint32_t)(energy.time_us[ENERGY_BLE] / 1000));
+	MYLOG("NRG", "Average %ld uA, %ld days with %d mAh", avg_ua, days, ENERGY_BATTERY_MAH);
+	if (g_ble_uart_is_connected)
+	{
+		g_ble_uart.printf("Uptime %ld s, %ld wakeups, %ld uplinks\n", (uint32_t)(energy_uptime_ms() / 1000), energy.wakeups, energy.uplinks);
+		g_ble_uart.printf("Average %ld uA, %ld days with %d mAh\n", avg_ua, days, ENERGY_BATTERY_MAH);
+	}
+}
+
+/**
+ * @brief AT+ENERGY=? prints the counters and the estimate
+ *        uptime s, wakeups, uplinks, TX ms, RX ms, BLE ms, average uA, days
+ *
+ * @param read true for AT+ENERGY=?
+ * @param args Not used
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_energy(bool read, uint32_t *args)
+{
+	if (!read)
+	{
+		return AT_ERR_PARAM;
+	}
+	uint32_t avg_ua = energy_average();
+	AT_PRINTF("+ENERGY:%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld", (uint32_t)(energy_uptime_ms() / 1000), energy.wakeups, energy.uplinks,
+			  (uint32_t)(energy.time_us[ENERGY_TX] / 1000), (uint32_t)(energy.time_us[ENERGY_RX] / 1000), (uint32_t)(energy.time_us[ENERGY_BLE] / 1000),
+			  avg_ua, (uint32_t)ENERGY_BATTERY_MAH * 1000 / avg_ua / 24);
+	return 0;
+}
@@ -0,0 +1,337 @@
+/**
+ * @file frag_decoder.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Forward error correction decoder for LoRaWAN fragmented data
+ *        block transport (TS004). Fragments 1 .. M are the image, each
+ *        parity fragment N > M is the XOR of about M/2 of them.
+ *        Received fragments go straight into the image storage. Only
+ *        the lost fragments are columns of the matrix, a parity
+ *        fragment is reduced by the known fragments and solved
+ *        step by step with Gaussian elimination over GF(2).
+ *        RAM use is fixed, about 12 kB with the default limits.
+ * @version 0.1
+ * @date 2021-06-25
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "frag_decoder.h"
+
+/** Bytes of a row over the lost fragments */
+#define FRAG_ROW_BYTES (FRAG_MAX_MISSING / 8)
+
+/** Fragments received or recovered */
+static uint8_t frag_known[FRAG_MAX_NB / 8];
+/** Fragment of each column */
+static uint16_t frag_col[FRAG_MAX_MISSING];
+/** Stored equations, indexed by the column of their first bit */
+static uint8_t frag_rows[FRAG_MAX_MISSING][FRAG_ROW_BYTES];
+/** Data of the stored equations */
+static uint8_t frag_rows_data[FRAG_MAX_MISSING][FRAG_MAX_SIZE];
+/** Columns with a stored equation */
+static uint8_t frag_rows_used[FRAG_ROW_BYTES];
+/** Columns with a recovered fragment */
+static uint8_t frag_solved[FRAG_ROW_BYTES];
+/** Parity matrix row over all fragments */
+static uint8_t frag_matrix_row[FRAG_MAX_NB / 8];
+/** Equation in work */
+static uint8_t frag_eq[FRAG_ROW_BYTES];
+static uint8_t frag_eq_data[FRAG_MAX_SIZE];
+/** Buffer for reading a known fragment */
+static uint8_t frag_tmp[FRAG_MAX_SIZE];
+
+#define BIT_GET(map, idx) (((map)[(idx) >> 3] >> ((idx)&7)) & 1)
+#define BIT_SET(map, idx) ((map)[(idx) >> 3] |= (1 << ((idx)&7)))
+#define BIT_CLR(map, idx) ((map)[(idx) >> 3] &= ~(1 << ((idx)&7)))
+
+/**
+ * @brief Pseudo random generator of the parity matrix, PRBS23
+ *
+ * @param value Last value
+ * @return uint32_t Next value
+ */
+static uint32_t frag_prbs23(uint32_t value)
+{
+	uint32_t b0 = value & 0x01;
+	uint32_t b1 = (value & 0x20) >> 5;
+	return (value >> 1) + ((b0 ^ b1) << 22);
+}
+
+/**
+ * @brief Calculate a row of the parity matrix as defined in TS004
+ *
+ * @param n Number of the parity fragment, 1 for the first one after M
+ * @param m Number of uncoded fragments
+ * @param row Bit map of the uncoded fragments in this parity fragment
+ */
+void frag_parity_row(uint16_t n, uint16_t m, uint8_t *row)
+{
+	// M is a power of 2
+	uint32_t m_temp = (m & (m - 1)) == 0 ? 1 : 0;
+	uint32_t x = 1 + (1001 * (uint32_t)n);
+	memset(row, 0, (m + 7) / 8);
+	for (uint16_t nb_coeff = 0; nb_coeff < (m >> 1); nb_coeff++)
+	{
+		uint32_t r = m;
+		while (r >= m)
+		{
+			x = frag_prbs23(x);
+			r = x % (m + m_temp);
+		}
+		BIT_SET(row, r);
+	}
+}
+
+/**
+ * @brief XOR a block into another one
+ *
+ * @param dst Destination
+ * @param src Source
+ * @param size Size in bytes
+ */
+static void frag_xor(uint8_t *dst, const uint8_t *src, uint8_t size)
+{
+	for (uint8_t idx = 0; idx < size; idx++)
+	{
+		dst[idx] ^= src[idx];
+	}
+}
+
+/**
+ * @brief Find the column of a lost fragment, add it if it has none
+ *
+ * @param dec Decoder
+ * @param frag Fragment index
+ * @param add Add a new column if the fragment has none
+ * @return int16_t Column, -1 if not found or no column left
+ */
+static int16_t frag_find_col(s_frag_decoder *dec, uint16_t frag, bool add)
+{
+	for (uint16_t col = 0; col < dec->cols; col++)
+	{
+		if (frag_col[col] == frag)
+		{
+			return col;
+		}
+	}
+	if (!add || (dec->cols == FRAG_MAX_MISSING))
+	{
+		return -1;
+	}
+	frag_col[dec->cols] = frag;
+	return dec->cols++;
+}
+
+/**
+ * @brief Store a recovered fragment and remove its column from all
+ *        stored equations. Equations that are left with one column
+ *        are recovered as well.
+ *
+ * @param dec Decoder
+ * @param col Column of the recovered fragment
+ */
+static void frag_solve(s_frag_decoder *dec, uint16_t col)
+{
+	bool changed = true;
+	BIT_SET(frag_solved, col);
+	dec->write(frag_col[col], frag_rows_data[col], dec->frag_size);
+	BIT_SET(frag_known, frag_col[col]);
+	dec->known++;
+
+	while (changed)
+	{
+		changed = false;
+		for (uint16_t solved = 0; solved < dec->cols; solved++)
+		{
+			if (!BIT_GET(frag_solved, solved))
+			{
+				continue;
+			}
+			for (uint16_t row = 0; row < dec->cols; row++)
+			{
+				if ((row == solved) || !BIT_GET(frag_rows_used, row) || !BIT_GET(frag_rows[row], solved))
+				{
+					continue;
+				}
+				BIT_CLR(frag_rows[row], solved);
+				frag_xor(frag_rows_data[row], frag_rows_data[solved], dec->frag_size);
+
+				// Only the first bit left, the fragment is recovered
+				bool single = true;
+				for (uint8_t idx = 0; idx < FRAG_ROW_BYTES; idx++)
+				{
+					uint8_t bits = frag_rows[row][idx];
+					if ((row >> 3) == idx)
+					{
+						bits &= ~(1 << (row & 7));
+					}
+					if (bits != 0)
+					{
+						single = false;
+						break;
+					}
+				}
+				if (single && !BIT_GET(frag_solved, row))
+				{
+					BIT_SET(frag_solved, row);
+					dec->write(frag_col[row], frag_rows_data[row], dec->frag_size);
+					BIT_SET(frag_known, frag_col[row]);
+					dec->known++;
+					changed = true;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * @brief Reduce the equation in work with the stored ones and store it
+ *
+ * @param dec Decoder
+ */
+static void frag_add_equation(s_frag_decoder *dec)
+{
+	int16_t pivot = -1;
+	uint8_t bit_count = 0;
+	for (uint16_t col = 0; col < dec->cols; col++)
+	{
+		if (!BIT_GET(frag_eq, col))
+		{
+			continue;
+		}
+		if (BIT_GET(frag_rows_used, col))
+		{
+			// Stored equations only have bits from their own column on
+			for (uint8_t idx = 0; idx < FRAG_ROW_BYTES; idx++)
+			{
+				frag_eq[idx] ^= frag_rows[col][idx];
+			}
+			frag_xor(frag_eq_data, frag_rows_data[col], dec->frag_size);
+			continue;
+		}
+		if (pivot < 0)
+		{
+			pivot = col;
+		}
+		bit_count++;
+	}
+	if (pivot < 0)
+	{
+		// Nothing new in this equation
+		return;
+	}
+	memcpy(frag_rows[pivot], frag_eq, FRAG_ROW_BYTES);
+	memcpy(frag_rows_data[pivot], frag_eq_data, dec->frag_size);
+	BIT_SET(frag_rows_used, pivot);
+	if (bit_count == 1)
+	{
+		frag_solve(dec, pivot);
+	}
+}
+
+/**
+ * @brief Start a new image
+ *
+ * @param dec Decoder
+ * @param nb_frag Number of uncoded fragments
+ * @param frag_size Size of a fragment
+ * @param write Write a fragment into the image storage
+ * @param read Read a fragment from the image storage
+ * @return true Decoder ready
+ * @return false Image too large for the limits
+ */
+bool frag_decoder_init(s_frag_decoder *dec, uint16_t nb_frag, uint8_t frag_size, frag_write_t write, frag_read_t read)
+{
+	if ((nb_frag == 0) || (nb_frag > FRAG_MAX_NB) || (frag_size == 0) || (frag_size > FRAG_MAX_SIZE))
+	{
+		return false;
+	}
+	dec->nb_frag = nb_frag;
+	dec->frag_size = frag_size;
+	dec->known = 0;
+	dec->cols = 0;
+	dec->parity = 0;
+	dec->write = write;
+	dec->read = read;
+	memset(frag_known, 0, sizeof(frag_known));
+	memset(frag_rows_used, 0, sizeof(frag_rows_used));
+	memset(frag_solved, 0, sizeof(frag_solved));
+	return true;
+}
+
+/**
+ * @brief Handle a received fragment
+ *
+ * @param dec Decoder
+ * @param n Fragment number, 1 .. M are uncoded, above M parity
+ * @param data Fragment data, frag_size bytes
+ * @return uint8_t FRAG_DONE if the image is complete,
+ *         FRAG_TOO_MANY_LOST if more fragments are lost than can be recovered,
+ *         otherwise FRAG_ONGOING
+ */
+uint8_t frag_decoder_process(s_frag_decoder *dec, uint16_t n, const uint8_t *data)
+{
+	if ((n == 0) || (dec->known == dec->nb_frag))
+	{
+		return dec->known == dec->nb_frag ? FRAG_DONE : FRAG_ONGOING;
+	}
+
+	memset(frag_eq, 0, FRAG_ROW_BYTES);
+	memcpy(frag_eq_data, data, dec->frag_size);
+
+	if (n <= dec->nb_frag)
+	{
+		uint16_t frag = n - 1;
+		if (BIT_GET(frag_known, frag))
+		{
+			return FRAG_ONGOING;
+		}
+		int16_t col = frag_find_col(dec, frag, false);
+		if (col < 0)
+		{
+			// Not used in a parity equation yet, store it directly
+			dec->write(frag, data, dec->frag_size);
+			BIT_SET(frag_known, frag);
+			dec->known++;
+		}
+		else
+		{
+			BIT_SET(frag_eq, col);
+			frag_add_equation(dec);
+		}
+	}
+	else
+	{
+		// Missing uncoded fragments
+		if ((dec->nb_frag - dec->known) > FRAG_MAX_MISSING)
+		{
+			return FRAG_TOO_MANY_LOST;
+		}
+		frag_parity_row(n - dec->nb_frag, dec->nb_frag, frag_matrix_row);
+		dec->parity++;
+		for (uint16_t frag = 0; frag < dec->nb_frag; frag++)
+		{
+			if (!BIT_GET(frag_matrix_row, frag))
+			{
+				continue;
+			}
+			if (BIT_GET(frag_known, frag))
+			{
+				dec->read(frag, frag_tmp, dec->frag_size);
+				frag_xor(frag_eq_data, frag_tmp, dec->frag_size);
+			}
+			else
+			{
+				int16_t col = frag_find_col(dec, frag, true);
+				if (col < 0)
+				{
+					return FRAG_TOO_MANY_LOST;
+				}
+				BIT_SET(frag_eq, col);
+			}
+		}
+		frag_add_equation(dec);
+	}
+	return dec->known == dec->nb_frag ? FRAG_DONE : FRAG_ONGOING;
+}
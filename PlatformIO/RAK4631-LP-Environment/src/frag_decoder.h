@@ -0,0 +1,58 @@
+/**
+ * @file frag_decoder.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Forward error correction decoder for LoRaWAN fragmented data
+ *        block transport. No Arduino includes, the same files can be
+ *        compiled for a simulation on the PC.
+ * @version 0.1
+ * @date 2021-06-25
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef FRAG_DECODER_H
+#define FRAG_DECODER_H
+
+#include <stdint.h>
+#include <string.h>
+
+/** Max number of fragments of an image */
+#define FRAG_MAX_NB 8192
+/** Max size of a fragment */
+#define FRAG_MAX_SIZE 64
+/** Max number of lost fragments that can be recovered */
+#define FRAG_MAX_MISSING 128
+
+/** Result of frag_decoder_process() */
+#define FRAG_ONGOING 0
+#define FRAG_DONE 1
+#define FRAG_TOO_MANY_LOST 2
+
+/** Write a fragment into the image storage */
+typedef void (*frag_write_t)(uint16_t idx, const uint8_t *data, uint8_t size);
+/** Read a fragment from the image storage */
+typedef void (*frag_read_t)(uint16_t idx, uint8_t *data, uint8_t size);
+
+struct s_frag_decoder
+{
+	// Number of uncoded fragments
+	uint16_t nb_frag;
+	// Size of a fragment
+	uint8_t frag_size;
+	// Number of fragments received or recovered
+	uint16_t known;
+	// Number of lost fragments with a column in the parity matrix
+	uint16_t cols;
+	// Number of parity fragments used
+	uint16_t parity;
+	// Image storage
+	frag_write_t write;
+	frag_read_t read;
+};
+
+bool frag_decoder_init(s_frag_decoder *dec, uint16_t nb_frag, uint8_t frag_size, frag_write_t write, frag_read_t read);
+uint8_t frag_decoder_process(s_frag_decoder *dec, uint16_t n, const uint8_t *data);
+void frag_parity_row(uint16_t n, uint16_t m, uint8_t *row);
+
+#endif
@@ -0,0 +1,522 @@
+/**
+ * @file fuota.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Firmware update over LoRaWAN, fragmented data block transport
+ *        (TS004) on port 201. The fragments are written into a second
+ *        slot in the flash, lost fragments are recovered from the
+ *        parity fragments. A complete image is checked against the
+ *        CRC32 in the session descriptor and copied over the
+ *        application.
+ *        Fragments of a multicast group are handled the same way, one
+ *        session can update all nodes in the group.
+ *        The copy is not fail safe and the image is only protected by
+ *        the CRC32, only compiled with FUOTA=1 in platformio.ini.
+ * @version 0.1
+ * @date 2021-06-25
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+#include "frag_decoder.h"
+#include "flash/flash_nrf5x.h"
+
+#if FUOTA > 0
+
+/** Port of the fragmentation package */
+#define FUOTA_PORT 201
+/** Application start after the SoftDevice S140 */
+#define FUOTA_APP_START 0x26000
+/** Slot for the new image, ends at the internal file system */
+#define FUOTA_SLOT_START 0xA0000
+#define FUOTA_SLOT_SIZE 0x4D000
+/** Flash page size */
+#define FUOTA_PAGE_SIZE 4096
+/** Delay between the complete image and the swap in ms */
+#define FUOTA_SWAP_DELAY 30000
+
+/** End of the code and start of the initialized data in RAM, from the linker script */
+extern "C" uint32_t __etext;
+extern "C" uint32_t __data_start__;
+extern "C" uint32_t __data_end__;
+
+/** TS004 commands */
+#define FRAG_PACKAGE_VERSION 0x00
+#define FRAG_SESSION_STATUS 0x01
+#define FRAG_SESSION_SETUP 0x02
+#define FRAG_SESSION_DELETE 0x03
+#define FRAG_DATA_FRAGMENT 0x08
+
+/** Session state */
+#define FUOTA_IDLE 0
+#define FUOTA_RECEIVING 1
+#define FUOTA_READY 2
+#define FUOTA_FAILED 3
+
+/** Decoder of the session */
+s_frag_decoder fuota_dec;
+/** State of the session */
+uint8_t fuota_state = FUOTA_IDLE;
+/** Session setup */
+uint8_t fuota_session = 0;
+uint8_t fuota_padding = 0;
+uint8_t fuota_ack_delay = 0;
+uint32_t fuota_descriptor = 0;
+
+/** Answers for the next uplink on the fragmentation port */
+uint8_t fuota_answer[16];
+uint8_t fuota_answer_len = 0;
+
+/** Timer for the answers and the swap */
+SoftwareTimer fuota_timer;
+
+/**
+ * @brief Wake up the loop for an answer or the swap
+ *
+ */
+static void fuota_timer_cb(TimerHandle_t xTimerID)
+{
+	g_task_event_type |= FUOTA_EVENT;
+	xSemaphoreGive(g_task_sem);
+}
+
+/**
+ * @brief Start the timer for the next FUOTA event
+ *
+ * @param delay_ms Delay in ms
+ */
+static void fuota_schedule(uint32_t delay_ms)
+{
+	static bool timer_created = false;
+	if (!timer_created)
+	{
+		fuota_timer.begin(delay_ms, fuota_timer_cb, NULL, false);
+		timer_created = true;
+	}
+	fuota_timer.stop();
+	fuota_timer.setPeriod(delay_ms);
+	fuota_timer.start();
+}
+
+/**
+ * @brief Write a fragment into the image slot
+ *
+ */
+static void fuota_write(uint16_t idx, const uint8_t *data, uint8_t size)
+{
+	flash_nrf5x_write(FUOTA_SLOT_START + (uint32_t)idx * size, data, size);
+}
+
+/**
+ * @brief Read a fragment from the image slot
+ *
+ */
+static void fuota_read(uint16_t idx, uint8_t *data, uint8_t size)
+{
+	flash_nrf5x_read(data, FUOTA_SLOT_START + (uint32_t)idx * size, size);
+}
+
+/**
+ * @brief Size of the image without the padding of the last fragment
+ *
+ * @return uint32_t Image size in bytes
+ */
+static uint32_t fuota_image_size(void)
+{
+	return (uint32_t)fuota_dec.nb_frag * fuota_dec.frag_size - fuota_padding;
+}
+
+/**
+ * @brief CRC32 of the image in the slot
+ *
+ * @param size Image size
+ * @return uint32_t CRC32, same as zlib
+ */
+static uint32_t fuota_crc32(uint32_t size)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	const uint8_t *image = (const uint8_t *)FUOTA_SLOT_START;
+	for (uint32_t idx = 0; idx < size; idx++)
+	{
+		crc ^= image[idx];
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+	}
+	return ~crc;
+}
+
+/**
+ * @brief Check the complete image
+ *        CRC32 must match the session descriptor, the vector table
+ *        must point into RAM and into the image
+ *
+ * @return true Image can be swapped in
+ * @return false Image is broken
+ */
+static bool fuota_verify(void)
+{
+	uint32_t size = fuota_image_size();
+	// All fragments must be in the flash before it is read directly
+	flash_nrf5x_flush();
+
+	uint32_t crc = fuota_crc32(size);
+	if (crc != fuota_descriptor)
+	{
+		MYLOG("FUOTA", "CRC 0x%08lX, expected 0x%08lX", crc, fuota_descriptor);
+		return false;
+	}
+	const uint32_t *vectors = (const uint32_t *)FUOTA_SLOT_START;
+	if ((vectors[0] < 0x20000000) || (vectors[0] > 0x20040000) || (vectors[1] < FUOTA_APP_START) || (vectors[1] >= (FUOTA_APP_START + size)))
+	{
+		MYLOG("FUOTA", "Invalid vector table");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Copy the image over the application and restart
+ *        Runs from RAM with the SoftDevice disabled and the interrupts
+ *        off, it cannot call any function in the flash
+ *        Not fail safe, the application is erased page by page. A reset
+ *        or power loss during the copy leaves a broken application,
+ *        only the serial DFU of the bootloader can recover the node
+ *
+ * @param size Image size
+ */
+__attribute__((section(".data.fuota_copy"), noinline, long_call)) static void fuota_copy(uint32_t size)
+{
+	for (uint32_t page = 0; page < size; page += FUOTA_PAGE_SIZE)
+	{
+#if WDT_TIMEOUT > 0
+		// The copy takes several seconds
+		NRF_WDT->RR[0] = WDT_RR_RR_Reload;
+#endif
+		NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Een << NVMC_CONFIG_WEN_Pos;
+		NRF_NVMC->ERASEPAGE = FUOTA_APP_START + page;
+		while (NRF_NVMC->READY == NVMC_READY_READY_Busy)
+		{
+		}
+		NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Wen << NVMC_CONFIG_WEN_Pos;
+		for (uint32_t word = page; (word < (page + FUOTA_PAGE_SIZE)) && (word < size); word += 4)
+		{
+			*(volatile uint32_t *)(FUOTA_APP_START + word) = *(volatile uint32_t *)(FUOTA_SLOT_START + word);
+			while (NRF_NVMC->READY == NVMC_READY_READY_Busy)
+			{
+			}
+		}
+	}
+	NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Ren << NVMC_CONFIG_WEN_Pos;
+	SCB->AIRCR = (0x5FA << SCB_AIRCR_VECTKEY_Pos) | SCB_AIRCR_SYSRESETREQ_Msk;
+	__DSB();
+	while (true)
+	{
+	}
+}
+
+/**
+ * @brief Swap the new image in, does not return
+ *
+ */
+static void fuota_swap(void)
+{
+	MYLOG("FUOTA", "Swap in %ld bytes", fuota_image_size());
+	delay(100);
+	flash_nrf5x_flush();
+	sd_softdevice_disable();
+	__disable_irq();
+	fuota_copy(fuota_image_size());
+}
+
+/**
+ * @brief Add an answer for the next uplink on the fragmentation port
+ *
+ * @param answer Answer
+ * @param len Size of the answer
+ * @param delay_ms Delay before the uplink
+ */
+static void fuota_add_answer(const uint8_t *answer, uint8_t len, uint32_t delay_ms)
+{
+	if ((fuota_answer_len + len) > sizeof(fuota_answer))
+	{
+		return;
+	}
+	memcpy(&fuota_answer[fuota_answer_len], answer, len);
+	fuota_answer_len += len;
+	fuota_schedule(delay_ms);
+}
+
+/**
+ * @brief Answer to a session status request
+ *        Delayed randomly by BlockAckDelay, all nodes of a multicast
+ *        group get the request at the same time
+ *
+ */
+static void fuota_status_answer(void)
+{
+	uint16_t missing = fuota_dec.nb_frag - fuota_dec.known;
+	uint8_t answer[5];
+	answer[0] = FRAG_SESSION_STATUS;
+	answer[1] = (uint8_t)fuota_dec.known;
+	answer[2] = (uint8_t)((fuota_dec.known >> 8) & 0x3F);
+	answer[3] = missing > 255 ? 255 : missing;
+	answer[4] = fuota_state == FUOTA_FAILED ? 0x01 : 0x00;
+	uint32_t min_delay = 1UL << (fuota_ack_delay + 4);
+	fuota_add_answer(answer, 5, random(min_delay, min_delay << 3) * 1000);
+}
+
+/**
+ * @brief Get the end of the running image in flash
+ *        The initialized data is stored in flash right after the code
+ *
+ * @return uint32_t First flash address after the image
+ */
+static uint32_t fuota_app_end(void)
+{
+	return (uint32_t)&__etext + ((uint32_t)&__data_end__ - (uint32_t)&__data_start__);
+}
+
+/**
+ * @brief Set up a new session
+ *
+ * @param data Session setup, 10 bytes
+ */
+static void fuota_setup(uint8_t *data)
+{
+	uint8_t status = 0;
+	uint16_t nb_frag = data[1] | (data[2] << 8);
+	uint8_t frag_size = data[3];
+	uint8_t control = data[4];
+
+	if (((data[0] >> 4) & 0x03) != 0)
+	{
+		// Only one session
+		status |= 0x04;
+	}
+	if (((control >> 3) & 0x07) != 0)
+	{
+		// Only the TS004 parity matrix
+		status |= 0x01;
+	}
+	if (((uint32_t)nb_frag * frag_size > FUOTA_SLOT_SIZE) || (data[5] >= frag_size))
+	{
+		status |= 0x02;
+	}
+	if (fuota_app_end() > FUOTA_SLOT_START)
+	{
+		// The slot would overwrite the running application
+		MYLOG("FUOTA", "Application ends at 0x%lX, inside the slot", fuota_app_end());
+		status |= 0x02;
+	}
+	if ((status == 0) && !frag_decoder_init(&fuota_dec, nb_frag, frag_size, fuota_write, fuota_read))
+	{
+		status |= 0x02;
+	}
+	if (status == 0)
+	{
+		fuota_session = data[0];
+		fuota_ack_delay = control & 0x07;
+		fuota_padding = data[5];
+		fuota_descriptor = data[6] | (data[7] << 8) | (data[8] << 16) | ((uint32_t)data[9] << 24);
+		fuota_state = FUOTA_RECEIVING;
+		MYLOG("FUOTA", "Session %d fragments of %d bytes", nb_frag, frag_size);
+	}
+	uint8_t answer[2] = {FRAG_SESSION_SETUP, status};
+	fuota_add_answer(answer, 2, 5000);
+}
+
+/**
+ * @brief Handle a data fragment
+ *
+ * @param data Index and fragment
+ * @param len Size of the fragment with the index
+ */
+static void fuota_fragment(uint8_t *data, uint8_t len)
+{
+	if ((fuota_state != FUOTA_RECEIVING) || (len < (fuota_dec.frag_size + 2)))
+	{
+		return;
+	}
+	uint16_t index_n = data[0] | (data[1] << 8);
+	if ((index_n >> 14) != 0)
+	{
+		return;
+	}
+	uint8_t result = frag_decoder_process(&fuota_dec, index_n & 0x3FFF, &data[2]);
+	if (result == FRAG_TOO_MANY_LOST)
+	{
+		MYLOG("FUOTA", "Too many lost fragments");
+		fuota_state = FUOTA_FAILED;
+	}
+	else if (result == FRAG_DONE)
+	{
+		MYLOG("FUOTA", "Image complete, %d parity fragments used", fuota_dec.parity);
+		if (fuota_verify())
+		{
+			fuota_state = FUOTA_READY;
+			fuota_schedule(FUOTA_SWAP_DELAY);
+		}
+		else
+		{
+			fuota_state = FUOTA_FAILED;
+		}
+	}
+}
+
+/**
+ * @brief Handle a downlink on the fragmentation port
+ *        A downlink can have several commands
+ *
+ * @param data Downlink data
+ * @param len Downlink size
+ * @return true Downlink was for the fragmentation port
+ * @return false Other port
+ */
+bool fuota_handler(uint8_t port, uint8_t *data, uint8_t len)
+{
+	if (port != FUOTA_PORT)
+	{
+		return false;
+	}
+
+	uint8_t idx = 0;
+	while (idx < len)
+	{
+		uint8_t cmd = data[idx++];
+		switch (cmd)
+		{
+		case FRAG_PACKAGE_VERSION:
+		{
+			uint8_t answer[3] = {FRAG_PACKAGE_VERSION, 3, 1};
+			fuota_add_answer(answer, 3, 5000);
+			break;
+		}
+		case FRAG_SESSION_STATUS:
+			if ((idx < len) && (fuota_state != FUOTA_IDLE) && (((data[idx] >> 1) & 0x03) == 0))
+			{
+				// Bit 0 cleared, only nodes with missing fragments answer
+				if (((data[idx] & 0x01) != 0) || (fuota_dec.known != fuota_dec.nb_frag))
+				{
+					fuota_status_answer();
+				}
+			}
+			idx++;
+			break;
+		case FRAG_SESSION_SETUP:
+			if ((idx + 10) > len)
+			{
+				return true;
+			}
+			fuota_setup(&data[idx]);
+			idx += 10;
+			break;
+		case FRAG_SESSION_DELETE:
+		{
+			uint8_t answer[2] = {FRAG_SESSION_DELETE, (uint8_t)(fuota_state == FUOTA_IDLE ? 0x04 : 0x00)};
+			fuota_state = FUOTA_IDLE;
+			fuota_add_answer(answer, 2, 5000);
+			idx++;
+			break;
+		}
+		case FRAG_DATA_FRAGMENT:
+			// The fragment is the rest of the downlink
+			fuota_fragment(&data[idx], len - idx);
+			return true;
+		default:
+			// Unknown command, the rest cannot be parsed
+			return true;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Send the pending answers or swap in the new image
+ *        Called from the loop on the FUOTA event
+ *
+ */
+void fuota_event(void)
+{
+	if (fuota_answer_len != 0)
+	{
+		if (!g_lpwan_has_joined)
+		{
+			return;
+		}
+		lmh_app_data_t answer_data;
+		answer_data.buffer = fuota_answer;
+		answer_data.buffsize = fuota_answer_len;
+		answer_data.port = FUOTA_PORT;
+		if (lmh_send(&answer_data, LMH_UNCONFIRMED_MSG) == LMH_SUCCESS)
+		{
+			energy_uplink(fuota_answer_len);
+			fuota_answer_len = 0;
+		}
+		// Try again later, or continue with the swap
+		if (fuota_answer_len != 0)
+		{
+			fuota_schedule(10000);
+		}
+		else if (fuota_state == FUOTA_READY)
+		{
+			fuota_schedule(FUOTA_SWAP_DELAY);
+		}
+		return;
+	}
+	if (fuota_state == FUOTA_READY)
+	{
+		fuota_swap();
+	}
+}
+
+/**
+ * @brief Cancel the session
+ *
+ */
+void fuota_cancel(void)
+{
+	fuota_state = FUOTA_IDLE;
+}
+
+/**
+ * @brief AT+FUOTA=? prints the session state, fragments, received, parity used and lost
+ *        AT+FUOTA=0 deletes the session
+ *
+ * @param read true for AT+FUOTA=?
+ * @param args 0 to delete the session
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_fuota(bool read, uint32_t *args)
+{
+	if (!read)
+	{
+		if (args[0] != 0)
+		{
+			return AT_ERR_RANGE;
+		}
+		fuota_cancel();
+		return 0;
+	}
+	AT_PRINTF("+FUOTA:%d,%d,%d,%d,%d", fuota_state, fuota_dec.nb_frag, fuota_dec.known, fuota_dec.parity, fuota_dec.cols);
+	return 0;
+}
+
+#else
+
+bool fuota_handler(uint8_t port, uint8_t *data, uint8_t len)
+{
+	return false;
+}
+
+void fuota_event(void)
+{
+}
+
+void fuota_cancel(void)
+{
+}
+
+#endif
@@ -0,0 +1,166 @@
+/**
+ * @file iaq.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Air quality index from the BME680 gas resistance
+ *        The gas resistance is compensated for humidity and compared
+ *        with a rolling baseline of clean air. Together with the
+ *        humidity this gives an index from 0 (good) to 500 (bad).
+ *        Integer math only, the state is a few bytes.
+ * @version 0.1
+ * @date 2021-06-21
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+/** Gas samples until the baseline is usable */
+#define IAQ_BURN_IN 30
+/** Gas samples until the baseline is stable */
+#define IAQ_STABLE 120
+/** Weight of the burn-in samples, 1/4 */
+#define IAQ_BURN_IN_SHIFT 2
+/** Weight of samples above the baseline, 1/8 */
+#define IAQ_RISE_SHIFT 3
+/** Weight of samples below the baseline, 1/1024 */
+#define IAQ_FALL_SHIFT 10
+/** Reference humidity in 0.01 %RH */
+#define IAQ_HUM_REF 4000
+/** Humidity compensation, gas resistance change per 0.01 %RH in 1/1000000 */
+#define IAQ_HUM_COMP 150
+
+/** Air quality state */
+s_iaq iaq;
+
+/** Timer for readings between the uplinks */
+SoftwareTimer iaq_timer;
+
+/**
+ * @brief Wake up the loop for a reading
+ *
+ */
+static void iaq_timer_cb(TimerHandle_t xTimerID)
+{
+	g_task_event_type |= IAQ_SAMPLE;
+	xSemaphoreGive(g_task_sem);
+}
+
+/**
+ * @brief Start or stop the reading timer from the application parameters
+ *
+ */
+void iaq_timer_apply(void)
+{
+	static bool timer_created = false;
+	if (!timer_created)
+	{
+		iaq_timer.begin(60000, iaq_timer_cb);
+		timer_created = true;
+	}
+	iaq_timer.stop();
+	if (bme_params.iaq_interval != 0)
+	{
+		iaq_timer.setPeriod(bme_params.iaq_interval * 1000);
+		iaq_timer.start();
+	}
+}
+
+/**
+ * @brief Add a gas measurement to the air quality index
+ *
+ * @param gas Gas resistance in Ohm
+ * @param hum Humidity in 0.01 %RH
+ * @return true The index crossed the alert threshold
+ * @return false No crossing
+ */
+bool iaq_update(uint32_t gas, uint16_t hum)
+{
+	if (gas == 0)
+	{
+		return false;
+	}
+
+	// Gas resistance drops with rising humidity
+	int32_t hum_diff = (int32_t)hum - IAQ_HUM_REF;
+	int64_t comp = (int64_t)gas * (1000000 + hum_diff * IAQ_HUM_COMP) / 1000000;
+	if (comp < 1)
+	{
+		comp = 1;
+	}
+
+	// Rolling baseline of clean air, follows rising values fast and falling values slow
+	if (iaq.samples == 0)
+	{
+		iaq.baseline = comp;
+	}
+	else if (iaq.samples < IAQ_BURN_IN)
+	{
+		// Heater plate is still settling
+		iaq.baseline += (comp - (int64_t)iaq.baseline) >> IAQ_BURN_IN_SHIFT;
+	}
+	else if (comp > iaq.baseline)
+	{
+		iaq.baseline += (comp - iaq.baseline) >> IAQ_RISE_SHIFT;
+		iaq.clean_age = 0;
+	}
+	else
+	{
+		iaq.baseline -= (iaq.baseline - comp) >> IAQ_FALL_SHIFT;
+	}
+	if (iaq.samples < 0xFFFF)
+	{
+		iaq.samples++;
+	}
+	if (iaq.clean_age < 0xFFFF)
+	{
+		iaq.clean_age++;
+	}
+
+	// Humidity score, max 25 % at the reference humidity
+	uint32_t hum_score = hum < IAQ_HUM_REF ? 2500UL * hum / IAQ_HUM_REF : 2500UL * (10000 - hum) / (10000 - IAQ_HUM_REF);
+	// Gas score, max 75 % at or above the baseline
+	uint32_t gas_score = comp >= iaq.baseline ? 7500 : (uint32_t)(7500 * comp / iaq.baseline);
+	uint16_t new_index = (10000 - hum_score - gas_score) * 5 / 100;
+
+	uint8_t old_accuracy = iaq.accuracy;
+	if (iaq.samples < IAQ_BURN_IN)
+	{
+		iaq.accuracy = IAQ_ACC_BURN_IN;
+	}
+	else if (iaq.samples < IAQ_STABLE)
+	{
+		iaq.accuracy = IAQ_ACC_LOW;
+	}
+	else
+	{
+		// Calibrated if clean air was seen recently
+		iaq.accuracy = iaq.clean_age < IAQ_STABLE ? IAQ_ACC_HIGH : IAQ_ACC_MEDIUM;
+	}
+
+	bool crossed = false;
+	if ((bme_params.iaq_threshold != 0) && (old_accuracy != IAQ_ACC_BURN_IN) && (iaq.accuracy != IAQ_ACC_BURN_IN))
+	{
+		crossed = (iaq.index < bme_params.iaq_threshold) != (new_index < bme_params.iaq_threshold);
+	}
+	iaq.index = new_index;
+	MYLOG("IAQ", "IAQ %d accuracy %d baseline %ld", iaq.index, iaq.accuracy, iaq.baseline);
+	return crossed;
+}
+
+/**
+ * @brief AT+IAQSTAT=? prints the index, accuracy, baseline and number of samples
+ *
+ * @param read true for AT+IAQSTAT=?
+ * @param args Not used
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_iaq_stat(bool read, uint32_t *args)
+{
+	if (!read)
+	{
+		return AT_ERR_PARAM;
+	}
+	AT_PRINTF("+IAQSTAT:%d,%d,%ld,%d", iaq.index, iaq.accuracy, iaq.baseline, iaq.samples);
+	return 0;
+}
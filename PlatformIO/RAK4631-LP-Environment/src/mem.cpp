@@ -0,0 +1,155 @@
+/**
+ * @file mem.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Memory high-water marks of the heap, the task stacks and the
+ *        static buffers of the application.
+ *        With HEAP_CHECK=1 in platformio.ini, malloc(), calloc() and
+ *        realloc() are wrapped and every heap allocation after init is
+ *        counted with the address of the caller. HEAP_CHECK=2 stops the
+ *        application on such an allocation.
+ * @version 0.1
+ * @date 2021-06-23
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+#include <malloc.h>
+
+/** Flag if init is finished, heap allocations are counted after it */
+static bool mem_init_done = false;
+/** Heap allocations after init */
+volatile uint32_t mem_late_allocs = 0;
+/** Caller of the last heap allocation after init */
+volatile uint32_t mem_late_caller = 0;
+/** Size of the last heap allocation after init */
+volatile uint32_t mem_late_size = 0;
+
+#if HEAP_CHECK > 0
+extern "C"
+{
+	void *__real_malloc(size_t size);
+	void *__real_calloc(size_t num, size_t size);
+	void *__real_realloc(void *ptr, size_t size);
+
+	/**
+	 * @brief Count a heap allocation after init
+	 *
+	 * @param caller Return address of the allocation
+	 * @param size Requested size
+	 */
+	static void mem_late_alloc(void *caller, size_t size)
+	{
+		if (mem_init_done)
+		{
+			mem_late_allocs++;
+			mem_late_caller = (uint32_t)caller;
+			mem_late_size = size;
+		}
+	}
+
+	void *__wrap_malloc(size_t size)
+	{
+		mem_late_alloc(__builtin_return_address(0), size);
+		return __real_malloc(size);
+	}
+
+	void *__wrap_calloc(size_t num, size_t size)
+	{
+		mem_late_alloc(__builtin_return_address(0), num * size);
+		return __real_calloc(num, size);
+	}
+
+	void *__wrap_realloc(void *ptr, size_t size)
+	{
+		mem_late_alloc(__builtin_return_address(0), size);
+		return __real_realloc(ptr, size);
+	}
+}
+#endif
+
+/**
+ * @brief Record the use of a static buffer
+ *
+ * @param pool Index in mem_pools[]
+ * @param used Used size
+ */
+void mem_pool_mark(uint8_t pool, uint16_t used)
+{
+	if ((pool < mem_pools_num) && (used > mem_pools[pool].high))
+	{
+		mem_pools[pool].high = used;
+	}
+}
+
+/**
+ * @brief Init is finished, from now on heap allocations are counted
+ *
+ */
+void mem_init_finished(void)
+{
+	mem_init_done = true;
+}
+
+/**
+ * @brief Check for heap allocations after init, call from the loop
+ *        Logs once for each new allocation
+ *
+ */
+void mem_check(void)
+{
+	static uint32_t reported = 0;
+	if (mem_late_allocs != reported)
+	{
+		reported = mem_late_allocs;
+		MYLOG("MEM", "ERROR heap allocation after init, %ld bytes from 0x%08lX, %ld in total", mem_late_size, mem_late_caller, reported);
+#if HEAP_CHECK > 1
+		while (true)
+		{
+			MYLOG("MEM", "Stopped, heap allocation after init from 0x%08lX", mem_late_caller);
+			delay(5000);
+		}
+#endif
+	}
+}
+
+/**
+ * @brief AT+MEM=? prints the heap, the stack of each task and the static buffers
+ *        +MEM:HEAP,<used>,<high-water>,<allocations after init>,<last caller>
+ *        +MEM:<task>,<min free stack in bytes>
+ *        +MEM:<buffer>,<high-water>,<size>
+ *
+ * @param read true for AT+MEM=?
+ * @param args Not used
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_mem(bool read, uint32_t *args)
+{
+	if (!read)
+	{
+		return AT_ERR_PARAM;
+	}
+
+	// The heap only grows, its size is the high-water mark
+	struct mallinfo info = mallinfo();
+	AT_PRINTF("+MEM:HEAP,%d,%d,%ld,0x%08lX", info.uordblks, info.arena, mem_late_allocs, mem_late_caller);
+
+#if configUSE_TRACE_FACILITY == 1
+	TaskStatus_t tasks[MEM_MAX_TASKS];
+	UBaseType_t num = uxTaskGetSystemState(tasks, MEM_MAX_TASKS, NULL);
+	for (UBaseType_t idx = 0; idx < num; idx++)
+	{
+		AT_PRINTF("+MEM:%s,%d", tasks[idx].pcTaskName, tasks[idx].usStackHighWaterMark * sizeof(StackType_t));
+	}
+#else
+	// Without trace facility only the loop task is known
+	AT_PRINTF("+MEM:%s,%d", pcTaskGetName(NULL), uxTaskGetStackHighWaterMark(NULL) * sizeof(StackType_t));
+#endif
+
+	for (uint8_t idx = 0; idx < mem_pools_num; idx++)
+	{
+		AT_PRINTF("+MEM:%s,%d,%d", mem_pools[idx].name, mem_pools[idx].high, mem_pools[idx].size);
+	}
+	return 0;
+}
@@ -0,0 +1,346 @@
+/**
+ * @file params.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Application parameters, base storage in flash and
+ *        access from the downlink configuration protocol
+ * @version 0.1
+ * @date 2021-06-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+#include <Adafruit_LittleFS.h>
+#include <InternalFileSystem.h>
+using namespace Adafruit_LittleFS_Namespace;
+
+/** Filename of the application parameters */
+static const char app_params_name[] = "APP";
+
+/** Active application parameters */
+s_bme_params bme_params;
+
+/** Shadow copy for the downlink configuration */
+s_bme_params new_bme_params;
+
+/** Gas measurement requested with the configuration */
+static bool new_gas_request = false;
+
+/** Application AT commands, map to application parameters or have their own handler */
+constexpr s_at_cmd app_at_cmds[] = {
+	{AT_NAME("+BMEOS"), "Get or set the oversampling of T, H and P 0 = off, 1 = 1x .. 5 = 16x", 3, {DL_BME_TEMP_OS, DL_BME_HUM_OS, DL_BME_PRES_OS}, {1, 1, 1}},
+	{AT_NAME("+BMEHEAT"), "Get or set the gas heater temperature in degree Celsius and duration in ms", 2, {DL_BME_HEATER_TEMP, DL_BME_HEATER_TIME}, {2, 2}},
+	{AT_NAME("+BMEGAS"), "Get or set the gas measurement interval, every N-th reading, 0 = only on request", 1, {DL_BME_GAS_INTERVAL}, {1}},
+	{AT_NAME("+BMEPROF"), "Get or set the heater temperature of profile steps 2 .. 4, 0 = step not used", 3, {DL_BME_PROFILE_2, DL_BME_PROFILE_3, DL_BME_PROFILE_4}, {2, 2, 2}},
+	{AT_NAME("+BMEGASNOW"), "Measure gas with the next reading, write 1", 1, {DL_BME_GAS_NOW}, {1}},
+	{AT_NAME("+IAQ"), "Get or set the uplink format 0 = raw gas 1 = IAQ, IAQ alert threshold 0 = off and reading interval in seconds", 3, {DL_IAQ_FORMAT, DL_IAQ_THRESHOLD, DL_IAQ_INTERVAL}, {1, 2, 2}},
+	{AT_NAME("+IAQSTAT"), "Show IAQ, accuracy 0 .. 3, gas baseline in Ohm and number of gas samples", 0, {}, {}, at_iaq_stat},
+	{AT_NAME("+LINK"), "Get or set the link estimator 0 = off 1 = confirmation 2 = confirmation and data rate, and the SNR margin in dB", 2, {DL_LINK_MODE, DL_LINK_MARGIN}, {1, 1}},
+	{AT_NAME("+LINKSTAT"), "Show link mode, data rate, SNR in 0.1 dB, RSSI, ACK permille, confirm interval, uplinks, confirmed and ACKs", 0, {}, {}, at_link_stat},
+	{AT_NAME("+DIAG"), "Get or set the loop latency block in every N-th uplink, 0 = off", 1, {DL_DIAG_INTERVAL}, {1}},
+	{AT_NAME("+LOOP"), "Show the loop latency of each event bit and of the wake ups, 0 to clear", 1, {}, {}, at_loop},
+	{AT_NAME("+BOOT"), "Show the boot timeline in us since reset", 0, {}, {}, at_boot},
+	{AT_NAME("+ENERGY"), "Show uptime, wakeups, uplinks, TX, RX and BLE ms, average uA and battery days", 0, {}, {}, at_energy},
+	{AT_NAME("+MEM"), "Show heap, task stack and buffer high-water marks", 0, {}, {}, at_mem},
+	{AT_NAME("+RXRING"), "Show received, dropped and queued downlinks", 0, {}, {}, at_rx_ring},
+#if BULK > 0
+	{AT_NAME("+BULK"), "Offload over LoRa P2P 1 = send the log 2 = collect 0 = cancel, read gives role, state, size, frames, base, sent, received, repeated, SACKs, timeouts and ms", 1, {}, {}, at_bulk},
+#endif
+	{AT_NAME("+TRACE"), "Sensor trace 1 = record 2 = replay 3 = print 0 = stop, read gives mode, bytes, records, mismatches, replay s, wakeups, uplinks and uA", 1, {}, {}, at_trace},
+#if FUOTA > 0
+	{AT_NAME("+FUOTA"), "Show firmware update state, fragments, received, parity used and lost, 0 to cancel", 1, {}, {}, at_fuota},
+#endif
+#if BENCH > 0
+	{AT_NAME("+BENCH"), "Run the benchmarks, result in CPU cycles", 0, {}, {}, at_bench},
+#endif
+};
+const uint8_t app_at_cmds_num = sizeof(app_at_cmds) / sizeof(s_at_cmd);
+constexpr uint16_t app_at_seed = at_find_seed(app_at_cmds, sizeof(app_at_cmds) / sizeof(s_at_cmd));
+static_assert(app_at_seed < AT_MAX_SEED, "No collision free AT command slots, rename the command or increase AT_SLOT_BITS");
+constexpr s_at_index app_at_index = at_make_index(app_at_cmds, sizeof(app_at_cmds) / sizeof(s_at_cmd), app_at_seed, at_make_seq<AT_SLOTS>::type());
+
+/** File to store the parameters */
+static File params_file(InternalFS);
+
+/**
+ * @brief Load the parameters from flash, keep the defaults if none are saved
+ *        Changes since the last save are in the journal
+ *
+ */
+void app_param_load(void)
+{
+	s_bme_params flash_params;
+	uint8_t crc[2];
+
+	InternalFS.begin();
+	if (params_file.open(app_params_name, FILE_O_READ))
+	{
+		if ((params_file.read((uint8_t *)&flash_params, sizeof(s_bme_params)) == sizeof(s_bme_params)) && (params_file.read(crc, 2) == 2))
+		{
+			uint16_t check = crc16((uint8_t *)&flash_params, sizeof(s_bme_params), 0xFFFF);
+			if ((flash_params.valid_mark == APP_PARAMS_MARK) && (crc[0] == (uint8_t)(check >> 8)) && (crc[1] == (uint8_t)check))
+			{
+				memcpy(&bme_params, &flash_params, sizeof(s_bme_params));
+				MYLOG("PARAM", "Parameters loaded from flash");
+			}
+		}
+		params_file.close();
+	}
+}
+
+/**
+ * @brief Save the parameters to flash, called when the journal is compacted
+ *
+ */
+void app_param_save(void)
+{
+	uint16_t check = crc16((uint8_t *)&bme_params, sizeof(s_bme_params), 0xFFFF);
+	uint8_t crc[2] = {(uint8_t)(check >> 8), (uint8_t)check};
+
+	InternalFS.remove(app_params_name);
+	if (params_file.open(app_params_name, FILE_O_WRITE))
+	{
+		params_file.write((uint8_t *)&bme_params, sizeof(s_bme_params));
+		params_file.write(crc, 2);
+		params_file.flush();
+		params_file.close();
+	}
+}
+
+/**
+ * @brief Start a downlink configuration, changes go into a shadow copy
+ *
+ */
+void app_param_begin(void)
+{
+	memcpy(&new_bme_params, &bme_params, sizeof(s_bme_params));
+	new_gas_request = false;
+}
+
+/**
+ * @brief Write a parameter into the shadow copy
+ *
+ * @param tag Tag of the parameter
+ * @param value Pointer to the value
+ * @param len Length of the value
+ * @return uint8_t DL_OK or error status
+ */
+uint8_t app_param_write(uint8_t tag, uint8_t *value, uint8_t len)
+{
+	uint32_t new_value = dl_get_value(value, len);
+	switch (tag)
+	{
+	case DL_BME_TEMP_OS:
+	case DL_BME_HUM_OS:
+	case DL_BME_PRES_OS:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		if (new_value > BME680_OS_16X)
+		{
+			return DL_ERR_RANGE;
+		}
+		if (tag == DL_BME_TEMP_OS)
+		{
+			new_bme_params.temp_os = new_value;
+		}
+		else if (tag == DL_BME_HUM_OS)
+		{
+			new_bme_params.hum_os = new_value;
+		}
+		else
+		{
+			new_bme_params.pres_os = new_value;
+		}
+		return DL_OK;
+	case DL_BME_HEATER_TEMP:
+	case DL_BME_PROFILE_2:
+	case DL_BME_PROFILE_3:
+	case DL_BME_PROFILE_4:
+		if (len != 2)
+		{
+			return DL_ERR_LEN;
+		}
+		// 0 disables the heater or the profile step
+		if (new_value > 400)
+		{
+			return DL_ERR_RANGE;
+		}
+		if (tag == DL_BME_HEATER_TEMP)
+		{
+			new_bme_params.heater_temp = new_value;
+		}
+		else
+		{
+			new_bme_params.heater_profile[tag - DL_BME_PROFILE_2] = new_value;
+		}
+		return DL_OK;
+	case DL_BME_HEATER_TIME:
+		if (len != 2)
+		{
+			return DL_ERR_LEN;
+		}
+		if (new_value > 4032)
+		{
+			return DL_ERR_RANGE;
+		}
+		new_bme_params.heater_time = new_value;
+		return DL_OK;
+	case DL_BME_GAS_INTERVAL:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		new_bme_params.gas_interval = new_value;
+		return DL_OK;
+	case DL_IAQ_FORMAT:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		if (new_value > 1)
+		{
+			return DL_ERR_RANGE;
+		}
+		new_bme_params.iaq_format = new_value;
+		return DL_OK;
+	case DL_IAQ_THRESHOLD:
+		if (len != 2)
+		{
+			return DL_ERR_LEN;
+		}
+		if (new_value > 500)
+		{
+			return DL_ERR_RANGE;
+		}
+		new_bme_params.iaq_threshold = new_value;
+		return DL_OK;
+	case DL_IAQ_INTERVAL:
+		if (len != 2)
+		{
+			return DL_ERR_LEN;
+		}
+		// 0 = off, otherwise min 10 seconds
+		if ((new_value != 0) && (new_value < 10))
+		{
+			return DL_ERR_RANGE;
+		}
+		new_bme_params.iaq_interval = new_value;
+		return DL_OK;
+	case DL_LINK_MODE:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		if (new_value > LINK_DR)
+		{
+			return DL_ERR_RANGE;
+		}
+		new_bme_params.link_mode = new_value;
+		return DL_OK;
+	case DL_LINK_MARGIN:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		if (new_value > 30)
+		{
+			return DL_ERR_RANGE;
+		}
+		new_bme_params.link_margin = new_value;
+		return DL_OK;
+	case DL_DIAG_INTERVAL:
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		new_bme_params.diag_interval = new_value;
+		return DL_OK;
+	case DL_BME_GAS_NOW:
+		// Action only, not stored and not readable
+		if (len != 1)
+		{
+			return DL_ERR_LEN;
+		}
+		new_gas_request = new_value != 0;
+		return DL_OK;
+	default:
+		return DL_ERR_TAG;
+	}
+}
+
+/**
+ * @brief Read a parameter
+ *
+ * @param tag Tag of the parameter
+ * @param buffer Buffer for the value
+ * @return uint8_t Length of the value, 0 if the tag is unknown
+ */
+uint8_t app_param_read(uint8_t tag, uint8_t *buffer)
+{
+	switch (tag)
+	{
+	case DL_BME_TEMP_OS:
+		return dl_put_value(buffer, bme_params.temp_os, 1);
+	case DL_BME_HUM_OS:
+		return dl_put_value(buffer, bme_params.hum_os, 1);
+	case DL_BME_PRES_OS:
+		return dl_put_value(buffer, bme_params.pres_os, 1);
+	case DL_BME_HEATER_TEMP:
+		return dl_put_value(buffer, bme_params.heater_temp, 2);
+	case DL_BME_HEATER_TIME:
+		return dl_put_value(buffer, bme_params.heater_time, 2);
+	case DL_BME_GAS_INTERVAL:
+		return dl_put_value(buffer, bme_params.gas_interval, 1);
+	case DL_BME_PROFILE_2:
+	case DL_BME_PROFILE_3:
+	case DL_BME_PROFILE_4:
+		return dl_put_value(buffer, bme_params.heater_profile[tag - DL_BME_PROFILE_2], 2);
+	case DL_IAQ_FORMAT:
+		return dl_put_value(buffer, bme_params.iaq_format, 1);
+	case DL_IAQ_THRESHOLD:
+		return dl_put_value(buffer, bme_params.iaq_threshold, 2);
+	case DL_IAQ_INTERVAL:
+		return dl_put_value(buffer, bme_params.iaq_interval, 2);
+	case DL_LINK_MODE:
+		return dl_put_value(buffer, bme_params.link_mode, 1);
+	case DL_LINK_MARGIN:
+		return dl_put_value(buffer, bme_params.link_margin, 1);
+	case DL_DIAG_INTERVAL:
+		return dl_put_value(buffer, bme_params.diag_interval, 1);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Apply the shadow copy to the sensor and the link estimator
+ *
+ */
+void app_param_commit(void)
+{
+	if (new_gas_request)
+	{
+		bme680_gas_request();
+	}
+	if (memcmp(&new_bme_params, &bme_params, sizeof(s_bme_params)) == 0)
+	{
+		return;
+	}
+	memcpy(&bme_params, &new_bme_params, sizeof(s_bme_params));
+	bme680_apply_params();
+	link_set_params(bme_params.link_mode, bme_params.link_margin);
+}
+
+/**
+ * @brief Take over the shadow copy without applying it,
+ *        used at boot before the sensor is initialized
+ *
+ */
+void app_param_restore(void)
+{
+	memcpy(&bme_params, &new_bme_params, sizeof(s_bme_params));
+}
@@ -0,0 +1,201 @@
+/**
+ * @file rx_ring.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Ring buffer of received LoRaWAN frames with port, RSSI and SNR
+ *        Single producer, single consumer without locks. The frame is
+ *        queued in the LoRaWAN RX callback, before the next frame can
+ *        overwrite the receive buffer of the WisBlock-API, and handled
+ *        later by lora_data_handler() in its slot.
+ *        The RX callback belongs to the WisBlock-API and has no hook.
+ *        It ends by waking the loop task with g_task_sem, with RX_RING=1
+ *        the semaphore give is wrapped by the linker (see platformio.ini)
+ *        and queues the frame while the callback still runs.
+ *        In class C a burst of downlinks is queued instead of
+ *        overwriting each other.
+ * @version 0.1
+ * @date 2021-06-24
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+/** Slots of the ring, written by the producer, read by the consumer */
+s_rx_frame rx_ring[RX_RING_SLOTS];
+/** Next slot to write, changed only by the producer */
+volatile uint8_t rx_ring_head = 0;
+/** Next slot to read, changed only by the consumer */
+volatile uint8_t rx_ring_tail = 0;
+
+/** Frames received */
+uint32_t rx_ring_received = 0;
+/** Frames dropped because the ring was full */
+uint32_t rx_ring_dropped = 0;
+
+/**
+ * @brief Get the next free slot to write a frame into
+ *        Producer only, the slot is queued with rx_ring_commit()
+ *
+ * @return s_rx_frame* Free slot, NULL if the ring is full
+ */
+s_rx_frame *rx_ring_reserve(void)
+{
+	uint8_t head = rx_ring_head;
+	if ((uint8_t)(head - rx_ring_tail) >= RX_RING_SLOTS)
+	{
+		rx_ring_dropped++;
+		return NULL;
+	}
+	return &rx_ring[head % RX_RING_SLOTS];
+}
+
+/**
+ * @brief Queue the slot returned by rx_ring_reserve()
+ *        Producer only
+ *
+ */
+void rx_ring_commit(void)
+{
+	// Frame must be complete before the consumer can see it
+	__DMB();
+	rx_ring_head = rx_ring_head + 1;
+	rx_ring_received++;
+	mem_pool_mark(MEM_RX_RING, (uint8_t)(rx_ring_head - rx_ring_tail));
+}
+
+/**
+ * @brief Copy a frame into the ring
+ *        Producer only
+ *
+ * @param data Frame payload
+ * @param len Payload size
+ * @param port LoRaWAN port
+ * @param rssi RSSI of the frame
+ * @param snr SNR of the frame
+ * @return true Frame queued
+ * @return false Ring full or frame too large, frame dropped
+ */
+bool rx_ring_push(const uint8_t *data, uint8_t len, uint8_t port, int16_t rssi, int8_t snr)
+{
+	if (len > RX_FRAME_MAX)
+	{
+		rx_ring_dropped++;
+		return false;
+	}
+	s_rx_frame *frame = rx_ring_reserve();
+	if (frame == NULL)
+	{
+		return false;
+	}
+	memcpy(frame->data, data, len);
+	frame->len = len;
+	frame->port = port;
+	frame->rssi = rssi;
+	frame->snr = snr;
+	rx_ring_commit();
+	return true;
+}
+
+/**
+ * @brief Queue the frame the RX callback just copied into g_rx_lora_data
+ *        LORA_DATA is replaced by RX_FRAME, a frame is queued only once
+ *        and the next frame sets LORA_DATA again
+ *
+ * @param sem Semaphore that is given
+ */
+static void rx_ring_from_callback(void *sem)
+{
+	if ((sem != (void *)g_task_sem) || ((g_task_event_type & LORA_DATA) == 0))
+	{
+		return;
+	}
+	rx_ring_push(g_rx_lora_data, g_rx_data_len, g_last_fport, g_last_rssi, g_last_snr);
+	g_task_event_type = (g_task_event_type & N_LORA_DATA) | RX_FRAME;
+}
+
+#if RX_RING > 0
+extern "C"
+{
+	BaseType_t __real_xQueueGenericSend(QueueHandle_t queue, const void *const item, TickType_t wait, const BaseType_t position);
+	BaseType_t __real_xQueueGiveFromISR(QueueHandle_t queue, BaseType_t *const woken);
+
+	/**
+	 * @brief xSemaphoreGive() of the RX callback, queues the frame first
+	 *
+	 */
+	BaseType_t __wrap_xQueueGenericSend(QueueHandle_t queue, const void *const item, TickType_t wait, const BaseType_t position)
+	{
+		rx_ring_from_callback(queue);
+		return __real_xQueueGenericSend(queue, item, wait, position);
+	}
+
+	/**
+	 * @brief xSemaphoreGiveFromISR() of the RX callback, queues the frame first
+	 *
+	 */
+	BaseType_t __wrap_xQueueGiveFromISR(QueueHandle_t queue, BaseType_t *const woken)
+	{
+		rx_ring_from_callback(queue);
+		return __real_xQueueGiveFromISR(queue, woken);
+	}
+}
+#endif
+
+/**
+ * @brief Queue a frame that is still in g_rx_lora_data
+ *        Without RX_RING the frame is queued only when the LORA_DATA event
+ *        is handled, a second frame before that overwrites the first one
+ *
+ */
+void rx_ring_take_pending(void)
+{
+	rx_ring_from_callback(g_task_sem);
+}
+
+/**
+ * @brief Get the oldest queued frame, it stays in the ring until released
+ *        Consumer only
+ *
+ * @return s_rx_frame* Oldest frame, NULL if the ring is empty
+ */
+s_rx_frame *rx_ring_peek(void)
+{
+	uint8_t tail = rx_ring_tail;
+	if (tail == rx_ring_head)
+	{
+		return NULL;
+	}
+	// Read the frame only after the head was seen
+	__DMB();
+	return &rx_ring[tail % RX_RING_SLOTS];
+}
+
+/**
+ * @brief Release the frame returned by rx_ring_peek()
+ *        Consumer only
+ *
+ */
+void rx_ring_release(void)
+{
+	// Done with the frame before the producer can reuse the slot
+	__DMB();
+	rx_ring_tail = rx_ring_tail + 1;
+}
+
+/**
+ * @brief AT+RXRING=? prints the received, dropped and queued frames
+ *
+ * @param read true for AT+RXRING=?
+ * @param args Not used
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_rx_ring(bool read, uint32_t *args)
+{
+	if (!read)
+	{
+		return AT_ERR_PARAM;
+	}
+	AT_PRINTF("+RXRING:%ld,%ld,%d", rx_ring_received, rx_ring_dropped, (uint8_t)(rx_ring_head - rx_ring_tail));
+	return 0;
+}
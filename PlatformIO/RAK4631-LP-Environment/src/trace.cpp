@@ -0,0 +1,405 @@
+/**
+ * @file trace.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Record and replay of the sensor readings
+ *        AT+TRACE=1 records the values of each bme.performReading() with
+ *        their time into a binary trace in flash:
+ *        'T' 'R' <version> <app> 0
+ *        then <tag> <ms since the previous record varint> <len> <data>...
+ *        AT+TRACE=2 plays the trace back. The readings come from the trace
+ *        instead of the sensor, in the recorded order, the application code
+ *        and its timers are the same. When the trace is used up the wakeups,
+ *        uplinks, average current and loop latency of the replay are
+ *        reported, two firmware versions can be compared with the same
+ *        field data. AT+TRACE=3 prints the trace as +TRACE:DATA lines.
+ *        In the native environment program sim --trace replays a trace
+ *        from a file of the PC in virtual time, see native/main.cpp.
+ * @version 0.1
+ * @date 2021-07-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "app.h"
+
+#include <Adafruit_LittleFS.h>
+#include <InternalFileSystem.h>
+using namespace Adafruit_LittleFS_Namespace;
+
+/** Filename of the trace */
+static const char trace_name[] = "TRCE";
+
+/** Max size of the trace in flash */
+#ifndef TRACE_MAX_SIZE
+#define TRACE_MAX_SIZE 16384
+#endif
+/** Records are collected in RAM and written to flash in blocks */
+#define TRACE_BUFFER_SIZE 256
+/** Header of the trace */
+#define TRACE_HEADER_SIZE 5
+#define TRACE_VERSION 1
+#define TRACE_APP 0x02
+/** Bytes in a +TRACE:DATA line */
+#define TRACE_DUMP_LINE 32
+
+/** TRACE_OFF, TRACE_RECORD or TRACE_REPLAY */
+static uint8_t trace_mode = TRACE_OFF;
+/** File for the replay */
+static File trace_file(InternalFS);
+/** Records not yet written to flash */
+static uint8_t trace_buffer[TRACE_BUFFER_SIZE];
+static uint16_t trace_used = 0;
+/** Size of the trace including the buffer */
+static uint32_t trace_size = 0;
+/** Time of the last record */
+static uint32_t trace_last_ms = 0;
+/** Records recorded or replayed */
+static uint32_t trace_records = 0;
+/** Replayed records with another tag or size than the application asked for */
+static uint32_t trace_mismatches = 0;
+
+/** Counters at the start of the replay */
+static s_energy trace_energy;
+static uint64_t trace_start_ms = 0;
+/** Result of the last replay */
+static uint32_t trace_duration = 0;
+static uint32_t trace_wakeups = 0;
+static uint32_t trace_uplinks = 0;
+static uint32_t trace_avg_ua = 0;
+
+/** Buffer for one +TRACE:DATA line */
+static char trace_hex[TRACE_DUMP_LINE * 2 + 1];
+
+/**
+ * @brief Check if a trace is recorded or replayed
+ *
+ * @return true Recording or replaying
+ */
+bool trace_active(void)
+{
+	return trace_mode != TRACE_OFF;
+}
+
+/**
+ * @brief Write the buffered records to flash
+ *
+ */
+static void trace_flush(void)
+{
+	if (trace_used == 0)
+	{
+		return;
+	}
+	if (trace_file.open(trace_name, FILE_O_WRITE))
+	{
+		trace_file.write(trace_buffer, trace_used);
+		trace_file.close();
+	}
+	else
+	{
+		MYLOG("TRACE", "Can't open trace");
+	}
+	trace_used = 0;
+}
+
+/**
+ * @brief Add bytes to the buffer, the buffer is written to flash when it is full
+ *
+ * @param data Bytes to add
+ * @param len Number of bytes
+ */
+static void trace_append(const uint8_t *data, uint16_t len)
+{
+	if ((trace_used + len) > TRACE_BUFFER_SIZE)
+	{
+		trace_flush();
+	}
+	memcpy(&trace_buffer[trace_used], data, len);
+	trace_used += len;
+	trace_size += len;
+}
+
+/**
+ * @brief Record a reading of the sensor
+ *
+ * @param tag TRACE_BME
+ * @param data Values read from the sensor
+ * @param len Size of the values
+ */
+void trace_add(uint8_t tag, const uint8_t *data, uint8_t len)
+{
+	if (trace_mode != TRACE_RECORD)
+	{
+		return;
+	}
+	uint32_t now = millis();
+	uint32_t delta = now - trace_last_ms;
+	uint8_t head[7];
+	uint8_t head_len = 0;
+	head[head_len++] = tag;
+	// Time as unsigned varint, 7 bit per byte, low bits first
+	while (delta >= 0x80)
+	{
+		head[head_len++] = (uint8_t)(delta | 0x80);
+		delta >>= 7;
+	}
+	head[head_len++] = (uint8_t)delta;
+	head[head_len++] = len;
+	if ((trace_size + head_len + len) > TRACE_MAX_SIZE)
+	{
+		MYLOG("TRACE", "Trace full");
+		trace_stop();
+		return;
+	}
+	trace_append(head, head_len);
+	trace_append(data, len);
+	trace_last_ms = now;
+	trace_records++;
+}
+
+/**
+ * @brief Start to record, an old trace is deleted
+ *
+ * @return true Recording
+ */
+static bool trace_record_start(void)
+{
+	InternalFS.begin();
+	InternalFS.remove(trace_name);
+	trace_used = 0;
+	trace_size = 0;
+	trace_records = 0;
+	trace_mismatches = 0;
+	uint8_t header[TRACE_HEADER_SIZE] = {'T', 'R', TRACE_VERSION, TRACE_APP, 0};
+	trace_append(header, TRACE_HEADER_SIZE);
+	trace_last_ms = millis();
+	trace_mode = TRACE_RECORD;
+	MYLOG("TRACE", "Recording");
+	return true;
+}
+
+/**
+ * @brief Start to replay the trace from flash
+ *
+ * @return true Replaying
+ * @return false No trace or the trace is from another application
+ */
+static bool trace_replay_start(void)
+{
+	InternalFS.begin();
+	if (!trace_file.open(trace_name, FILE_O_READ))
+	{
+		MYLOG("TRACE", "No trace");
+		return false;
+	}
+	uint8_t header[TRACE_HEADER_SIZE];
+	if ((trace_file.read(header, TRACE_HEADER_SIZE) != TRACE_HEADER_SIZE) || (header[0] != 'T') || (header[1] != 'R') ||
+		(header[2] != TRACE_VERSION) || (header[3] != TRACE_APP) || (trace_file.size() == TRACE_HEADER_SIZE))
+	{
+		MYLOG("TRACE", "Trace invalid or empty");
+		trace_file.close();
+		return false;
+	}
+	trace_size = trace_file.size();
+	trace_records = 0;
+	trace_mismatches = 0;
+
+	memcpy(&trace_energy, &energy, sizeof(s_energy));
+	trace_start_ms = energy_uptime_ms();
+	loop_clear();
+	trace_mode = TRACE_REPLAY;
+	MYLOG("TRACE", "Replay %ld bytes", trace_size);
+	return true;
+}
+
+/**
+ * @brief Replay is over, keep and report the result
+ *
+ */
+static void trace_replay_end(void)
+{
+	trace_file.close();
+	trace_mode = TRACE_OFF;
+	trace_duration = (uint32_t)(energy_uptime_ms() - trace_start_ms);
+	trace_wakeups = energy.wakeups - trace_energy.wakeups;
+	trace_uplinks = energy.uplinks - trace_energy.uplinks;
+	trace_avg_ua = energy_average_since(&trace_energy, trace_start_ms);
+	trace_report();
+	loop_report();
+}
+
+/**
+ * @brief Start to record or to replay
+ *        Not during an offload
+ *
+ * @param mode TRACE_RECORD or TRACE_REPLAY
+ * @return true Started
+ * @return false Busy or no trace to replay
+ */
+bool trace_start(uint8_t mode)
+{
+	if ((trace_mode != TRACE_OFF) || bulk_active())
+	{
+		return false;
+	}
+	if (mode == TRACE_RECORD)
+	{
+		return trace_record_start();
+	}
+	return trace_replay_start();
+}
+
+/**
+ * @brief Stop to record or to replay
+ *
+ */
+void trace_stop(void)
+{
+	if (trace_mode == TRACE_RECORD)
+	{
+		trace_flush();
+		trace_mode = TRACE_OFF;
+		MYLOG("TRACE", "Recorded %ld records, %ld bytes", trace_records, trace_size);
+	}
+	else if (trace_mode == TRACE_REPLAY)
+	{
+		trace_replay_end();
+	}
+}
+
+/**
+ * @brief End the replay when the trace is used up, call on TRACE_EVENT
+ *
+ */
+void trace_event(void)
+{
+	if (trace_mode == TRACE_REPLAY)
+	{
+		trace_replay_end();
+	}
+}
+
+/**
+ * @brief Get a reading from the trace instead of the sensor
+ *        At the end of the trace TRACE_EVENT is raised and the sensor is read again
+ *
+ * @param tag TRACE_BME
+ * @param data Buffer for the values
+ * @param max_len Size of the buffer
+ * @return int16_t Size of the values, -1 if not replaying or the trace is used up
+ */
+int16_t trace_take(uint8_t tag, uint8_t *data, uint8_t max_len)
+{
+	if (trace_mode != TRACE_REPLAY)
+	{
+		return -1;
+	}
+	uint8_t record_tag;
+	uint8_t value;
+	uint8_t len = 0;
+	bool valid = trace_file.read(&record_tag, 1) == 1;
+	// Time since the previous record, the application timers set the pace
+	do
+	{
+		valid = valid && (trace_file.read(&value, 1) == 1);
+	} while (valid && ((value & 0x80) != 0));
+	valid = valid && (trace_file.read(&len, 1) == 1) && (trace_file.read(trace_buffer, len) == len);
+	if (!valid)
+	{
+		g_task_event_type |= TRACE_EVENT;
+		xSemaphoreGive(g_task_sem);
+		return -1;
+	}
+	trace_records++;
+	if ((record_tag != tag) || (len > max_len))
+	{
+		trace_mismatches++;
+		return 0;
+	}
+	memcpy(data, trace_buffer, len);
+	return len;
+}
+
+/**
+ * @brief Print the trace as +TRACE:DATA,<offset>,<hex> lines, also over BLE UART if connected
+ *
+ */
+static void trace_dump(void)
+{
+	InternalFS.begin();
+	if (!trace_file.open(trace_name, FILE_O_READ))
+	{
+		return;
+	}
+	uint8_t line[TRACE_DUMP_LINE];
+	uint32_t offset = 0;
+	int len;
+	while ((len = trace_file.read(line, TRACE_DUMP_LINE)) > 0)
+	{
+		for (int idx = 0; idx < len; idx++)
+		{
+			sprintf(&trace_hex[idx * 2], "%02X", line[idx]);
+		}
+		trace_hex[len * 2] = 0;
+		AT_PRINTF("+TRACE:DATA,%ld,%s", offset, trace_hex);
+		if (g_ble_uart_is_connected)
+		{
+			g_ble_uart.printf("+TRACE:DATA,%ld,%s\n", offset, trace_hex);
+		}
+		offset += len;
+	}
+	trace_file.close();
+}
+
+/**
+ * @brief Report the trace and the last replay to the log and, if connected, to BLE UART
+ *
+ */
+void trace_report(void)
+{
+	MYLOG("TRACE", "Mode %d, %ld bytes, %ld records, %ld mismatches", trace_mode, trace_size, trace_records, trace_mismatches);
+	MYLOG("TRACE", "Replay %ld s, %ld wakeups, %ld uplinks, average %ld uA", trace_duration / 1000, trace_wakeups, trace_uplinks, trace_avg_ua);
+	if (g_ble_uart_is_connected)
+	{
+		g_ble_uart.printf("TRACE mode %d %ld bytes %ld records %ld mismatches\n", trace_mode, trace_size, trace_records, trace_mismatches);
+		g_ble_uart.printf("Replay %ld s %ld wakeups %ld uplinks %ld uA\n", trace_duration / 1000, trace_wakeups, trace_uplinks, trace_avg_ua);
+	}
+}
+
+/**
+ * @brief AT+TRACE=1 records, AT+TRACE=2 replays, AT+TRACE=3 prints the trace, AT+TRACE=0 stops
+ *        AT+TRACE=? prints mode, bytes, records, mismatches and of the last
+ *        replay the duration in s, wakeups, uplinks and average current in uA
+ *
+ * @param read true for AT+TRACE=?
+ * @param args Value for AT+TRACE=<value>
+ * @return uint8_t 0 for OK, otherwise the AT error code
+ */
+uint8_t at_trace(bool read, uint32_t *args)
+{
+	if (read)
+	{
+		AT_PRINTF("+TRACE:%d,%ld,%ld,%ld,%ld,%ld,%ld,%ld", trace_mode, trace_size, trace_records, trace_mismatches,
+				  trace_duration / 1000, trace_wakeups, trace_uplinks, trace_avg_ua);
+		return 0;
+	}
+	switch (args[0])
+	{
+	case TRACE_OFF:
+		trace_stop();
+		return 0;
+	case TRACE_RECORD:
+	case TRACE_REPLAY:
+		return trace_start(args[0]) ? 0 : AT_ERR_GENERIC;
+	case TRACE_DUMP:
+		if (trace_mode != TRACE_OFF)
+		{
+			return AT_ERR_GENERIC;
+		}
+		trace_dump();
+		return 0;
+	default:
+		return AT_ERR_PARAM;
+	}
+}
@@ -0,0 +1,219 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Firmware update decoder on a lossy channel
+ *        The fragments are coded like the TS004 server does, lost ones
+ *        are drawn from a fixed pseudo random sequence.
+ *        Run with pio test -e native
+ * @version 0.1
+ * @date 2021-07-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <unity.h>
+#include "frag_decoder.h"
+
+/** Largest image of the tests */
+#define TEST_MAX_NB 512
+#define TEST_SIZE 48
+/** Runs with different loss patterns per loss rate */
+#define TEST_SEEDS 8
+
+static uint8_t test_image[TEST_MAX_NB * TEST_SIZE];
+static uint8_t test_store[TEST_MAX_NB * TEST_SIZE];
+static s_frag_decoder test_dec;
+
+static void test_write(uint16_t idx, const uint8_t *data, uint8_t size)
+{
+	memcpy(&test_store[idx * size], data, size);
+}
+
+static void test_read(uint16_t idx, uint8_t *data, uint8_t size)
+{
+	memcpy(data, &test_store[idx * size], size);
+}
+
+/**
+ * @brief Coded fragment n, uncoded for n <= nb, parity after it
+ *
+ * @param n Fragment number, starts with 1
+ * @param nb Number of uncoded fragments
+ * @param frag Fragment
+ */
+static void test_fragment(uint16_t n, uint16_t nb, uint8_t *frag)
+{
+	if (n <= nb)
+	{
+		memcpy(frag, &test_image[(n - 1) * TEST_SIZE], TEST_SIZE);
+		return;
+	}
+	uint8_t row[TEST_MAX_NB / 8];
+	frag_parity_row(n - nb, nb, row);
+	memset(frag, 0, TEST_SIZE);
+	for (uint16_t idx = 0; idx < nb; idx++)
+	{
+		if ((row[idx >> 3] >> (idx & 7)) & 1)
+		{
+			for (uint8_t byte = 0; byte < TEST_SIZE; byte++)
+			{
+				frag[byte] ^= test_image[idx * TEST_SIZE + byte];
+			}
+		}
+	}
+}
+
+/**
+ * @brief Send an image over a lossy channel until the decoder is done
+ *
+ * @param nb Number of uncoded fragments
+ * @param loss Lost fragments in %
+ * @param seed Seed of the loss pattern
+ * @param sent Max number of fragments the server sends
+ * @return uint8_t Last result of the decoder
+ */
+static uint8_t test_channel(uint16_t nb, uint8_t loss, uint32_t seed, uint16_t sent)
+{
+	uint32_t lcg = seed;
+	for (uint32_t idx = 0; idx < (uint32_t)nb * TEST_SIZE; idx++)
+	{
+		lcg = lcg * 1103515245 + 12345;
+		test_image[idx] = (uint8_t)(lcg >> 16);
+	}
+	memset(test_store, 0, sizeof(test_store));
+	TEST_ASSERT_TRUE(frag_decoder_init(&test_dec, nb, TEST_SIZE, test_write, test_read));
+
+	uint8_t frag[TEST_SIZE];
+	uint8_t result = FRAG_ONGOING;
+	for (uint16_t n = 1; (n <= sent) && (result == FRAG_ONGOING); n++)
+	{
+		lcg = lcg * 1103515245 + 12345;
+		if (((lcg >> 16) % 100) < loss)
+		{
+			continue;
+		}
+		test_fragment(n, nb, frag);
+		result = frag_decoder_process(&test_dec, n, frag);
+	}
+	return result;
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * @brief Without loss the image is complete after the uncoded fragments
+ *
+ */
+static void test_no_loss(void)
+{
+	TEST_ASSERT_EQUAL(FRAG_DONE, test_channel(64, 0, 1, 64));
+	TEST_ASSERT_EQUAL(0, test_dec.parity);
+	TEST_ASSERT_EQUAL_MEMORY(test_image, test_store, 64 * TEST_SIZE);
+}
+
+/**
+ * @brief Decode with a loss rate and twice the fragments of the image
+ *
+ * @param nb Number of uncoded fragments
+ * @param loss Lost fragments in %
+ */
+static void test_loss(uint16_t nb, uint8_t loss)
+{
+	for (uint32_t seed = 1; seed <= TEST_SEEDS; seed++)
+	{
+		TEST_ASSERT_EQUAL(FRAG_DONE, test_channel(nb, loss, seed, nb * 2));
+		TEST_ASSERT_EQUAL(nb, test_dec.known);
+		TEST_ASSERT_GREATER_THAN(0, test_dec.parity);
+		TEST_ASSERT_EQUAL_MEMORY(test_image, test_store, nb * TEST_SIZE);
+	}
+}
+
+static void test_loss_5(void)
+{
+	test_loss(64, 5);
+}
+
+static void test_loss_10(void)
+{
+	test_loss(64, 10);
+}
+
+static void test_loss_20(void)
+{
+	test_loss(256, 20);
+}
+
+static void test_loss_30(void)
+{
+	test_loss(256, 30);
+}
+
+/**
+ * @brief The same fragment twice changes nothing
+ *
+ */
+static void test_duplicate(void)
+{
+	uint8_t frag[TEST_SIZE];
+	test_channel(16, 0, 1, 0);
+	for (uint16_t n = 1; n <= 16; n++)
+	{
+		if (n == 3)
+		{
+			// Lost, recovered from the parity
+			continue;
+		}
+		test_fragment(n, 16, frag);
+		TEST_ASSERT_EQUAL(FRAG_ONGOING, frag_decoder_process(&test_dec, n, frag));
+		TEST_ASSERT_EQUAL(FRAG_ONGOING, frag_decoder_process(&test_dec, n, frag));
+	}
+	TEST_ASSERT_EQUAL(15, test_dec.known);
+	uint8_t result = FRAG_ONGOING;
+	for (uint16_t n = 17; (n <= 32) && (result == FRAG_ONGOING); n++)
+	{
+		test_fragment(n, 16, frag);
+		result = frag_decoder_process(&test_dec, n, frag);
+	}
+	TEST_ASSERT_EQUAL(FRAG_DONE, result);
+	TEST_ASSERT_EQUAL_MEMORY(test_image, test_store, 16 * TEST_SIZE);
+}
+
+/**
+ * @brief More lost fragments than the decoder can hold
+ *
+ */
+static void test_too_many_lost(void)
+{
+	TEST_ASSERT_EQUAL(FRAG_TOO_MANY_LOST, test_channel(TEST_MAX_NB, 40, 1, TEST_MAX_NB * 2));
+}
+
+/**
+ * @brief Images outside the limits are refused
+ *
+ */
+static void test_limits(void)
+{
+	TEST_ASSERT_FALSE(frag_decoder_init(&test_dec, FRAG_MAX_NB + 1, TEST_SIZE, test_write, test_read));
+	TEST_ASSERT_FALSE(frag_decoder_init(&test_dec, 64, FRAG_MAX_SIZE + 1, test_write, test_read));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_no_loss);
+	RUN_TEST(test_loss_5);
+	RUN_TEST(test_loss_10);
+	RUN_TEST(test_loss_20);
+	RUN_TEST(test_loss_30);
+	RUN_TEST(test_duplicate);
+	RUN_TEST(test_too_many_lost);
+	RUN_TEST(test_limits);
+	return UNITY_END();
+}